@@ -0,0 +1,23 @@
+@echo off
+
+REM Ensure we have an MSVC environment
+call "C:\Program Files\Microsoft Visual Studio\2022\Community\VC\Auxiliary\Build\vcvars64.bat" >nul
+
+if not exist build mkdir build
+
+REM Unlike build.bat, benchmarks are built with optimizations on
+cl /nologo /TC /W4 /std:c11 /O2 ^
+ /Fobuild\ ^
+ /Iinclude ^
+ /I..\vendor\OpenCL-SDK\install\include ^
+ /DCL_TARGET_OPENCL_VERSION=100 ^
+ bench\*.c lib\*.c opencl\frame_pipeline.c opencl\opencl_backend.c opencl\profiler.c opencl\program_cache.c opencl\work_group_tuner.c ^
+ /Febuild\bench.exe ^
+ /link /LIBPATH:..\vendor\OpenCL-SDK\install\lib OpenCL.lib
+
+if %ERRORLEVEL% neq 0 (
+    echo Benchmark build failed!
+    exit /b %ERRORLEVEL%
+)
+
+build\bench.exe
@@ -0,0 +1,969 @@
+#define _USE_MATH_DEFINES  // For M_PI on Windows
+#define _DEFAULT_SOURCE    // For M_PI on Unix
+#include <math.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <animation.h>
+#include <config.h>
+#include <canvas.h>
+#include <group.h>
+#include <matrix.h>
+#include <ray.h>
+#include <renderer.h>
+#include <scene.h>
+#include <timer.h>
+
+/* Performance benchmarks. Built with optimizations on by bench.bat. */
+
+// -------------------
+// Scenes
+// -------------------
+
+/// Returns a floor plane with a square grid of `n` by `n` small spheres resting on it, lit by two lights.
+World scene_sphere_grid(int n) {
+    World world = world_new();
+    world.object_count = (size_t)n * n + 1;
+    world.objects = malloc(world.object_count * sizeof(Shape));
+    world.material_count = world.object_count;
+    world.materials = malloc(world.material_count * sizeof(Material));
+
+    Material material = material_default();
+    material.pattern = pattern_plain_new(color_rgb(0.8, 0.8, 0.9), mat4d_identity());
+    material.reflective = 0.2;
+    world.materials[0] = material;
+    world.objects[0] = plane_new(mat4d_identity(), 0, "floor");
+
+    double spacing = 10.0 / n;
+    double radius = 0.4 * spacing;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            Mat4D transform = mat4d_mul_mat4d(
+                translation(-5.0 + (i + 0.5) * spacing, radius, -5.0 + (j + 0.5) * spacing),
+                scaling(radius, radius, radius)
+            );
+            material = material_default();
+            material.pattern = pattern_plain_new(color_rgb((double)i / n, 0.5, (double)j / n), mat4d_identity());
+            material.reflective = 0.3;
+            uint32_t k = 1 + i * n + j;
+            world.materials[k] = material;
+            world.objects[k] = sphere_new(transform, k, "grid_sphere");
+        }
+    }
+
+    world.light_count = 2;
+    world.lights = malloc(world.light_count * sizeof(PointLight));
+    world.lights[0] = point_light_new(d4_point(-10.0, 10.0, -10.0), color_rgb(0.7, 0.7, 0.7));
+    world.lights[1] = point_light_new(d4_point(10.0, 8.0, -6.0), color_rgb(0.4, 0.4, 0.5));
+    return world;
+}
+
+/// Returns a cube of `n` by `n` by `n` small spheres of a few sizes, jittered off a lattice, like a cloud of
+/// particles, lit by one light.
+World scene_particle_cloud(int n) {
+    World world = world_new();
+    world.object_count = (size_t)n * n * n;
+    world.objects = malloc(world.object_count * sizeof(Shape));
+    world.material_count = 4;
+    world.materials = malloc(world.material_count * sizeof(Material));
+    for (int i = 0; i < 4; i++) {
+        world.materials[i] = material_default();
+        world.materials[i].pattern = pattern_plain_new(color_rgb(0.9, 0.5 + 0.1 * i, 0.3), mat4d_identity());
+    }
+
+    double spacing = 10.0 / n;
+    uint32_t state = 1;
+    for (size_t i = 0; i < world.object_count; i++) {
+        double p[3];
+        size_t cell[3] = { i % n, i / n % n, i / n / n };
+        for (int a = 0; a < 3; a++) {
+            state = state * 1664525u + 1013904223u;
+            p[a] = -5.0 + (cell[a] + 0.25 + 0.5 * state / 4294967296.0) * spacing;
+        }
+        double radius = (0.15 + 0.05 * (i % 4)) * spacing;
+        Mat4D transform = mat4d_mul_mat4d(translation(p[0], p[1], p[2]), scaling(radius, radius, radius));
+        world.objects[i] = sphere_new(transform, (uint32_t)(i % 4), "particle");
+    }
+
+    world.light_count = 1;
+    world.lights = malloc(sizeof(PointLight));
+    world.lights[0] = point_light_new(d4_point(-10.0, 10.0, -10.0), color_rgb(1.0, 1.0, 1.0));
+    return world;
+}
+
+/// Returns the particles of scene_particle_cloud as a sphere cloud, whose palette is that world's four
+/// materials.
+SphereCloud *scene_sphere_cloud(int n) {
+    size_t count = (size_t)n * n * n;
+    float *memory = malloc(5 * count * sizeof(float));
+    if (memory == NULL) {
+        return NULL;
+    }
+    float *x = memory, *y = memory + count, *z = memory + 2 * count, *radius = memory + 3 * count;
+    uint32_t *materials = (uint32_t *)(memory + 4 * count);
+    double spacing = 10.0 / n;
+    uint32_t state = 1;
+    for (size_t i = 0; i < count; i++) {
+        double p[3];
+        size_t cell[3] = { i % n, i / n % n, i / n / n };
+        for (int a = 0; a < 3; a++) {
+            state = state * 1664525u + 1013904223u;
+            p[a] = -5.0 + (cell[a] + 0.25 + 0.5 * state / 4294967296.0) * spacing;
+        }
+        x[i] = (float)p[0];
+        y[i] = (float)p[1];
+        z[i] = (float)p[2];
+        radius[i] = (float)((0.15 + 0.05 * (i % 4)) * spacing);
+        materials[i] = (uint32_t)(i % 4);
+    }
+    SphereCloud *cloud = sphere_cloud_create(memory, x, y, z, radius, materials, count);
+    if (cloud == NULL) {
+        return NULL;
+    }
+    uint32_t palette[4] = { 0, 1, 2, 3 };
+    sphere_cloud_set_palette(cloud, palette, 4);
+    return cloud;
+}
+
+/// Returns a city block at night: a floor, a 10 by 10 grid of buildings and `light_count` street lights
+/// scattered between them, each lighting only its surroundings.
+World scene_city_night(int light_count) {
+    World world = world_new();
+    world.object_count = 101;
+    world.objects = malloc(world.object_count * sizeof(Shape));
+    world.material_count = 2;
+    world.materials = malloc(world.material_count * sizeof(Material));
+    world.materials[0] = material_default();
+    world.materials[0].pattern = pattern_plain_new(color_rgb(0.3, 0.3, 0.35), mat4d_identity());
+    world.materials[0].ambient = 0.0;
+    world.materials[1] = material_default();
+    world.materials[1].pattern = pattern_plain_new(color_rgb(0.6, 0.55, 0.5), mat4d_identity());
+    world.materials[1].ambient = 0.0;
+    world.objects[0] = plane_new(mat4d_identity(), 0, "street");
+    uint32_t state = 1;
+    for (int i = 0; i < 100; i++) {
+        state = state * 1664525u + 1013904223u;
+        double height = 0.5 + 1.5 * state / 4294967296.0;
+        Mat4D transform = mat4d_mul_mat4d(
+            translation(-9.0 + 2.0 * (i % 10), height, -9.0 + 2.0 * (i / 10)),
+            scaling(0.6, height, 0.6)
+        );
+        world.objects[1 + i] = cube_new(transform, 1, "building");
+    }
+
+    world.light_count = light_count;
+    world.lights = malloc(world.light_count * sizeof(PointLight));
+    for (int i = 0; i < light_count; i++) {
+        double p[2];
+        for (int a = 0; a < 2; a++) {
+            state = state * 1664525u + 1013904223u;
+            p[a] = -10.0 + 20.0 * state / 4294967296.0;
+        }
+        // Along the streets, which run between the buildings
+        p[i % 2] = -10.0 + 2.0 * (int)((p[i % 2] + 10.0) / 2.0);
+        world.lights[i] = point_light_new(d4_point(p[0], 0.3, p[1]), color_rgb(0.2, 0.15, 0.08));
+        world.lights[i].falloff = 0.3;
+    }
+    return world;
+}
+
+Camera scene_camera(int hsize, int vsize) {
+    Mat4D view = view_transform(d4_point(0.0, 6.0, -12.0), d4_point(0.0, 0.0, 0.0), d4_vector(0.0, 1.0, 0.0));
+    return camera_new(hsize, vsize, M_PI / 3.0, view);
+}
+
+void world_free(World world) {
+    free(world.objects);
+    free(world.materials);
+    free(world.lights);
+}
+
+// -------------------
+// Animation
+// -------------------
+
+void bench_animation_update() {
+    const int frames = 24;
+    World world = scene_sphere_grid(316);
+    Camera camera = scene_camera(160, 120);
+
+    // Every tenth sphere hops up and back over a second
+    Keyframe keys[] = {
+        keyframe_new(0.0, d4_vector(0.0, 0.0, 0.0), d4_vector(0.0, 0.0, 0.0), d4_vector(1.0, 1.0, 1.0)),
+        keyframe_new(0.5, d4_vector(0.0, 0.2, 0.0), d4_vector(0.0, 0.0, 0.0), d4_vector(1.0, 1.0, 1.0)),
+        keyframe_new(1.0, d4_vector(0.0, 0.0, 0.0), d4_vector(0.0, 0.0, 0.0), d4_vector(1.0, 1.0, 1.0)),
+    };
+    Animation animation = { NULL, 0, 24.0 };
+    animation.tracks = malloc((world.object_count + 9) / 10 * sizeof(Track));
+    for (size_t i = 1; i < world.object_count; i += 10) {
+        animation.tracks[animation.track_count++] = (Track) { i, world.objects[i].transform, keys, 3 };
+    }
+    printf(
+        "Animation update (%zu objects, %zu animated, %d frames, %dx%d CPU render)\n",
+        world.object_count,
+        animation.track_count,
+        frames,
+        camera.hsize,
+        camera.vsize
+    );
+
+    double start = timer_seconds();
+    world_build_bvh(&world);
+    double build = timer_seconds() - start;
+
+    double apply = 0.0;
+    double refit = 0.0;
+    int rebuilds = 0;
+    for (int frame = 1; frame <= frames; frame++) {
+        start = timer_seconds();
+        animation_apply(&animation, &world, frame / animation.fps);
+        double applied = timer_seconds();
+        rebuilds += world_update_bvh(&world) == 1;
+        apply += applied - start;
+        refit += timer_seconds() - applied;
+    }
+
+    Canvas canvas = canvas_create(camera.hsize, camera.vsize);
+    start = timer_seconds();
+    for (int y = 0; y < camera.vsize; y++) {
+        for (int x = 0; x < camera.hsize; x++) {
+            canvas_pixel_set(canvas, x, y, ray_color(ray_at_pixel(camera, x, y), world, CFG_RECURSION_DEPTH));
+        }
+    }
+    double render = timer_seconds() - start;
+
+    printf("  full build:        %8.2f ms\n", 1000.0 * build);
+    printf("  apply keyframes:   %8.2f ms/frame\n", 1000.0 * apply / frames);
+    printf("  refit:             %8.2f ms/frame (%d rebuilds)\n", 1000.0 * refit / frames, rebuilds);
+    printf("  render:            %8.2f ms/frame\n\n", 1000.0 * render);
+
+    canvas_destroy(canvas);
+    free(animation.tracks);
+    world_free_bvh(&world);
+    world_free(world);
+}
+
+// -------------------
+// BVH
+// -------------------
+
+/// Returns the seconds taken to trace the camera's primary rays through `world` `passes` times.
+double time_primary_rays(World world, Camera camera, int passes) {
+    double start = timer_seconds();
+    for (int pass = 0; pass < passes; pass++) {
+        for (int y = 0; y < camera.vsize; y++) {
+            for (int x = 0; x < camera.hsize; x++) {
+                ray_intersect_world(ray_at_pixel(camera, x, y), world);
+            }
+        }
+    }
+    return timer_seconds() - start;
+}
+
+/// @brief Returns the milliseconds taken to build a hierarchy over `bounds` with `options`, and writes its cost.
+double time_bvh_build(const Aabb *bounds, size_t count, BvhBuildOptions options, double *out_cost) {
+    uint32_t *ids = malloc(count * sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) {
+        ids[i] = (uint32_t)i;
+    }
+    Bvh bvh = { 0 };
+    double start = timer_seconds();
+    int err = bvh_build_with(&bvh, bounds, ids, count, options);
+    double elapsed = timer_seconds() - start;
+    free(ids);
+    if (err) {
+        return NAN;
+    }
+    *out_cost = bvh.built_cost;
+    bvh_free(&bvh);
+    return 1000.0 * elapsed;
+}
+
+void bench_bvh_build() {
+    const size_t count = 1000000;
+    printf("BVH build (%zu boxes scattered through a cube, %d processors)\n", count, cpu_count());
+    Aabb *bounds = malloc(count * sizeof(Aabb));
+    uint32_t state = 1;
+    for (size_t i = 0; i < count; i++) {
+        double c[3];
+        for (int a = 0; a < 3; a++) {
+            state = state * 1664525u + 1013904223u;
+            c[a] = 100.0 * state / 4294967296.0;
+        }
+        double r = 0.05 + 0.2 * (i % 7) / 7.0;
+        bounds[i] = (Aabb) { { c[0] - r, c[1] - r, c[2] - r }, { c[0] + r, c[1] + r, c[2] + r } };
+    }
+
+    BvhBuildOptions options = bvh_build_options_default();
+    double cost = 0.0;
+    options.linear = 0;
+    options.thread_count = 1;
+    double sah_one = time_bvh_build(bounds, count, options, &cost);
+    options.thread_count = 0;
+    double sah_all = time_bvh_build(bounds, count, options, &cost);
+    printf("  SAH, 1 thread:     %8.2f ms\n", sah_one);
+    printf("  SAH, all threads:  %8.2f ms (cost %.1f)\n", sah_all, cost);
+    options.linear = 1;
+    double linear = time_bvh_build(bounds, count, options, &cost);
+    printf("  linear:            %8.2f ms (cost %.1f)\n\n", linear, cost);
+    free(bounds);
+}
+
+void bench_wide_bvh() {
+    const int passes = 10;
+    World world = scene_sphere_grid(316);
+    Camera camera = scene_camera(320, 240);
+    printf("Wide BVH (%zu objects, %d passes of %dx%d primary rays)\n", world.object_count, passes, camera.hsize, camera.vsize);
+    world.accelerator = ACCELERATOR_BVH;  // Which a grid would stand in for
+    if (world_build_bvh(&world)) {
+        world_free(world);
+        return;
+    }
+
+    WorldBvh *bvh = world.bvh;
+    double start = timer_seconds();
+    wide_bvh_build(&bvh->wide, &bvh->tree);
+    double collapse = timer_seconds() - start;
+    double rays = (double)passes * camera.hsize * camera.vsize;
+    double wide = time_primary_rays(world, camera, passes);
+
+    // Set the wide tree aside, so rays take the binary one
+    WideBvh wide_tree = bvh->wide;
+    bvh->wide = (WideBvh) { 0 };
+    double binary = time_primary_rays(world, camera, passes);
+    bvh->wide = wide_tree;
+
+    printf("  binary nodes:      %8.2f MB (%zu nodes of %zu bytes)\n", bvh->tree.node_count * sizeof(BvhNode) / 1e6, bvh->tree.node_count, sizeof(BvhNode));
+    printf("  wide nodes:        %8.2f MB (%zu nodes of %zu bytes)\n", bvh->wide.node_count * sizeof(WideBvhNode) / 1e6, bvh->wide.node_count, sizeof(WideBvhNode));
+    printf("  collapse:          %8.2f ms\n", 1000.0 * collapse);
+    printf("  binary traversal:  %8.2f Mrays/s\n", rays / binary / 1e6);
+    printf("  wide traversal:    %8.2f Mrays/s (%.2fx)\n\n", rays / wide / 1e6, binary / wide);
+
+    world_free_bvh(&world);
+    world_free(world);
+}
+
+void bench_fast_paths() {
+    const int passes = 5;
+    World world = scene_sphere_grid(100);
+    Camera camera = scene_camera(320, 240);
+    printf("Transform-free fast paths (%zu objects, %d passes of %dx%d primary rays)\n", world.object_count, passes, camera.hsize, camera.vsize);
+    if (world_build_bvh(&world)) {
+        world_free(world);
+        return;
+    }
+    double rays = (double)passes * camera.hsize * camera.vsize;
+    double fast = time_primary_rays(world, camera, passes);
+    for (size_t i = 0; i < world.object_count; i++) {
+        world.objects[i].fast = SHAPE_FAST_NONE;
+    }
+    double transformed = time_primary_rays(world, camera, passes);
+    printf("  through transforms: %7.2f Mrays/s\n", rays / transformed / 1e6);
+    printf("  fast paths:        %8.2f Mrays/s (%.2fx)\n\n", rays / fast / 1e6, transformed / fast);
+    world_free_bvh(&world);
+    world_free(world);
+}
+
+/// @brief Prints the primary ray throughput of `world` through each structure it can be traced through.
+void compare_accelerators(World world, Camera camera, int passes) {
+    double rays = (double)passes * camera.hsize * camera.vsize;
+    world.accelerator = ACCELERATOR_GRID;
+    if (world_build_bvh(&world)) {
+        return;
+    }
+    WorldBvh *bvh = world.bvh;
+    double grid = time_primary_rays(world, camera, passes);
+    int suits = grid_suits(&bvh->grid, bvh->bounds, bvh->tree.indices, bvh->tree.primitive_count);
+    printf("  grid cells:        %8zu (%dx%dx%d, %.0f%% occupied, %.2f per object), auto picks the %s\n",
+        bvh->grid.cell_count, bvh->grid.resolution[0], bvh->grid.resolution[1], bvh->grid.resolution[2],
+        100.0 * bvh->grid.occupied_count / bvh->grid.cell_count, (double)bvh->grid.item_count / bvh->tree.primitive_count,
+        suits ? "grid" : "BVH");
+
+    world.accelerator = ACCELERATOR_BVH;
+    world_update_bvh(&world);
+    bvh = world.bvh;
+    double wide = time_primary_rays(world, camera, passes);
+    WideBvh wide_tree = bvh->wide;
+    bvh->wide = (WideBvh) { 0 };
+    double binary = time_primary_rays(world, camera, passes);
+    bvh->wide = wide_tree;
+
+    printf("  binary BVH:        %8.2f Mrays/s\n", rays / binary / 1e6);
+    printf("  wide BVH:          %8.2f Mrays/s\n", rays / wide / 1e6);
+    printf("  grid:              %8.2f Mrays/s (%.2fx the wide BVH)\n\n", rays / grid / 1e6, wide / grid);
+    world_free_bvh(&world);
+}
+
+void bench_grid() {
+    const int passes = 5;
+    Camera camera = scene_camera(320, 240);
+    World cloud = scene_particle_cloud(40);
+    printf("Grid, particle cloud (%zu objects, %d passes of %dx%d primary rays)\n", cloud.object_count, passes, camera.hsize, camera.vsize);
+    compare_accelerators(cloud, camera, passes);
+    world_free(cloud);
+
+    World spheres = scene_sphere_grid(316);
+    printf("Grid, sphere grid (%zu objects, %d passes of %dx%d primary rays)\n", spheres.object_count, passes, camera.hsize, camera.vsize);
+    compare_accelerators(spheres, camera, passes);
+    world_free(spheres);
+}
+
+void bench_sphere_cloud() {
+    const int passes = 5;
+    Camera camera = scene_camera(320, 240);
+    World spheres = scene_particle_cloud(40);
+    SphereCloud *cloud = scene_sphere_cloud(40);
+    if (cloud == NULL || world_build_bvh(&spheres)) {
+        sphere_cloud_destroy(cloud);
+        world_free(spheres);
+        return;
+    }
+    printf("Sphere cloud (%zu particles, %d passes of %dx%d primary rays)\n", cloud->count, passes, camera.hsize, camera.vsize);
+    double rays = (double)passes * camera.hsize * camera.vsize;
+    double shapes = time_primary_rays(spheres, camera, passes);
+    world_free_bvh(&spheres);
+
+    World world = world_new();
+    Shape shape = sphere_cloud_new(mat4d_identity(), 0, "particles", cloud);
+    world.objects = &shape;
+    world.object_count = 1;
+    world.lights = spheres.lights;
+    world.light_count = spheres.light_count;
+    world.materials = spheres.materials;
+    world.material_count = spheres.material_count;
+    double particles = time_primary_rays(world, camera, passes);
+    printf("  sphere shapes:     %8.2f Mrays/s (%zu bytes a sphere)\n", rays / shapes / 1e6, sizeof(Shape));
+    printf("  sphere cloud:      %8.2f Mrays/s (%.2fx, %s)\n", rays / particles / 1e6, shapes / particles,
+        cloud->grid.cell_count > 0 ? "grid" : "BVH");
+    sphere_cloud_destroy(cloud);
+    world_free(spheres);
+
+    // A million particles, written to a dump and mapped back
+    const char *path = "build/bench_particles.bin";
+    cloud = scene_sphere_cloud(100);
+    if (cloud == NULL) {
+        return;
+    }
+    size_t count = cloud->count;
+    size_t index_bytes = cloud->grid.cell_count > 0
+        ? (cloud->grid.cell_count + 1 + cloud->grid.item_count) * sizeof(uint32_t)
+        : cloud->bvh.node_count * sizeof(BvhNode) + cloud->bvh.primitive_count * sizeof(uint32_t);
+    int err = sphere_cloud_write(cloud, path);
+    sphere_cloud_destroy(cloud);
+    if (err) {
+        printf("  cannot write %s\n\n", path);
+        return;
+    }
+    double start = timer_seconds();
+    cloud = sphere_cloud_load(path);
+    double load = timer_seconds() - start;
+    if (cloud != NULL) {
+        printf("  %zu particles:   %8.2f MB, and %.2f MB of index (%.2f MB as shapes)\n", count,
+            count * 5 * sizeof(float) / 1e6, index_bytes / 1e6, count * sizeof(Shape) / 1e6);
+        printf("  map and index:     %8.2f ms\n\n", 1000.0 * load);
+    }
+    sphere_cloud_destroy(cloud);
+    remove(path);
+}
+
+// -------------------
+// Lights
+// -------------------
+
+/// @brief Returns the seconds taken to shade the camera's primary rays through `world`, and writes the colors
+/// to `canvas`.
+double time_shaded_rays(World world, Camera camera, Canvas canvas) {
+    double start = timer_seconds();
+    for (int y = 0; y < camera.vsize; y++) {
+        for (int x = 0; x < camera.hsize; x++) {
+            canvas_pixel_set(canvas, x, y, ray_color(ray_at_pixel(camera, x, y), world, 0));
+        }
+    }
+    return timer_seconds() - start;
+}
+
+void bench_many_lights() {
+    Camera camera = scene_camera(160, 120);
+    Canvas every = canvas_create(camera.hsize, camera.vsize);
+    Canvas sampled = canvas_create(camera.hsize, camera.vsize);
+    printf("Many lights (%d samples a hit, %dx%d shaded primary rays)\n", CFG_LIGHT_SAMPLES, camera.hsize, camera.vsize);
+    World world = scene_city_night(1000);
+    if (world_build_bvh(&world) == 0) {
+        double tree = time_shaded_rays(world, camera, sampled);
+        // Without its light tree, the world's hits are shaded by every light
+        light_tree_free(&world.bvh->lights);
+        double all = time_shaded_rays(world, camera, every);
+        double difference = 0.0;
+        double total = 0.0;
+        for (int i = 0; i < camera.hsize * camera.vsize; i++) {
+            Color a = every.pixels[i];
+            Color b = sampled.pixels[i];
+            difference += fabs(a.r - b.r) + fabs(a.g - b.g) + fabs(a.b - b.b);
+            total += a.r + a.g + a.b;
+        }
+        printf("  %5zu lights, every light: %8.2f ms\n", world.light_count, 1000.0 * all);
+        printf("  %5zu lights, light tree:  %8.2f ms (%.1fx, off by %.1f%% of the brightness on average)\n",
+            world.light_count, 1000.0 * tree, all / tree, 100.0 * difference / total);
+        world_free_bvh(&world);
+    }
+    world_free(world);
+
+    // Every light would take minutes here
+    world = scene_city_night(10000);
+    if (world_build_bvh(&world) == 0) {
+        double tree = time_shaded_rays(world, camera, sampled);
+        printf("  %5zu lights, light tree:  %8.2f ms\n\n", world.light_count, 1000.0 * tree);
+        world_free_bvh(&world);
+    }
+    world_free(world);
+    canvas_destroy(every);
+    canvas_destroy(sampled);
+}
+
+void bench_area_lights() {
+    const int steps = 8;
+    Camera camera = scene_camera(160, 120);
+    Canvas canvas = canvas_create(camera.hsize, camera.vsize);
+    World world = scene_sphere_grid(100);
+    if (world_build_bvh(&world)) {
+        world_free(world);
+        canvas_destroy(canvas);
+        return;
+    }
+    printf("Area lights (%zu objects, %dx%d cells, %dx%d shaded primary rays)\n", world.object_count, steps, steps, camera.hsize, camera.vsize);
+    PointLight *lights = world.lights;
+    size_t light_count = world.light_count;
+    PointLight area = area_light_new(d4_point(-2.0, 8.0, -2.0), d4_vector(4.0, 0.0, 0.0), steps, d4_vector(0.0, 0.0, 4.0), steps, color_rgb(1.0, 1.0, 1.0));
+
+    // The same light as a point in the middle of each cell, each with its own shadow ray
+    PointLight *points = malloc(steps * steps * sizeof(PointLight));
+    for (int k = 0; k < steps * steps; k++) {
+        Vec4D at = light_sample_point(&area, k % steps, k / steps, 0.5, 0.5);
+        points[k] = point_light_new(at, color_mul(area.intensity, 1.0 / (steps * steps)));
+    }
+    world.lights = points;
+    world.light_count = steps * steps;
+    double point_time = time_shaded_rays(world, camera, canvas);
+
+    world.lights = &area;
+    world.light_count = 1;
+    double area_time = time_shaded_rays(world, camera, canvas);
+    printf("  %2d point lights:   %8.2f ms\n", steps * steps, 1000.0 * point_time);
+    printf("  area light:        %8.2f ms (%.1fx)\n\n", 1000.0 * area_time, point_time / area_time);
+
+    world.lights = lights;
+    world.light_count = light_count;
+    free(points);
+    world_free_bvh(&world);
+    world_free(world);
+    canvas_destroy(canvas);
+}
+
+/// @brief Returns the seconds taken to trace the camera's rays through `world`, following up to `depth`
+/// reflections and refractions within budgets of `rays` each, writes the colors to `canvas` and counts the
+/// rays in `stats`.
+double time_budgeted_rays(World world, Camera camera, Canvas canvas, int depth, int rays, double cutoff, RayStats *stats) {
+    double start = timer_seconds();
+    for (int y = 0; y < camera.vsize; y++) {
+        for (int x = 0; x < camera.hsize; x++) {
+            RayStats pixel = { 1, 0, 0, 0, 0, 0, 0 };
+            RayBudget budget = { rays, cutoff, &pixel };
+            canvas_pixel_set(canvas, x, y, ray_trace(ray_at_pixel(camera, x, y), world, depth, &budget));
+            pixel.most = pixel.camera + pixel.reflected + pixel.refracted + pixel.shadow;
+            ray_stats_add(stats, &pixel);
+        }
+    }
+    return timer_seconds() - start;
+}
+
+void bench_glass() {
+    const int depth = 12;
+    Camera camera = scene_camera(160, 120);
+    Canvas unbounded = canvas_create(camera.hsize, camera.vsize);
+    Canvas budgeted = canvas_create(camera.hsize, camera.vsize);
+    World world = scene_sphere_grid(10);
+    for (size_t k = 1; k < world.material_count; k++) {
+        world.materials[k].reflective = 0.9;
+        world.materials[k].transparency = 0.9;
+        world.materials[k].refractive_index = 1.5;
+    }
+    if (world_build_bvh(&world) == 0) {
+        printf("Glass (%zu spheres, %d bounces, %dx%d camera rays)\n", world.object_count - 1, depth, camera.hsize, camera.vsize);
+        RayStats all = { 0 };
+        RayStats bounded = { 0 };
+        double all_time = time_budgeted_rays(world, camera, unbounded, depth, INT_MAX, 0.0, &all);
+        double bounded_time = time_budgeted_rays(world, camera, budgeted, depth, CFG_RAY_BUDGET, CFG_STOP_AT_ATTENUATION, &bounded);
+        double difference = 0.0;
+        double total = 0.0;
+        for (int i = 0; i < camera.hsize * camera.vsize; i++) {
+            Color a = unbounded.pixels[i];
+            Color b = budgeted.pixels[i];
+            difference += fabs(a.r - b.r) + fabs(a.g - b.g) + fabs(a.b - b.b);
+            total += a.r + a.g + a.b;
+        }
+        double pixels = (double)all.pixels;
+        printf("  every ray:     %8.2f ms, %6.1f rays a pixel, at most %llu\n", 1000.0 * all_time,
+            (all.camera + all.reflected + all.refracted + all.shadow) / pixels, (unsigned long long)all.most);
+        printf("  %2d ray budget: %8.2f ms, %6.1f rays a pixel, at most %llu (%.1fx, off by %.2f%% of the brightness on average)\n\n",
+            CFG_RAY_BUDGET, 1000.0 * bounded_time, (bounded.camera + bounded.reflected + bounded.refracted + bounded.shadow) / pixels,
+            (unsigned long long)bounded.most, all_time / bounded_time, 100.0 * difference / total);
+        world_free_bvh(&world);
+    }
+    world_free(world);
+    canvas_destroy(unbounded);
+    canvas_destroy(budgeted);
+}
+
+// -------------------
+// CSG
+// -------------------
+
+/// @brief Returns a die in place of a sphere of the given transform and material: a cube rounded by a
+/// sphere, with a hole bored through it.
+Shape csg_die(Mat4D transform, uint32_t material) {
+    Shape rounded = csg_new(CSG_INTERSECTION, scaling(0.75, 0.75, 0.75), "rounded");
+    group_add(&rounded, cube_new(mat4d_identity(), material, "body"));
+    group_add(&rounded, sphere_new(scaling(1.35, 1.35, 1.35), material, "corners"));
+    Shape die = csg_new(CSG_DIFFERENCE, transform, "die");
+    group_add(&die, rounded);
+    group_add(&die, cylinder_new(scaling(0.3, 1.0, 0.3), material, "hole", -1.0, 1.0, 1));
+    return die;
+}
+
+void bench_csg() {
+    const int passes = 5;
+    World world = scene_sphere_grid(30);
+    Camera camera = scene_camera(320, 240);
+    printf("CSG (%zu dice of 4 shapes each, %d passes of %dx%d primary rays)\n", world.object_count - 1, passes, camera.hsize, camera.vsize);
+    if (world_build_bvh(&world)) {
+        world_free(world);
+        return;
+    }
+    double rays = (double)passes * camera.hsize * camera.vsize;
+    double spheres = time_primary_rays(world, camera, passes);
+    world_free_bvh(&world);
+    for (size_t i = 1; i < world.object_count; i++) {
+        world.objects[i] = csg_die(world.objects[i].transform, world.objects[i].material);
+    }
+    if (world_build_bvh(&world) == 0) {
+        double dice = time_primary_rays(world, camera, passes);
+        printf("  spheres: %8.2f Mrays/s\n", rays / spheres / 1e6);
+        printf("  dice:    %8.2f Mrays/s (%.2fx the time)\n\n", rays / dice / 1e6, dice / spheres);
+        world_free_bvh(&world);
+    }
+    for (size_t i = 1; i < world.object_count; i++) {
+        group_free(&world.objects[i]);
+    }
+    world_free(world);
+}
+
+// -------------------
+// Scene files
+// -------------------
+
+void bench_scene_load() {
+    const int n = 1000;
+    const char *path = "build/bench_scene.yml";
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        printf("Scene load: cannot write %s\n\n", path);
+        return;
+    }
+    // A camera, a light and an n by n by n cube of small spheres sharing one defined material
+    fprintf(fp, "- add: camera\n  width: 160\n  height: 120\n  from: [0, 0, -50]\n  to: [0, 0, 0]\n  up: [0, 1, 0]\n\n");
+    fprintf(fp, "- add: light\n  at: [-100, 100, -100]\n  intensity: [1, 1, 1]\n\n");
+    fprintf(fp, "- define: ball\n  value:\n    color: [0.8, 0.3, 0.2]\n    specular: 0.3\n\n");
+    int side = (int)cbrt((double)n * n);
+    for (int i = 0; i < n * n; i++) {
+        fprintf(fp, "- add: sphere\n  material: ball\n  transform:\n    - [scale, 0.25, 0.25, 0.25]\n    - [translate, %.3f, %.3f, %.3f]\n",
+            0.731 * (i % side), 0.731 * (i / side % side), 0.731 * (i / side / side));
+    }
+    long bytes = ftell(fp);
+    fclose(fp);
+
+    Scene scene;
+    double start = timer_seconds();
+    if (scene_load(path, &scene)) {
+        return;
+    }
+    double load = timer_seconds() - start;
+    printf("Scene load (%zu objects, %.0f MB)\n", scene.world.object_count, bytes / 1e6);
+    printf("  load:              %8.2f ms (%.0f MB/s)\n\n", 1000.0 * load, bytes / 1e6 / load);
+    scene_free(&scene);
+    remove(path);
+}
+
+// -------------------
+// OpenCL
+// -------------------
+
+/// Renders `frames` frames with the given options and returns the average seconds per frame,
+/// or a negative value if the device is unavailable. Writes the setup time to `out_setup_seconds`.
+double time_opencl_frames(World world, Camera camera, OpenCLOptions options, int frames, double *out_setup_seconds) {
+    Canvas canvas = canvas_create(camera.hsize, camera.vsize);
+    Tile whole_image = { 0, 0, camera.hsize, camera.vsize };
+
+    double start = timer_seconds();
+    OpenCLRenderer *renderer = opencl_renderer_new(world, camera, options);
+    *out_setup_seconds = timer_seconds() - start;
+    if (renderer == NULL) {
+        canvas_destroy(canvas);
+        return -1.0;
+    }
+
+    // Warm up once so that lazy driver work is not counted
+    opencl_render_tile(renderer, whole_image, canvas);
+
+    start = timer_seconds();
+    for (int i = 0; i < frames; i++) {
+        opencl_render_tile(renderer, whole_image, canvas);
+    }
+    double seconds = (timer_seconds() - start) / frames;
+
+    opencl_renderer_free(renderer);
+    canvas_destroy(canvas);
+    return seconds;
+}
+
+void bench_opencl_specialization() {
+    const int frames = 10;
+    World world = scene_sphere_grid(16);
+    Camera camera = scene_camera(640, 480);
+    printf(
+        "OpenCL kernel specialization (%zu shapes, %zu lights, %dx%d, %d frames)\n",
+        world.object_count,
+        world.light_count,
+        camera.hsize,
+        camera.vsize,
+        frames
+    );
+
+    OpenCLOptions generic = opencl_options_default();
+    generic.specialize = 0;
+    OpenCLOptions specialized = opencl_options_default();
+    specialized.specialize = 1;
+
+    double generic_setup, specialized_setup;
+    double generic_frame = time_opencl_frames(world, camera, generic, frames, &generic_setup);
+    double specialized_frame = time_opencl_frames(world, camera, specialized, frames, &specialized_setup);
+    if (generic_frame < 0.0 || specialized_frame < 0.0) {
+        printf("  skipped: no OpenCL device\n\n");
+        world_free(world);
+        return;
+    }
+
+    printf("  generic:      setup %8.1f ms, %8.2f ms/frame\n", 1000.0 * generic_setup, 1000.0 * generic_frame);
+    printf("  specialized:  setup %8.1f ms, %8.2f ms/frame\n", 1000.0 * specialized_setup, 1000.0 * specialized_frame);
+    printf("  speedup:      %.2fx\n\n", generic_frame / specialized_frame);
+    world_free(world);
+}
+
+void bench_opencl_local_staging() {
+    const int frames = 10;
+    World world = scene_sphere_grid(12);
+    Camera camera = scene_camera(640, 480);
+    printf(
+        "OpenCL local memory staging (%zu shapes, %zu lights, %dx%d, %d frames)\n",
+        world.object_count,
+        world.light_count,
+        camera.hsize,
+        camera.vsize,
+        frames
+    );
+
+    OpenCLOptions global = opencl_options_default();
+    global.stage_local = 0;
+    OpenCLOptions staged = opencl_options_default();
+    staged.stage_local = 1;
+
+    double global_setup, staged_setup;
+    double global_frame = time_opencl_frames(world, camera, global, frames, &global_setup);
+    double staged_frame = time_opencl_frames(world, camera, staged, frames, &staged_setup);
+    if (global_frame < 0.0 || staged_frame < 0.0) {
+        printf("  skipped: no OpenCL device\n\n");
+        world_free(world);
+        return;
+    }
+
+    printf("  global memory:  %8.2f ms/frame\n", 1000.0 * global_frame);
+    printf("  local staging:  %8.2f ms/frame\n", 1000.0 * staged_frame);
+    printf("  speedup:        %.2fx\n\n", global_frame / staged_frame);
+    world_free(world);
+}
+
+void bench_opencl_work_group_size() {
+    const int frames = 10;
+    World world = scene_sphere_grid(16);
+    Camera camera = scene_camera(640, 480);
+    printf("OpenCL work-group size (%dx%d, %d frames)\n", camera.hsize, camera.vsize, frames);
+
+    OpenCLOptions driver = opencl_options_default();
+    driver.tune_work_group = 0;
+    OpenCLOptions tuned = opencl_options_default();
+    tuned.tune_work_group = 1;
+
+    // The first tuned run includes tuning in its setup time. Later runs load the stored result.
+    double driver_setup, tuned_setup;
+    double driver_frame = time_opencl_frames(world, camera, driver, frames, &driver_setup);
+    double tuned_frame = time_opencl_frames(world, camera, tuned, frames, &tuned_setup);
+    if (driver_frame < 0.0 || tuned_frame < 0.0) {
+        printf("  skipped: no OpenCL device\n\n");
+        world_free(world);
+        return;
+    }
+
+    printf("  driver choice:  setup %8.1f ms, %8.2f ms/frame\n", 1000.0 * driver_setup, 1000.0 * driver_frame);
+    printf("  tuned:          setup %8.1f ms, %8.2f ms/frame\n", 1000.0 * tuned_setup, 1000.0 * tuned_frame);
+    printf("  speedup:        %.2fx\n\n", driver_frame / tuned_frame);
+    world_free(world);
+}
+
+typedef struct {
+    World world;
+    int frame_count;
+} OrbitSequence;
+
+/// Frame source that orbits the camera once around the sphere grid over the sequence
+int orbit_frame(int frame, void *user, World *out_world, Camera *out_camera) {
+    OrbitSequence *sequence = user;
+    double angle = 2.0 * M_PI * frame / sequence->frame_count;
+    Mat4D view = view_transform(
+        d4_point(12.0 * sin(angle), 6.0, -12.0 * cos(angle)),
+        d4_point(0.0, 0.0, 0.0),
+        d4_vector(0.0, 1.0, 0.0)
+    );
+    *out_world = sequence->world;
+    *out_camera = camera_new(640, 480, M_PI / 3.0, view);
+    return 0;
+}
+
+int save_frame(int frame, Canvas canvas, void *user) {
+    (void)user;
+    char path[64];
+    snprintf(path, sizeof(path), "build/frame_%03d.ppm", frame);
+    return canvas_save_ppm(canvas, path);
+}
+
+int discard_frame(int frame, Canvas canvas, void *user) {
+    (void)frame;
+    (void)canvas;
+    (void)user;
+    return 0;
+}
+
+/// Renders a sequence with the given options and returns the average seconds per frame, including the
+/// sink, or a negative value if the device is unavailable.
+double time_opencl_sequence(FrameSource source, FrameSink sink, void *user, int frame_count, OpenCLOptions options) {
+    Camera camera;
+    World world;
+    source(0, user, &world, &camera);
+    OpenCLRenderer *renderer = opencl_renderer_new(world, camera, options);
+    if (renderer == NULL) {
+        return -1.0;
+    }
+
+    double start = timer_seconds();
+    int err = opencl_render_frames(renderer, frame_count, source, sink, user);
+    double seconds = (timer_seconds() - start) / frame_count;
+    opencl_renderer_free(renderer);
+    return err ? -1.0 : seconds;
+}
+
+void bench_opencl_frame_pipeline() {
+    OrbitSequence sequence = { scene_sphere_grid(16), 30 };
+    printf("OpenCL frame sequence (640x480, %d frames written as PPM)\n", sequence.frame_count);
+
+    OpenCLOptions serial = opencl_options_default();
+    serial.double_buffer = 0;
+    OpenCLOptions pipelined = opencl_options_default();
+    pipelined.double_buffer = 1;
+
+    double serial_frame = time_opencl_sequence(orbit_frame, save_frame, &sequence, sequence.frame_count, serial);
+    double pipelined_frame = time_opencl_sequence(orbit_frame, save_frame, &sequence, sequence.frame_count, pipelined);
+    if (serial_frame < 0.0 || pipelined_frame < 0.0) {
+        printf("  skipped: no OpenCL device\n\n");
+        world_free(sequence.world);
+        return;
+    }
+
+    printf("  one frame at a time:  %8.2f ms/frame\n", 1000.0 * serial_frame);
+    printf("  double buffered:      %8.2f ms/frame\n", 1000.0 * pipelined_frame);
+    printf("  speedup:              %.2fx\n\n", serial_frame / pipelined_frame);
+    world_free(sequence.world);
+}
+
+typedef struct {
+    World world;
+    Camera camera;
+    Mat4D *rest_transforms;  // Transform of each shape at rest
+    int bouncing;            // How many spheres move each frame
+} BounceSequence;
+
+/// Frame source that bounces a few spheres of the grid, spread across it, and leaves the rest alone
+int bounce_frame(int frame, void *user, World *out_world, Camera *out_camera) {
+    BounceSequence *sequence = user;
+    size_t spheres = sequence->world.object_count - 1;
+    for (int k = 0; k < sequence->bouncing; k++) {
+        size_t i = 1 + k * spheres / sequence->bouncing;
+        double height = fabs(sin(0.3 * frame + k));
+        shape_set_transform(&sequence->world.objects[i], mat4d_mul_mat4d(translation(0.0, height, 0.0), sequence->rest_transforms[i]));
+    }
+    *out_world = sequence->world;
+    *out_camera = sequence->camera;
+    return 0;
+}
+
+void bench_opencl_incremental_uploads() {
+    const int frames = 30;
+    BounceSequence sequence = { scene_sphere_grid(32), scene_camera(640, 480), NULL, 4 };
+    sequence.rest_transforms = malloc(sequence.world.object_count * sizeof(Mat4D));
+    for (size_t i = 0; i < sequence.world.object_count; i++) {
+        sequence.rest_transforms[i] = sequence.world.objects[i].transform;
+    }
+    printf(
+        "OpenCL incremental scene uploads (%d of %zu shapes moving, %d frames)\n",
+        sequence.bouncing,
+        sequence.world.object_count,
+        frames
+    );
+
+    OpenCLOptions full = opencl_options_default();
+    full.incremental_uploads = 0;
+    OpenCLOptions incremental = opencl_options_default();
+    incremental.incremental_uploads = 1;
+
+    double full_frame = time_opencl_sequence(bounce_frame, discard_frame, &sequence, frames, full);
+    double incremental_frame = time_opencl_sequence(bounce_frame, discard_frame, &sequence, frames, incremental);
+    if (full_frame < 0.0 || incremental_frame < 0.0) {
+        printf("  skipped: no OpenCL device\n\n");
+    } else {
+        printf("  whole scene:      %8.2f ms/frame\n", 1000.0 * full_frame);
+        printf("  changed shapes:   %8.2f ms/frame\n", 1000.0 * incremental_frame);
+        printf("  speedup:          %.2fx\n\n", full_frame / incremental_frame);
+    }
+    free(sequence.rest_transforms);
+    world_free(sequence.world);
+}
+
+int main() {
+    bench_scene_load();
+    bench_animation_update();
+    bench_bvh_build();
+    bench_wide_bvh();
+    bench_fast_paths();
+    bench_grid();
+    bench_sphere_cloud();
+    bench_many_lights();
+    bench_area_lights();
+    bench_glass();
+    bench_csg();
+    bench_opencl_specialization();
+    bench_opencl_local_staging();
+    bench_opencl_work_group_size();
+    bench_opencl_frame_pipeline();
+    bench_opencl_incremental_uploads();
+
+    printf("Benchmarks complete\n");
+}
@@ -45,4 +45,15 @@ if %ERRORLEVEL% neq 0 (
     exit /b %ERRORLEVEL%
 )
 
+REM Build hybrid renderer: OpenCL device and CPU worker pool sharing one tile queue
+cl %COMMON_FLAGS% ^
+ %SOURCES% cpu\cpu_workers.c opencl\frame_pipeline.c opencl\opencl_backend.c opencl\profiler.c opencl\program_cache.c opencl\work_group_tuner.c hybrid\renderer_hybrid.c ^
+ /Febuild\beaker_hybrid.exe ^
+ /link %LIBPATH% OpenCL.lib
+
+if %ERRORLEVEL% neq 0 (
+    echo Hybrid build failed!
+    exit /b %ERRORLEVEL%
+)
+
 
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+
+#include <renderer.h>
+#include <ray.h>
+#include <config.h>
+
+typedef struct {
+    CpuWorkers *workers;
+    RayStats stats;         // Of the rays this thread traced
+} CpuWorker;
+
+struct CpuWorkers {
+    World world;
+    Camera camera;
+    Canvas canvas;
+    TileQueue *queue;
+    int thread_count;
+    thrd_t *threads;
+    CpuWorker *states;      // One per thread
+};
+
+void cpu_render_tile(World world, Camera camera, Canvas canvas, Tile tile, RayStats *stats) {
+    for (int y = tile.y; y < tile.y + tile.height; y++) {
+        for (int x = tile.x; x < tile.x + tile.width; x++) {
+            RayStats pixel = { 1, 0, 0, 0, 0, 0, 0 };  // One pixel, no rays yet
+            // Each pixel's jitter is its own sequence, so threads share no random state and tiles rendered
+            // by different threads are not correlated
+            uint64_t state = (uint64_t)y * (uint64_t)canvas.width + (uint64_t)x;
+            Color combined = color_black();
+            for (int i = 0; i < CFG_NUM_SAMPLES; i++) {
+                Ray ray = random_ray_within_pixel(camera, x, y, &state);
+                RayBudget budget = { CFG_RAY_BUDGET, CFG_STOP_AT_ATTENUATION, &pixel };
+                Color c = ray_trace(ray, world, CFG_RECURSION_DEPTH, &budget);
+                combined = color_add(combined, c);
+            }
+            combined = color_div(combined, CFG_NUM_SAMPLES);
+            canvas_pixel_set(canvas, x, y, combined);
+            pixel.most = pixel.camera + pixel.reflected + pixel.refracted + pixel.shadow;
+            ray_stats_add(stats, &pixel);
+        }
+    }
+}
+
+/// @brief Thread entry point. Renders tiles from the back of the queue until it is empty and
+/// returns the number of tiles rendered.
+static int _worker_main(void *arg) {
+    CpuWorker *worker = arg;
+    CpuWorkers *workers = worker->workers;
+    int rendered = 0;
+    Tile tile;
+    while (tile_queue_claim_last(workers->queue, &tile)) {
+        cpu_render_tile(workers->world, workers->camera, workers->canvas, tile, &worker->stats);
+        rendered++;
+    }
+    intersection_arena_free();
+    return rendered;
+}
+
+CpuWorkers *cpu_workers_start(World world, Camera camera, Canvas canvas, TileQueue *queue, int thread_count) {
+    CpuWorkers *workers = malloc(sizeof(CpuWorkers));
+    thrd_t *threads = malloc(thread_count * sizeof(thrd_t));
+    CpuWorker *states = calloc(thread_count, sizeof(CpuWorker));
+    if (!workers || !threads || !states) {
+        fprintf(stderr, "Out of memory!\n");
+        free(workers);
+        free(threads);
+        free(states);
+        return NULL;
+    }
+    *workers = (CpuWorkers) { world, camera, canvas, queue, 0, threads, states };
+
+    for (int i = 0; i < thread_count; i++) {
+        states[i].workers = workers;
+        if (thrd_create(&threads[i], _worker_main, &states[i]) != thrd_success) {
+            fprintf(stderr, "Failed to start CPU worker %d.\n", i);
+            break;
+        }
+        workers->thread_count++;
+    }
+
+    if (workers->thread_count == 0) {
+        free(threads);
+        free(states);
+        free(workers);
+        return NULL;
+    }
+    return workers;
+}
+
+int cpu_workers_join(CpuWorkers *workers, RayStats *stats) {
+    int total = 0;
+    for (int i = 0; i < workers->thread_count; i++) {
+        int rendered = 0;
+        thrd_join(workers->threads[i], &rendered);
+        total += rendered;
+        if (stats != NULL) {
+            ray_stats_add(stats, &workers->states[i].stats);
+        }
+    }
+    free(workers->threads);
+    free(workers->states);
+    free(workers);
+    return total;
+}
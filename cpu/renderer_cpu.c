@@ -1,39 +1,45 @@
+#include <stdio.h>
+
 #include <renderer.h>
-#include <ray.h>
 #include <config.h>
 
-Ray _random_ray_within_pixel(Camera camera, int px, int py)
-{
-    // Offset from edge of canvas to pixel's center
-    double xoffset = (px + 0.5) * camera.pixel_size;
-    double yoffset = (py + 0.5) * camera.pixel_size;
+int render_image(World world, Camera camera, Canvas canvas, RayStats *stats) {
+    TileQueue queue;
+    if (tile_queue_init(&queue, camera.hsize, camera.vsize, CFG_TILE_SIZE)) {
+        return 1;
+    }
 
-    // Untransformed coordinates of the pixel in world space.
-    double world_x = camera.half_width - xoffset;
-    double world_y = camera.half_height - yoffset;
+    CpuWorkers *workers = cpu_workers_start(world, camera, canvas, &queue, cpu_count());
+    if (workers == NULL) {
+        tile_queue_destroy(&queue);
+        return 1;
+    }
+    cpu_workers_join(workers, stats);
 
-    // Using the camera matrix, transform the canvas point and the origin,
-    // and then compute the ray's direction vector.
-    Mat4D inv = camera.inv_transform;
-    Vec4D pixel = mat4d_mul_vec4d(inv, d4_point(world_x, world_y, -1));
-    Vec4D origin = mat4d_mul_vec4d(inv, d4_point(0., 0., 0.));
-    Vec4D direction = d4_norm(d4_sub(pixel, origin));
-    
-    return (Ray){ origin, direction };
+    tile_queue_destroy(&queue);
+    return 0;
 }
 
-int render_image(World world, Camera camera, Canvas canvas) {
-    for (int y = 0; y < camera.vsize; y++) {
-        for (int x = 0; x < camera.hsize; x++) {
-            Color combined = color_black();
-            for (int i = 0; i < CFG_NUM_SAMPLES; i++) {
-                Ray ray = random_ray_within_pixel(camera, x, y);
-                Color c = ray_color(ray, world, CFG_RECURSION_DEPTH);
-                combined = color_add(combined, c);
-            }
-            combined = color_div(combined, CFG_NUM_SAMPLES);
-            canvas_pixel_set(canvas, x, y, combined);
+int render_frames(int frame_count, FrameSource source, FrameSink sink, void *user, RayStats *stats) {
+    Canvas canvas = { 0 };
+    int err = 0;
+    for (int frame = 0; frame < frame_count && !err; frame++) {
+        World world;
+        Camera camera;
+        if (source(frame, user, &world, &camera)) {
+            fprintf(stderr, "Failed to get scene for frame %d\n", frame);
+            err = 1;
+            break;
         }
+        if (canvas.pixels == NULL) {
+            canvas = canvas_create(camera.hsize, camera.vsize);
+        } else if (camera.hsize != canvas.width || camera.vsize != canvas.height) {
+            fprintf(stderr, "Frame %d does not match the size of the first\n", frame);
+            err = 1;
+            break;
+        }
+        err = render_image(world, camera, canvas, stats) || sink(frame, canvas, user);
     }
-    return 0;
-}
\ No newline at end of file
+    canvas_destroy(canvas);
+    return err;
+}
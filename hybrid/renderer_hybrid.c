@@ -0,0 +1,106 @@
+#include <stdio.h>
+
+#include <renderer.h>
+#include <config.h>
+#include <timer.h>
+
+/* Renders with the OpenCL device and a pool of CPU threads at the same time.
+Both pull tiles from one queue: the device claims batches of tiles from the front, sized so that each
+launch takes about CFG_HYBRID_BATCH_SECONDS, and the CPU threads take single tiles from the back. Scenes the
+device would render differently from the CPU are rendered on the CPU only, so every tile matches. */
+
+int render_image(World world, Camera camera, Canvas canvas, RayStats *stats) {
+    TileQueue queue;
+    if (tile_queue_init(&queue, camera.hsize, camera.vsize, CFG_TILE_SIZE)) {
+        return 1;
+    }
+
+    // Start the CPU workers first so they are busy while the OpenCL program builds.
+    // This thread drives the device, so leave one processor for it.
+    int cpu_threads = cpu_count() - 1;
+    if (cpu_threads < 1) {
+        cpu_threads = 1;
+    }
+    CpuWorkers *workers = cpu_workers_start(world, camera, canvas, &queue, cpu_threads);
+    if (workers == NULL) {
+        tile_queue_destroy(&queue);
+        return 1;
+    }
+
+    // Tiles the device gave up on are finished here, and their rays counted with the workers'
+    RayStats fallback_stats = { 0 };
+    int device_tiles = 0;
+    double device_seconds = 0.0;
+    int supported = opencl_supports_world(world);
+    OpenCLRenderer *device = supported ? opencl_renderer_new(world, camera, opencl_options_default()) : NULL;
+    if (!supported) {
+        fprintf(stderr, "The scene uses features the OpenCL kernel lacks. Rendering on the CPU only.\n");
+    } else if (device == NULL) {
+        fprintf(stderr, "No OpenCL device available. Rendering on the CPU only.\n");
+    } else {
+        int batch = queue.tiles_x;
+        Tile tile;
+        int claimed;
+        while ((claimed = tile_queue_claim(&queue, batch, &tile)) > 0) {
+            double start = timer_seconds();
+            if (opencl_render_tile(device, tile, canvas)) {
+                // Finish the claimed region here and leave the rest of the queue to the CPU workers
+                fprintf(stderr, "OpenCL render failed. Falling back to the CPU.\n");
+                cpu_render_tile(world, camera, canvas, tile, &fallback_stats);
+                break;
+            }
+            device_seconds += timer_seconds() - start;
+            device_tiles += claimed;
+
+            // Size the next batch from the device's measured throughput, but never take more than half
+            // of what is left so the CPU workers are not left waiting at the end of the frame.
+            double seconds_per_tile = device_seconds / device_tiles;
+            int target = seconds_per_tile > 0.0 ? (int)(CFG_HYBRID_BATCH_SECONDS / seconds_per_tile) : 2 * batch;
+            int limit = tile_queue_remaining(&queue) / 2;
+            batch = target < limit ? target : limit;
+            if (batch < 1) {
+                batch = 1;
+            }
+        }
+        opencl_renderer_free(device);
+    }
+
+    int cpu_tiles = cpu_workers_join(workers, stats);
+    if (stats != NULL) {
+        ray_stats_add(stats, &fallback_stats);
+    }
+    tile_queue_destroy(&queue);
+
+    printf(
+        "Rendered %d tiles on the OpenCL device and %d tiles on %d CPU threads.\n",
+        device_tiles,
+        cpu_tiles,
+        cpu_threads
+    );
+    return 0;
+}
+
+// Each frame goes through render_image, which checks again whether the device can render it
+int render_frames(int frame_count, FrameSource source, FrameSink sink, void *user, RayStats *stats) {
+    Canvas canvas = { 0 };
+    int err = 0;
+    for (int frame = 0; frame < frame_count && !err; frame++) {
+        World world;
+        Camera camera;
+        if (source(frame, user, &world, &camera)) {
+            fprintf(stderr, "Failed to get scene for frame %d\n", frame);
+            err = 1;
+            break;
+        }
+        if (canvas.pixels == NULL) {
+            canvas = canvas_create(camera.hsize, camera.vsize);
+        } else if (camera.hsize != canvas.width || camera.vsize != canvas.height) {
+            fprintf(stderr, "Frame %d does not match the size of the first\n", frame);
+            err = 1;
+            break;
+        }
+        err = render_image(world, camera, canvas, stats) || sink(frame, canvas, user);
+    }
+    canvas_destroy(canvas);
+    return err;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <matrix.h>
+#include <world.h>
+
+/* Keyframed object transforms. Each track moves one object of a world through a sequence of keyframes,
+interpolating linearly between them and holding the first and last keyframes outside their range. */
+
+typedef struct {
+    double time;        // Seconds from the start of the animation
+    Vec4D translation;
+    Vec4D rotation;     // Angles in radians about the x, y and z axes, applied in that order
+    Vec4D scale;
+} Keyframe;
+
+typedef struct {
+    size_t object;      // Index of the animated object in the world
+    Mat4D base;         // Applied before the keyframed transform, e.g. the object's transform at rest
+    Keyframe *keys;     // Sorted by time
+    size_t key_count;
+} Track;
+
+typedef struct {
+    Track *tracks;
+    size_t track_count;
+    double fps;
+} Animation;
+
+Keyframe keyframe_new(double time, Vec4D offset, Vec4D angles, Vec4D scale);
+
+/// Returns the transform of a track at `time`, including its base transform.
+Mat4D track_transform(const Track *track, double time);
+
+/// Moves every animated object to its transform at `time`. Objects whose transform is unchanged, such as
+/// those between two identical keyframes or past their last one, are left alone, so only moved objects get
+/// their inverse recomputed and their revision bumped. Returns the number of objects that moved.
+size_t animation_apply(const Animation *animation, World *world, double time);
@@ -43,7 +43,7 @@ int assert_eq_size_t(size_t actual, size_t expected) {
     return 1;
 }
 
-int assert_eq_ptr(void *actual, void *expected) {
+int assert_eq_ptr(const void *actual, const void *expected) {
     if (actual != expected) {
         printf("Expected pointer to address %p but was %p\n", expected, actual);
         return 0;
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <matrix.h>
+
+/* Bounding volume hierarchy over axis-aligned boxes. Nodes are stored in one array with every node's
+children after it, so a refit can walk the array backwards and visit children before their parents. */
+
+typedef struct {
+    double min[3];
+    double max[3];
+} Aabb;
+
+typedef struct {
+    Aabb bounds;
+    uint32_t first;  // Leaves: index of the first primitive in `Bvh.indices`. Interior nodes: index of the left child; the right child follows it.
+    uint32_t count;  // Number of primitives in a leaf, or 0 for interior nodes
+} BvhNode;
+
+typedef struct Bvh {
+    BvhNode *nodes;
+    size_t node_count;
+    uint32_t *indices;       // Primitive ids, grouped by leaf
+    size_t primitive_count;
+    double built_cost;       // SAH cost just after the last build, to tell how much refits have degraded the tree
+} Bvh;
+
+/// A ray set up for box tests, once for all the boxes it is tested against.
+typedef struct {
+    double origin[3];
+    double inv_direction[3];  // Reciprocals of the direction's components, infinite for zero ones
+    int sign[3];              // 1 where the direction is negative, which makes the box's max the near side
+} AabbRay;
+
+Aabb aabb_empty();
+/// Returns the box around all of space, which unbounded shapes such as planes report.
+Aabb aabb_infinite();
+/// Returns 1 if the box is finite, and so neither infinite nor empty.
+int aabb_is_finite(const Aabb *box);
+void aabb_extend(Aabb *box, const Aabb *other);
+double aabb_surface_area(const Aabb *box);
+/// Returns the box around the corners of `box` moved by `transform`, which must be finite.
+Aabb aabb_transform(const Aabb *box, Mat4D transform);
+
+AabbRay aabb_ray_new(Vec4D origin, Vec4D direction);
+
+/// Returns the distance along the ray at which it enters `box`, or INFINITY if it misses it or enters beyond `tmax`.
+double aabb_ray_entry(const Aabb *box, const AabbRay *ray, double tmax);
+
+/// How bvh_build_with builds a hierarchy.
+typedef struct {
+    int thread_count;  // Threads to build on, including the calling one
+    int linear;        // Split at the Morton codes of the primitives' centroids rather than by the surface area heuristic, which builds several times faster but traces slower
+} BvhBuildOptions;
+
+/// Returns the options from config.h, with a thread per processor unless it sets a count.
+BvhBuildOptions bvh_build_options_default();
+
+/// Builds a hierarchy over the primitives listed in `ids`, whose bounds are `bounds[id]`, with the default
+/// options. Returns 0 on success.
+int bvh_build(Bvh *bvh, const Aabb *bounds, const uint32_t *ids, size_t count);
+
+/// Builds a hierarchy as bvh_build does, with the given options. The tree is the same whatever the number of
+/// threads. Returns 0 on success.
+int bvh_build_with(Bvh *bvh, const Aabb *bounds, const uint32_t *ids, size_t count, BvhBuildOptions options);
+
+/// Recomputes every node's bounds from the primitives' current bounds without changing the tree's structure.
+void bvh_refit(Bvh *bvh, const Aabb *bounds);
+
+/// Returns the expected cost of tracing a ray through the tree by the surface area heuristic.
+double bvh_cost(const Bvh *bvh);
+
+void bvh_free(Bvh *bvh);
@@ -8,4 +8,50 @@ static const int CFG_SINGLE_PIXEL_Y = 9;
 static const int CFG_VERBOSE = 0;
 static const int CFG_NUM_SAMPLES = 1;
 
+// Side length in pixels of the tiles handed out to render workers
+static const int CFG_TILE_SIZE = 32;
+// Target duration of each OpenCL launch when sharing tiles with CPU workers
+static const double CFG_HYBRID_BATCH_SECONDS = 0.05;
+
+// Rays stop bouncing once their contribution to the pixel falls below this fraction
+static const double CFG_STOP_AT_ATTENUATION = 0.001;
+// Reflected and refracted rays each camera ray may spawn on the CPU, however deep the reflections go.
+// Bounds the work a pixel looking through a lot of glass takes, where every hit spawns two more rays.
+static const int CFG_RAY_BUDGET = 16;
+// Build kernel variants specialized to each scene's light count and shape types
+static const int CFG_OPENCL_SPECIALIZE = 1;
+// Stage shapes and lights in each work-group's local memory when they fit
+static const int CFG_OPENCL_STAGE_LOCAL = 1;
+// Time candidate work-group sizes for each kernel variant and device, and remember the fastest
+static const int CFG_OPENCL_TUNE_WORK_GROUP = 1;
+// Time every OpenCL stage and print a breakdown when the renderer is freed
+static const int CFG_OPENCL_PROFILE = 0;
+// Where the profile is also written as JSON
+static const char CFG_OPENCL_PROFILE_PATH[] = "build/opencl_profile.json";
+// When rendering frame sequences, overlap each frame's kernel with the next frame's upload and the previous frame's readback
+static const int CFG_OPENCL_DOUBLE_BUFFER = 1;
+// Keep the scene on the device between renders and only upload the shapes and lights that changed
+static const int CFG_OPENCL_INCREMENTAL_UPLOADS = 1;
+
+// Compile scene files to a binary file beside them on first load, and map that instead on later loads
+static const int CFG_SCENE_CACHE = 1;
+// Appended to a scene file's path to name its compiled scene
+static const char CFG_SCENE_CACHE_SUFFIX[] = ".compiled";
+
+// Threads that build BVHs, or 0 for one per processor
+static const int CFG_BVH_BUILD_THREADS = 0;
+// Build BVHs from the Morton codes of their primitives' centroids instead of by the surface area heuristic,
+// which is several times faster but gives trees that are slower to trace
+static const int CFG_BVH_LINEAR = 0;
+// Collapse the world's BVH into a four-wide one with quantized bounds, and trace rays through that instead
+static const int CFG_WIDE_BVH = 1;
+// Cells per object in grids over the world's objects
+static const double CFG_GRID_DENSITY = 1.0;
+
+// Lights each hit is shaded by, picked at random from the world's light tree, in worlds with more lights
+// than this. Fewer lights are all shaded.
+static const int CFG_LIGHT_SAMPLES = 8;
+// Lights that could add less than this to any channel of a point's color are skipped there
+static const double CFG_LIGHT_CUTOFF = 0.001;
+
 static const double EPSILON = 0.0000001;
\ No newline at end of file
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bvh.h>
+
+/* Uniform grid over axis-aligned boxes. The box around them all is cut into cells of equal size, about
+`density` of them per box, and each cell lists the boxes that overlap it. A ray walks the cells it passes
+through in order, by 3D-DDA (Amanatides and Woo, "A Fast Voxel Traversal Algorithm for Ray Tracing", 1987),
+and can stop at the first cell in which it hits something. For many similar boxes spread evenly through a
+volume, that visits fewer cells than a tree visits nodes. A box in several cells is listed in each, so rays
+should remember the boxes they have tested, and skip them in later cells. */
+
+typedef struct {
+    Aabb bounds;
+    int resolution[3];       // Cells along each axis
+    double cell_size[3];
+    double inv_cell_size[3];
+    size_t cell_count;
+    size_t occupied_count;   // Cells that at least one box overlaps
+    uint32_t *cell_start;    // The ith cell's boxes are items[cell_start[i]] up to items[cell_start[i + 1]]. Cells are numbered x fastest, then y, then z.
+    uint32_t *items;         // Box ids, grouped by cell. A box is listed once for every cell it overlaps.
+    size_t item_count;
+} Grid;
+
+/// A ray's walk through the cells of a grid, in the order it passes through them.
+typedef struct {
+    int cell[3];
+    int step[3];             // 1 or -1 along each axis, in the direction of the ray
+    int stop[3];             // The cell just outside the grid along each axis, in the direction of the ray
+    ptrdiff_t stride[3];     // Change in `index` for a step along each axis
+    double t_next[3];        // Distance along the ray at which it crosses into the next cell along each axis
+    double t_delta[3];       // Distance along the ray across one cell along each axis
+    double t_end;            // Where the ray leaves the grid, or its tmax if that is nearer
+    double t_cell_exit;      // Where the ray leaves the current cell
+    size_t index;            // Of the current cell
+} GridWalk;
+
+/// Builds a grid with about `density` cells per box over the boxes with the given ids. Returns 0 on
+/// success, or 1 if out of memory or the boxes overlap too many cells to list.
+int grid_build(Grid *grid, const Aabb *bounds, const uint32_t *ids, size_t count, double density);
+
+/// Returns 1 if the grid, built over the given boxes, is likely to trace faster than a tree: there are
+/// many boxes, of similar size, and they fill the grid's cells evenly, each overlapping only a few.
+int grid_suits(const Grid *grid, const Aabb *bounds, const uint32_t *ids, size_t count);
+
+/// Starts the ray's walk at the first cell it enters before `tmax`. Returns 0 if it misses the grid.
+int grid_walk_start(const Grid *grid, Vec4D origin, Vec4D direction, double tmax, GridWalk *out);
+
+/// Moves on to the next cell. Returns 0 once the ray has left the grid or passed its tmax.
+int grid_walk_next(GridWalk *walk);
+
+void grid_free(Grid *grid);
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bvh.h>
+#include <matrix.h>
+#include <shape.h>
+
+/* Groups of shapes, as in chapter 14 of the Ray Tracer Challenge. A group is a SHAPE_GROUP shape whose
+children, which may be groups themselves, move with it. Each child's transform is stored composed with
+those of the groups above it, so a child is tested and shaded like any other shape, without walking up to
+its parents. The transforms relative to the group are kept too, to compose again when a group moves.
+
+Every group caches the bounds of its children, in the same space as its own bounds, so that a ray that
+misses a group skips all of its children, and one that hits it skips the children whose boxes it misses.
+Moving a group or a child recomposes only the shapes below it, and the bounds of the groups above it.
+
+CSG shapes, as in chapter 16, are groups of two children, which a SHAPE_CSG shape combines by an operation
+instead of simply holding both. Rays find every place they cross each child, and keep only those on the
+surface of the combination: for a union, the hits on each child outside the other, for an intersection,
+those inside it, and for a difference, the hits on the first child outside the second and on the second
+inside the first. Children are spheres, planes, cubes, cylinders and cones, or groups and CSG shapes of
+them; meshes and sphere clouds, which rays only find the nearest hit on, cannot be combined. */
+
+// How a group combines its children
+#define CSG_NONE         0  // Not at all: a plain group
+#define CSG_UNION        1
+#define CSG_INTERSECTION 2
+#define CSG_DIFFERENCE   3
+
+typedef struct Group {
+    size_t child_count;
+    Shape *children;        // Transforms composed with the group's
+    Mat4D *locals;          // Each child's transform relative to the group
+    Mat4D *local_invs;
+    Aabb *child_bounds;     // Infinite for unbounded children
+    Aabb bounds;            // Of every child, infinite if any is unbounded, or of what a CSG shape keeps of them
+    struct Group *parent;   // The group this one is a child of, or NULL
+    size_t index;           // Among the parent's children
+    size_t capacity;
+    uint32_t revision;      // Incremented whenever a child moves. See shape_revision.
+    int operation;          // CSG_*
+} Group;
+
+/// Returns an empty group, or a shape whose group is NULL if out of memory. Children are added with group_add.
+Shape group_new(Mat4D transform, const char *name);
+
+/// Returns an empty CSG shape combining its children by `operation`, one of CSG_UNION, CSG_INTERSECTION or
+/// CSG_DIFFERENCE, or a shape whose group is NULL if out of memory. Its two children are added with group_add,
+/// the one a difference subtracts from first.
+Shape csg_new(int operation, Mat4D transform, const char *name);
+
+/// Returns whether the shape has children: if it is a group or a CSG shape.
+int shape_is_group(const Shape *shape);
+
+/// Returns whether a CSG shape could hold `shape`, which only needs every place rays cross it.
+int csg_can_combine(const Shape *shape);
+
+/// Adds `child`, whose transform places it in the group's space, to the group, which takes ownership of it
+/// and of its children if it is a group. Groups of a compiled scene, whose arrays are in its mapping, cannot
+/// be added to. Returns 0 on success.
+int group_add(Shape *group, Shape child);
+
+/// Sets the transform of a group's `index`th child relative to the group.
+void group_set_child_transform(Shape *group, size_t index, Mat4D transform);
+
+/// Composes the children's transforms with the group's again, after the group's own transform changed.
+/// Called by shape_set_transform.
+void group_compose(Shape *group);
+
+/// Frees a group's children, and theirs.
+void group_free(Shape *group);
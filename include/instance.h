@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <matrix.h>
+#include <material.h>
+#include <shape.h>
+
+/* Instances place shared geometry in the world. The geometry is a prototype shape, which may be a mesh, and
+whose own transform places it in the instance's space. An instance holds only its transform and the index
+of its material, so each copy costs a fraction of a Shape, and every copy of a mesh shares its triangles
+and BVH. The world's BVH over objects and instances is then the top level of a two-level hierarchy, whose
+bottom levels are the prototypes' own. */
+
+// Material index of an instance that keeps its prototype's material
+#define INSTANCE_PROTOTYPE_MATERIAL UINT32_MAX
+
+typedef struct Instance {
+    uint32_t prototype;  // Index into World.prototypes
+    uint32_t material;   // Index into World.materials, like a shape's, or INSTANCE_PROTOTYPE_MATERIAL
+    Mat4D transform;
+    Mat4D inv_transform;
+    uint32_t revision;   // Incremented by the instance_set_* functions. See Shape.revision.
+} Instance;
+
+Instance instance_new(uint32_t prototype, Mat4D transform, uint32_t material);
+
+void instance_set_transform(Instance *instance, Mat4D transform);
+void instance_set_material(Instance *instance, uint32_t material);
+
+/// Returns `prototype` as `instance` places it, with the transforms composed and the instance's material, if
+/// it has one, in place of the prototype's.
+Shape instance_shape(const Instance *instance, const Shape *prototype);
+
+/// Returns the normal at a point where a ray hit the instance, as shape_normal_at does for shapes.
+Vec4D instance_normal_at(const Instance *instance, Shape *prototype, Vec4D world_point, uint32_t primitive, double u, double v);
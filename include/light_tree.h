@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bvh.h>
+#include <lighting.h>
+
+/* Hierarchy over a world's point lights, for shading with many of them. Each node bounds the power of its
+lights, which is enough to bound how much they can add to a point's color, and to estimate it. Shading
+picks lights at random by walking down from the root, taking each child in proportion to its estimate, and
+weights what a light adds by the inverse of the probability of picking it, which keeps the sum unbiased
+(Conty Estevez and Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting", 2018). Nodes
+whose bound at a point is below a cutoff are never taken, so lights too far or too dim to matter there are
+skipped without a shadow ray. */
+
+typedef struct {
+    Bvh tree;               // Over the lights' bounds: their positions, or their rectangles if they are area lights
+    double *power;          // Of each node: the brightest channel of each of its lights' intensities, summed
+    double *reach;          // Of each node: its lights' largest falloff distance, or INFINITY if one of them has none
+    uint32_t *revisions;    // Of every light when the tree was last fit to it
+    size_t light_count;
+} LightTree;
+
+/// What a point being shaded makes of the light reaching it, for bounding lights' contributions there.
+typedef struct {
+    Vec4D point;
+    Vec4D normal;
+    double facing;          // Most of a light's intensity the point can send on, if the light is in front of it
+    double behind;          // Most it can send on of a light behind it, which only adds its ambient part
+} LightReceiver;
+
+/// Returns how `point`, of the given material and color, receives light. See lighting_compute.
+LightReceiver light_receiver_new(const Material *material, Color color, Vec4D point, Vec4D normal);
+
+/// Returns the most `light` can add to any channel of the receiver's color.
+double light_bound(const PointLight *light, const LightReceiver *receiver);
+
+/// Builds a tree over the lights. Returns 0 on success.
+int light_tree_build(LightTree *tree, const PointLight *lights, size_t count);
+
+/// Brings the tree up to date after lights have changed: refits it if they moved or changed intensity, or
+/// rebuilds it if lights were added or removed, or the refit tree is much worse than a new one.
+/// Returns 1 if the tree was rebuilt, 0 if it was refit or already up to date, or -1 on failure.
+int light_tree_update(LightTree *tree, const PointLight *lights, size_t count);
+
+/// Picks a light for the receiver by walking down the tree with `u`, uniform in [0, 1), skipping lights
+/// whose bound there is below `cutoff`. Writes the light and the probability it had of being picked.
+/// Returns 0, and picks nothing, if the walk came only to lights below the cutoff.
+int light_tree_sample(const LightTree *tree, const PointLight *lights, const LightReceiver *receiver, double cutoff, double u, uint32_t *out_light, double *out_probability);
+
+void light_tree_free(LightTree *tree);
@@ -6,11 +6,47 @@
 #include <material.h>
 #include <shape.h>
 
+// Kinds of light
+#define LIGHT_POINT 0
+#define LIGHT_AREA  1
+
+/// A light, which is a point, or a rectangle that casts soft shadows. An area light is shaded as a point
+/// light in each cell of a usteps by vsteps grid over it, each with its share of the intensity.
 typedef struct PointLight {
-    Vec4D position;
+    Vec4D position;     // For area lights, a corner of the rectangle
     Color intensity;
+    double falloff;     // Distance beyond which the intensity falls with the square of the distance, or 0 if it never does
+    uint32_t revision;  // Incremented by point_light_set. See Shape.revision.
+    int type;           // LIGHT_POINT or LIGHT_AREA
+    // Only relevant for area lights
+    Vec4D uvec;         // Edges of the rectangle from the corner
+    Vec4D vvec;
+    int usteps;         // Cells along each edge
+    int vsteps;
 } PointLight;
 
-Color lighting_compute(Shape object, PointLight light, Vec4D point, Vec4D eye, Vec4D normal, int in_shadow);
+/// Returns a point light at `position` that never falls off.
+PointLight point_light_new(Vec4D position, Color intensity);
+
+/// Returns a rectangular light with a corner at `corner` and edges `uvec` and `vvec`, sampled in a `usteps`
+/// by `vsteps` grid of cells.
+PointLight area_light_new(Vec4D corner, Vec4D uvec, int usteps, Vec4D vvec, int vsteps, Color intensity);
+
+/// Moves the light so that it starts at `position`, its corner if it is an area light, and sets its intensity.
+void point_light_set(PointLight *light, Vec4D position, Color intensity);
+
+/// Returns the center of the light.
+Vec4D light_center(const PointLight *light);
+
+/// Returns the point a sample at (`u`, `v`), each in [0, 1), of the light's cell in column `i` and row `j`
+/// falls on. Point lights are the same everywhere.
+Vec4D light_sample_point(const PointLight *light, int i, int j, double u, double v);
+
+/// Returns the light's intensity at `point`, after its falloff.
+Color point_light_intensity_at(const PointLight *light, Vec4D point);
+
+/// Returns the light's contribution at a point of the given material and color, which is the material's
+/// color there. See shape_color_at.
+Color lighting_compute(const Material *material, Color color, PointLight light, Vec4D point, Vec4D eye, Vec4D normal, int in_shadow);
 
 
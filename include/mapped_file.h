@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Files mapped into memory whole, copy-on-write, so that what was read from them can be used in place, and
+even modified in memory, without touching the file. Compiled scenes and particle dumps are mapped. */
+
+typedef struct {
+    void *data;
+    size_t size;
+#ifdef _WIN32
+    void *file;              // HANDLEs, so that this header needs no windows.h
+    void *mapping;
+#endif
+} MappedFile;
+
+/// Maps the whole file at `path`. Returns 0 on success, or 1 if it is missing or empty, or cannot be mapped.
+int mapped_file_open(const char *path, MappedFile *out);
+void mapped_file_close(MappedFile *file);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bvh.h>
+#include <vector.h>
+
+/* Triangle meshes. Vertices are stored once and shared between triangles, in single precision to halve
+their size, and each mesh has a BVH over its own triangles in object space. A mesh can be shared by any
+number of SHAPE_MESH shapes, each with its own transform and material. */
+
+typedef struct Mesh {
+    size_t vertex_count;
+    size_t triangle_count;
+    float *positions;    // Three coordinates per vertex
+    float *normals;      // Three per vertex to interpolate across triangles, or NULL to shade them flat
+    uint32_t *indices;   // Three vertices per triangle
+    Bvh bvh;             // Over the triangles
+    Aabb bounds;         // Of every vertex
+} Mesh;
+
+/// Creates a mesh from vertex and index buffers, taking ownership of them, and builds its BVH. `normals`
+/// may be NULL. Returns NULL on failure, having freed the buffers.
+Mesh *mesh_create(float *positions, float *normals, size_t vertex_count, uint32_t *indices, size_t triangle_count);
+void mesh_destroy(Mesh *mesh);
+
+/// Reads a Wavefront OBJ file, triangulating polygons as fans. Only positions, normals and faces are used.
+/// Normals in the file are used if present. Otherwise, if `smooth` is set, each vertex gets the
+/// area-weighted average normal of the triangles around it, and if not, triangles are shaded flat.
+/// The file is streamed, so it is never held in memory whole. Returns NULL on failure.
+Mesh *mesh_load_obj(const char *path, int smooth);
+
+/// Returns the distance along the object-space ray to the nearest triangle it hits closer than `tmax`, or
+/// INFINITY. On a hit, writes the triangle and the barycentric coordinates of the hit on it, which weight its
+/// second and third vertices. The test is watertight: rays never slip between triangles sharing an edge.
+double mesh_intersect(const Mesh *mesh, Vec4D origin, Vec4D direction, double tmax, uint32_t *out_triangle, double *out_u, double *out_v);
+
+/// Returns the object-space normal at barycentric coordinates (u, v) on `triangle`.
+Vec4D mesh_normal(const Mesh *mesh, uint32_t triangle, double u, double v);
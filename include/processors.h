@@ -0,0 +1,6 @@
+#pragma once
+
+/* The machine's processors, which render workers and BVH builds spread their threads across. */
+
+/// Returns the number of logical processors available to the process.
+int cpu_count();
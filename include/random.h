@@ -1,4 +1,10 @@
 // Random number generation module. Plan is to base loosely on Python's `random` module.
 
+#pragma once
+
+#include <stdint.h>
+
 double random_double();
-double random_uniform(double a, double b);
\ No newline at end of file
+double random_uniform(double a, double b);
+/// Returns a number in [0, 1) from the sequence at `state`, and advances it. Threadsafe for separate states.
+double random_next(uint64_t *state);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 #include <vector.h>
 #include <matrix.h>
 #include <shape.h>
@@ -14,27 +15,60 @@
 typedef struct {
     double t;
     Shape *object_ptr;
+    // Where on the shape the hit is, for shapes made of primitives: the triangle of a mesh, and the
+    // barycentric coordinates of the hit on it, or the particle of a sphere cloud
+    uint32_t primitive;
+    double u;
+    double v;
+    // Set if the hit is on an instance, in which case object_ptr is its prototype
+    const Instance *instance;
+    uint32_t material;         // Index into World.materials of the material hit: the shape's, or its instance's or particle's
 } Intersection;
 
+// Intersections a list holds in place before it spills to its thread's arena
+#define INTERSECTION_LIST_LOCAL 16
+
+struct IntersectionChunk;
+
+/* Lists of every intersection of a ray with a shape, which CSG shapes need. A list lives on the stack and
+holds its first INTERSECTION_LIST_LOCAL intersections in place. Longer lists move to blocks of an arena each
+thread keeps, which grows to fit the longest lists it has had to hold and is then reused, so lists do not
+allocate once it has. Intersections are appended in any order and sorted once they are all in.
+
+Lists are freed in the reverse of the order they were made in, which gives back all the arena took for
+them, and a list may not grow while one made after it is in use. */
 typedef struct {
     size_t count;
     size_t capacity;
-    Intersection *items;
+    Intersection *items;                     // `local`, or a block of the arena once the list outgrows it
+    struct IntersectionChunk *arena_chunk;   // Where the thread's arena stood when the list was made
+    size_t arena_used;
+    Intersection local[INTERSECTION_LIST_LOCAL];
 } IntersectionList;
 
-IntersectionList intersection_list_new();
+/// Makes an empty list. Lists cannot be copied, as they may point into themselves.
+void intersection_list_init(IntersectionList *xs);
+/// Gives back what the list, and any made after it, took from the thread's arena.
 void intersection_list_free(IntersectionList *xs);
-int intersection_list_add(IntersectionList *xs, Intersection x);
+/// Appends `x`, out of order. Exits if out of memory.
+void intersection_list_add(IntersectionList *xs, Intersection x);
+/// Sorts the `count` intersections from the `first`th on by increasing t.
+void intersection_list_sort(IntersectionList *xs, size_t first, size_t count);
+/// Frees the calling thread's arena. Threads that traced rays call this before they exit.
+void intersection_arena_free();
 
 typedef struct {
     double t;
     Shape *object_ptr;
     Vec4D point;
     Vec4D over_point;
+    Vec4D under_point;          // Just below the surface, where refracted rays start
     Vec4D eyev;
     Vec4D normalv;
     int inside;
     Vec4D reflectv;
+    const Instance *instance;   // As in Intersection
+    uint32_t material;          // As in Intersection
 } IntersectionData;
 
 // ----------------------------------
@@ -47,7 +81,8 @@ typedef struct Ray {
 } Ray;
 
 Ray ray_at_pixel(Camera camera, int px, int py);
-Ray random_ray_within_pixel(Camera camera, int px, int py);
+/// Returns a ray through a random point of the pixel, drawn from the random sequence at `state`.
+Ray random_ray_within_pixel(Camera camera, int px, int py, uint64_t *state);
 
 IntersectionData ray_prepare_computations(Ray r, Intersection i);
 
@@ -61,13 +96,47 @@ Vec4D ray_position(Ray ray, double t);
 
 Intersection ray_intersect_world(Ray ray, World world);
 double ray_intersect_shape(Ray ray, Shape *shape);
+/// Like ray_intersect_shape, but returns the whole hit, including where on the shape it is.
+Intersection ray_hit_shape(Ray ray, Shape *shape);
 
 /// Returns the intersection with the smallest positive t-value,
 /// or NULL if intersection list is empty or has only negative t-values.
-Intersection *hit(IntersectionList intersections);
+const Intersection *hit(const IntersectionList *intersections);
+
+// ----------------------------------
+// Shading
+// ----------------------------------
 
+/// Counts of the rays traced for one or more pixels.
+typedef struct {
+    uint64_t pixels;
+    uint64_t camera;
+    uint64_t reflected;
+    uint64_t refracted;
+    uint64_t shadow;
+    uint64_t culled;       // Reflected and refracted rays not cast because the budget ran out or they added too little
+    uint64_t most;         // Most rays traced for any one pixel
+} RayStats;
+
+/// Bounds the tree of reflected and refracted rays a camera ray grows, which in scenes with a lot of glass
+/// could otherwise double at every bounce.
+typedef struct {
+    int rays_left;         // Reflected and refracted rays that may still be cast
+    double cutoff;         // Rays that would add less than this fraction of their color to the pixel are not cast
+    RayStats *stats;       // Counts the rays traced, if not NULL
+} RayBudget;
+
+/// Returns the color seen along a camera ray, following at most `remaining_reflections` reflections or
+/// refractions in a row, and only those `budget` has room for. Rays that matter more to the pixel are cast
+/// first.
+Color ray_trace(Ray ray, World world, int remaining_reflections, RayBudget *budget);
+
+/// Like ray_trace, with a budget that never runs out.
 Color ray_color(
     Ray ray,
     World world,
     int remaining_reflections
 );
+
+/// Adds the counts in `more` to `total`.
+void ray_stats_add(RayStats *total, const RayStats *more);
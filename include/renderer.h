@@ -2,5 +2,75 @@
 #include <world.h>
 #include <canvas.h>
 #include <camera.h>
+#include <ray.h>
+#include <processors.h>
+#include <tile.h>
 
-int render_image(World world, Camera camera, Canvas canvas);
\ No newline at end of file
+/// Renders the whole image into `canvas`. Adds the rays traced on the CPU to `stats` if it is not NULL.
+/// Returns 0 on success.
+int render_image(World world, Camera camera, Canvas canvas, RayStats *stats);
+
+/// Supplies the scene for frame `frame` of a sequence. The world only needs to stay valid until the next call.
+/// Frames are expected to be one world changing over time: uploads skip shapes whose revision is unchanged.
+/// A frame may be asked for more than once. Returns 0 on success.
+typedef int (*FrameSource)(int frame, void *user, World *out_world, Camera *out_camera);
+
+/// Receives each finished frame, in order. The canvas is reused for the next frame once this returns.
+/// Returns 0 to continue.
+typedef int (*FrameSink)(int frame, Canvas canvas, void *user);
+
+/// Renders frames 0 to `frame_count` - 1, each with the scene from `source`, and passes them to `sink`. Every
+/// frame must have the same image size and numbers of shapes, materials and lights. Adds the rays traced on
+/// the CPU to `stats` if it is not NULL. Returns 0 on success.
+int render_frames(int frame_count, FrameSource source, FrameSink sink, void *user, RayStats *stats);
+
+// ----------------------------------
+// CPU backend
+// ----------------------------------
+
+typedef struct CpuWorkers CpuWorkers;
+
+/// Renders the tile into `canvas`, each camera ray within its own CFG_RAY_BUDGET, and adds the rays traced to
+/// `stats`.
+void cpu_render_tile(World world, Camera camera, Canvas canvas, Tile tile, RayStats *stats);
+
+/// Starts `thread_count` threads that render tiles from the back of `queue` into `canvas` until it is empty.
+CpuWorkers *cpu_workers_start(World world, Camera camera, Canvas canvas, TileQueue *queue, int thread_count);
+
+/// Waits for all workers to finish and frees them. Adds the rays they traced to `stats` if it is not NULL.
+/// Returns the total number of tiles they rendered.
+int cpu_workers_join(CpuWorkers *workers, RayStats *stats);
+
+// ----------------------------------
+// OpenCL backend
+// ----------------------------------
+
+typedef struct OpenCLRenderer OpenCLRenderer;
+
+typedef struct {
+    int specialize;       // Compile a kernel variant for the scene's light count and shape types
+    int stage_local;      // Copy as much of the scene as fits into local memory once per work-group
+    int tune_work_group;  // Time candidate work-group sizes on first use instead of letting the driver pick
+    int profile;          // Record host and device timings per stage and report them when the renderer is freed
+    int double_buffer;    // Let opencl_render_frames work on the next and previous frames while a kernel runs
+    int incremental_uploads; // Only upload the shapes, lights and materials that changed since the last upload
+} OpenCLOptions;
+
+OpenCLOptions opencl_options_default();
+
+/// Returns whether the device renders `world` as the CPU does. The kernel only traces spheres and planes
+/// without instances, shades them by every light as a point, in plain colors, and does not refract.
+int opencl_supports_world(World world);
+
+/// Sets up an OpenCL device and uploads the scene to it. Returns NULL if no usable device is found.
+OpenCLRenderer *opencl_renderer_new(World world, Camera camera, OpenCLOptions options);
+
+/// Renders the given region of the image on the device and writes it to `canvas`. Returns 0 on success.
+int opencl_render_tile(OpenCLRenderer *renderer, Tile tile, Canvas canvas);
+void opencl_renderer_free(OpenCLRenderer *renderer);
+
+/// Renders `frame_count` frames, each with the scene from `source`, and passes them to `sink`. Every frame must
+/// have the same image size and the same numbers of shapes, materials and lights as the scene the renderer was
+/// created with. With double buffering, the next frame's scene is marshalled and uploaded and the previous
+/// frame is read back and passed to `sink` while the current frame renders. Returns 0 on success.
+int opencl_render_frames(OpenCLRenderer *renderer, int frame_count, FrameSource source, FrameSink sink, void *user);
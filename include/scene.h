@@ -0,0 +1,169 @@
+#pragma once
+
+#include <animation.h>
+#include <camera.h>
+#include <world.h>
+
+/* Scene description files, in the YAML-like format of the Ray Tracer Challenge scene files. A scene is a
+list of items, each adding a camera, a light or a shape, or defining a named material or transform:
+
+    - add: camera
+      width: 800
+      height: 600
+      field-of-view: 1.047
+      from: [0, 1.5, -5]
+      to: [0, 1, 0]
+      up: [0, 1, 0]
+
+    - add: light
+      at: [-10, 10, -10]
+      intensity: [1, 1, 1]
+
+    - define: red-plastic
+      value:
+        color: [1, 0.2, 0.2]
+        specular: 0.3
+
+    - define: raised
+      value:
+        - [translate, 0, 1, 0]
+
+    - add: sphere
+      name: ball
+      material: red-plastic
+      transform:
+        - [scale, 0.5, 0.5, 0.5]
+        - raised
+      keyframes:
+        - time: 0
+          translate: [0, 0, 0]
+        - time: 2
+          translate: [0, 2, 0]
+          rotate: [0, 3.14, 0]
+
+Shapes are sphere, plane, cube, cylinder, cone, mesh, sphere-cloud, group and csg; cylinders and cones also take min, max and
+closed. A mesh takes the Wavefront OBJ file to read its triangles from, relative to the scene file, and
+whether to smooth them if the file has no normals:
+
+    - add: mesh
+      file: teapot.obj
+      smooth: true
+
+Shapes made from the same file share its triangles.
+
+A sphere cloud maps its particles from a particle dump (see sphere_cloud.h), and takes a palette of defined
+materials, which the particles' material indices pick from. Particles without one take the shape's:
+
+    - add: sphere-cloud
+      file: particles.bin
+      material: dust
+      palette:
+        - water
+        - ice
+
+A group holds shapes, including other groups, which move with it. Groups take a name, a transform,
+keyframes if they are not in another group, and their children, which are items of their own:
+
+    - add: group
+      transform:
+        - [translate, 0, 1, 0]
+      children:
+        - add: sphere
+        - add: cube
+          transform:
+            - [translate, 2, 0, 0]
+
+A csg shape is laid out like a group of exactly two shapes, which it combines by its `operation`: union,
+the default, intersection, or difference, which takes the second shape from the first. Its shapes may be
+groups or csg shapes themselves, but not meshes or sphere clouds, or groups holding them:
+
+    - add: csg
+      operation: difference
+      children:
+        - add: cube
+        - add: sphere
+          transform:
+            - [scale, 1.3, 1.3, 1.3]
+
+Geometry used many times is best defined once as a prototype, with `shape` and the keys of a shape, and
+placed by instances, which each take a transform and optionally a material of their own:
+
+    - define: tree
+      shape: mesh
+      file: tree.obj
+      material: leaves
+
+    - add: instance
+      of: tree
+      transform:
+        - [translate, 4, 0, 2]
+
+Materials take color, pattern, ambient, diffuse, specular, shininess, reflective, transparency and
+refractive-index. Lights may take a `falloff` distance, beyond which they dim with the square of the
+distance; without one they are as bright everywhere. A light with a `corner` in place of `at` is a
+rectangle with edges `uvec` and `vvec` from it, which casts soft shadows, sampled in a grid of `usteps` by
+`vsteps` cells, 4 by 4 unless given:
+
+    - add: light
+      corner: [-1, 4, -1]
+      uvec: [2, 0, 0]
+      vvec: [0, 0, 2]
+      usteps: 8
+      vsteps: 8
+      intensity: [1, 1, 1]
+
+A pattern has a type (stripes, gradient, rings or checkers), two colors and a
+transform. Transforms are lists of operations applied in order: translate, scale, rotate-x, rotate-y,
+rotate-z, shear, or the name of a defined transform. A define may start from another with `extend`.
+An item `- add: animation` sets the animation's frame rate with `fps`, and `- add: accelerator` sets what
+rays are traced through with `type`: a `bvh`, a `grid`, which suits many similar objects filling a volume,
+or `auto`, the default, which picks between them. Only block style is supported, besides inline lists. */
+
+// Longest path to a mesh's file, including the scene file's directory
+#define SCENE_MAX_PATH 260
+
+// A compiled scene file mapped into memory. See scene_cache_load.
+typedef struct SceneMapping SceneMapping;
+
+/// A mesh the scene's shapes refer to, and the file it was read from.
+typedef struct {
+    Mesh *mesh;
+    char path[SCENE_MAX_PATH];
+    int smooth;
+} SceneMesh;
+
+typedef struct {
+    World world;
+    Camera camera;
+    Animation animation;    // Tracks for the shapes with keyframes, if any
+    Keyframe *keyframes;    // Storage for the keys of every track
+    SceneMesh *meshes;      // Every mesh the shapes refer to, each once
+    size_t mesh_count;
+    SphereCloud **clouds;   // The sphere cloud of every shape that is one
+    size_t cloud_count;
+    SceneMapping *mapping;  // Set if the scene was loaded from a compiled scene, whose mapping holds the arrays above
+} Scene;
+
+/// Reads the scene file at `path` in a single pass. Returns 0 on success, or prints the offending line
+/// and returns 1.
+int scene_load(const char *path, Scene *out);
+void scene_free(Scene *scene);
+
+/* Compiled scenes. A compiled scene file holds a scene's objects, lights and animation exactly as they are
+laid out in memory, with every transform already inverted, along with its meshes and its world's BVH if one
+was built. It is mapped copy-on-write and used in place, so loading takes the same time however large the scene is. The
+file is only readable by builds with the same struct layouts, which its header records. */
+
+/// Writes `scene` to the compiled scene file at `path`. `source_path`, if not NULL, names the scene file it
+/// was loaded from, whose size and modification time are recorded so that scene_cache_load can tell when
+/// the compiled scene is out of date. Scenes with sphere clouds cannot be compiled. Returns 0 on success.
+int scene_cache_write(const Scene *scene, const char *path, const char *source_path);
+
+/// Maps the compiled scene file at `path`. If `source_path` is not NULL, it must name the scene file the
+/// compiled scene was written from, unchanged since. Returns 0 on success, or 1 if the file is missing,
+/// out of date, or was written by an incompatible build, in which case the scene should be loaded from its
+/// source instead.
+int scene_cache_load(const char *path, const char *source_path, Scene *out);
+
+/// Unmaps a compiled scene. Called by scene_free.
+void scene_cache_unmap(SceneMapping *mapping);
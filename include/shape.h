@@ -1,35 +1,92 @@
 #pragma once
 
+#include <stdint.h>
+
 #include <matrix.h>
 #include <material.h>
+#include <mesh.h>
+#include <sphere_cloud.h>
 
 #define SHAPE_SPHERE   0
 #define SHAPE_PLANE    1
 #define SHAPE_CUBE     2
 #define SHAPE_CYLINDER 3
 #define SHAPE_CONE     4
+#define SHAPE_MESH     5
+#define SHAPE_GROUP    6
+#define SHAPE_SPHERE_CLOUD 7
+#define SHAPE_CSG      8
 
 #define SHAPE_NAME_LEN 64
 
-typedef struct {
+// How rays test a shape. Most shapes are only moved and scaled, which rays can test in world space
+// directly instead of carrying themselves into object space by the inverse transform.
+#define SHAPE_FAST_NONE   0  // Through the transform
+#define SHAPE_FAST_SPHERE 1  // A sphere moved, turned and scaled evenly: fast_shape is its center and radius
+#define SHAPE_FAST_BOX    2  // A cube moved and scaled along the axes: fast_shape is its min and max corners
+#define SHAPE_FAST_PLANE  3  // Any plane: fast_shape is the row of the inverse transform that gives object-space y
+
+// Children of a SHAPE_GROUP or SHAPE_CSG. See group.h.
+typedef struct Group Group;
+
+typedef struct Shape {
+    // The fields rays and shading read first, which share a cache line
     int type;
+    int fast;                // SHAPE_FAST_*, set from the transform by shape_classify
+    uint32_t material;       // Index into World.materials
+    double fast_shape[6];    // The shape in world space, for fast paths
     Mat4D transform;
     Mat4D inv_transform;
-    Material material;
     char name[SHAPE_NAME_LEN];
     // For infinite shapes like cylinders and cones we can optionally provide minimum and maximum y-coordinates
     double ymin;
     double ymax;
     int closed;
+    // The triangles of a SHAPE_MESH, which shapes may share. Owned by whoever loaded it, not the shape.
+    Mesh *mesh;
+    // The children of a SHAPE_GROUP or SHAPE_CSG, which the shape owns. See group.h.
+    Group *group;
+    // The particles of a SHAPE_SPHERE_CLOUD, which shapes may share. Owned by whoever loaded it, like meshes.
+    SphereCloud *cloud;
+    // Incremented by the shape_set_* functions. Renderers that keep their own copy of the scene compare
+    // revisions to find the shapes that changed, so code that modifies a shape directly should bump it too.
+    uint32_t revision;
 } Shape;
 
-Shape sphere_new(Mat4D transform, Material material, char *name);
-Shape plane_new(Mat4D transform, Material material, char *name);
-Shape cube_new(Mat4D transform, Material material, char *name);
-Shape cylinder_new(Mat4D transform, Material material, char *name, double ymin, double ymax, int closed);
-Shape cone_new(Mat4D transform, Material material, char *name, double ymin, double ymax, int closed);
+/// Shapes are made with the index of their material in the world's materials. See World.materials.
+Shape sphere_new(Mat4D transform, uint32_t material, char *name);
+Shape plane_new(Mat4D transform, uint32_t material, char *name);
+Shape cube_new(Mat4D transform, uint32_t material, char *name);
+Shape cylinder_new(Mat4D transform, uint32_t material, char *name, double ymin, double ymax, int closed);
+Shape cone_new(Mat4D transform, uint32_t material, char *name, double ymin, double ymax, int closed);
+Shape mesh_new(Mat4D transform, uint32_t material, char *name, Mesh *mesh);
+Shape sphere_cloud_new(Mat4D transform, uint32_t material, char *name, SphereCloud *cloud);
 
 Shape sphere_default();
 
+/// Returns a shape of any type whose transform's inverse is already known, which spares inverting it. Loaders
+/// that build transforms from known operations use this.
+Shape shape_from_parts(int type, Mat4D transform, Mat4D inv_transform, uint32_t material, const char *name, double ymin, double ymax, int closed);
+
+/// Sets a shape's transform. A group's children move with it. The transforms of groups that are children of
+/// another are set with group_set_child_transform instead.
+void shape_set_transform(Shape *shape, Mat4D transform);
+
+/// Sets how rays test the shape from its transform. The shape constructors and shape_set_transform do
+/// this, so only code that sets a shape's transform directly needs to call it.
+void shape_classify(Shape *shape);
+void shape_set_material(Shape *shape, uint32_t material);
+
+/// Returns the world-space bounds of `shape`: the box around its object-space box, moved by its transform.
+/// Unbounded shapes, like planes and cylinders without both a min and a max, return aabb_infinite().
+Aabb shape_bounds(const Shape *shape);
+
+/// Returns a number that changes whenever the shape does, including when a child of a group does.
+uint32_t shape_revision(const Shape *shape);
+
 Vec4D shape_normal(Shape *shape, Vec4D world_point);
-Color shape_color_at(Shape shape, Vec4D world_point);
+/// Returns the normal at a point where a ray hit the shape, given the primitive and barycentric coordinates
+/// of the hit: the triangle of a mesh, or the particle of a sphere cloud.
+Vec4D shape_normal_at(Shape *shape, Vec4D world_point, uint32_t primitive, double u, double v);
+/// Returns the color of `material`, which the shape is shaded with, at a point on the shape.
+Color shape_color_at(const Shape *shape, const Material *material, Vec4D world_point);
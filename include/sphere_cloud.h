@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bvh.h>
+#include <grid.h>
+#include <mapped_file.h>
+#include <material.h>
+#include <vector.h>
+
+/* Clouds of spheres, for particle data with millions of particles. Each is a center and radius in single
+precision, stored as one array per coordinate, and optionally the index of its material in the cloud's
+palette: 16 or 20 bytes a particle, where a sphere shape takes hundreds. Rays are tested against the
+particles directly, in the cloud's object space, through a grid over them, or a BVH if they are too uneven
+in size or spread for a grid to suit them. A SHAPE_SPHERE_CLOUD shape places a cloud with its transform,
+and its material shades particles without one of their own.
+
+Particle dumps hold a cloud's arrays as they are laid out in memory, so a cloud is used in place once its
+dump is mapped:
+
+    offset 0:  char magic[8]          "BEAKPTC"
+               uint32_t version       1
+               uint32_t has_materials 1 if the material indices follow the radii
+               uint64_t count
+    then, each starting at a multiple of 64 bytes from the start of the file:
+               float x[count], y[count], z[count], radius[count]
+               uint32_t material[count], if has_materials
+
+in the byte order of the machine that reads them. */
+
+typedef struct SphereCloud {
+    size_t count;
+    const float *x;               // Center of each particle, one array per coordinate
+    const float *y;
+    const float *z;
+    const float *radius;
+    const uint32_t *materials;    // Index in the palette of each particle's material, or NULL if all take the shape's
+    uint32_t *palette;            // Index into World.materials of each of the cloud's materials. Owned by the cloud.
+    size_t palette_size;
+    Aabb bounds;                  // Of every particle
+    Grid grid;                    // Over the particles, if it suits them, and otherwise empty
+    Bvh bvh;                      // Over the particles if there is no grid
+    void *memory;                 // The arrays, if the cloud was created from them rather than mapped
+    MappedFile file;              // The dump, if the cloud was mapped from one
+} SphereCloud;
+
+/// Creates a cloud from the arrays of its particles' centers, radii and material indices, which must be
+/// allocated together in `memory`, which the cloud takes ownership of. `materials` may be NULL. Builds the
+/// cloud's grid or BVH. Returns NULL on failure, having freed `memory`.
+SphereCloud *sphere_cloud_create(void *memory, const float *x, const float *y, const float *z, const float *radius, const uint32_t *materials, size_t count);
+
+/// Maps the particle dump at `path` and builds a grid or BVH over its particles. Returns NULL on failure.
+SphereCloud *sphere_cloud_load(const char *path);
+
+/// Writes the cloud's particles to a particle dump at `path`. Returns 0 on success.
+int sphere_cloud_write(const SphereCloud *cloud, const char *path);
+
+/// Gives the cloud a copy of `materials`, indices into the world's materials, as its palette. Returns 0 on
+/// success.
+int sphere_cloud_set_palette(SphereCloud *cloud, const uint32_t *materials, size_t count);
+
+void sphere_cloud_destroy(SphereCloud *cloud);
+
+/// Returns the distance along the object-space ray to the nearest particle it hits closer than `tmax`, or
+/// INFINITY, and writes the particle hit.
+double sphere_cloud_intersect(const SphereCloud *cloud, Vec4D origin, Vec4D direction, double tmax, uint32_t *out_particle);
+
+/// Returns the object-space normal at `object_point` on `particle`.
+Vec4D sphere_cloud_normal(const SphereCloud *cloud, uint32_t particle, Vec4D object_point);
+
+/// Returns the world material index of `particle` from the palette, or `fallback`, its shape's, if the
+/// particle has none there.
+uint32_t sphere_cloud_material(const SphereCloud *cloud, uint32_t particle, uint32_t fallback);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdio.h>
+
+/* Helpers shared by the text file loaders: scene files and OBJ meshes. */
+
+// Bytes read from a file at a time. This is also the longest line allowed.
+#define TEXT_CHUNK_SIZE (1 << 20)
+
+/// Called with each line of a file, without its line ending. Returns 0 to carry on.
+typedef int (*LineHandler)(void *user, const char *begin, const char *end);
+
+/// Reads `fp` in large chunks, calling `handle` on every line as soon as it has been read, so that files
+/// of any size are read with a fixed amount of memory. Returns 0 once every line has been handled, the
+/// nonzero value of the first handler that fails, or -1 if the file cannot be read or a line is too long.
+int text_for_each_line(FILE *fp, LineHandler handle, void *user);
+
+/// Parses a decimal number at the start of [s, end) into `out`. Returns a pointer past it, or NULL if
+/// there is no number there. Much faster than strtod, which needs a terminated string and honours the locale.
+const char *text_parse_double(const char *s, const char *end, double *out);
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <threads.h>
+
+/* A queue of square image tiles shared between render workers.
+Tiles are numbered in row-major order. Devices that prefer large launches claim rectangles from the
+front of the queue while CPU threads take single tiles from the back, so the two never interleave
+and every claim is a single rectangle of the image. */
+
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+} Tile;
+
+typedef struct {
+    mtx_t lock;
+    int image_width;
+    int image_height;
+    int tile_size;
+    int tiles_x;
+    int tiles_y;
+    int next;  // Index of the first unclaimed tile
+    int end;   // One past the index of the last unclaimed tile
+} TileQueue;
+
+int tile_queue_init(TileQueue *queue, int image_width, int image_height, int tile_size);
+void tile_queue_destroy(TileQueue *queue);
+
+/// Claims up to `max_tiles` tiles from the front of the queue as a single rectangle, writing it to `out`.
+/// Returns the number of tiles claimed, or 0 once the queue is empty.
+int tile_queue_claim(TileQueue *queue, int max_tiles, Tile *out);
+
+/// Claims the last unclaimed tile. Returns 1 on success, or 0 once the queue is empty.
+int tile_queue_claim_last(TileQueue *queue, Tile *out);
+
+int tile_queue_remaining(TileQueue *queue);
@@ -0,0 +1,6 @@
+#pragma once
+
+/* Wall-clock timing for progress reporting and load balancing. */
+
+/// Returns the current wall-clock time in seconds, measured from an arbitrary fixed point.
+double timer_seconds();
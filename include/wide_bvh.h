@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bvh.h>
+
+/* Four-wide bounding volume hierarchy, made by collapsing a binary one. Each node holds the boxes of up to
+four children, which a ray is tested against together, in one SSE operation where the target has it.
+
+The children's boxes are quantized to 8 bits per coordinate, relative to the box around them all: each axis
+has an origin and a power-of-two step, and every child's min and max are whole numbers of steps from the
+origin, rounded outwards so the decoded box still holds the child. That keeps a node to one 64-byte cache
+line, where four double-precision boxes alone would take three. */
+
+#define WIDE_BVH_WIDTH 4
+
+typedef struct {
+    float origin[3];          // Min corner of the box around every child, rounded down to a float
+    int8_t exponent[3];       // The quantization step along each axis is 2^exponent
+    uint8_t child_count;
+    uint8_t bounds[2][3][WIDE_BVH_WIDTH];  // Steps from the origin to each child's min ([0]) and max ([1]), per axis. Empty slots have min 255 and max 0.
+    uint32_t child[WIDE_BVH_WIDTH];        // Leaves: index of the first primitive in the binary tree's `indices`. Interior children: index of the node.
+    uint16_t count[WIDE_BVH_WIDTH];        // Number of primitives in a leaf, or 0 for interior children
+} WideBvhNode;
+
+typedef struct {
+    WideBvhNode *nodes;       // Aligned to a cache line, in `memory`
+    size_t node_count;
+    const uint32_t *indices;  // The binary tree's, which the leaves index
+    void *memory;
+} WideBvh;
+
+/// A ray set up for testing nodes' children, once for all the nodes it is tested against.
+typedef struct {
+    float origin[4];          // The fourth component of each is unused, so that they load as one vector
+    float inv_direction[4];
+    float error[4];           // |origin * inv_direction|, which scales the error from rounding the origin to a float
+    int sign[3];              // 1 where the direction is negative, which makes the children's max the near side
+} WideBvhRay;
+
+/// Collapses `bvh` into `out`, which borrows its indices, so must be rebuilt whenever `bvh` is. Returns 0 on
+/// success, or 1 if out of memory or a leaf holds more primitives than a node can count.
+int wide_bvh_build(WideBvh *out, const Bvh *bvh);
+
+/// Sets up the ray from `origin` along `direction` for testing nodes' children.
+WideBvhRay wide_bvh_ray_new(Vec4D origin, Vec4D direction);
+
+/// Tests the ray against every child of `node`. Returns a mask of the children it enters before `tmax`, with
+/// bit i set for the ith, and writes the distances at which it enters them to `out_t`.
+int wide_bvh_node_hits(const WideBvhNode *node, const WideBvhRay *ray, double tmax, float out_t[WIDE_BVH_WIDTH]);
+
+void wide_bvh_free(WideBvh *bvh);
@@ -1,15 +1,71 @@
 #pragma once
 
+#include <bvh.h>
+#include <grid.h>
+#include <instance.h>
+#include <light_tree.h>
 #include <lighting.h>
 #include <shape.h>
+#include <wide_bvh.h>
+
+// Which structure rays take through a world's objects. With ACCELERATOR_AUTO, a grid is used if the objects
+// suit one (see grid_suits), and the BVH otherwise.
+#define ACCELERATOR_AUTO 0
+#define ACCELERATOR_BVH  1
+#define ACCELERATOR_GRID 2
+
+// Acceleration structure over a world's objects and instances, which are numbered after the objects, and its
+// lights. See world_build_bvh.
+typedef struct WorldBvh {
+    Bvh tree;                // Over the objects and instances with finite bounds
+    WideBvh wide;            // Collapsed from the tree if CFG_WIDE_BVH, and then traversed in its place
+    Grid grid;               // Over the same objects and instances, if the accelerator picks it, and then traversed in place of either tree
+    int accelerator;         // The world's when the structures were built
+    size_t object_count;
+    size_t instance_count;
+    Aabb *bounds;            // World-space bounds of every object and instance, infinite for unbounded ones
+    uint32_t *revisions;     // Revision of every object and instance when its bounds were last computed
+    uint32_t *unbounded;     // Objects such as planes, which every ray is tested against
+    size_t unbounded_count;
+    int borrowed;            // The arrays belong to a mapped compiled scene, so are copied before a rebuild and never freed
+    LightTree lights;        // Over the world's lights, which hits are shaded by samples of if there are more than CFG_LIGHT_SAMPLES. Never borrowed.
+} WorldBvh;
 
 typedef struct World {
     size_t light_count;
     PointLight *lights;
     size_t object_count;
     Shape *objects;
+    WorldBvh *bvh;           // NULL until world_build_bvh, in which case rays are tested against every object
+    // Instanced geometry. Prototypes are only rendered where instances place them. Code that changes a
+    // prototype should bump the revisions of its instances, whose bounds depend on it.
+    size_t prototype_count;
+    Shape *prototypes;
+    size_t material_count;
+    Material *materials;     // Every material in the world, each once, which shapes and instances refer to by index
+    size_t instance_count;
+    Instance *instances;
+    int accelerator;         // One of the ACCELERATOR_* values
 } World;
 
 World world_new();
 World world_default();
-int is_point_shadowed(Vec4D point, PointLight light, World world);
\ No newline at end of file
+int is_point_shadowed(Vec4D point, PointLight light, World world);
+
+/// Builds a bounding volume hierarchy over the world's objects and instances, which ray_intersect_world then uses to skip
+/// objects a ray cannot hit, and a light tree over its lights. Returns 0 on success.
+int world_build_bvh(World *world);
+
+/// Brings the hierarchy up to date after objects or instances have moved. The bounds of those whose revision
+/// changed are recomputed and the tree is refit around them, keeping its structure. If refitting has made
+/// the tree much more expensive to traverse than it was when built, or objects or instances were added or
+/// removed, it is rebuilt. The light tree is brought up to date with the lights the same way.
+/// Returns 1 if the tree was rebuilt, 0 if it was refit, or -1 on failure.
+int world_update_bvh(World *world);
+
+/// Builds the structures rays take in place of the binary tree, from the tree: a grid or a wide tree. Called by
+/// world_build_bvh and world_update_bvh, and by code that fills in the tree itself. If this fails, rays take
+/// the binary tree.
+void world_bvh_finish(WorldBvh *bvh);
+
+void world_free_bvh(World *world);
@@ -0,0 +1,66 @@
+#include <string.h>
+
+#include <animation.h>
+
+Keyframe keyframe_new(double time, Vec4D offset, Vec4D angles, Vec4D scale) {
+    return (Keyframe) { time, offset, angles, scale };
+}
+
+static Vec4D _lerp(Vec4D a, Vec4D b, double s) {
+    return d4_add(a, d4_mul(d4_sub(b, a), s));
+}
+
+static Mat4D _keyframe_matrix(Vec4D offset, Vec4D angles, Vec4D scale) {
+    Mat4D m = scaling(scale.x, scale.y, scale.z);
+    m = mat4d_mul_mat4d(rotation_x(angles.x), m);
+    m = mat4d_mul_mat4d(rotation_y(angles.y), m);
+    m = mat4d_mul_mat4d(rotation_z(angles.z), m);
+    return mat4d_mul_mat4d(translation(offset.x, offset.y, offset.z), m);
+}
+
+Mat4D track_transform(const Track *track, double time) {
+    if (track->key_count == 0) {
+        return track->base;
+    }
+
+    // Find the keyframes either side of `time`, clamping to the ends
+    const Keyframe *keys = track->keys;
+    size_t last = track->key_count - 1;
+    const Keyframe *a = &keys[0];
+    const Keyframe *b = &keys[0];
+    if (time >= keys[last].time) {
+        a = b = &keys[last];
+    } else if (time > keys[0].time) {
+        size_t i = 1;
+        while (keys[i].time <= time) {
+            i++;
+        }
+        a = &keys[i - 1];
+        b = &keys[i];
+    }
+
+    double s = b->time > a->time ? (time - a->time) / (b->time - a->time) : 0.0;
+    Mat4D keyed = _keyframe_matrix(
+        _lerp(a->translation, b->translation, s),
+        _lerp(a->rotation, b->rotation, s),
+        _lerp(a->scale, b->scale, s)
+    );
+    return mat4d_mul_mat4d(keyed, track->base);
+}
+
+size_t animation_apply(const Animation *animation, World *world, double time) {
+    size_t moved = 0;
+    for (size_t i = 0; i < animation->track_count; i++) {
+        const Track *track = &animation->tracks[i];
+        if (track->object >= world->object_count) {
+            continue;
+        }
+        Shape *shape = &world->objects[track->object];
+        Mat4D transform = track_transform(track, time);
+        if (memcmp(&transform, &shape->transform, sizeof(Mat4D)) != 0) {
+            shape_set_transform(shape, transform);
+            moved++;
+        }
+    }
+    return moved;
+}
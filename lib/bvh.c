@@ -0,0 +1,734 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#include <bvh.h>
+#include <config.h>
+#include <processors.h>
+
+// Nodes with this many primitives or fewer are not split
+#define BVH_LEAF_SIZE 4
+// Deeper nodes are not split either, which bounds the traversal stack. See ray_intersect_world.
+#define BVH_MAX_DEPTH 48
+// Bins per axis that a node's primitives are sorted into by centroid, to cost splits between them
+#define BVH_BINS 16
+// Fewest primitives per thread worth binning, gathering or coding on several threads
+#define BVH_PARALLEL_GRAIN 16384
+// Subtrees per thread that the top of the tree is split into before the threads build them, which evens
+// out their sizes
+#define BVH_TASKS_PER_THREAD 4
+// Subtrees with fewer primitives are not worth splitting into more tasks
+#define BVH_TASK_MIN 1024
+#define BVH_MAX_THREADS 64
+
+// Relative costs of visiting a node and intersecting a primitive, for the surface area heuristic
+static const double COST_TRAVERSAL = 1.0;
+static const double COST_INTERSECTION = 1.0;
+
+Aabb aabb_empty() {
+    return (Aabb) { { INFINITY, INFINITY, INFINITY }, { -INFINITY, -INFINITY, -INFINITY } };
+}
+
+Aabb aabb_infinite() {
+    return (Aabb) { { -INFINITY, -INFINITY, -INFINITY }, { INFINITY, INFINITY, INFINITY } };
+}
+
+int aabb_is_finite(const Aabb *box) {
+    for (int i = 0; i < 3; i++) {
+        if (!isfinite(box->min[i]) || !isfinite(box->max[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void aabb_extend(Aabb *box, const Aabb *other) {
+    for (int i = 0; i < 3; i++) {
+        box->min[i] = fmin(box->min[i], other->min[i]);
+        box->max[i] = fmax(box->max[i], other->max[i]);
+    }
+}
+
+double aabb_surface_area(const Aabb *box) {
+    double dx = box->max[0] - box->min[0];
+    double dy = box->max[1] - box->min[1];
+    double dz = box->max[2] - box->min[2];
+    if (dx < 0.0 || dy < 0.0 || dz < 0.0) {
+        return 0.0;
+    }
+    return 2.0 * (dx * dy + dy * dz + dz * dx);
+}
+
+Aabb aabb_transform(const Aabb *box, Mat4D transform) {
+    Aabb out = aabb_empty();
+    for (int i = 0; i < 8; i++) {
+        Vec4D corner = d4_point(
+            i & 1 ? box->max[0] : box->min[0],
+            i & 2 ? box->max[1] : box->min[1],
+            i & 4 ? box->max[2] : box->min[2]
+        );
+        Vec4D p = mat4d_mul_vec4d(transform, corner);
+        Aabb point = { { p.x, p.y, p.z }, { p.x, p.y, p.z } };
+        aabb_extend(&out, &point);
+    }
+    return out;
+}
+
+AabbRay aabb_ray_new(Vec4D origin, Vec4D direction) {
+    AabbRay r = { { origin.x, origin.y, origin.z }, { 1.0 / direction.x, 1.0 / direction.y, 1.0 / direction.z }, { 0, 0, 0 } };
+    for (int i = 0; i < 3; i++) {
+        // Also set for -0.0, whose reciprocal is -INFINITY
+        r.sign[i] = r.inv_direction[i] < 0.0;
+    }
+    return r;
+}
+
+double aabb_ray_entry(const Aabb *box, const AabbRay *ray, double tmax) {
+    // The signs pick each slab's near and far planes by index rather than by comparing the two distances.
+    // A distance that is NaN, from a ray lying in a slab's plane, loses both comparisons and is ignored.
+    const double *planes[2] = { box->min, box->max };
+    double tmin = 0.0;
+    for (int i = 0; i < 3; i++) {
+        double t_near = (planes[ray->sign[i]][i] - ray->origin[i]) * ray->inv_direction[i];
+        double t_far = (planes[1 - ray->sign[i]][i] - ray->origin[i]) * ray->inv_direction[i];
+        tmin = t_near > tmin ? t_near : tmin;
+        tmax = t_far < tmax ? t_far : tmax;
+    }
+    return tmin <= tmax ? tmin : INFINITY;
+}
+
+static double _centroid(const Aabb *box, int axis) {
+    return 0.5 * (box->min[axis] + box->max[axis]);
+}
+
+/// @brief As aabb_extend, for the build's inner loops, with comparisons in place of fmin and fmax, since the
+/// boxes there are never NaN.
+static void _extend(Aabb *box, const Aabb *other) {
+    for (int i = 0; i < 3; i++) {
+        box->min[i] = other->min[i] < box->min[i] ? other->min[i] : box->min[i];
+        box->max[i] = other->max[i] > box->max[i] ? other->max[i] : box->max[i];
+    }
+}
+
+static void _extend_point(Aabb *box, const double p[3]) {
+    for (int i = 0; i < 3; i++) {
+        box->min[i] = p[i] < box->min[i] ? p[i] : box->min[i];
+        box->max[i] = p[i] > box->max[i] ? p[i] : box->max[i];
+    }
+}
+
+BvhBuildOptions bvh_build_options_default() {
+    return (BvhBuildOptions) { CFG_BVH_BUILD_THREADS > 0 ? CFG_BVH_BUILD_THREADS : cpu_count(), CFG_BVH_LINEAR };
+}
+
+/* Builds are top down. The calling thread splits the top of the tree, binning the primitives of each of
+those large nodes on every thread, until there are a few subtrees per thread, which the threads then take
+from a queue and build on their own. Each subtree is given a range of node slots of its own up front, so
+threads never share a counter. The slots leaves leave unused are squeezed out at the end. */
+
+typedef struct {
+    Aabb box;  // Of the primitives in the bin
+    size_t count;
+} Bin;
+
+/// A subtree to build: `count` primitives from `first` in the ids, whose root goes in slot `node` and whose
+/// other nodes in the 2 * count - 2 slots from `children`, which any binary tree over them fits in.
+typedef struct {
+    uint32_t node;
+    uint32_t children;
+    size_t first;
+    size_t count;
+    int depth;
+    Aabb box;        // Of the primitives. Unused by linear builds, which refit at the end.
+    Aabb centroids;  // Of the primitives' centroids
+} BuildTask;
+
+/// A primitive's bounds, copied in with its id so that the build reads them in order as it sorts them.
+typedef struct {
+    Aabb box;
+    uint32_t id;
+} PrimitiveRef;
+
+typedef struct {
+    BvhNode *slots;
+    uint32_t *ids;
+    const Aabb *bounds;
+    PrimitiveRef *refs;     // Surface area heuristic builds: the primitives, in the order of the ids
+    const uint32_t *codes;  // Linear builds: the Morton code of each id, in the same order
+    int thread_count;       // For binning a node's primitives, or 1 while subtrees are built in parallel
+} Builder;
+
+/// @brief Runs `run` on each of `count` jobs of `size` bytes from `jobs`, the first on the calling thread
+/// and the others on threads of their own, or on the calling thread too if theirs fails to start.
+static void _run_parallel(int (*run)(void *), void *jobs, size_t size, int count) {
+    thrd_t threads[BVH_MAX_THREADS];
+    int started[BVH_MAX_THREADS] = { 0 };
+    for (int i = 1; i < count; i++) {
+        started[i] = thrd_create(&threads[i], run, (char *)jobs + i * size) == thrd_success;
+    }
+    run(jobs);
+    for (int i = 1; i < count; i++) {
+        if (started[i]) {
+            thrd_join(threads[i], NULL);
+        } else {
+            run((char *)jobs + i * size);
+        }
+    }
+}
+
+/// @brief Returns the number of threads to share `count` primitives between, which each get at least
+/// BVH_PARALLEL_GRAIN.
+static int _share(const Builder *b, size_t count) {
+    size_t parts = count / BVH_PARALLEL_GRAIN;
+    return parts < (size_t)b->thread_count ? (parts > 0 ? (int)parts : 1) : b->thread_count;
+}
+
+static void _bin_merge(Bin *into, const Bin *from) {
+    _extend(&into->box, &from->box);
+    into->count += from->count;
+}
+
+typedef struct {
+    const Builder *builder;
+    size_t first;
+    size_t count;
+    Aabb box;
+    Aabb centroids;
+} GatherJob;
+
+static int _gather_range(void *arg) {
+    GatherJob *job = arg;
+    const Builder *b = job->builder;
+    job->box = aabb_empty();
+    job->centroids = aabb_empty();
+    for (size_t i = job->first; i < job->first + job->count; i++) {
+        uint32_t id = b->ids[i];
+        const Aabb *box = &b->bounds[id];
+        double c[3] = { _centroid(box, 0), _centroid(box, 1), _centroid(box, 2) };
+        _extend(&job->box, box);
+        _extend_point(&job->centroids, c);
+        if (b->refs != NULL) {
+            b->refs[i] = (PrimitiveRef) { *box, id };
+        }
+    }
+    return 0;
+}
+
+/// @brief Writes the bounds of the primitives and of their centroids to the root's task, and fills in the
+/// builder's primitive refs if it has them.
+static void _gather(const Builder *b, BuildTask *root) {
+    GatherJob jobs[BVH_MAX_THREADS];
+    int parts = _share(b, root->count);
+    for (int i = 0; i < parts; i++) {
+        size_t lo = root->count * i / parts;
+        size_t hi = root->count * (i + 1) / parts;
+        jobs[i] = (GatherJob) { b, lo, hi - lo, aabb_empty(), aabb_empty() };
+    }
+    _run_parallel(_gather_range, jobs, sizeof(GatherJob), parts);
+    for (int i = 0; i < parts; i++) {
+        _extend(&root->box, &jobs[i].box);
+        _extend(&root->centroids, &jobs[i].centroids);
+    }
+}
+
+// -------------------
+// Surface area heuristic
+// -------------------
+
+/// @brief Returns the bin along an axis of the centroid `c`, given the centroids' min along it and the
+/// number of bins per unit length.
+static int _bin_index(double c, double min, double scale) {
+    int bin = (int)((c - min) * scale);
+    return bin < BVH_BINS - 1 ? bin : BVH_BINS - 1;
+}
+
+static void _bin_scales(const Aabb *centroids, double out[3]) {
+    for (int a = 0; a < 3; a++) {
+        double extent = centroids->max[a] - centroids->min[a];
+        out[a] = extent > 0.0 ? BVH_BINS / extent : 0.0;
+    }
+}
+
+typedef struct {
+    const Builder *builder;
+    size_t first;
+    size_t count;
+    Aabb centroids;  // Of the node's primitives, which the bins divide evenly along each axis
+    Bin bins[3][BVH_BINS];
+} BinJob;
+
+static int _bin_range(void *arg) {
+    BinJob *job = arg;
+    const Builder *b = job->builder;
+    double scale[3];
+    _bin_scales(&job->centroids, scale);
+    for (int a = 0; a < 3; a++) {
+        for (int i = 0; i < BVH_BINS; i++) {
+            job->bins[a][i] = (Bin) { aabb_empty(), 0 };
+        }
+    }
+    for (size_t i = job->first; i < job->first + job->count; i++) {
+        const Aabb *box = &b->refs[i].box;
+        for (int a = 0; a < 3; a++) {
+            Bin *bin = &job->bins[a][_bin_index(_centroid(box, a), job->centroids.min[a], scale[a])];
+            _extend(&bin->box, box);
+            bin->count++;
+        }
+    }
+    return 0;
+}
+
+/// @brief Bins the task's primitives along every axis, on several threads if there are enough of them.
+/// Returns 0 on success.
+static int _bin(const Builder *b, const BuildTask *task, Bin out[3][BVH_BINS]) {
+    int parts = _share(b, task->count);
+    BinJob *jobs = malloc(parts * sizeof(BinJob));
+    if (jobs == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < parts; i++) {
+        size_t lo = task->first + task->count * i / parts;
+        size_t hi = task->first + task->count * (i + 1) / parts;
+        jobs[i].builder = b;
+        jobs[i].first = lo;
+        jobs[i].count = hi - lo;
+        jobs[i].centroids = task->centroids;
+    }
+    _run_parallel(_bin_range, jobs, sizeof(BinJob), parts);
+    memcpy(out, jobs[0].bins, sizeof(jobs[0].bins));
+    for (int i = 1; i < parts; i++) {
+        for (int a = 0; a < 3; a++) {
+            for (int j = 0; j < BVH_BINS; j++) {
+                _bin_merge(&out[a][j], &jobs[i].bins[a][j]);
+            }
+        }
+    }
+    free(jobs);
+    return 0;
+}
+
+/// @brief Finds the boundary between bins with the lowest cost by the surface area heuristic, and moves
+/// the ids left of it before those right of it. Writes the bounds of each side and of its centroids to the
+/// children's tasks, and returns the number on the left, or 0 if the centroids all coincide, so that no
+/// boundary separates them, or if out of memory.
+static size_t _split_sah(const Builder *b, const BuildTask *task, BuildTask out[2]) {
+    Bin bins[3][BVH_BINS];
+    if (_bin(b, task, bins)) {
+        return 0;
+    }
+    double best_cost = INFINITY;
+    int best_axis = -1;
+    int best_bin = 0;
+    for (int a = 0; a < 3; a++) {
+        if (task->centroids.max[a] <= task->centroids.min[a]) {
+            continue;
+        }
+        // Sweep from the right to get each boundary's right side, then from the left
+        Bin right[BVH_BINS];
+        right[BVH_BINS - 1] = bins[a][BVH_BINS - 1];
+        for (int i = BVH_BINS - 2; i >= 0; i--) {
+            right[i] = right[i + 1];
+            _bin_merge(&right[i], &bins[a][i]);
+        }
+        Bin left = { aabb_empty(), 0 };
+        for (int i = 0; i < BVH_BINS - 1; i++) {
+            _bin_merge(&left, &bins[a][i]);
+            if (left.count == 0 || right[i + 1].count == 0) {
+                continue;
+            }
+            double cost = left.count * aabb_surface_area(&left.box) + right[i + 1].count * aabb_surface_area(&right[i + 1].box);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = a;
+                best_bin = i;
+                out[0].box = left.box;
+                out[1].box = right[i + 1].box;
+            }
+        }
+    }
+    if (best_axis < 0) {
+        return 0;
+    }
+
+    double scale[3];
+    _bin_scales(&task->centroids, scale);
+    PrimitiveRef *refs = b->refs;
+    size_t i = task->first;
+    size_t end = task->first + task->count;
+    out[0].centroids = aabb_empty();
+    out[1].centroids = aabb_empty();
+    while (i < end) {
+        const Aabb *box = &refs[i].box;
+        double c[3] = { _centroid(box, 0), _centroid(box, 1), _centroid(box, 2) };
+        if (_bin_index(c[best_axis], task->centroids.min[best_axis], scale[best_axis]) <= best_bin) {
+            _extend_point(&out[0].centroids, c);
+            i++;
+        } else {
+            _extend_point(&out[1].centroids, c);
+            PrimitiveRef tmp = refs[i];
+            refs[i] = refs[--end];
+            refs[end] = tmp;
+        }
+    }
+    return i - task->first;
+}
+
+// -------------------
+// Linear build
+// -------------------
+
+/// @brief Spreads the low 10 bits of `x` out to every third bit.
+static uint32_t _spread_bits(uint32_t x) {
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+typedef struct {
+    const Builder *builder;
+    size_t first;
+    size_t count;
+    Aabb centroids;   // Of every primitive, which the codes' grid divides into 1024 cells along each axis
+    uint32_t *codes;
+} MortonJob;
+
+static int _morton_range(void *arg) {
+    MortonJob *job = arg;
+    const Builder *b = job->builder;
+    double scale[3];
+    for (int a = 0; a < 3; a++) {
+        double extent = job->centroids.max[a] - job->centroids.min[a];
+        scale[a] = extent > 0.0 ? 1023.0 / extent : 0.0;
+    }
+    for (size_t i = job->first; i < job->first + job->count; i++) {
+        const Aabb *box = &b->bounds[b->ids[i]];
+        uint32_t code = 0;
+        for (int a = 0; a < 3; a++) {
+            uint32_t cell = (uint32_t)((_centroid(box, a) - job->centroids.min[a]) * scale[a]);
+            code |= _spread_bits(cell) << (2 - a);
+        }
+        job->codes[i] = code;
+    }
+    return 0;
+}
+
+/// @brief Computes the Morton code of every primitive's centroid and sorts the ids by them, with a radix
+/// sort of 10 bits at a time. Returns 0 on success.
+static int _sort_by_morton_code(const Builder *b, size_t count, const Aabb *centroids, uint32_t *codes) {
+    uint32_t *ids = b->ids;
+    uint32_t *ids_tmp = malloc(count * sizeof(uint32_t));
+    uint32_t *codes_tmp = malloc(count * sizeof(uint32_t));
+    size_t *offsets = malloc(1024 * sizeof(size_t));
+    if (ids_tmp == NULL || codes_tmp == NULL || offsets == NULL) {
+        free(ids_tmp);
+        free(codes_tmp);
+        free(offsets);
+        return 1;
+    }
+
+    MortonJob jobs[BVH_MAX_THREADS];
+    int parts = _share(b, count);
+    for (int i = 0; i < parts; i++) {
+        size_t lo = count * i / parts;
+        size_t hi = count * (i + 1) / parts;
+        jobs[i] = (MortonJob) { b, lo, hi - lo, *centroids, codes };
+    }
+    _run_parallel(_morton_range, jobs, sizeof(MortonJob), parts);
+
+    for (int shift = 0; shift < 30; shift += 10) {
+        memset(offsets, 0, 1024 * sizeof(size_t));
+        for (size_t i = 0; i < count; i++) {
+            offsets[(codes[i] >> shift) & 0x3ff]++;
+        }
+        size_t sum = 0;
+        for (int d = 0; d < 1024; d++) {
+            size_t n = offsets[d];
+            offsets[d] = sum;
+            sum += n;
+        }
+        for (size_t i = 0; i < count; i++) {
+            size_t to = offsets[(codes[i] >> shift) & 0x3ff]++;
+            ids_tmp[to] = ids[i];
+            codes_tmp[to] = codes[i];
+        }
+        memcpy(ids, ids_tmp, count * sizeof(uint32_t));
+        memcpy(codes, codes_tmp, count * sizeof(uint32_t));
+    }
+    free(ids_tmp);
+    free(codes_tmp);
+    free(offsets);
+    return 0;
+}
+
+/// @brief Returns the number of the task's primitives before the first whose code has the highest bit
+/// that differs across them set, or half of them if their codes are all the same.
+static size_t _split_linear(const Builder *b, const BuildTask *task) {
+    const uint32_t *codes = b->codes;
+    size_t first = task->first;
+    size_t last = task->first + task->count - 1;
+    uint32_t differing = codes[first] ^ codes[last];
+    if (differing == 0) {
+        return task->count / 2;
+    }
+    uint32_t bit = 1u << 31;
+    while (!(differing & bit)) {
+        bit >>= 1;
+    }
+    // The codes are sorted and agree above the bit, so those without it come first
+    size_t lo = first;
+    size_t hi = last;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (codes[mid] & bit) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo - first;
+}
+
+// -------------------
+// Tasks
+// -------------------
+
+/// @brief Writes the task's node, and if it is split, its children's tasks. Returns 0 if it is a leaf.
+static int _split(const Builder *b, const BuildTask *task, BuildTask out[2]) {
+    BvhNode *node = &b->slots[task->node];
+    *node = (BvhNode) { task->box, (uint32_t)task->first, (uint32_t)task->count };
+    if (task->count <= BVH_LEAF_SIZE || task->depth >= BVH_MAX_DEPTH) {
+        return 0;
+    }
+
+    out[0].box = out[1].box = out[0].centroids = out[1].centroids = aabb_empty();
+    size_t left_count = b->codes != NULL ? _split_linear(b, task) : _split_sah(b, task, out);
+    if (left_count == 0) {
+        return 0;
+    }
+    node->first = task->children;
+    node->count = 0;
+    out[0].node = task->children;
+    out[0].children = task->children + 2;
+    out[0].first = task->first;
+    out[0].count = left_count;
+    out[1].node = task->children + 1;
+    out[1].children = task->children + 2 * (uint32_t)left_count;
+    out[1].first = task->first + left_count;
+    out[1].count = task->count - left_count;
+    out[0].depth = out[1].depth = task->depth + 1;
+    return 1;
+}
+
+static void _build_subtree(const Builder *b, const BuildTask *task) {
+    BuildTask children[2];
+    if (_split(b, task, children)) {
+        _build_subtree(b, &children[0]);
+        _build_subtree(b, &children[1]);
+    }
+}
+
+typedef struct {
+    const Builder *builder;
+    const BuildTask *tasks;
+    size_t task_count;
+    size_t next;  // Index of the first task not yet taken
+    mtx_t lock;
+} SubtreeQueue;
+
+/// @brief Thread entry point. Builds subtrees from the queue until it is empty.
+static int _build_subtrees(void *arg) {
+    SubtreeQueue *queue = *(SubtreeQueue **)arg;
+    for (;;) {
+        mtx_lock(&queue->lock);
+        size_t i = queue->next < queue->task_count ? queue->next++ : queue->task_count;
+        mtx_unlock(&queue->lock);
+        if (i == queue->task_count) {
+            return 0;
+        }
+        _build_subtree(queue->builder, &queue->tasks[i]);
+    }
+}
+
+static int _larger_task_first(const void *a, const void *b) {
+    size_t ca = ((const BuildTask *)a)->count;
+    size_t cb = ((const BuildTask *)b)->count;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/// @brief Splits the top of the tree into subtrees, then builds those on every thread.
+static void _build_parallel(const Builder *b, const BuildTask *root) {
+    size_t capacity = (size_t)b->thread_count * BVH_TASKS_PER_THREAD;
+    BuildTask *tasks = malloc((capacity + 1) * sizeof(BuildTask));
+    SubtreeQueue queue = { 0 };
+    queue.tasks = tasks;
+    if (tasks == NULL || mtx_init(&queue.lock, mtx_plain) != thrd_success) {
+        free(tasks);
+        _build_subtree(b, root);
+        return;
+    }
+
+    // Split the largest subtree until there are enough, or they are all small enough to leave whole
+    tasks[queue.task_count++] = *root;
+    while (queue.task_count > 0 && queue.task_count < capacity) {
+        size_t largest = 0;
+        for (size_t i = 1; i < queue.task_count; i++) {
+            largest = tasks[i].count > tasks[largest].count ? i : largest;
+        }
+        if (tasks[largest].count < BVH_TASK_MIN) {
+            break;
+        }
+        BuildTask children[2];
+        if (_split(b, &tasks[largest], children)) {
+            tasks[largest] = children[0];
+            tasks[queue.task_count++] = children[1];
+        } else {
+            tasks[largest] = tasks[--queue.task_count];
+        }
+    }
+
+    // Hand out the largest first, so that the small ones fill in around them at the end
+    qsort(tasks, queue.task_count, sizeof(BuildTask), _larger_task_first);
+    Builder subtree_builder = *b;
+    subtree_builder.thread_count = 1;
+    queue.builder = &subtree_builder;
+    SubtreeQueue *jobs[BVH_MAX_THREADS];
+    for (int i = 0; i < b->thread_count; i++) {
+        jobs[i] = &queue;
+    }
+    _run_parallel(_build_subtrees, jobs, sizeof(SubtreeQueue *), b->thread_count);
+    mtx_destroy(&queue.lock);
+    free(tasks);
+}
+
+static size_t _count_nodes(const BvhNode *slots, uint32_t index) {
+    const BvhNode *node = &slots[index];
+    return node->count > 0 ? 1 : 1 + _count_nodes(slots, node->first) + _count_nodes(slots, node->first + 1);
+}
+
+/// @brief Copies the subtree at slot `from_index` to node `to_index`, placing each pair of children at
+/// the next of `*next` nodes, depth first.
+static void _compact(const BvhNode *slots, BvhNode *nodes, uint32_t from_index, uint32_t to_index, size_t *next) {
+    const BvhNode *from = &slots[from_index];
+    nodes[to_index] = *from;
+    if (from->count > 0) {
+        return;
+    }
+    uint32_t left = (uint32_t)*next;
+    *next += 2;
+    nodes[to_index].first = left;
+    _compact(slots, nodes, from->first, left, next);
+    _compact(slots, nodes, from->first + 1, left + 1, next);
+}
+
+int bvh_build(Bvh *bvh, const Aabb *bounds, const uint32_t *ids, size_t count) {
+    return bvh_build_with(bvh, bounds, ids, count, bvh_build_options_default());
+}
+
+int bvh_build_with(Bvh *bvh, const Aabb *bounds, const uint32_t *ids, size_t count, BvhBuildOptions options) {
+    bvh_free(bvh);
+    if (count == 0) {
+        return 0;
+    }
+
+    // A binary tree with single-primitive leaves has 2n - 1 nodes, and leaves only ever hold more
+    BvhNode *slots = malloc((2 * count - 1) * sizeof(BvhNode));
+    PrimitiveRef *refs = options.linear ? NULL : malloc(count * sizeof(PrimitiveRef));
+    uint32_t *codes = options.linear ? malloc(count * sizeof(uint32_t)) : NULL;
+    bvh->indices = malloc(count * sizeof(uint32_t));
+    if (slots == NULL || (refs == NULL && codes == NULL) || bvh->indices == NULL) {
+        free(slots);
+        free(refs);
+        free(codes);
+        bvh_free(bvh);
+        return 1;
+    }
+    memcpy(bvh->indices, ids, count * sizeof(uint32_t));
+    bvh->primitive_count = count;
+
+    int threads = options.thread_count < 1 ? 1 : options.thread_count > BVH_MAX_THREADS ? BVH_MAX_THREADS : options.thread_count;
+    Builder b = { slots, bvh->indices, bounds, refs, NULL, threads };
+    BuildTask root = { 0, 1, 0, count, 0, aabb_empty(), aabb_empty() };
+    _gather(&b, &root);
+    if (options.linear) {
+        if (_sort_by_morton_code(&b, count, &root.centroids, codes)) {
+            free(slots);
+            free(codes);
+            bvh_free(bvh);
+            return 1;
+        }
+        b.codes = codes;
+    }
+    if (threads > 1) {
+        _build_parallel(&b, &root);
+    } else {
+        _build_subtree(&b, &root);
+    }
+    if (refs != NULL) {
+        for (size_t i = 0; i < count; i++) {
+            bvh->indices[i] = refs[i].id;
+        }
+    }
+    free(refs);
+    free(codes);
+
+    bvh->node_count = _count_nodes(slots, 0);
+    bvh->nodes = malloc(bvh->node_count * sizeof(BvhNode));
+    if (bvh->nodes == NULL) {
+        free(slots);
+        bvh_free(bvh);
+        return 1;
+    }
+    size_t next = 1;
+    _compact(slots, bvh->nodes, 0, 0, &next);
+    free(slots);
+    if (options.linear) {
+        // Splitting by code needs no bounds, so they are all computed at the end
+        bvh_refit(bvh, bounds);
+    }
+    bvh->built_cost = bvh_cost(bvh);
+    return 0;
+}
+
+void bvh_refit(Bvh *bvh, const Aabb *bounds) {
+    for (size_t i = bvh->node_count; i-- > 0;) {
+        BvhNode *node = &bvh->nodes[i];
+        Aabb box = aabb_empty();
+        if (node->count > 0) {
+            for (uint32_t j = node->first; j < node->first + node->count; j++) {
+                aabb_extend(&box, &bounds[bvh->indices[j]]);
+            }
+        } else {
+            aabb_extend(&box, &bvh->nodes[node->first].bounds);
+            aabb_extend(&box, &bvh->nodes[node->first + 1].bounds);
+        }
+        node->bounds = box;
+    }
+}
+
+double bvh_cost(const Bvh *bvh) {
+    if (bvh->node_count == 0) {
+        return 0.0;
+    }
+    double root_area = aabb_surface_area(&bvh->nodes[0].bounds);
+    if (root_area <= 0.0) {
+        return COST_INTERSECTION * bvh->primitive_count;
+    }
+
+    double cost = 0.0;
+    for (size_t i = 0; i < bvh->node_count; i++) {
+        const BvhNode *node = &bvh->nodes[i];
+        double p = aabb_surface_area(&node->bounds) / root_area;
+        cost += node->count > 0 ? p * COST_INTERSECTION * node->count : p * COST_TRAVERSAL;
+    }
+    return cost;
+}
+
+void bvh_free(Bvh *bvh) {
+    free(bvh->nodes);
+    free(bvh->indices);
+    *bvh = (Bvh) { 0 };
+}
@@ -0,0 +1,241 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include <grid.h>
+
+// Most cells along an axis, which keeps a grid over a long thin scene from having most of its cells empty
+#define GRID_MAX_RESOLUTION 512
+
+// Fewest boxes worth a grid, as a tree over fewer is only a few levels deep
+#define GRID_MIN_BOXES 1024
+// Largest spread of the boxes' sizes, as the standard deviation of their longest sides over the mean, for
+// which a grid suits them. Cells sized for the typical box hold large ones many times over.
+static const double GRID_MAX_SIZE_SPREAD = 1.0;
+// Most cells a box may overlap on average, beyond which rays test the same boxes in cell after cell
+static const double GRID_MAX_CELLS_PER_BOX = 8.0;
+// Fewest cells that must hold something, below which the boxes are clumped and rays cross many empty cells
+static const double GRID_MIN_OCCUPANCY = 0.25;
+
+/// @brief Returns the cell along `axis` that holds the coordinate `x`, clamped to the grid.
+static int _cell(const Grid *grid, int axis, double x) {
+    double c = (x - grid->bounds.min[axis]) * grid->inv_cell_size[axis];
+    if (!(c > 0.0)) {
+        return 0;
+    }
+    return c < grid->resolution[axis] ? (int)c : grid->resolution[axis] - 1;
+}
+
+/// @brief Sets the cells along each axis so that there are about `density` per box, shaped like cubes. Axes
+/// along which the boxes are flat get one cell.
+static void _resolution(Grid *grid, size_t count, double density) {
+    double extent[3];
+    double largest = 0.0;
+    for (int a = 0; a < 3; a++) {
+        extent[a] = grid->bounds.max[a] - grid->bounds.min[a];
+        largest = extent[a] > largest ? extent[a] : largest;
+    }
+    int dims = 0;
+    double volume = 1.0;
+    for (int a = 0; a < 3; a++) {
+        if (extent[a] > 1e-9 * largest) {
+            dims++;
+            volume *= extent[a];
+        }
+    }
+    double per_unit = dims > 0 ? pow(density * count / volume, 1.0 / dims) : 0.0;
+    for (int a = 0; a < 3; a++) {
+        int r = 1;
+        if (extent[a] > 1e-9 * largest) {
+            double cells = extent[a] * per_unit + 0.5;
+            r = cells < 1.0 ? 1 : cells > GRID_MAX_RESOLUTION ? GRID_MAX_RESOLUTION : (int)cells;
+        }
+        grid->resolution[a] = r;
+        grid->cell_size[a] = extent[a] > 0.0 ? extent[a] / r : 1.0;
+        grid->inv_cell_size[a] = 1.0 / grid->cell_size[a];
+    }
+}
+
+/// @brief Writes the first and last cells along each axis that `box` overlaps, and returns how many there are.
+static size_t _cell_range(const Grid *grid, const Aabb *box, int lo[3], int hi[3]) {
+    size_t cells = 1;
+    for (int a = 0; a < 3; a++) {
+        lo[a] = _cell(grid, a, box->min[a]);
+        hi[a] = _cell(grid, a, box->max[a]);
+        cells *= (size_t)(hi[a] - lo[a] + 1);
+    }
+    return cells;
+}
+
+int grid_build(Grid *grid, const Aabb *bounds, const uint32_t *ids, size_t count, double density) {
+    grid_free(grid);
+    if (count == 0) {
+        return 0;
+    }
+    grid->bounds = aabb_empty();
+    for (size_t i = 0; i < count; i++) {
+        aabb_extend(&grid->bounds, &bounds[ids[i]]);
+    }
+    _resolution(grid, count, density);
+    const int *res = grid->resolution;
+    grid->cell_count = (size_t)res[0] * res[1] * res[2];
+    grid->cell_start = calloc(grid->cell_count + 1, sizeof(uint32_t));
+    if (grid->cell_start == NULL) {
+        grid_free(grid);
+        return 1;
+    }
+
+    // Count the boxes in each cell
+    uint32_t *start = grid->cell_start;
+    size_t item_count = 0;
+    int lo[3], hi[3];
+    for (size_t i = 0; i < count; i++) {
+        item_count += _cell_range(grid, &bounds[ids[i]], lo, hi);
+        if (item_count >= UINT32_MAX) {
+            grid_free(grid);
+            return 1;
+        }
+        for (int z = lo[2]; z <= hi[2]; z++) {
+            for (int y = lo[1]; y <= hi[1]; y++) {
+                for (int x = lo[0]; x <= hi[0]; x++) {
+                    start[x + (size_t)res[0] * (y + (size_t)res[1] * z)]++;
+                }
+            }
+        }
+    }
+
+    // Turn the counts into where each cell's list ends, then fill the lists from their ends, which leaves
+    // each cell's entry at its start
+    uint32_t end = 0;
+    for (size_t c = 0; c < grid->cell_count; c++) {
+        grid->occupied_count += start[c] > 0;
+        end += start[c];
+        start[c] = end;
+    }
+    start[grid->cell_count] = end;
+    grid->items = malloc((item_count > 0 ? item_count : 1) * sizeof(uint32_t));
+    if (grid->items == NULL) {
+        grid_free(grid);
+        return 1;
+    }
+    grid->item_count = item_count;
+    for (size_t i = count; i-- > 0;) {
+        _cell_range(grid, &bounds[ids[i]], lo, hi);
+        for (int z = lo[2]; z <= hi[2]; z++) {
+            for (int y = lo[1]; y <= hi[1]; y++) {
+                for (int x = lo[0]; x <= hi[0]; x++) {
+                    grid->items[--start[x + (size_t)res[0] * (y + (size_t)res[1] * z)]] = ids[i];
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int grid_suits(const Grid *grid, const Aabb *bounds, const uint32_t *ids, size_t count) {
+    if (count < GRID_MIN_BOXES || grid->cell_count == 0) {
+        return 0;
+    }
+    double sum = 0.0;
+    double sum_squares = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        const Aabb *box = &bounds[ids[i]];
+        double size = 0.0;
+        for (int a = 0; a < 3; a++) {
+            double extent = box->max[a] - box->min[a];
+            size = extent > size ? extent : size;
+        }
+        sum += size;
+        sum_squares += size * size;
+    }
+    double mean = sum / count;
+    double variance = sum_squares / count - mean * mean;
+    double spread = mean > 0.0 ? sqrt(variance > 0.0 ? variance : 0.0) / mean : 0.0;
+    return spread <= GRID_MAX_SIZE_SPREAD
+        && grid->item_count <= GRID_MAX_CELLS_PER_BOX * count
+        && grid->occupied_count >= GRID_MIN_OCCUPANCY * grid->cell_count;
+}
+
+int grid_walk_start(const Grid *grid, Vec4D origin, Vec4D direction, double tmax, GridWalk *out) {
+    if (grid->cell_count == 0) {
+        return 0;
+    }
+    double o[3] = { origin.x, origin.y, origin.z };
+    double d[3] = { direction.x, direction.y, direction.z };
+    double t_enter = 0.0;
+    double t_end = tmax;
+    for (int a = 0; a < 3; a++) {
+        if (d[a] == 0.0) {
+            if (o[a] < grid->bounds.min[a] || o[a] > grid->bounds.max[a]) {
+                return 0;
+            }
+            continue;
+        }
+        double t0 = (grid->bounds.min[a] - o[a]) / d[a];
+        double t1 = (grid->bounds.max[a] - o[a]) / d[a];
+        if (t0 > t1) {
+            double tmp = t0;
+            t0 = t1;
+            t1 = tmp;
+        }
+        t_enter = t0 > t_enter ? t0 : t_enter;
+        t_end = t1 < t_end ? t1 : t_end;
+    }
+    if (t_enter > t_end) {
+        return 0;
+    }
+
+    out->t_end = t_end;
+    out->t_cell_exit = t_end;
+    out->index = 0;
+    ptrdiff_t stride = 1;
+    for (int a = 0; a < 3; a++) {
+        int c = _cell(grid, a, o[a] + t_enter * d[a]);
+        double inv = 1.0 / d[a];
+        out->cell[a] = c;
+        out->index += c * stride;
+        if (d[a] > 0.0) {
+            out->step[a] = 1;
+            out->stop[a] = grid->resolution[a];
+            out->t_next[a] = (grid->bounds.min[a] + (c + 1) * grid->cell_size[a] - o[a]) * inv;
+            out->t_delta[a] = grid->cell_size[a] * inv;
+        } else if (d[a] < 0.0) {
+            out->step[a] = -1;
+            out->stop[a] = -1;
+            out->t_next[a] = (grid->bounds.min[a] + c * grid->cell_size[a] - o[a]) * inv;
+            out->t_delta[a] = -grid->cell_size[a] * inv;
+        } else {
+            // Never crosses into another cell along this axis
+            out->step[a] = 1;
+            out->stop[a] = grid->resolution[a];
+            out->t_next[a] = INFINITY;
+            out->t_delta[a] = INFINITY;
+        }
+        out->stride[a] = out->step[a] * stride;
+        stride *= grid->resolution[a];
+        out->t_cell_exit = out->t_next[a] < out->t_cell_exit ? out->t_next[a] : out->t_cell_exit;
+    }
+    return 1;
+}
+
+int grid_walk_next(GridWalk *walk) {
+    const double *t = walk->t_next;
+    int a = t[0] < t[1] ? (t[0] < t[2] ? 0 : 2) : (t[1] < t[2] ? 1 : 2);
+    if (t[a] >= walk->t_end) {
+        return 0;
+    }
+    walk->cell[a] += walk->step[a];
+    if (walk->cell[a] == walk->stop[a]) {
+        return 0;
+    }
+    walk->index += walk->stride[a];
+    walk->t_next[a] += walk->t_delta[a];
+    double exit = t[0] < t[1] ? (t[0] < t[2] ? t[0] : t[2]) : (t[1] < t[2] ? t[1] : t[2]);
+    walk->t_cell_exit = exit < walk->t_end ? exit : walk->t_end;
+    return 1;
+}
+
+void grid_free(Grid *grid) {
+    free(grid->cell_start);
+    free(grid->items);
+    *grid = (Grid) { 0 };
+}
@@ -0,0 +1,163 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include <group.h>
+
+/// @brief Recomputes the group's bounds from its children'. An intersection is within both children's
+/// boxes, and a difference within its first child's.
+static void _gather_bounds(Group *group) {
+    group->bounds = aabb_empty();
+    if (group->operation == CSG_INTERSECTION && group->child_count == 2) {
+        const Aabb *a = &group->child_bounds[0];
+        const Aabb *b = &group->child_bounds[1];
+        for (int i = 0; i < 3; i++) {
+            group->bounds.min[i] = fmax(a->min[i], b->min[i]);
+            group->bounds.max[i] = fmin(a->max[i], b->max[i]);
+        }
+    } else if (group->operation == CSG_DIFFERENCE && group->child_count > 0) {
+        group->bounds = group->child_bounds[0];
+    } else {
+        for (size_t i = 0; i < group->child_count; i++) {
+            aabb_extend(&group->bounds, &group->child_bounds[i]);
+        }
+    }
+    group->revision++;
+}
+
+/// @brief Recomputes the group's bounds, then those of the groups above it.
+static void _update_bounds(Group *group) {
+    for (; group != NULL; group = group->parent) {
+        _gather_bounds(group);
+        if (group->parent != NULL) {
+            group->parent->child_bounds[group->index] = group->bounds;
+        }
+    }
+}
+
+/// @brief Composes the `index`th child's transform with the group's, and those of its own children if it
+/// is a group, and updates its bounds in the group. The bounds of the group itself are left as they are.
+static void _compose_child(const Shape *group, size_t index) {
+    Group *g = group->group;
+    Shape *child = &g->children[index];
+    child->transform = mat4d_mul_mat4d(group->transform, g->locals[index]);
+    child->inv_transform = mat4d_mul_mat4d(g->local_invs[index], group->inv_transform);
+    shape_classify(child);
+    if (shape_is_group(child)) {
+        Group *inner = child->group;
+        for (size_t i = 0; i < inner->child_count; i++) {
+            _compose_child(child, i);
+        }
+        _gather_bounds(inner);
+    }
+    g->child_bounds[index] = shape_bounds(child);
+}
+
+Shape group_new(Mat4D transform, const char *name) {
+    Shape shape = shape_from_parts(SHAPE_GROUP, transform, mat4d_inverse(transform), 0, name, -INFINITY, INFINITY, 0);
+    shape.group = calloc(1, sizeof(Group));
+    if (shape.group != NULL) {
+        shape.group->bounds = aabb_empty();
+    }
+    return shape;
+}
+
+Shape csg_new(int operation, Mat4D transform, const char *name) {
+    Shape shape = group_new(transform, name);
+    shape.type = SHAPE_CSG;
+    if (shape.group != NULL) {
+        shape.group->operation = operation;
+    }
+    return shape;
+}
+
+int shape_is_group(const Shape *shape) {
+    return shape->type == SHAPE_GROUP || shape->type == SHAPE_CSG;
+}
+
+int csg_can_combine(const Shape *shape) {
+    if (shape->type == SHAPE_MESH || shape->type == SHAPE_SPHERE_CLOUD) {
+        return 0;
+    }
+    if (shape_is_group(shape)) {
+        for (size_t i = 0; i < shape->group->child_count; i++) {
+            if (!csg_can_combine(&shape->group->children[i])) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int group_add(Shape *group, Shape child) {
+    Group *g = group->group;
+    if (g->child_count == g->capacity) {
+        size_t capacity = g->capacity ? 2 * g->capacity : 4;
+        Shape *children = realloc(g->children, capacity * sizeof(Shape));
+        if (children != NULL) {
+            g->children = children;
+        }
+        Mat4D *locals = realloc(g->locals, capacity * sizeof(Mat4D));
+        if (locals != NULL) {
+            g->locals = locals;
+        }
+        Mat4D *local_invs = realloc(g->local_invs, capacity * sizeof(Mat4D));
+        if (local_invs != NULL) {
+            g->local_invs = local_invs;
+        }
+        Aabb *child_bounds = realloc(g->child_bounds, capacity * sizeof(Aabb));
+        if (child_bounds != NULL) {
+            g->child_bounds = child_bounds;
+        }
+        if (children == NULL || locals == NULL || local_invs == NULL || child_bounds == NULL) {
+            return 1;
+        }
+        g->capacity = capacity;
+    }
+
+    size_t index = g->child_count++;
+    g->children[index] = child;
+    g->locals[index] = child.transform;
+    g->local_invs[index] = child.inv_transform;
+    if (shape_is_group(&child)) {
+        child.group->parent = g;
+        child.group->index = index;
+    }
+    _compose_child(group, index);
+    _update_bounds(g);
+    return 0;
+}
+
+void group_set_child_transform(Shape *group, size_t index, Mat4D transform) {
+    Group *g = group->group;
+    g->locals[index] = transform;
+    g->local_invs[index] = mat4d_inverse(transform);
+    g->children[index].revision++;
+    _compose_child(group, index);
+    _update_bounds(g);
+}
+
+void group_compose(Shape *group) {
+    Group *g = group->group;
+    for (size_t i = 0; i < g->child_count; i++) {
+        _compose_child(group, i);
+    }
+    _update_bounds(g);
+}
+
+void group_free(Shape *group) {
+    Group *g = group->group;
+    if (g == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < g->child_count; i++) {
+        if (shape_is_group(&g->children[i])) {
+            group_free(&g->children[i]);
+        }
+    }
+    free(g->children);
+    free(g->locals);
+    free(g->local_invs);
+    free(g->child_bounds);
+    free(g);
+    group->group = NULL;
+}
@@ -0,0 +1,36 @@
+#include <instance.h>
+
+Instance instance_new(uint32_t prototype, Mat4D transform, uint32_t material) {
+    return (Instance) { prototype, material, transform, mat4d_inverse(transform), 0 };
+}
+
+void instance_set_transform(Instance *instance, Mat4D transform) {
+    instance->transform = transform;
+    instance->inv_transform = mat4d_inverse(transform);
+    instance->revision++;
+}
+
+void instance_set_material(Instance *instance, uint32_t material) {
+    instance->material = material;
+    instance->revision++;
+}
+
+Shape instance_shape(const Instance *instance, const Shape *prototype) {
+    Shape shape = *prototype;
+    shape.transform = mat4d_mul_mat4d(instance->transform, prototype->transform);
+    shape.inv_transform = mat4d_mul_mat4d(prototype->inv_transform, instance->inv_transform);
+    shape_classify(&shape);
+    if (instance->material != INSTANCE_PROTOTYPE_MATERIAL) {
+        shape.material = instance->material;
+    }
+    return shape;
+}
+
+Vec4D instance_normal_at(const Instance *instance, Shape *prototype, Vec4D world_point, uint32_t primitive, double u, double v) {
+    // The prototype's normal in the instance's space, then carried out of it like any shape's
+    Vec4D local_point = mat4d_mul_vec4d(instance->inv_transform, world_point);
+    Vec4D local_normal = shape_normal_at(prototype, local_point, primitive, u, v);
+    Vec4D world_normal = mat4d_mul_vec4d(mat4d_transpose(instance->inv_transform), local_normal);
+    world_normal.w = 0.0;
+    return d4_norm(world_normal);
+}
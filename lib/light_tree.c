@@ -0,0 +1,294 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include <light_tree.h>
+
+// Rebuild the tree once refits have made it this many times as expensive to walk as when it was built
+static const double LIGHT_TREE_REBUILD_COST_RATIO = 1.5;
+// Estimates are at least this fraction of their bound. Lights that can add to a point must keep some chance
+// of being picked there for the sum to stay unbiased, even where the estimate of what they add comes to 0.
+static const double LIGHT_TREE_ESTIMATE_FLOOR = 0.01;
+
+static double _brightest(Color c) {
+    double m = c.r > c.g ? c.r : c.g;
+    return m > c.b ? m : c.b;
+}
+
+static double _reach(const PointLight *light) {
+    return light->falloff > 0.0 ? light->falloff : INFINITY;
+}
+
+/// @brief Returns the fraction of their intensity that lights whose largest falloff distance is `reach` at
+/// least keep at `distance`.
+static double _falloff_bound(double reach, double distance) {
+    if (reach == INFINITY || distance <= reach) {
+        return 1.0;
+    }
+    double ratio = reach / distance;
+    return ratio * ratio;
+}
+
+LightReceiver light_receiver_new(const Material *material, Color color, Vec4D point, Vec4D normal) {
+    double brightest = _brightest(color);
+    return (LightReceiver) {
+        point,
+        normal,
+        (material->ambient + material->diffuse) * brightest + material->specular,
+        material->ambient * brightest,
+    };
+}
+
+/// @brief Returns how much of a light's intensity the receiver sends on, with the bound of what it sends on
+/// of lights in front of it scaled by `cosine`, the most the light's angle to the normal could make of it.
+static double _shading(const LightReceiver *r, double cosine) {
+    return r->behind + (r->facing - r->behind) * cosine;
+}
+
+/// @brief Returns the most lights in `box` of the given power and reach can add to a channel of the
+/// receiver's color, and writes an estimate of what they add, which may be 0 where the bound is not. See
+/// _box_bound.
+static double _box_bound_raw(const Aabb *box, double power, double reach, const LightReceiver *r, double *out_estimate) {
+    double p[3] = { r->point.x, r->point.y, r->point.z };
+    double n[3] = { r->normal.x, r->normal.y, r->normal.z };
+    double nearest = 0.0;
+    double to_center = 0.0;
+    double center_height = 0.0;  // Of the box's center above the receiver's tangent plane
+    double half_diagonal = 0.0;
+    double highest = 0.0;        // Of the box's corners above the plane
+    for (int a = 0; a < 3; a++) {
+        double gap = p[a] < box->min[a] ? box->min[a] - p[a] : p[a] > box->max[a] ? p[a] - box->max[a] : 0.0;
+        double center = 0.5 * (box->min[a] + box->max[a]) - p[a];
+        double half = 0.5 * (box->max[a] - box->min[a]);
+        nearest += gap * gap;
+        to_center += center * center;
+        center_height += n[a] * center;
+        half_diagonal += half * half;
+        highest += n[a] * ((n[a] > 0.0 ? box->max[a] : box->min[a]) - p[a]);
+    }
+    if (highest < 0.0) {
+        *out_estimate = power * _falloff_bound(reach, sqrt(to_center)) * r->behind;
+        return power * _falloff_bound(reach, sqrt(nearest)) * r->behind;
+    }
+
+    // The lights' angle to the normal is at least the center's, less the angle the box spans, and inside
+    // the box they can be as near as their spread allows
+    double cosine = 1.0;
+    double typical = sqrt(half_diagonal);
+    if (to_center > half_diagonal) {
+        typical = sqrt(to_center);
+        double center_angle = acos(fmax(-1.0, fmin(1.0, center_height / typical)));
+        double spread = asin(sqrt(half_diagonal / to_center));
+        cosine = center_angle > spread ? fmax(0.0, cos(center_angle - spread)) : 1.0;
+    }
+    *out_estimate = power * _falloff_bound(reach, typical) * _shading(r, cosine);
+    return power * _falloff_bound(reach, sqrt(nearest)) * r->facing;
+}
+
+/// @brief Returns the same bound as _box_bound_raw, and writes its estimate raised to at least
+/// LIGHT_TREE_ESTIMATE_FLOOR of the bound. For a receiver with no ambient part, the raw estimate comes to 0,
+/// or next to it, when the lights lie at or near its horizon, though the bound, taken at their nearest point
+/// and steepest angle, does not.
+static double _box_bound(const Aabb *box, double power, double reach, const LightReceiver *r, double *out_estimate) {
+    double bound = _box_bound_raw(box, power, reach, r, out_estimate);
+    *out_estimate = fmax(*out_estimate, LIGHT_TREE_ESTIMATE_FLOOR * bound);
+    return bound;
+}
+
+/// @brief Returns the box around the light, which is a point unless it is an area light.
+static Aabb _light_box(const PointLight *light) {
+    Vec4D c = light->position;
+    Aabb box = { { c.x, c.y, c.z }, { c.x, c.y, c.z } };
+    if (light->type == LIGHT_AREA) {
+        for (int k = 1; k < 4; k++) {
+            Vec4D p = d4_add(c, d4_add(k & 1 ? light->uvec : d4_vector(0.0, 0.0, 0.0), k & 2 ? light->vvec : d4_vector(0.0, 0.0, 0.0)));
+            Aabb corner = { { p.x, p.y, p.z }, { p.x, p.y, p.z } };
+            aabb_extend(&box, &corner);
+        }
+    }
+    return box;
+}
+
+/// @brief Writes the most `light` can add to any channel of the receiver's color, and returns an estimate of
+/// what it adds.
+static double _light_weight(const PointLight *light, const LightReceiver *r, double *out_bound) {
+    Aabb box = _light_box(light);
+    double estimate;
+    *out_bound = _box_bound(&box, _brightest(light->intensity), _reach(light), r, &estimate);
+    return estimate;
+}
+
+double light_bound(const PointLight *light, const LightReceiver *receiver) {
+    double bound;
+    _light_weight(light, receiver, &bound);
+    return bound;
+}
+
+/// @brief Returns the most the lights under `node` can add to a channel of the receiver's color, and writes
+/// an estimate of what they add.
+static double _node_bound(const LightTree *tree, uint32_t node, const LightReceiver *r, double *out_estimate) {
+    return _box_bound(&tree->tree.nodes[node].bounds, tree->power[node], tree->reach[node], r, out_estimate);
+}
+
+/// @brief Computes every node's power and reach from the lights under it, children before their parents.
+static void _fit_power(LightTree *tree, const PointLight *lights) {
+    const Bvh *bvh = &tree->tree;
+    for (size_t i = bvh->node_count; i-- > 0;) {
+        const BvhNode *node = &bvh->nodes[i];
+        double power = 0.0;
+        double reach = 0.0;
+        if (node->count > 0) {
+            for (uint32_t j = node->first; j < node->first + node->count; j++) {
+                const PointLight *light = &lights[bvh->indices[j]];
+                double r = _reach(light);
+                power += _brightest(light->intensity);
+                reach = r > reach ? r : reach;
+            }
+        } else {
+            power = tree->power[node->first] + tree->power[node->first + 1];
+            reach = tree->reach[node->first] > tree->reach[node->first + 1] ? tree->reach[node->first] : tree->reach[node->first + 1];
+        }
+        tree->power[i] = power;
+        tree->reach[i] = reach;
+    }
+}
+
+int light_tree_build(LightTree *tree, const PointLight *lights, size_t count) {
+    light_tree_free(tree);
+    size_t n = count > 0 ? count : 1;
+    Aabb *bounds = malloc(n * sizeof(Aabb));
+    uint32_t *ids = malloc(n * sizeof(uint32_t));
+    tree->revisions = malloc(n * sizeof(uint32_t));
+    int err = bounds == NULL || ids == NULL || tree->revisions == NULL;
+    if (!err) {
+        for (size_t i = 0; i < count; i++) {
+            bounds[i] = _light_box(&lights[i]);
+            ids[i] = (uint32_t)i;
+            tree->revisions[i] = lights[i].revision;
+        }
+        // Points have no area for the surface area heuristic to weigh, so they are split by Morton code
+        BvhBuildOptions options = bvh_build_options_default();
+        options.linear = 1;
+        err = bvh_build_with(&tree->tree, bounds, ids, count, options);
+    }
+    if (!err) {
+        size_t nodes = tree->tree.node_count > 0 ? tree->tree.node_count : 1;
+        tree->power = malloc(nodes * sizeof(double));
+        tree->reach = malloc(nodes * sizeof(double));
+        err = tree->power == NULL || tree->reach == NULL;
+    }
+    free(bounds);
+    free(ids);
+    if (err) {
+        light_tree_free(tree);
+        return 1;
+    }
+    tree->light_count = count;
+    _fit_power(tree, lights);
+    return 0;
+}
+
+int light_tree_update(LightTree *tree, const PointLight *lights, size_t count) {
+    if (count != tree->light_count || tree->revisions == NULL) {
+        return light_tree_build(tree, lights, count) ? -1 : 1;
+    }
+    int moved = 0;
+    for (size_t i = 0; i < count; i++) {
+        moved |= lights[i].revision != tree->revisions[i];
+        tree->revisions[i] = lights[i].revision;
+    }
+    if (!moved) {
+        return 0;
+    }
+    Aabb *bounds = malloc(count * sizeof(Aabb));
+    if (bounds == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        bounds[i] = _light_box(&lights[i]);
+    }
+    bvh_refit(&tree->tree, bounds);
+    free(bounds);
+    if (bvh_cost(&tree->tree) > LIGHT_TREE_REBUILD_COST_RATIO * tree->tree.built_cost) {
+        return light_tree_build(tree, lights, count) ? -1 : 1;
+    }
+    _fit_power(tree, lights);
+    return 0;
+}
+
+int light_tree_sample(const LightTree *tree, const PointLight *lights, const LightReceiver *receiver, double cutoff, double u, uint32_t *out_light, double *out_probability) {
+    const Bvh *bvh = &tree->tree;
+    if (bvh->node_count == 0) {
+        return 0;
+    }
+    double estimate;
+    if (_node_bound(tree, 0, receiver, &estimate) < cutoff) {
+        return 0;
+    }
+    double probability = 1.0;
+    uint32_t node = 0;
+    while (bvh->nodes[node].count == 0) {
+        uint32_t left = bvh->nodes[node].first;
+        double w[2];
+        for (int c = 0; c < 2; c++) {
+            if (_node_bound(tree, left + c, receiver, &w[c]) < cutoff) {
+                w[c] = 0.0;
+            }
+        }
+        if (w[0] + w[1] <= 0.0) {
+            return 0;
+        }
+        // Rescale u across the child taken, so one number makes every choice
+        double p_left = w[0] / (w[0] + w[1]);
+        if (u < p_left) {
+            u /= p_left;
+            probability *= p_left;
+            node = left;
+        } else {
+            u = (u - p_left) / (1.0 - p_left);
+            probability *= 1.0 - p_left;
+            node = left + 1;
+        }
+        u = u < 1.0 ? u : nextafter(1.0, 0.0);
+    }
+
+    // Pick from the leaf's lights by their own estimates
+    const BvhNode *leaf = &bvh->nodes[node];
+    double total = 0.0;
+    for (uint32_t j = leaf->first; j < leaf->first + leaf->count; j++) {
+        double bound;
+        double w = _light_weight(&lights[bvh->indices[j]], receiver, &bound);
+        total += bound >= cutoff ? w : 0.0;
+    }
+    if (total <= 0.0) {
+        return 0;
+    }
+    double target = u * total;
+    double below = 0.0;
+    uint32_t picked = 0;
+    double picked_weight = 0.0;
+    for (uint32_t j = leaf->first; j < leaf->first + leaf->count; j++) {
+        double bound;
+        double w = _light_weight(&lights[bvh->indices[j]], receiver, &bound);
+        if (bound < cutoff) {
+            continue;
+        }
+        // The last light above the cutoff catches any rounding past the total
+        picked = bvh->indices[j];
+        picked_weight = w;
+        if (target < below + w) {
+            break;
+        }
+        below += w;
+    }
+    *out_light = picked;
+    *out_probability = probability * picked_weight / total;
+    return 1;
+}
+
+void light_tree_free(LightTree *tree) {
+    bvh_free(&tree->tree);
+    free(tree->power);
+    free(tree->reach);
+    free(tree->revisions);
+    *tree = (LightTree) { 0 };
+}
@@ -1,19 +1,78 @@
 #include <lighting.h>
 #include <shape.h>
 
-Color lighting_compute(Shape object, PointLight light, Vec4D point, Vec4D eye, Vec4D normal, int in_shadow) {
-    Color ambient, diffuse, specular;
+PointLight point_light_new(Vec4D position, Color intensity) {
+    return (PointLight) {
+        position,
+        intensity,
+        0.0,
+        0,
+        LIGHT_POINT,
+        d4_vector(0.0, 0.0, 0.0),
+        d4_vector(0.0, 0.0, 0.0),
+        1,
+        1,
+    };
+}
+
+PointLight area_light_new(Vec4D corner, Vec4D uvec, int usteps, Vec4D vvec, int vsteps, Color intensity) {
+    return (PointLight) {
+        corner,
+        intensity,
+        0.0,
+        0,
+        LIGHT_AREA,
+        uvec,
+        vvec,
+        usteps > 0 ? usteps : 1,
+        vsteps > 0 ? vsteps : 1,
+    };
+}
+
+Vec4D light_center(const PointLight *light) {
+    if (light->type != LIGHT_AREA) {
+        return light->position;
+    }
+    return d4_add(light->position, d4_mul(d4_add(light->uvec, light->vvec), 0.5));
+}
+
+Vec4D light_sample_point(const PointLight *light, int i, int j, double u, double v) {
+    if (light->type != LIGHT_AREA) {
+        return light->position;
+    }
+    Vec4D along_u = d4_mul(light->uvec, (i + u) / light->usteps);
+    Vec4D along_v = d4_mul(light->vvec, (j + v) / light->vsteps);
+    return d4_add(light->position, d4_add(along_u, along_v));
+}
+
+void point_light_set(PointLight *light, Vec4D position, Color intensity) {
+    light->position = position;
+    light->intensity = intensity;
+    light->revision++;
+}
 
-    Color color = shape_color_at(object, point);
+Color point_light_intensity_at(const PointLight *light, Vec4D point) {
+    if (light->falloff <= 0.0) {
+        return light->intensity;
+    }
+    Vec4D v = d4_sub(light->position, point);
+    double squared = d4_dot(v, v);
+    double falloff_squared = light->falloff * light->falloff;
+    return squared <= falloff_squared ? light->intensity : color_mul(light->intensity, falloff_squared / squared);
+}
+
+Color lighting_compute(const Material *material, Color color, PointLight light, Vec4D point, Vec4D eye, Vec4D normal, int in_shadow) {
+    Color ambient, diffuse, specular;
 
     // Combine the surface color with the light's color/intensity
-    Color effective_color = color_hadamard(color, light.intensity);
+    Color intensity = point_light_intensity_at(&light, point);
+    Color effective_color = color_hadamard(color, intensity);
     
     // Find the direction to the light source
     Vec4D lightv = d4_norm(d4_sub(light.position, point));
 
     // Compute ambient contribution
-    ambient = color_mul(effective_color, object.material.ambient);
+    ambient = color_mul(effective_color, material->ambient);
 
     if (in_shadow) {
         return ambient;
@@ -25,7 +84,7 @@ Color lighting_compute(Shape object, PointLight light, Vec4D point, Vec4D eye, V
         diffuse = color_black();
         specular = color_black();
     } else {
-        diffuse = color_mul(effective_color, object.material.diffuse * light_dot_normal);
+        diffuse = color_mul(effective_color, material->diffuse * light_dot_normal);
 
         Vec4D reflectv = d4_reflect(d4_neg(lightv), normal);
         double reflect_dot_eye = d4_dot(eye, reflectv);
@@ -33,8 +92,8 @@ Color lighting_compute(Shape object, PointLight light, Vec4D point, Vec4D eye, V
         if (reflect_dot_eye <= 0.0) {
             specular = color_black();
         } else {
-            double factor = pow(reflect_dot_eye, object.material.shininess);
-            specular = color_mul(light.intensity, object.material.specular * factor);
+            double factor = pow(reflect_dot_eye, material->shininess);
+            specular = color_mul(intensity, material->specular * factor);
         }
     }
 
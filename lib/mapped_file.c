@@ -0,0 +1,68 @@
+#define _DEFAULT_SOURCE  // For mmap on Unix
+#define WIN32_LEAN_AND_MEAN
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <mapped_file.h>
+
+int mapped_file_open(const char *path, MappedFile *out) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+        return 1;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    void *data = mapping != NULL ? MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0) : NULL;
+    if (data == NULL) {
+        if (mapping != NULL) {
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+        return 1;
+    }
+    *out = (MappedFile) { data, (size_t)size.QuadPart, file, mapping };
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);  // The mapping keeps the file open
+    if (data == MAP_FAILED) {
+        return 1;
+    }
+    *out = (MappedFile) { data, size };
+#endif
+    return 0;
+}
+
+void mapped_file_close(MappedFile *file) {
+    if (file->data == NULL) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(file->data);
+    CloseHandle(file->mapping);
+    CloseHandle(file->file);
+#else
+    munmap(file->data, file->size);
+#endif
+    *file = (MappedFile) { 0 };
+}
@@ -0,0 +1,219 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mesh.h>
+
+// Deeper than any tree bvh_build makes, since each level pushes at most one node
+#define MESH_STACK_SIZE 64
+
+static void _triangle_bounds(const Mesh *mesh, size_t triangle, Aabb *out) {
+    *out = aabb_empty();
+    for (int i = 0; i < 3; i++) {
+        const float *p = &mesh->positions[3 * mesh->indices[3 * triangle + i]];
+        Aabb point = { { p[0], p[1], p[2] }, { p[0], p[1], p[2] } };
+        aabb_extend(out, &point);
+    }
+}
+
+Mesh *mesh_create(float *positions, float *normals, size_t vertex_count, uint32_t *indices, size_t triangle_count) {
+    Mesh *mesh = calloc(1, sizeof(Mesh));
+    Aabb *bounds = malloc((triangle_count > 0 ? triangle_count : 1) * sizeof(Aabb));
+    uint32_t *ids = malloc((triangle_count > 0 ? triangle_count : 1) * sizeof(uint32_t));
+    if (mesh == NULL || bounds == NULL || ids == NULL) {
+        free(mesh);
+        free(bounds);
+        free(ids);
+        free(positions);
+        free(normals);
+        free(indices);
+        return NULL;
+    }
+    *mesh = (Mesh) { vertex_count, triangle_count, positions, normals, indices, { 0 }, aabb_empty() };
+
+    for (size_t i = 0; i < triangle_count; i++) {
+        _triangle_bounds(mesh, i, &bounds[i]);
+        aabb_extend(&mesh->bounds, &bounds[i]);
+        ids[i] = (uint32_t)i;
+    }
+    int err = bvh_build(&mesh->bvh, bounds, ids, triangle_count);
+    free(bounds);
+    if (err) {
+        free(ids);
+        mesh_destroy(mesh);
+        return NULL;
+    }
+
+    // Store the triangles in the order of the BVH's leaves, so that those tested together are together in
+    // memory, and the BVH can index them directly
+    uint32_t *ordered = triangle_count > 0 ? malloc(3 * triangle_count * sizeof(uint32_t)) : NULL;
+    if (ordered != NULL) {
+        for (size_t i = 0; i < triangle_count; i++) {
+            memcpy(&ordered[3 * i], &indices[3 * mesh->bvh.indices[i]], 3 * sizeof(uint32_t));
+            mesh->bvh.indices[i] = (uint32_t)i;
+        }
+        free(indices);
+        mesh->indices = ordered;
+    }
+    free(ids);
+    return mesh;
+}
+
+void mesh_destroy(Mesh *mesh) {
+    if (mesh == NULL) {
+        return;
+    }
+    free(mesh->positions);
+    free(mesh->normals);
+    free(mesh->indices);
+    bvh_free(&mesh->bvh);
+    free(mesh);
+}
+
+/* Watertight ray-triangle intersection, after Woop, Benthin and Wald, "Watertight Ray/Triangle
+Intersection" (JCGT 2013). The ray is made the z axis of a sheared coordinate system, in which each of
+the triangle's edges is tested against the origin by a 2D edge function. A point on an edge shared by two
+triangles gets the same edge function value, with opposite signs, from both, so it counts as inside at
+least one of them. */
+
+typedef struct {
+    double origin[3];
+    AabbRay box;              // For the bounding box tests
+    int kx, ky, kz;           // Axes of the sheared space: kz is the direction's largest component
+    double sx, sy, sz;        // Shear that maps the direction onto the z axis
+} TriangleRay;
+
+static TriangleRay _triangle_ray(Vec4D origin, Vec4D direction) {
+    double d[3] = { direction.x, direction.y, direction.z };
+    TriangleRay r = { { origin.x, origin.y, origin.z }, aabb_ray_new(origin, direction), 0, 0, 0, 0.0, 0.0, 0.0 };
+    r.kz = fabs(d[0]) > fabs(d[1]) ? (fabs(d[0]) > fabs(d[2]) ? 0 : 2) : (fabs(d[1]) > fabs(d[2]) ? 1 : 2);
+    r.kx = (r.kz + 1) % 3;
+    r.ky = (r.kx + 1) % 3;
+    if (d[r.kz] < 0.0) {
+        // Keep the triangles' winding the same in the sheared space
+        int tmp = r.kx;
+        r.kx = r.ky;
+        r.ky = tmp;
+    }
+    r.sx = d[r.kx] / d[r.kz];
+    r.sy = d[r.ky] / d[r.kz];
+    r.sz = 1.0 / d[r.kz];
+    return r;
+}
+
+/// @brief Returns the distance to `triangle` if the ray hits it between 0 and `tmax`, or INFINITY.
+static double _intersect_triangle(const TriangleRay *r, const Mesh *mesh, uint32_t triangle, double tmax, double *out_u, double *out_v) {
+    const uint32_t *index = &mesh->indices[3 * triangle];
+    double local[3][3];
+    for (int i = 0; i < 3; i++) {
+        const float *p = &mesh->positions[3 * index[i]];
+        local[i][0] = p[r->kx] - r->origin[r->kx];
+        local[i][1] = p[r->ky] - r->origin[r->ky];
+        local[i][2] = p[r->kz] - r->origin[r->kz];
+    }
+    double ax = local[0][0] - r->sx * local[0][2];
+    double ay = local[0][1] - r->sy * local[0][2];
+    double bx = local[1][0] - r->sx * local[1][2];
+    double by = local[1][1] - r->sy * local[1][2];
+    double cx = local[2][0] - r->sx * local[2][2];
+    double cy = local[2][1] - r->sy * local[2][2];
+
+    // Edge functions, which are each twice the signed area of the triangle between the ray and an edge
+    double u = cx * by - cy * bx;
+    double v = ax * cy - ay * cx;
+    double w = bx * ay - by * ax;
+    if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0)) {
+        return INFINITY;
+    }
+    double det = u + v + w;
+    if (det == 0.0) {
+        return INFINITY;
+    }
+
+    double t = (u * local[0][2] + v * local[1][2] + w * local[2][2]) * r->sz / det;
+    if (!(t > 0.0 && t < tmax)) {
+        return INFINITY;
+    }
+    *out_u = v / det;
+    *out_v = w / det;
+    return t;
+}
+
+double mesh_intersect(const Mesh *mesh, Vec4D origin, Vec4D direction, double tmax, uint32_t *out_triangle, double *out_u, double *out_v) {
+    const Bvh *bvh = &mesh->bvh;
+    if (bvh->node_count == 0) {
+        return INFINITY;
+    }
+    TriangleRay r = _triangle_ray(origin, direction);
+    double best = tmax;
+    const BvhNode *nodes = bvh->nodes;
+    uint32_t stack[MESH_STACK_SIZE];
+    int top = 0;
+    if (aabb_ray_entry(&nodes[0].bounds, &r.box, best) < INFINITY) {
+        stack[top++] = 0;
+    }
+    while (top > 0) {
+        const BvhNode *node = &nodes[stack[--top]];
+        if (node->count > 0) {
+            for (uint32_t i = node->first; i < node->first + node->count; i++) {
+                uint32_t triangle = bvh->indices[i];
+                double u = 0.0, v = 0.0;
+                double t = _intersect_triangle(&r, mesh, triangle, best, &u, &v);
+                if (t < best) {
+                    best = t;
+                    *out_triangle = triangle;
+                    *out_u = u;
+                    *out_v = v;
+                }
+            }
+            continue;
+        }
+
+        // Visit the nearer child first, so that hits in it cull the farther one
+        uint32_t near = node->first;
+        uint32_t far = node->first + 1;
+        double t_near = aabb_ray_entry(&nodes[near].bounds, &r.box, best);
+        double t_far = aabb_ray_entry(&nodes[far].bounds, &r.box, best);
+        if (t_far < t_near) {
+            uint32_t tmp = near;
+            near = far;
+            far = tmp;
+            double tmp_t = t_near;
+            t_near = t_far;
+            t_far = tmp_t;
+        }
+        if (t_far < INFINITY) {
+            stack[top++] = far;
+        }
+        if (t_near < INFINITY) {
+            stack[top++] = near;
+        }
+    }
+    return best < tmax ? best : INFINITY;
+}
+
+Vec4D mesh_normal(const Mesh *mesh, uint32_t triangle, double u, double v) {
+    const uint32_t *index = &mesh->indices[3 * triangle];
+    if (mesh->normals != NULL) {
+        const float *n0 = &mesh->normals[3 * index[0]];
+        const float *n1 = &mesh->normals[3 * index[1]];
+        const float *n2 = &mesh->normals[3 * index[2]];
+        double w = 1.0 - u - v;
+        Vec4D n = d4_vector(
+            w * n0[0] + u * n1[0] + v * n2[0],
+            w * n0[1] + u * n1[1] + v * n2[1],
+            w * n0[2] + u * n1[2] + v * n2[2]
+        );
+        // Vertices without a normal in the file have a zero one, so fall back to the face normal
+        if (d4_dot(n, n) > 0.0) {
+            return n;
+        }
+    }
+
+    const float *p0 = &mesh->positions[3 * index[0]];
+    const float *p1 = &mesh->positions[3 * index[1]];
+    const float *p2 = &mesh->positions[3 * index[2]];
+    Vec4D e1 = d4_vector(p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]);
+    Vec4D e2 = d4_vector(p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]);
+    return d4_cross(e1, e2);
+}
@@ -0,0 +1,345 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mesh.h>
+#include <text.h>
+
+/* Streaming Wavefront OBJ reader. Positions and faces are appended to their final arrays as they are
+read, so besides the mesh itself only one chunk of the file is held in memory, along with the normals and
+each corner's normal index when the file has normals. Those are only needed to pair positions with
+normals, which OBJ indexes separately, and are freed once the vertices are built. */
+
+// Marks a face corner without a normal
+#define NO_NORMAL UINT32_MAX
+
+typedef struct {
+    const char *path;
+    int line;
+    float *positions;            // Three per position, as read
+    size_t position_count;
+    size_t position_capacity;
+    float *normals;              // Three per normal, as read
+    size_t normal_count;
+    size_t normal_capacity;
+    uint32_t *corners;           // Position of each corner of each triangle
+    size_t corner_count;
+    size_t corner_capacity;
+    uint32_t *corner_normals;    // Normal of each corner, or NO_NORMAL. NULL until a face has normals.
+    size_t corner_normal_capacity;
+} ObjReader;
+
+static int _error(ObjReader *r, const char *format, ...) {
+    fprintf(stderr, "%s:%d: ", r->path, r->line);
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+    return 1;
+}
+
+/// @brief Makes room for at least `count` elements of `size` bytes in `*array`, doubling its capacity as
+/// needed. Returns 0 on success.
+static int _reserve(void **array, size_t *capacity, size_t count, size_t size) {
+    if (count <= *capacity) {
+        return 0;
+    }
+    size_t new_capacity = *capacity ? *capacity : 1024;
+    while (new_capacity < count) {
+        new_capacity *= 2;
+    }
+    void *grown = realloc(*array, new_capacity * size);
+    if (grown == NULL) {
+        return 1;
+    }
+    *array = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+static const char *_skip_spaces(const char *s, const char *end) {
+    while (s < end && (*s == ' ' || *s == '\t')) {
+        s++;
+    }
+    return s;
+}
+
+/// @brief Reads three numbers from [s, end) onto the end of `*array`.
+static int _read_triple(ObjReader *r, const char *s, const char *end, float **array, size_t *count, size_t *capacity) {
+    if (*count >= UINT32_MAX || _reserve((void **)array, capacity, *count + 1, 3 * sizeof(float))) {
+        return _error(r, "too many vertices");
+    }
+    float *out = &(*array)[3 * *count];
+    for (int i = 0; i < 3; i++) {
+        double value;
+        s = _skip_spaces(s, end);
+        s = text_parse_double(s, end, &value);
+        if (s == NULL) {
+            return _error(r, "expected three numbers");
+        }
+        out[i] = (float)value;
+    }
+    (*count)++;
+    return 0;
+}
+
+/// @brief Parses a 1-based or negative, relative OBJ index into a 0-based one below `count`. Returns a
+/// pointer past it, or NULL.
+static const char *_parse_index(const char *s, const char *end, size_t count, uint32_t *out) {
+    int negative = s < end && *s == '-';
+    s += negative;
+    if (s == end || *s < '0' || *s > '9') {
+        return NULL;
+    }
+    uint64_t value = 0;
+    for (; s < end && *s >= '0' && *s <= '9'; s++) {
+        value = 10 * value + (uint64_t)(*s - '0');
+        if (value > count) {
+            return NULL;
+        }
+    }
+    if (value == 0) {
+        return NULL;
+    }
+    *out = (uint32_t)(negative ? count - value : value - 1);
+    return s;
+}
+
+static int _add_corner(ObjReader *r, uint32_t position, uint32_t normal) {
+    if (_reserve((void **)&r->corners, &r->corner_capacity, r->corner_count + 1, sizeof(uint32_t))) {
+        return _error(r, "out of memory");
+    }
+    if (normal != NO_NORMAL && r->corner_normals == NULL) {
+        // The first corner with a normal: every corner before it had none
+        r->corner_normals = malloc(r->corner_capacity * sizeof(uint32_t));
+        if (r->corner_normals == NULL) {
+            return _error(r, "out of memory");
+        }
+        r->corner_normal_capacity = r->corner_capacity;
+        for (size_t i = 0; i < r->corner_count; i++) {
+            r->corner_normals[i] = NO_NORMAL;
+        }
+    }
+    if (r->corner_normals != NULL) {
+        if (_reserve((void **)&r->corner_normals, &r->corner_normal_capacity, r->corner_count + 1, sizeof(uint32_t))) {
+            return _error(r, "out of memory");
+        }
+        r->corner_normals[r->corner_count] = normal;
+    }
+    r->corners[r->corner_count++] = position;
+    return 0;
+}
+
+/// @brief Reads a face of any number of vertices, each written "p", "p/t", "p/t/n" or "p//n", and adds
+/// it as a fan of triangles around its first vertex.
+static int _read_face(ObjReader *r, const char *s, const char *end) {
+    uint32_t first[2] = { 0, 0 };
+    uint32_t previous[2] = { 0, 0 };
+    int count = 0;
+    while ((s = _skip_spaces(s, end)) < end) {
+        uint32_t position;
+        uint32_t normal = NO_NORMAL;
+        uint32_t unused;
+        s = _parse_index(s, end, r->position_count, &position);
+        if (s != NULL && s < end && *s == '/') {
+            s++;
+            if (s < end && *s != '/') {
+                // Texture coordinates are not used, so are only checked to be an index
+                s = _parse_index(s, end, SIZE_MAX, &unused);
+            }
+            if (s != NULL && s < end && *s == '/') {
+                s = _parse_index(s + 1, end, r->normal_count, &normal);
+            }
+        }
+        if (s == NULL || (s < end && *s != ' ' && *s != '\t')) {
+            return _error(r, "invalid face vertex, or one that refers to a vertex not yet defined");
+        }
+
+        uint32_t vertex[2] = { position, normal };
+        if (count >= 2) {
+            if (_add_corner(r, first[0], first[1]) || _add_corner(r, previous[0], previous[1]) || _add_corner(r, vertex[0], vertex[1])) {
+                return 1;
+            }
+        } else if (count == 0) {
+            memcpy(first, vertex, sizeof(vertex));
+        }
+        memcpy(previous, vertex, sizeof(vertex));
+        count++;
+    }
+    if (count < 3) {
+        return _error(r, "faces need at least three vertices");
+    }
+    if (r->corner_count / 3 >= UINT32_MAX) {
+        return _error(r, "too many triangles");
+    }
+    return 0;
+}
+
+static int _read_line(void *user, const char *begin, const char *end) {
+    ObjReader *r = user;
+    r->line++;
+    const char *s = _skip_spaces(begin, end);
+    if (end - s < 2 || (s[1] != ' ' && s[1] != '\t' && s[1] != 'n')) {
+        // Blank lines, comments, and statements such as "o", "g" or "usemtl" that do not affect the shape
+        return 0;
+    }
+    if (s[0] == 'v' && s[1] != 'n') {
+        return _read_triple(r, s + 2, end, &r->positions, &r->position_count, &r->position_capacity);
+    } else if (s[0] == 'v' && end - s > 2 && (s[2] == ' ' || s[2] == '\t')) {
+        return _read_triple(r, s + 3, end, &r->normals, &r->normal_count, &r->normal_capacity);
+    } else if (s[0] == 'f' && s[1] != 'n') {
+        return _read_face(r, s + 2, end);
+    }
+    return 0;
+}
+
+static void _normalize(float *n) {
+    float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    if (length > 0.0f) {
+        n[0] /= length;
+        n[1] /= length;
+        n[2] /= length;
+    }
+}
+
+/// @brief Returns each vertex's area-weighted average of the normals of the triangles around it.
+static float *_smooth_normals(const float *positions, size_t vertex_count, const uint32_t *indices, size_t triangle_count) {
+    float *normals = calloc(3 * (vertex_count > 0 ? vertex_count : 1), sizeof(float));
+    if (normals == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < triangle_count; i++) {
+        const float *p0 = &positions[3 * indices[3 * i]];
+        const float *p1 = &positions[3 * indices[3 * i + 1]];
+        const float *p2 = &positions[3 * indices[3 * i + 2]];
+        float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+        float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+        // The cross product's length is twice the triangle's area, which weights it
+        float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+        for (int j = 0; j < 3; j++) {
+            float *out = &normals[3 * indices[3 * i + j]];
+            out[0] += n[0];
+            out[1] += n[1];
+            out[2] += n[2];
+        }
+    }
+    for (size_t i = 0; i < vertex_count; i++) {
+        _normalize(&normals[3 * i]);
+    }
+    return normals;
+}
+
+/// @brief Replaces the positions and normals read with one vertex per distinct pair of position and normal
+/// used by a corner, and points the corners at those. Returns 0 on success.
+static int _pair_normals(ObjReader *r, float **out_positions, float **out_normals, size_t *out_vertex_count) {
+    // Open addressing hash table from (position, normal) to vertex, at most half full
+    size_t capacity = 64;
+    while (capacity < 2 * r->corner_count) {
+        capacity *= 2;
+    }
+    uint64_t *keys = malloc(capacity * sizeof(uint64_t));
+    uint32_t *vertices = malloc(capacity * sizeof(uint32_t));
+    size_t max_vertices = r->corner_count > 0 ? r->corner_count : 1;
+    float *positions = malloc(3 * max_vertices * sizeof(float));
+    float *normals = malloc(3 * max_vertices * sizeof(float));
+    if (keys == NULL || vertices == NULL || positions == NULL || normals == NULL) {
+        free(keys);
+        free(vertices);
+        free(positions);
+        free(normals);
+        return 1;
+    }
+    memset(keys, 0xff, capacity * sizeof(uint64_t));
+
+    size_t vertex_count = 0;
+    for (size_t i = 0; i < r->corner_count; i++) {
+        uint32_t position = r->corners[i];
+        uint32_t normal = r->corner_normals[i];
+        uint64_t key = ((uint64_t)position << 32) | normal;
+        size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (capacity - 1);
+        while (keys[slot] != UINT64_MAX && keys[slot] != key) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (keys[slot] == UINT64_MAX) {
+            keys[slot] = key;
+            vertices[slot] = (uint32_t)vertex_count;
+            memcpy(&positions[3 * vertex_count], &r->positions[3 * position], 3 * sizeof(float));
+            float *n = &normals[3 * vertex_count];
+            if (normal == NO_NORMAL) {
+                n[0] = n[1] = n[2] = 0.0f;
+            } else {
+                memcpy(n, &r->normals[3 * normal], 3 * sizeof(float));
+                _normalize(n);
+            }
+            vertex_count++;
+        }
+        r->corners[i] = vertices[slot];
+    }
+    free(keys);
+    free(vertices);
+
+    // Give back the space reserved for vertices that turned out to be shared
+    float *shrunk = realloc(positions, 3 * (vertex_count > 0 ? vertex_count : 1) * sizeof(float));
+    *out_positions = shrunk != NULL ? shrunk : positions;
+    shrunk = realloc(normals, 3 * (vertex_count > 0 ? vertex_count : 1) * sizeof(float));
+    *out_normals = shrunk != NULL ? shrunk : normals;
+    *out_vertex_count = vertex_count;
+    return 0;
+}
+
+Mesh *mesh_load_obj(const char *path, int smooth) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open OBJ file %s\n", path);
+        return NULL;
+    }
+    ObjReader r = { 0 };
+    r.path = path;
+    int err = text_for_each_line(fp, _read_line, &r);
+    if (err < 0 && ferror(fp)) {
+        err = _error(&r, "failed to read file");
+    } else if (err < 0) {
+        r.line++;
+        err = _error(&r, "line is too long");
+    }
+    fclose(fp);
+
+    float *positions = NULL;
+    float *normals = NULL;
+    size_t vertex_count = 0;
+    if (!err && r.corner_normals != NULL) {
+        if (_pair_normals(&r, &positions, &normals, &vertex_count)) {
+            err = _error(&r, "out of memory");
+        }
+        free(r.positions);
+    } else if (!err) {
+        positions = r.positions;
+        vertex_count = r.position_count;
+        if (smooth) {
+            normals = _smooth_normals(positions, vertex_count, r.corners, r.corner_count / 3);
+            if (normals == NULL) {
+                err = _error(&r, "out of memory");
+            }
+        }
+    } else {
+        free(r.positions);
+    }
+    free(r.normals);
+    free(r.corner_normals);
+    if (err) {
+        free(positions);
+        free(normals);
+        free(r.corners);
+        return NULL;
+    }
+
+    Mesh *mesh = mesh_create(positions, normals, vertex_count, r.corners, r.corner_count / 3);
+    if (mesh == NULL) {
+        fprintf(stderr, "Failed to build mesh from %s\n", path);
+    }
+    return mesh;
+}
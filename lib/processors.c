@@ -0,0 +1,21 @@
+#define _DEFAULT_SOURCE  // For sysconf on Unix
+#define WIN32_LEAN_AND_MEAN
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <processors.h>
+
+int cpu_count() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
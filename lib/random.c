@@ -1,8 +1,11 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include <random.h>
+
 /* Simple random number generation module, loosely based on Python's interface.
-It is NOT threadsafe and NOT cryptographically secure and probably does NOT generate perfectly uniform distributions. */
+random_double and random_uniform are NOT threadsafe, and none of it is cryptographically secure or probably
+generates perfectly uniform distributions. */
 
 static int _initialized = 0;
 
@@ -27,4 +30,14 @@ double random_uniform(double a, double b) {
     double min = a < b ? a : b;
     double max = a < b ? b : a;
     return min + (max - min) * random_double();
-}
\ No newline at end of file
+}
+
+/* Returns the next number in the range 0.0 <= X < 1.0 of the splitmix64 sequence at `state`, and advances it.
+Threads that each keep their own state can call it at once. */
+double random_next(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    return (z >> 11) * (1.0 / 9007199254740992.0);
+}
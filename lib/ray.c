@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -8,50 +9,125 @@
 #include <vector.h>
 #include <ray.h>
 #include <shape.h>
+#include <group.h>
 #include <random.h>
 
-const size_t BASE_INTERSECTION_COUNT = 4;
+// What a ray that hits nothing finds
+static const Intersection NO_HIT = { INFINITY, NULL, 0, 0.0, 0.0, NULL, 0 };
 
-/// Creates a new, dynamically sized, always-sorted, insert-only list of intersections
-IntersectionList intersection_list_new() {
-    Intersection *ptr = malloc(BASE_INTERSECTION_COUNT * sizeof(Intersection));
-    return (IntersectionList) { 0, BASE_INTERSECTION_COUNT, ptr};
+// Intersections in the first chunk of a thread's arena. Each chunk after it is twice the size of the last.
+#define ARENA_FIRST_CHUNK 256
+// Lists longer than this are sorted by qsort rather than by insertion
+#define INSERTION_SORT_MAX 32
+
+/// Part of a thread's arena. Blocks are taken from each chunk in turn.
+typedef struct IntersectionChunk {
+    struct IntersectionChunk *next;
+    size_t capacity;
+    Intersection items[];
+} IntersectionChunk;
+
+typedef struct {
+    IntersectionChunk *first;
+    IntersectionChunk *current;   // Where blocks are taken from, or NULL before any are
+    size_t used;                  // Of the current chunk
+} IntersectionArena;
+
+static _Thread_local IntersectionArena _arena;
+
+/// @brief Takes a block of `count` intersections from the thread's arena, moving on to the next chunk, or
+/// adding one, if the current chunk is full. Returns NULL if out of memory.
+static Intersection *_arena_take(size_t count) {
+    IntersectionArena *a = &_arena;
+    if (a->current != NULL && a->current->capacity - a->used >= count) {
+        a->used += count;
+        return &a->current->items[a->used - count];
+    }
+    size_t capacity = a->current != NULL ? 2 * a->current->capacity : ARENA_FIRST_CHUNK;
+    IntersectionChunk **link = a->current != NULL ? &a->current->next : &a->first;
+    while (*link != NULL && (*link)->capacity < count) {
+        capacity = 2 * (*link)->capacity;
+        link = &(*link)->next;
+    }
+    if (*link == NULL) {
+        capacity = capacity > count ? capacity : count;
+        *link = malloc(sizeof(IntersectionChunk) + capacity * sizeof(Intersection));
+        if (*link == NULL) {
+            return NULL;
+        }
+        (*link)->next = NULL;
+        (*link)->capacity = capacity;
+    }
+    a->current = *link;
+    a->used = count;
+    return a->current->items;
+}
+
+void intersection_list_init(IntersectionList *xs) {
+    xs->count = 0;
+    xs->capacity = INTERSECTION_LIST_LOCAL;
+    xs->items = xs->local;
+    xs->arena_chunk = _arena.current;
+    xs->arena_used = _arena.used;
 }
 
 void intersection_list_free(IntersectionList *xs) {
-    free(xs->items);
+    _arena.current = xs->arena_chunk;
+    _arena.used = xs->arena_used;
 }
 
-int intersection_list_add(IntersectionList *xs, Intersection x)
-{
-    // Allocate additional memory if required
-    if (xs->count >= xs->capacity) {
-        xs->capacity *= 2;
-        xs->items = realloc(xs->items, xs->capacity * sizeof(Intersection));
-        if (!xs->items) {
-            fprintf(stderr, "Out of memory!\n");
-            exit(1);
+void intersection_list_add(IntersectionList *xs, Intersection x) {
+    if (xs->count == xs->capacity) {
+        IntersectionArena *a = &_arena;
+        size_t capacity = 2 * xs->capacity;
+        if (xs->items != xs->local && xs->items + xs->capacity == &a->current->items[a->used]
+            && a->current->capacity - a->used >= capacity - xs->capacity) {
+            // The list's block is the last one taken, so it grows in place
+            a->used += capacity - xs->capacity;
+        } else {
+            Intersection *items = _arena_take(capacity);
+            if (items == NULL) {
+                fprintf(stderr, "Out of memory!\n");
+                exit(1);
+            }
+            memcpy(items, xs->items, xs->count * sizeof(Intersection));
+            xs->items = items;
         }
+        xs->capacity = capacity;
     }
+    xs->items[xs->count++] = x;
+}
 
-    // Find the appropriate position for the intersection: t-values must be increasing.
-    // OPT: A binary search for the correct insertion point may be more efficient when array gets large.
-    size_t home = xs->count;
-    for (size_t i = 0; i < xs->count; i++) {
-        if (xs->items[i].t >= x.t) {
-            home = i;
-            break;
+static int _compare_t(const void *a, const void *b) {
+    double ta = ((const Intersection *)a)->t;
+    double tb = ((const Intersection *)b)->t;
+    return (ta > tb) - (ta < tb);
+}
+
+void intersection_list_sort(IntersectionList *xs, size_t first, size_t count) {
+    Intersection *items = &xs->items[first];
+    if (count > INSERTION_SORT_MAX) {
+        qsort(items, count, sizeof(Intersection), _compare_t);
+        return;
+    }
+    for (size_t i = 1; i < count; i++) {
+        Intersection x = items[i];
+        size_t j = i;
+        for (; j > 0 && items[j - 1].t > x.t; j--) {
+            items[j] = items[j - 1];
         }
+        items[j] = x;
     }
+}
 
-    // Shift everything at home or to its right one step to the right to make room for the new item.
-    for (size_t i = xs->count; i > home; i--) {
-        xs->items[i] = xs->items[i - 1];
+void intersection_arena_free() {
+    IntersectionChunk *chunk = _arena.first;
+    while (chunk != NULL) {
+        IntersectionChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
-
-    xs->items[home] = x;
-    xs->count += 1;
-    return 0;
+    _arena = (IntersectionArena) { 0 };
 }
 
 Ray _ray_at_fractional_pixel(Camera camera, double px, double py)
@@ -74,8 +150,10 @@ Ray _ray_at_fractional_pixel(Camera camera, double px, double py)
     return (Ray){ origin, direction };
 }
 
-Ray random_ray_within_pixel(Camera camera, int px, int py) {
-    return _ray_at_fractional_pixel(camera, px + random_double(), py + random_double());
+Ray random_ray_within_pixel(Camera camera, int px, int py, uint64_t *state) {
+    double dx = random_next(state);
+    double dy = random_next(state);
+    return _ray_at_fractional_pixel(camera, px + dx, py + dy);
 }
 
 Ray ray_at_pixel(Camera camera, int px, int py)
@@ -97,7 +175,22 @@ Vec4D ray_position(Ray ray, double t)
     return result;
 }
 
-double ray_intersect_sphere(Ray ray) {
+/// @brief Returns the smallest non-negative of the `count` t-values, or INFINITY if there is none.
+static double _nearest(const double *t, int count) {
+    double best = INFINITY;
+    for (int i = 0; i < count; i++) {
+        if (t[i] >= 0.0 && t[i] < best) {
+            best = t[i];
+        }
+    }
+    return best;
+}
+
+// The _roots functions write every t-value at which an object-space ray crosses a shape's surface, behind
+// its origin as well as in front, and return how many there are. CSG shapes need them all, and other
+// shapes the nearest in front.
+
+static int _sphere_roots(Ray ray, double *t) {
     // Vector from sphere's centre to ray origin
     Vec4D sphere_to_ray = d4_sub(ray.origin, d4_point(0., 0., 0.));
 
@@ -108,30 +201,31 @@ double ray_intersect_sphere(Ray ray) {
     double discriminant = b * b - 4 * a * c;
 
     if (discriminant < 0) {
-        return INFINITY;
+        return 0;
     }
 
     double root = sqrt(discriminant);
-    double t1 = (-b - root) / (2 * a);
-    double t2 = (-b + root) / (2 * a);
+    t[0] = (-b - root) / (2 * a);
+    t[1] = (-b + root) / (2 * a);
+    return 2;
+}
 
-    double tmin = fmin(t1, t2);
-    double tmax = fmax(t1, t2);
-    if (tmin >= 0.0) {
-        return tmin;
-    } else if (tmax >= 0.0) {
-        return tmax;
-    }
-    return INFINITY;
+double ray_intersect_sphere(Ray ray) {
+    double t[2];
+    return _nearest(t, _sphere_roots(ray, t));
 }
 
-double ray_intersect_plane(Ray ray) {
+static int _plane_roots(Ray ray, double *t) {
     if (fabs(ray.direction.y) < EPSILON) {
-        return INFINITY;
+        return 0;
     }
+    t[0] = -ray.origin.y / ray.direction.y;
+    return 1;
+}
 
-    double t = -ray.origin.y / ray.direction.y;
-    return t >= 0.0 ? t : INFINITY;
+double ray_intersect_plane(Ray ray) {
+    double t[1];
+    return _nearest(t, _plane_roots(ray, t));
 }
 
 /// @brief Computes the smaller and larger t-values at which a ray will intersect the -1 and +1
@@ -159,7 +253,7 @@ void _cube_check_axis(double origin, double direction, double *tmin, double *tma
     }
 }
 
-double ray_intersect_cube(Ray ray) {
+static int _cube_roots(Ray ray, double *t) {
     double xtmin, xtmax, ytmin, ytmax, ztmin, ztmax;
     _cube_check_axis(ray.origin.x, ray.direction.x, &xtmin, &xtmax);
     _cube_check_axis(ray.origin.y, ray.direction.y, &ytmin, &ytmax);
@@ -169,52 +263,67 @@ double ray_intersect_cube(Ray ray) {
     double tmax = fmin(fmin(xtmax, ytmax), ztmax);
 
     if (tmin > tmax) {
-        return INFINITY;
+        return 0;
     }
+    t[0] = tmin;
+    t[1] = tmax;
+    return 2;
+}
 
-    if (tmin >= 0.0) {
-        return tmin;
-    } else if (tmax >= 0.0) {
-        return tmax;
-    }
-    return INFINITY;
+double ray_intersect_cube(Ray ray) {
+    double t[2];
+    return _nearest(t, _cube_roots(ray, t));
 }
 
-/// @brief Checks whether the intersection at `t` is within a radius of 1 from the y axis
-int _check_cap(Ray ray, double t) {
+/// @brief Checks whether the intersection at `t` is within `radius` of the y axis
+int _check_cap(Ray ray, double t, double radius) {
     double x = ray.origin.x + t * ray.direction.x;
     double z = ray.origin.z + t * ray.direction.z;
-    return (pow(x, 2.0) + pow(z, 2.0)) <= 1.0;
+    return (pow(x, 2.0) + pow(z, 2.0)) <= pow(radius, 2.0);
 }
 
-/// @brief Returns the smallest non-negative t-value where the ray intersects with the given
-/// cylinder's end caps, or INFINITY if there is no such intersection.
-double _ray_intersect_cylinder_cap(Ray ray, Shape *cylinder) {
+/// @brief Finds where the ray crosses the end caps of the given cylinder or cone, if it is closed.
+static int _cap_roots(Ray ray, Shape *cylinder, double *t) {
     if (!cylinder->closed || fabs(ray.direction.y) < EPSILON) {
-        return INFINITY;
+        return 0;
     }
+    // A cone's radius at each cap is the cap's distance from its apex
+    int cone = cylinder->type == SHAPE_CONE;
+    int n = 0;
 
     // Check lower end cap by intersecting ray with plane at y = cyl.minimum
     double tlower = (cylinder->ymin - ray.origin.y) / ray.direction.y;
-    if (tlower < 0.0 || !_check_cap(ray, tlower)) { 
-        tlower = INFINITY;
+    if (_check_cap(ray, tlower, cone ? fabs(cylinder->ymin) : 1.0)) {
+        t[n++] = tlower;
     }
 
     // Check upper end cap by intersecting ray with plane at y = cyl.maximum
     double tupper = (cylinder->ymax - ray.origin.y) / ray.direction.y;
-    if (tupper < 0.0 || !_check_cap(ray, tupper)) {
-        tupper = INFINITY;
+    if (_check_cap(ray, tupper, cone ? fabs(cylinder->ymax) : 1.0)) {
+        t[n++] = tupper;
     }
+    return n;
+}
 
-    return fmin(tlower, tupper);
+/// @brief Keeps those of the `count` t-values at which the ray is between the shape's min and max, moving
+/// them to the front of `t`, and returns how many there are.
+static int _between_caps(Ray ray, const Shape *shape, double *t, int count) {
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        double y = ray.origin.y + t[i] * ray.direction.y;
+        if (y > shape->ymin && y < shape->ymax) {
+            t[n++] = t[i];
+        }
+    }
+    return n;
 }
 
-double _ray_intersect_cylinder_side(Ray ray, Shape *cylinder) {
+static int _cylinder_side_roots(Ray ray, Shape *cylinder, double *t) {
     double a = pow(ray.direction.x, 2.0) + pow(ray.direction.z, 2.0);
 
     if (fabs(a) < EPSILON) {
         // Ray is parallel to the y axis
-        return INFINITY;
+        return 0;
     }
 
     double b = 2.0 * ray.origin.x * ray.direction.x + 2.0 * ray.origin.z * ray.direction.z;
@@ -223,53 +332,476 @@ double _ray_intersect_cylinder_side(Ray ray, Shape *cylinder) {
 
     if (disc < 0.0) {
         // Ray does not intersect the cylinder
-        return INFINITY;
+        return 0;
     }
 
-    double t0 = (-b - sqrt(disc)) / (2.0 * a);
-    double t1 = (-b + sqrt(disc)) / (2.0 * a);
+    t[0] = (-b - sqrt(disc)) / (2.0 * a);
+    t[1] = (-b + sqrt(disc)) / (2.0 * a);
+    return _between_caps(ray, cylinder, t, 2);
+}
+
+static int _cylinder_roots(Ray ray, Shape *cylinder, double *t) {
+    int n = _cylinder_side_roots(ray, cylinder, t);
+    return n + _cap_roots(ray, cylinder, t + n);
+}
+
+double ray_intersect_cylinder(Ray ray, Shape *cylinder) {
+    double t[4];
+    return _nearest(t, _cylinder_roots(ray, cylinder, t));
+}
 
-    double tmin = fmin(t0, t1);
-    double y0 = ray.origin.y + tmin * ray.direction.y;
-    if (tmin >= 0.0 && y0 > cylinder->ymin && y0 < cylinder->ymax) {
-        return tmin;
+static int _cone_side_roots(Ray ray, Shape *cone, double *t) {
+    double a = pow(ray.direction.x, 2.0) - pow(ray.direction.y, 2.0) + pow(ray.direction.z, 2.0);
+    double b = 2.0 * ray.origin.x * ray.direction.x - 2.0 * ray.origin.y * ray.direction.y + 2.0 * ray.origin.z * ray.direction.z;
+    double c = pow(ray.origin.x, 2.0) - pow(ray.origin.y, 2.0) + pow(ray.origin.z, 2.0);
+
+    if (fabs(a) < EPSILON) {
+        // Ray is parallel to one of the cone's halves, so it hits the other at most once
+        if (fabs(b) < EPSILON) {
+            return 0;
+        }
+        t[0] = -c / (2.0 * b);
+        return _between_caps(ray, cone, t, 1);
     }
 
-    double tmax = fmax(t0, t1);
-    double y1 = ray.origin.y + tmax * ray.direction.y;
-    if (tmax >= 0.0 && y1 > cylinder->ymin && y1 < cylinder->ymax) {
-        return tmax;
+    double disc = pow(b, 2.0) - 4.0 * a * c;
+    if (disc < 0.0) {
+        return 0;
     }
+    t[0] = (-b - sqrt(disc)) / (2.0 * a);
+    t[1] = (-b + sqrt(disc)) / (2.0 * a);
+    return _between_caps(ray, cone, t, 2);
+}
 
-    return INFINITY;
+/// @brief Intersects the double-napped cone x^2 + z^2 = y^2, cut at the shape's min and max.
+static int _cone_roots(Ray ray, Shape *cone, double *t) {
+    int n = _cone_side_roots(ray, cone, t);
+    return n + _cap_roots(ray, cone, t + n);
 }
 
-double ray_intersect_cylinder(Ray ray, Shape *cylinder) {
-    double t_side = _ray_intersect_cylinder_side(ray, cylinder);
-    double t_cap = _ray_intersect_cylinder_cap(ray, cylinder);
-    return fmin(t_side, t_cap);
+double ray_intersect_cone(Ray ray, Shape *cone) {
+    double t[4];
+    return _nearest(t, _cone_roots(ray, cone, t));
 }
 
 /// @brief Returns the smallest positive t-value at which the ray intersects the given shape.
 /// If there are no such t-values, returns INFINITY.
 double ray_intersect_shape(Ray ray, Shape *shape) {
+    return ray_hit_shape(ray, shape).t;
+}
+
+/// @brief Returns the nearest hit on a child of the group. The children' transforms already include the
+/// group's, so the ray is tested in the space around the group.
+static Intersection _ray_hit_group(Ray ray, const Group *group) {
+    Intersection best = NO_HIT;
+    AabbRay box_ray = aabb_ray_new(ray.origin, ray.direction);
+    if (aabb_is_finite(&group->bounds) && aabb_ray_entry(&group->bounds, &box_ray, INFINITY) == INFINITY) {
+        return best;
+    }
+    for (size_t i = 0; i < group->child_count; i++) {
+        // Skip children whose boxes the ray misses, or enters beyond the nearest hit so far
+        const Aabb *box = &group->child_bounds[i];
+        if (aabb_is_finite(box) && aabb_ray_entry(box, &box_ray, best.t) == INFINITY) {
+            continue;
+        }
+        Intersection x = ray_hit_shape(ray, &group->children[i]);
+        if (x.t < best.t) {
+            best = x;
+        }
+    }
+    return best;
+}
+
+/// @brief Intersects a sphere given by its world-space center and radius. World-space distances along the
+/// ray equal object-space ones, so this finds the same t as ray_intersect_sphere.
+static double _ray_intersect_placed_sphere(Ray ray, const double *sphere) {
+    Vec4D sphere_to_ray = d4_vector(ray.origin.x - sphere[0], ray.origin.y - sphere[1], ray.origin.z - sphere[2]);
+    double a = d4_dot(ray.direction, ray.direction);
+    double b = 2 * d4_dot(ray.direction, sphere_to_ray);
+    double c = d4_dot(sphere_to_ray, sphere_to_ray) - sphere[3] * sphere[3];
+    double discriminant = b * b - 4 * a * c;
+    if (discriminant < 0) {
+        return INFINITY;
+    }
+    double root = sqrt(discriminant);
+    double t1 = (-b - root) / (2 * a);
+    double t2 = (-b + root) / (2 * a);
+    return t1 >= 0.0 ? t1 : t2 >= 0.0 ? t2 : INFINITY;
+}
+
+/// @brief Intersects an axis-aligned box given by its world-space min and max corners, as ray_intersect_cube
+/// does the unit cube.
+static double _ray_intersect_placed_box(Ray ray, const double *box) {
+    double origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+    double direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+    double tmin = -INFINITY;
+    double tmax = INFINITY;
+    for (int a = 0; a < 3; a++) {
+        double t0, t1;
+        if (fabs(direction[a]) >= EPSILON) {
+            t0 = (box[a] - origin[a]) / direction[a];
+            t1 = (box[a + 3] - origin[a]) / direction[a];
+        } else {
+            t0 = (box[a] - origin[a]) * INFINITY;
+            t1 = (box[a + 3] - origin[a]) * INFINITY;
+        }
+        tmin = fmax(tmin, fmin(t0, t1));
+        tmax = fmin(tmax, fmax(t0, t1));
+    }
+    if (tmin > tmax) {
+        return INFINITY;
+    }
+    return tmin >= 0.0 ? tmin : tmax >= 0.0 ? tmax : INFINITY;
+}
+
+/// @brief Intersects a plane given by the row of its inverse transform that gives object-space y, which
+/// is all of the transform that ray_intersect_plane needs.
+static double _ray_intersect_placed_plane(Ray ray, const double *row) {
+    double dy = row[0] * ray.direction.x + row[1] * ray.direction.y + row[2] * ray.direction.z;
+    if (fabs(dy) < EPSILON) {
+        return INFINITY;
+    }
+    double oy = row[0] * ray.origin.x + row[1] * ray.origin.y + row[2] * ray.origin.z + row[3];
+    double t = -oy / dy;
+    return t >= 0.0 ? t : INFINITY;
+}
+
+/// @brief Returns whether a CSG shape keeps a hit on its first child, if `on_first`, or on its second, given
+/// whether the ray is inside each child there.
+static int _csg_keeps(int operation, int on_first, int in_first, int in_second) {
+    switch (operation) {
+        case CSG_UNION:
+            return on_first ? !in_second : !in_first;
+        case CSG_INTERSECTION:
+            return on_first ? in_second : in_first;
+        case CSG_DIFFERENCE:
+            return on_first ? !in_second : in_first;
+    }
+    return 1;
+}
+
+static void _append_csg_hits(Ray ray, Shape *csg, IntersectionList *xs);
+
+/// @brief Appends every hit of the ray on the shape, behind its origin as well as in front, out of order
+/// except for those on CSG shapes. Meshes and sphere clouds have none, as CSG shapes cannot hold them.
+static void _append_hits(Ray ray, Shape *shape, IntersectionList *xs) {
+    if (shape->type == SHAPE_CSG) {
+        _append_csg_hits(ray, shape, xs);
+        return;
+    }
+    if (shape->type == SHAPE_GROUP) {
+        // Children are closed, so one whose box is behind the ray is crossed an even number of times there,
+        // which leaves the ray outside it in front
+        const Group *group = shape->group;
+        AabbRay box_ray = aabb_ray_new(ray.origin, ray.direction);
+        for (size_t i = 0; i < group->child_count; i++) {
+            const Aabb *box = &group->child_bounds[i];
+            if (!aabb_is_finite(box) || aabb_ray_entry(box, &box_ray, INFINITY) < INFINITY) {
+                _append_hits(ray, &group->children[i], xs);
+            }
+        }
+        return;
+    }
+
+    Ray r = ray_transform(ray, shape->inv_transform);
+    double t[4];
+    int n = 0;
+    switch (shape->type) {
+        case SHAPE_SPHERE:
+            n = _sphere_roots(r, t);
+            break;
+        case SHAPE_PLANE:
+            n = _plane_roots(r, t);
+            break;
+        case SHAPE_CUBE:
+            n = _cube_roots(r, t);
+            break;
+        case SHAPE_CYLINDER:
+            n = _cylinder_roots(r, shape, t);
+            break;
+        case SHAPE_CONE:
+            n = _cone_roots(r, shape, t);
+            break;
+    }
+    for (int i = 0; i < n; i++) {
+        intersection_list_add(xs, (Intersection) { t[i], shape, 0, 0.0, 0.0, NULL, shape->material });
+    }
+}
+
+/// @brief Appends the hits on the CSG shape's surface, sorted: those of its children's hits that the
+/// operation keeps, given which children the ray is inside at each.
+static void _append_csg_hits(Ray ray, Shape *csg, IntersectionList *xs) {
+    const Group *group = csg->group;
+    size_t first = xs->count;
+    _append_hits(ray, &group->children[0], xs);
+    size_t second = xs->count;
+    _append_hits(ray, &group->children[1], xs);
+    size_t end = xs->count;
+    intersection_list_sort(xs, first, second - first);
+    intersection_list_sort(xs, second, end - second);
+
+    // Walk both children's hits in order, appending those kept after them, then move those down
+    int in_first = 0;
+    int in_second = 0;
+    size_t i = first;
+    size_t j = second;
+    while (i < second || j < end) {
+        int on_first = j == end || (i < second && xs->items[i].t <= xs->items[j].t);
+        Intersection x = xs->items[on_first ? i++ : j++];
+        if (_csg_keeps(group->operation, on_first, in_first, in_second)) {
+            intersection_list_add(xs, x);
+        }
+        if (on_first) {
+            in_first = !in_first;
+        } else {
+            in_second = !in_second;
+        }
+    }
+    size_t kept = xs->count - end;
+    memmove(&xs->items[first], &xs->items[end], kept * sizeof(Intersection));
+    xs->count = first + kept;
+}
+
+/// @brief Returns the nearest hit on the CSG shape's surface.
+static Intersection _ray_hit_csg(Ray ray, Shape *csg) {
+    Intersection best = NO_HIT;
+    AabbRay box_ray = aabb_ray_new(ray.origin, ray.direction);
+    if (aabb_is_finite(&csg->group->bounds) && aabb_ray_entry(&csg->group->bounds, &box_ray, INFINITY) == INFINITY) {
+        return best;
+    }
+    IntersectionList xs;
+    intersection_list_init(&xs);
+    _append_csg_hits(ray, csg, &xs);
+    const Intersection *h = hit(&xs);
+    if (h != NULL) {
+        best = *h;
+    }
+    intersection_list_free(&xs);
+    return best;
+}
+
+Intersection ray_hit_shape(Ray ray, Shape *shape) {
+    Intersection x = { INFINITY, shape, 0, 0.0, 0.0, NULL, shape->material };
+    switch (shape->fast) {
+        case SHAPE_FAST_SPHERE:
+            x.t = _ray_intersect_placed_sphere(ray, shape->fast_shape);
+            return x;
+        case SHAPE_FAST_BOX:
+            x.t = _ray_intersect_placed_box(ray, shape->fast_shape);
+            return x;
+        case SHAPE_FAST_PLANE:
+            x.t = _ray_intersect_placed_plane(ray, shape->fast_shape);
+            return x;
+    }
+    if (shape->type == SHAPE_GROUP) {
+        return _ray_hit_group(ray, shape->group);
+    }
+    if (shape->type == SHAPE_CSG) {
+        return _ray_hit_csg(ray, shape);
+    }
+
     // Transform the ray into the shape's object space
     Mat4D inv = shape->inv_transform;
     Ray r = ray_transform(ray, inv);
 
     switch (shape->type) {
         case SHAPE_SPHERE:
-            return ray_intersect_sphere(r);
+            x.t = ray_intersect_sphere(r);
+            break;
         case SHAPE_PLANE:
-            return ray_intersect_plane(r);
+            x.t = ray_intersect_plane(r);
+            break;
         case SHAPE_CUBE:
-            return ray_intersect_cube(r);
+            x.t = ray_intersect_cube(r);
+            break;
         case SHAPE_CYLINDER:
-            return ray_intersect_cylinder(r, shape);
+            x.t = ray_intersect_cylinder(r, shape);
+            break;
+        case SHAPE_CONE:
+            x.t = ray_intersect_cone(r, shape);
+            break;
+        case SHAPE_MESH:
+            x.t = mesh_intersect(shape->mesh, r.origin, r.direction, INFINITY, &x.primitive, &x.u, &x.v);
+            break;
+        case SHAPE_SPHERE_CLOUD:
+            x.t = sphere_cloud_intersect(shape->cloud, r.origin, r.direction, INFINITY, &x.primitive);
+            if (x.t < INFINITY) {
+                x.material = sphere_cloud_material(shape->cloud, x.primitive, shape->material);
+            }
+            break;
         default:
             printf("Unrecognised shape %i", shape->type);
-            return INFINITY;
+            break;
     }
+    return x;
+}
+
+// Deeper than any tree bvh_build makes, since each level pushes at most one node
+#define BVH_STACK_SIZE 64
+
+static void _test_instance(Ray ray, World world, const Instance *instance, Intersection *best) {
+    // Into the instance's space, where ray_hit_shape takes it on into the prototype's
+    Intersection x = ray_hit_shape(ray_transform(ray, instance->inv_transform), &world.prototypes[instance->prototype]);
+    if (x.t < best->t) {
+        x.instance = instance;
+        if (instance->material != INSTANCE_PROTOTYPE_MATERIAL) {
+            x.material = instance->material;
+        }
+        *best = x;
+    }
+}
+
+/// @brief Tests the object with the given index, or the instance if the index is past the objects.
+static void _test_object(Ray ray, World world, uint32_t index, Intersection *best) {
+    if (index >= world.object_count) {
+        _test_instance(ray, world, &world.instances[index - world.object_count], best);
+        return;
+    }
+    Intersection x = ray_hit_shape(ray, &world.objects[index]);
+    if (x.t < best->t) {
+        *best = x;
+    }
+}
+
+/// @brief Finds the nearest hit using the world's BVH, visiting the nearer child of each node first so
+/// that hits found there cull the farther one.
+static Intersection _ray_intersect_bvh(Ray ray, World world) {
+    WorldBvh *bvh = world.bvh;
+    Intersection best = NO_HIT;
+    for (size_t i = 0; i < bvh->unbounded_count; i++) {
+        _test_object(ray, world, bvh->unbounded[i], &best);
+    }
+    if (bvh->tree.node_count == 0) {
+        return best;
+    }
+
+    AabbRay box_ray = aabb_ray_new(ray.origin, ray.direction);
+    const BvhNode *nodes = bvh->tree.nodes;
+    uint32_t stack[BVH_STACK_SIZE];
+    int top = 0;
+    if (aabb_ray_entry(&nodes[0].bounds, &box_ray, best.t) < INFINITY) {
+        stack[top++] = 0;
+    }
+    while (top > 0) {
+        const BvhNode *node = &nodes[stack[--top]];
+        if (node->count > 0) {
+            for (uint32_t i = node->first; i < node->first + node->count; i++) {
+                _test_object(ray, world, bvh->tree.indices[i], &best);
+            }
+            continue;
+        }
+
+        uint32_t near = node->first;
+        uint32_t far = node->first + 1;
+        double t_near = aabb_ray_entry(&nodes[near].bounds, &box_ray, best.t);
+        double t_far = aabb_ray_entry(&nodes[far].bounds, &box_ray, best.t);
+        if (t_far < t_near) {
+            uint32_t tmp = near;
+            near = far;
+            far = tmp;
+            double tmp_t = t_near;
+            t_near = t_far;
+            t_far = tmp_t;
+        }
+        // Push the farther child first so the nearer one is visited next
+        if (t_far < INFINITY) {
+            stack[top++] = far;
+        }
+        if (t_near < INFINITY) {
+            stack[top++] = near;
+        }
+    }
+    return best;
+}
+
+// Each node pushes at most all but one of its children, and the wide tree is no deeper than the binary one
+#define WIDE_BVH_STACK_SIZE (BVH_STACK_SIZE * (WIDE_BVH_WIDTH - 1) + 1)
+
+typedef struct {
+    uint32_t child;  // As in WideBvhNode
+    uint32_t count;
+    float t;         // Where the ray enters it, to skip it if a nearer hit is found first
+} WideBvhEntry;
+
+/// @brief Finds the nearest hit using the world's wide BVH, visiting the children of each node from
+/// nearest to farthest.
+static Intersection _ray_intersect_wide_bvh(Ray ray, World world) {
+    WorldBvh *bvh = world.bvh;
+    Intersection best = NO_HIT;
+    for (size_t i = 0; i < bvh->unbounded_count; i++) {
+        _test_object(ray, world, bvh->unbounded[i], &best);
+    }
+
+    WideBvhRay box_ray = wide_bvh_ray_new(ray.origin, ray.direction);
+    const WideBvhNode *nodes = bvh->wide.nodes;
+    WideBvhEntry stack[WIDE_BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = (WideBvhEntry) { 0, 0, 0.0f };
+    while (top > 0) {
+        WideBvhEntry entry = stack[--top];
+        if (entry.t > best.t) {
+            continue;
+        }
+        if (entry.count > 0) {
+            for (uint32_t i = entry.child; i < entry.child + entry.count; i++) {
+                _test_object(ray, world, bvh->wide.indices[i], &best);
+            }
+            continue;
+        }
+
+        const WideBvhNode *node = &nodes[entry.child];
+        float t[WIDE_BVH_WIDTH];
+        int mask = wide_bvh_node_hits(node, &box_ray, best.t, t);
+        // Push the children hit from farthest to nearest, so the nearest is visited next
+        int first = top;
+        for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+            WideBvhEntry child = { node->child[i], node->count[i], t[i] };
+            int j = top++;
+            for (; j > first && stack[j - 1].t < child.t; j--) {
+                stack[j] = stack[j - 1];
+            }
+            stack[j] = child;
+        }
+    }
+    return best;
+}
+
+// Boxes a ray remembers testing as it walks a grid, by their ids' low bits. A power of two.
+#define GRID_MAILBOX_SIZE 32
+
+/// @brief Finds the nearest hit using the world's grid, walking the cells along the ray until one holds a
+/// hit within it. Objects in several cells are only tested in the first, unless a later object in the
+/// mailbox has taken their slot.
+static Intersection _ray_intersect_grid(Ray ray, World world) {
+    WorldBvh *bvh = world.bvh;
+    Intersection best = NO_HIT;
+    for (size_t i = 0; i < bvh->unbounded_count; i++) {
+        _test_object(ray, world, bvh->unbounded[i], &best);
+    }
+
+    const Grid *grid = &bvh->grid;
+    GridWalk walk;
+    if (!grid_walk_start(grid, ray.origin, ray.direction, best.t, &walk)) {
+        return best;
+    }
+    uint32_t mailbox[GRID_MAILBOX_SIZE];
+    memset(mailbox, 0xff, sizeof(mailbox));  // No id is UINT32_MAX
+    do {
+        for (uint32_t i = grid->cell_start[walk.index]; i < grid->cell_start[walk.index + 1]; i++) {
+            uint32_t id = grid->items[i];
+            uint32_t *slot = &mailbox[id & (GRID_MAILBOX_SIZE - 1)];
+            if (*slot == id) {
+                continue;
+            }
+            *slot = id;
+            _test_object(ray, world, id, &best);
+        }
+        // A hit beyond this cell may be behind an object in the cells still to come
+    } while (best.t > walk.t_cell_exit && grid_walk_next(&walk));
+    return best;
 }
 
 Intersection ray_intersect_world(Ray ray, World world)
@@ -282,23 +814,36 @@ Intersection ray_intersect_world(Ray ray, World world)
         );
     }
 
-    Intersection best = (Intersection) { INFINITY, NULL };
+    if (world.bvh != NULL && world.bvh->grid.cell_count > 0) {
+        return _ray_intersect_grid(ray, world);
+    }
+    if (world.bvh != NULL && world.bvh->wide.node_count > 0) {
+        return _ray_intersect_wide_bvh(ray, world);
+    }
+    if (world.bvh != NULL) {
+        return _ray_intersect_bvh(ray, world);
+    }
+
+    Intersection best = NO_HIT;
     for (size_t i = 0; i < world.object_count; i++) {
-        double t = ray_intersect_shape(ray, &world.objects[i]);
-        assert(t >= 0.0);
-        if (t < best.t) {
-            best = (Intersection) { t, &world.objects[i] };
+        Intersection x = ray_hit_shape(ray, &world.objects[i]);
+        assert(x.t >= 0.0);
+        if (x.t < best.t) {
+            best = x;
         }
     }
+    for (size_t i = 0; i < world.instance_count; i++) {
+        _test_instance(ray, world, &world.instances[i], &best);
+    }
     return best;
 
 }
 
-Intersection *hit(IntersectionList intersections) {
+const Intersection *hit(const IntersectionList *intersections) {
     double best = INFINITY;
-    Intersection *best_ptr = NULL;
-    for (size_t i = 0; i < intersections.count; i++) {
-        Intersection *candidate = &intersections.items[i];
+    const Intersection *best_ptr = NULL;
+    for (size_t i = 0; i < intersections->count; i++) {
+        const Intersection *candidate = &intersections->items[i];
         if (candidate->t >= 0.0 && candidate->t < best) {
             best = candidate->t;
             best_ptr = candidate;
@@ -322,9 +867,11 @@ IntersectionData ray_prepare_computations(Ray r, Intersection i)
     d.object_ptr = i.object_ptr;
     d.point = ray_position(r, d.t);
     d.eyev = d4_neg(r.direction);
-    d.normalv = shape_normal(d.object_ptr, d.point);
-    d.over_point = d4_add(d.point, d4_mul(d.normalv, EPSILON));
-    d.reflectv = d4_reflect(r.direction, d.normalv);
+    d.instance = i.instance;
+    d.material = i.material;
+    d.normalv = i.instance != NULL
+        ? instance_normal_at(i.instance, d.object_ptr, d.point, i.primitive, i.u, i.v)
+        : shape_normal_at(d.object_ptr, d.point, i.primitive, i.u, i.v);
 
     // Handle case where eye is *inside* the object, so normal vector points away
     if (d4_dot(d.normalv, d.eyev) < 0.0) {
@@ -333,53 +880,236 @@ IntersectionData ray_prepare_computations(Ray r, Intersection i)
     } else {
         d.inside = 0;
     }
+    d.over_point = d4_add(d.point, d4_mul(d.normalv, EPSILON));
+    d.under_point = d4_sub(d.point, d4_mul(d.normalv, EPSILON));
+    d.reflectv = d4_reflect(r.direction, d.normalv);
     return d;
 }
 
-Color reflected_color(World w, IntersectionData x, int remaining_reflections) {
-    if (remaining_reflections <= 0) {
-        return color_black();
+void ray_stats_add(RayStats *total, const RayStats *more) {
+    total->pixels += more->pixels;
+    total->camera += more->camera;
+    total->reflected += more->reflected;
+    total->refracted += more->refracted;
+    total->shadow += more->shadow;
+    total->culled += more->culled;
+    total->most = more->most > total->most ? more->most : total->most;
+}
+
+/// @brief Returns whether something hides `light` from `point`, and counts the shadow ray.
+static int _shadowed(World world, Vec4D point, PointLight light, RayBudget *budget) {
+    if (budget->stats != NULL) {
+        budget->stats->shadow++;
     }
-    double reflective = x.object_ptr->material.reflective;
-    if (reflective == 0.0) {
-        return color_black();
+    return is_point_shadowed(point, light, world);
+}
+
+/// @brief Returns what a point light adds to the hit, casting a shadow ray towards it.
+static Color _shade_point_light(World world, const IntersectionData *data, const Material *material, Color color, PointLight light, RayBudget *budget) {
+    int in_shadow = _shadowed(world, data->over_point, light, budget);
+
+    if (CFG_VERBOSE) {
+        if (in_shadow) {
+            printf("Intersection is in shadow\n");
+        } else {
+            printf("Intersection is NOT in shadow\n");
+        }
     }
-    Ray reflected_ray = (Ray) { x.over_point, x.reflectv };
-    Color c = ray_color(reflected_ray, w, remaining_reflections - 1);
-    return color_mul(c, reflective);
+
+    return lighting_compute(
+        material,
+        color,
+        light,
+        data->point,
+        data->eyev,
+        data->normalv,
+        in_shadow
+    );
 }
 
-Color shade_hit(World world, IntersectionData data, int remaining_reflections) {
+/// @brief Returns a seed for the random numbers that pick the hit's lights and the points on them, from where
+/// it is and where it is seen from. Render workers share no random state, and the same ray always picks the
+/// same lights.
+static uint64_t _hit_seed(const IntersectionData *data) {
+    double v[6] = { data->point.x, data->point.y, data->point.z, data->eyev.x, data->eyev.y, data->eyev.z };
+    uint64_t seed = 14695981039346656037ull;
+    for (int i = 0; i < 6; i++) {
+        uint64_t bits;
+        memcpy(&bits, &v[i], sizeof(bits));
+        seed = (seed ^ bits) * 1099511628211ull;
+    }
+    return seed;
+}
+
+/// @brief Returns the light at a random point in the area light's cell `k`, numbered along u first, as a
+/// point light with the cell's share of the intensity. The point only depends on `seed` and the cell.
+static PointLight _area_light_cell(const PointLight *light, int k, uint64_t seed) {
+    uint64_t state = seed + 2 * (uint64_t)k;
+    double u = random_next(&state);
+    double v = random_next(&state);
+    PointLight cell = *light;
+    cell.type = LIGHT_POINT;
+    cell.position = light_sample_point(light, k % light->usteps, k / light->usteps, u, v);
+    cell.intensity = color_mul(light->intensity, 1.0 / (light->usteps * light->vsteps));
+    return cell;
+}
+
+/// @brief Returns what an area light adds to the hit, from a point at random in each cell of its grid.
+/// Shadow rays go to the corner cells first. If those agree, the hit is taken to be fully lit or fully in
+/// shadow, and the other cells cast none; only in the penumbra, where they disagree, does every cell.
+static Color _shade_area_light(World world, const IntersectionData *data, const Material *material, Color color, const PointLight *light, uint64_t seed, RayBudget *budget) {
+    int us = light->usteps;
+    int vs = light->vsteps;
+    int probes[4] = { 0, us - 1, (vs - 1) * us, vs * us - 1 };
+    int probe_shadowed[4];
+    int shadowed = 0;
+    for (int p = 0; p < 4; p++) {
+        probe_shadowed[p] = _shadowed(world, data->over_point, _area_light_cell(light, probes[p], seed), budget);
+        shadowed += probe_shadowed[p];
+    }
+    int agree = shadowed == 0 || shadowed == 4;
+
+    Color c = color_black();
+    for (int k = 0; k < us * vs; k++) {
+        PointLight cell = _area_light_cell(light, k, seed);
+        int in_shadow = shadowed == 4;
+        if (!agree) {
+            int p = 0;
+            while (p < 4 && probes[p] != k) {
+                p++;
+            }
+            in_shadow = p < 4 ? probe_shadowed[p] : _shadowed(world, data->over_point, cell, budget);
+        }
+        c = color_add(c, lighting_compute(material, color, cell, data->point, data->eyev, data->normalv, in_shadow));
+    }
+    return c;
+}
+
+/// @brief Returns what `light` adds to the hit. Area lights take their random points from `seed`.
+static Color _shade_light(World world, const IntersectionData *data, const Material *material, Color color, const PointLight *light, uint64_t seed, RayBudget *budget) {
+    if (light->type == LIGHT_AREA) {
+        return _shade_area_light(world, data, material, color, light, seed, budget);
+    }
+    return _shade_point_light(world, data, material, color, *light, budget);
+}
+
+/// @brief Returns the light CFG_LIGHT_SAMPLES lights picked from the world's light tree add to the hit,
+/// each weighted by the inverse of its chance of being picked, which makes the sum an unbiased estimate of
+/// what every light adds.
+static Color _shade_sampled_lights(World world, const IntersectionData *data, const Material *material, Color color, RayBudget *budget) {
+    LightReceiver receiver = light_receiver_new(material, color, data->point, data->normalv);
+    uint64_t state = _hit_seed(data);
     Color c = color_black();
-    for (size_t i = 0; i < world.light_count; i++) {
+    for (int s = 0; s < CFG_LIGHT_SAMPLES; s++) {
+        // Each sample takes its own slice of [0, 1), which spreads them across the tree
+        double u = (s + random_next(&state)) / CFG_LIGHT_SAMPLES;
+        uint32_t i;
+        double probability;
+        if (!light_tree_sample(&world.bvh->lights, world.lights, &receiver, CFG_LIGHT_CUTOFF, u, &i, &probability)) {
+            continue;
+        }
         PointLight light = world.lights[i];
-        int in_shadow = is_point_shadowed(data.over_point, light, world);
+        light.intensity = color_mul(light.intensity, 1.0 / (probability * CFG_LIGHT_SAMPLES));
+        c = color_add(c, _shade_light(world, data, material, color, &light, state, budget));
+    }
+    return c;
+}
 
-        if (CFG_VERBOSE) {
-            if (in_shadow) {
-                printf("Intersection is in shadow\n");
-            } else {
-                printf("Intersection is NOT in shadow\n");
-            }
+/// @brief Writes the direction a ray refracts in at the hit, passing from a medium of refractive index `n1`
+/// into one of `n2`, and returns Schlick's approximation of the fraction of the light reflected there
+/// instead. Returns 1 without writing a direction under total internal reflection.
+static double _refract(const IntersectionData *data, double n1, double n2, Vec4D *out_direction) {
+    double ratio = n1 / n2;
+    double cos_i = d4_dot(data->eyev, data->normalv);
+    double sin2_t = ratio * ratio * (1.0 - cos_i * cos_i);
+    if (sin2_t > 1.0) {
+        return 1.0;
+    }
+    double cos_t = sqrt(1.0 - sin2_t);
+    *out_direction = d4_sub(d4_mul(data->normalv, ratio * cos_i - cos_t), d4_mul(data->eyev, ratio));
+
+    // Going into a less dense medium, the angle that matters is the refracted ray's
+    double cos = n1 > n2 ? cos_t : cos_i;
+    double r0 = (n1 - n2) / (n1 + n2);
+    r0 *= r0;
+    return r0 + (1.0 - r0) * pow(1.0 - cos, 5);
+}
+
+static Color _trace(Ray ray, World world, int remaining_reflections, double weight, RayBudget *budget);
+
+/// @brief Returns `share` of the color seen along a reflected or refracted ray from a hit that adds `weight`
+/// of its color to the pixel, or black if the ray is not cast: when there are no reflections left, or when
+/// the ray would add less than the budget's cutoff or the budget has run out.
+static Color _secondary_color(Ray ray, World world, int remaining_reflections, double weight, double share, int refracted, RayBudget *budget) {
+    if (remaining_reflections <= 0 || share <= 0.0) {
+        return color_black();
+    }
+    RayStats *stats = budget->stats;
+    if (weight * share < budget->cutoff || budget->rays_left <= 0) {
+        if (stats != NULL) {
+            stats->culled++;
         }
+        return color_black();
+    }
+    budget->rays_left--;
+    if (stats != NULL && refracted) {
+        stats->refracted++;
+    } else if (stats != NULL) {
+        stats->reflected++;
+    }
+    return color_mul(_trace(ray, world, remaining_reflections - 1, weight * share, budget), share);
+}
 
-        Color contribution = lighting_compute(
-            *data.object_ptr,
-            light,
-            data.point,
-            data.eyev,
-            data.normalv,
-            in_shadow
-        );
+/// @brief Returns the color of the hit, which adds `weight` of its color to the pixel: what the lights add
+/// to it, and what it reflects and lets through.
+static Color _shade_hit(World world, IntersectionData data, int remaining_reflections, double weight, RayBudget *budget) {
+    // The color is the same for every light. Instances are colored as their prototype in their space.
+    const Material *material = &world.materials[data.material];
+    Vec4D local_point = data.instance != NULL ? mat4d_mul_vec4d(data.instance->inv_transform, data.point) : data.point;
+    Color color = shape_color_at(data.object_ptr, material, local_point);
+    Color c = color_black();
+    if (world.light_count > (size_t)CFG_LIGHT_SAMPLES && world.bvh != NULL && world.bvh->lights.light_count == world.light_count) {
+        c = _shade_sampled_lights(world, &data, material, color, budget);
+    } else {
+        uint64_t seed = _hit_seed(&data);
+        for (size_t i = 0; i < world.light_count; i++) {
+            c = color_add(c, _shade_light(world, &data, material, color, &world.lights[i], seed + (uint64_t)i * 0x100000001b3ull, budget));
+        }
+    }
+
+    // Transparent materials let through what reflection does not take. Media are told apart only by the side
+    // of the surface the ray is on, so a transparent shape is taken to be surrounded by air.
+    double reflected_share = material->reflective;
+    double refracted_share = material->transparency;
+    Vec4D refracted_direction = data.eyev;
+    if (refracted_share > 0.0) {
+        double n1 = data.inside ? material->refractive_index : 1.0;
+        double n2 = data.inside ? 1.0 : material->refractive_index;
+        double reflectance = _refract(&data, n1, n2, &refracted_direction);
+        if (reflectance >= 1.0) {
+            refracted_share = 0.0;
+        }
+        if (reflected_share > 0.0) {
+            reflected_share *= reflectance;
+            refracted_share *= 1.0 - reflectance;
+        }
+    }
 
-        Color reflection = reflected_color(world, data, remaining_reflections);        
-        c = color_add(c, contribution);
-        c = color_add(c, reflection);
+    // The ray that matters more goes first, so it is the one cast if the budget only has room for one
+    Ray reflected = { data.over_point, data.reflectv };
+    Ray refracted = { data.under_point, refracted_direction };
+    if (refracted_share > reflected_share) {
+        c = color_add(c, _secondary_color(refracted, world, remaining_reflections, weight, refracted_share, 1, budget));
+        c = color_add(c, _secondary_color(reflected, world, remaining_reflections, weight, reflected_share, 0, budget));
+    } else {
+        c = color_add(c, _secondary_color(reflected, world, remaining_reflections, weight, reflected_share, 0, budget));
+        c = color_add(c, _secondary_color(refracted, world, remaining_reflections, weight, refracted_share, 1, budget));
     }
     return c;
 }
 
-Color ray_color(Ray ray, World world, int remaining_reflections) {
+/// @brief Returns the color seen along a ray that adds `weight` of its color to the pixel.
+static Color _trace(Ray ray, World world, int remaining_reflections, double weight, RayBudget *budget) {
     Intersection h = ray_intersect_world(ray, world);
     if (h.t == INFINITY) {
         return color_black();
@@ -394,6 +1124,18 @@ Color ray_color(Ray ray, World world, int remaining_reflections) {
         printf("Intersection over_point: (%f, %f, %f)\n", data.over_point.x, data.over_point.y, data.over_point.z);
     }
 
-    Color c = shade_hit(world, data, remaining_reflections);
+    Color c = _shade_hit(world, data, remaining_reflections, weight, budget);
     return c;
 }
+
+Color ray_trace(Ray ray, World world, int remaining_reflections, RayBudget *budget) {
+    if (budget->stats != NULL) {
+        budget->stats->camera++;
+    }
+    return _trace(ray, world, remaining_reflections, 1.0, budget);
+}
+
+Color ray_color(Ray ray, World world, int remaining_reflections) {
+    RayBudget unlimited = { INT_MAX, 0.0, NULL };
+    return ray_trace(ray, world, remaining_reflections, &unlimited);
+}
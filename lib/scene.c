@@ -0,0 +1,1489 @@
+#define _USE_MATH_DEFINES  // For M_PI on Windows
+#define _DEFAULT_SOURCE    // For M_PI on Unix
+#include <math.h>
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <group.h>
+#include <scene.h>
+#include <text.h>
+
+/* Scene files are read in large chunks and parsed a line at a time, so nothing but the current line and
+the item being built is held in memory besides the scene itself. Each line is handled as soon as it is
+read, by the innermost open block: an item, a material, a pattern, a transform and so on. Blocks close
+when a line is indented no further than the line that opened them. */
+
+// Deepest nesting of groups in groups
+#define SCENE_MAX_NESTING 4
+// Deepest nesting of blocks, as in item > material > pattern > transform, with an item and its children
+// for each group around them
+#define SCENE_MAX_DEPTH (8 + 2 * SCENE_MAX_NESTING)
+// Most numbers in an inline list. A shear takes six.
+#define SCENE_MAX_VALUES 8
+
+static const double DEFAULT_FPS = 24.0;
+
+typedef struct {
+    const char *s;
+    size_t len;
+} Text;
+
+typedef struct {
+    int indent;      // Column of the line's key or value, after any "- "
+    int dash;        // Column of the line's first character, which is its dash if it is a list entry
+    int list_item;   // Nonzero if the line begins with "- "
+    Text key;        // Empty for bare list entries like "- [scale, 2, 2, 2]"
+    Text value;      // Empty if the line opens a block
+} Line;
+
+typedef enum {
+    BLOCK_ROOT,
+    BLOCK_ITEM,
+    BLOCK_MATERIAL,
+    BLOCK_PATTERN,
+    BLOCK_COLORS,
+    BLOCK_TRANSFORM,
+    BLOCK_VALUE,      // A define's value, which is a material or a transform depending on its first line
+    BLOCK_KEYFRAMES,
+    BLOCK_KEYFRAME,
+    BLOCK_CHILDREN,   // A group's children, each an item of its own
+    BLOCK_PALETTE,    // A sphere cloud's palette, of defined materials
+} BlockKind;
+
+typedef struct {
+    BlockKind kind;
+    int indent;            // Column of the line that opened the block. Its lines are indented further.
+    Material *material;    // Materials, patterns and colors: the material being filled in
+    Mat4D *m;              // Transforms: the transform being built and its inverse
+    Mat4D *inv;
+    int count;             // Colors: how many have been read
+} Block;
+
+// Material index of shapes and defines whose material has not been added to the world's materials yet
+#define MATERIAL_UNSET UINT32_MAX
+
+typedef enum { ITEM_NONE, ITEM_CAMERA, ITEM_LIGHT, ITEM_SHAPE, ITEM_INSTANCE, ITEM_ANIMATION, ITEM_ACCELERATOR, ITEM_DEFINE } ItemKind;
+typedef enum { DEFINE_UNSET, DEFINE_MATERIAL, DEFINE_TRANSFORM, DEFINE_SHAPE } DefineKind;
+
+static const char *DEFINE_KIND_NAMES[] = { "value", "material", "transform", "shape" };
+
+typedef struct {
+    char name[SHAPE_NAME_LEN];  // Empty for unused slots of the define table
+    DefineKind kind;
+    Material material;
+    Mat4D m;
+    Mat4D inv;
+    uint32_t material_index;  // Materials: where in the world's materials it is, once something uses it, or MATERIAL_UNSET
+    uint32_t prototype;       // Shapes: index into the world's prototypes
+} Define;
+
+/// An item being read: a top-level one, or a child of a group. Its fields are filled in line by line and it
+/// is added to the scene, or to its group, when the next item starts.
+typedef struct {
+    ItemKind kind;
+    int line;
+    // Shapes are built in place at the end of the world's objects, which do not move until the next item,
+    // or of its prototypes if the item defines one. Instances are built in place too. Children of groups
+    // are built in `child`, and copied into the group when they end.
+    Shape *shape;
+    Shape child;
+    int prototype;
+    Instance *instance;
+    size_t first_key;     // Index of the shape's first keyframe in Parser.keys
+    // Shapes and instances with a material of their own, which is added to the world's materials when they
+    // end, unless an equal one is there already
+    Material material;
+    int own_material;
+    // Meshes
+    char file[SCENE_MAX_PATH];
+    int smooth;
+    // Cameras
+    int width;
+    int height;
+    double field_of_view;
+    Vec4D from;
+    Vec4D to;
+    Vec4D up;
+    // Lights
+    Vec4D at;                // Or the corner of an area light
+    Color intensity;
+    double falloff;
+    int area;
+    Vec4D uvec;
+    Vec4D vvec;
+    int usteps;
+    int vsteps;
+    // Animations
+    double fps;
+    // Accelerators
+    int accelerator;
+    // Defines
+    Define define;
+} Item;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t index;          // Into the world's materials, or MATERIAL_UNSET for empty slots
+} MaterialSlot;
+
+typedef struct {
+    const char *path;
+    int line;
+    Scene *scene;
+    size_t object_capacity;
+    size_t prototype_capacity;
+    size_t material_capacity;
+    size_t instance_capacity;
+    size_t light_capacity;
+    size_t track_capacity;
+    Keyframe *keys;
+    size_t key_count;
+    size_t key_capacity;
+    size_t *track_keys;      // Index in `keys` of each track's first keyframe, fixed up once `keys` stops moving
+    Define *defines;         // Open addressing hash table
+    size_t define_count;
+    size_t define_capacity;
+    size_t mesh_capacity;
+    size_t cloud_capacity;
+    // Index of every material in the world's materials, by hash, so that each is added once. Open addressing.
+    MaterialSlot *material_table;
+    size_t material_table_capacity;
+    uint32_t *palette;       // Of the sphere cloud being read
+    size_t palette_count;
+    size_t palette_capacity;
+    Block blocks[SCENE_MAX_DEPTH];
+    int depth;
+    Item items[1 + SCENE_MAX_NESTING];  // The top-level item, then the child being read of each open group
+    Item *item;                         // The innermost item
+    int has_camera;
+    Material default_material;
+    Mat4D identity;
+} Parser;
+
+static int _error(Parser *p, const char *format, ...) {
+    fprintf(stderr, "%s:%d: ", p->path, p->line);
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+    return 1;
+}
+
+/// @brief Makes room for at least `count` elements of `size` bytes in `*array`, doubling its capacity as
+/// needed. Returns 0 on success.
+static int _reserve(void **array, size_t *capacity, size_t count, size_t size) {
+    if (count <= *capacity) {
+        return 0;
+    }
+    size_t new_capacity = *capacity ? *capacity : 16;
+    while (new_capacity < count) {
+        new_capacity *= 2;
+    }
+    void *grown = realloc(*array, new_capacity * size);
+    if (grown == NULL) {
+        return 1;
+    }
+    *array = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+static int _is(Text t, const char *word) {
+    size_t len = strlen(word);
+    return t.len == len && memcmp(t.s, word, len) == 0;
+}
+
+static Text _trim(const char *begin, const char *end) {
+    while (begin < end && *begin == ' ') {
+        begin++;
+    }
+    while (end > begin && end[-1] == ' ') {
+        end--;
+    }
+    return (Text) { begin, (size_t)(end - begin) };
+}
+
+static int _read_number(Parser *p, Text t, double *out) {
+    const char *end = t.s + t.len;
+    if (t.len == 0 || text_parse_double(t.s, end, out) != end) {
+        return _error(p, "expected a number, found '%.*s'", (int)t.len, t.s);
+    }
+    return 0;
+}
+
+static int _read_int(Parser *p, Text t, int *out) {
+    double value;
+    if (_read_number(p, t, &value)) {
+        return 1;
+    }
+    if (value != floor(value) || value < 0 || value > 1e6) {
+        return _error(p, "expected a whole number, found '%.*s'", (int)t.len, t.s);
+    }
+    *out = (int)value;
+    return 0;
+}
+
+static int _read_bool(Parser *p, Text t, int *out) {
+    if (_is(t, "true")) {
+        *out = 1;
+    } else if (_is(t, "false")) {
+        *out = 0;
+    } else {
+        return _error(p, "expected true or false, found '%.*s'", (int)t.len, t.s);
+    }
+    return 0;
+}
+
+/// @brief Reads an inline list like "[1, 2, 3]", or "[translate, 1, 2, 3]" if `word` is not NULL, in which
+/// case the first element must be a word and is stored there. Returns the count of numbers read, or -1.
+static int _read_list(Parser *p, Text t, Text *word, double values[SCENE_MAX_VALUES]) {
+    const char *s = t.s;
+    const char *end = t.s + t.len;
+    if (t.len < 2 || *s != '[' || end[-1] != ']') {
+        _error(p, "expected a list in brackets, found '%.*s'", (int)t.len, t.s);
+        return -1;
+    }
+    s++;
+    end--;
+
+    if (word != NULL) {
+        const char *comma = memchr(s, ',', (size_t)(end - s));
+        *word = _trim(s, comma ? comma : end);
+        s = comma ? comma + 1 : end;
+    }
+
+    int count = 0;
+    while (1) {
+        while (s < end && *s == ' ') {
+            s++;
+        }
+        if (s == end) {
+            break;
+        }
+        if (count == SCENE_MAX_VALUES) {
+            _error(p, "too many values in '%.*s'", (int)t.len, t.s);
+            return -1;
+        }
+        const char *next = text_parse_double(s, end, &values[count]);
+        if (next == NULL) {
+            _error(p, "expected a number in '%.*s'", (int)t.len, t.s);
+            return -1;
+        }
+        count++;
+        s = next;
+        while (s < end && *s == ' ') {
+            s++;
+        }
+        if (s < end) {
+            if (*s != ',') {
+                _error(p, "expected ',' in '%.*s'", (int)t.len, t.s);
+                return -1;
+            }
+            s++;
+        }
+    }
+    return count;
+}
+
+static int _read_triple(Parser *p, Text t, double out[3]) {
+    double values[SCENE_MAX_VALUES];
+    int count = _read_list(p, t, NULL, values);
+    if (count < 0) {
+        return 1;
+    }
+    if (count != 3) {
+        return _error(p, "expected three numbers, found '%.*s'", (int)t.len, t.s);
+    }
+    memcpy(out, values, 3 * sizeof(double));
+    return 0;
+}
+
+static int _read_point(Parser *p, Text t, Vec4D *out) {
+    double v[3];
+    if (_read_triple(p, t, v)) {
+        return 1;
+    }
+    *out = d4_point(v[0], v[1], v[2]);
+    return 0;
+}
+
+static int _read_vector(Parser *p, Text t, Vec4D *out) {
+    double v[3];
+    if (_read_triple(p, t, v)) {
+        return 1;
+    }
+    *out = d4_vector(v[0], v[1], v[2]);
+    return 0;
+}
+
+static int _read_color(Parser *p, Text t, Color *out) {
+    double v[3];
+    if (_read_triple(p, t, v)) {
+        return 1;
+    }
+    *out = color_rgb(v[0], v[1], v[2]);
+    return 0;
+}
+
+static int _read_name(Parser *p, Text t, char out[SHAPE_NAME_LEN]) {
+    if (t.len == 0 || t.len >= SHAPE_NAME_LEN) {
+        return _error(p, "names must have between 1 and %d characters", SHAPE_NAME_LEN - 1);
+    }
+    memcpy(out, t.s, t.len);
+    out[t.len] = '\0';
+    return 0;
+}
+
+/// @brief Reads a path relative to the scene file into the path from the working directory.
+static int _read_file(Parser *p, Text t, char out[SCENE_MAX_PATH]) {
+    size_t dir_len = 0;
+    int absolute = t.len > 0 && (t.s[0] == '/' || t.s[0] == '\\' || (t.len > 1 && t.s[1] == ':'));
+    if (!absolute) {
+        for (const char *c = p->path; *c != '\0'; c++) {
+            if (*c == '/' || *c == '\\') {
+                dir_len = (size_t)(c - p->path) + 1;
+            }
+        }
+    }
+    if (t.len == 0 || dir_len + t.len >= SCENE_MAX_PATH) {
+        return _error(p, "file paths must have between 1 and %d characters", SCENE_MAX_PATH - 1 - (int)dir_len);
+    }
+    memcpy(out, p->path, dir_len);
+    memcpy(out + dir_len, t.s, t.len);
+    out[dir_len + t.len] = '\0';
+    return 0;
+}
+
+// Defines
+
+static uint64_t _hash(const char *s, size_t len) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+/// @brief Returns the slot of the define called `name`, or the empty slot where it would go.
+static Define *_define_slot(Define *table, size_t capacity, const char *name, size_t len) {
+    size_t mask = capacity - 1;
+    for (size_t i = _hash(name, len) & mask;; i = (i + 1) & mask) {
+        Define *slot = &table[i];
+        if (slot->name[0] == '\0' || (strncmp(slot->name, name, len) == 0 && slot->name[len] == '\0')) {
+            return slot;
+        }
+    }
+}
+
+/// @brief Returns the define called `name`, of any kind if `kind` is DEFINE_UNSET, or reports that there is none.
+static Define *_define_find(Parser *p, Text name, DefineKind kind) {
+    Define *d = NULL;
+    if (p->defines != NULL && name.len < SHAPE_NAME_LEN) {
+        d = _define_slot(p->defines, p->define_capacity, name.s, name.len);
+    }
+    if (d == NULL || d->name[0] == '\0') {
+        _error(p, "'%.*s' has not been defined", (int)name.len, name.s);
+        return NULL;
+    }
+    if (kind != DEFINE_UNSET && d->kind != kind) {
+        _error(p, "'%.*s' is not a %s", (int)name.len, name.s, DEFINE_KIND_NAMES[kind]);
+        return NULL;
+    }
+    return d;
+}
+
+static int _define_add(Parser *p, const Define *define) {
+    // Keep the table at most half full so that probes stay short
+    if (2 * (p->define_count + 1) > p->define_capacity) {
+        size_t capacity = p->define_capacity ? 2 * p->define_capacity : 64;
+        Define *table = calloc(capacity, sizeof(Define));
+        if (table == NULL) {
+            return _error(p, "out of memory");
+        }
+        for (size_t i = 0; i < p->define_capacity; i++) {
+            const Define *d = &p->defines[i];
+            if (d->name[0] != '\0') {
+                *_define_slot(table, capacity, d->name, strlen(d->name)) = *d;
+            }
+        }
+        free(p->defines);
+        p->defines = table;
+        p->define_capacity = capacity;
+    }
+
+    Define *slot = _define_slot(p->defines, p->define_capacity, define->name, strlen(define->name));
+    if (slot->name[0] == '\0') {
+        p->define_count++;
+    }
+    *slot = *define;
+    return 0;
+}
+
+// Materials
+
+/// @brief Copies the material's fields into `out`, whose padding is zeroed, so that materials can be
+/// hashed and compared as bytes.
+static void _material_bytes(const Material *m, Material *out) {
+    memset(out, 0, sizeof(*out));
+    out->pattern.type = m->pattern.type;
+    out->pattern.transform = m->pattern.transform;
+    out->pattern.inv_transform = m->pattern.inv_transform;
+    out->pattern.a = m->pattern.a;
+    out->pattern.b = m->pattern.b;
+    out->ambient = m->ambient;
+    out->diffuse = m->diffuse;
+    out->specular = m->specular;
+    out->shininess = m->shininess;
+    out->reflective = m->reflective;
+    out->transparency = m->transparency;
+    out->refractive_index = m->refractive_index;
+}
+
+/// @brief Returns the slot of the material equal to `key`, or the empty slot where it would go.
+static MaterialSlot *_material_slot(Parser *p, MaterialSlot *table, size_t capacity, const Material *key, uint64_t hash) {
+    size_t mask = capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        MaterialSlot *slot = &table[i];
+        if (slot->index == MATERIAL_UNSET) {
+            return slot;
+        }
+        Material other;
+        if (slot->hash == hash) {
+            _material_bytes(&p->scene->world.materials[slot->index], &other);
+            if (memcmp(&other, key, sizeof(Material)) == 0) {
+                return slot;
+            }
+        }
+    }
+}
+
+/// @brief Writes the index in the world's materials of one equal to `material`, adding it if there is none.
+/// Returns 0 on success.
+static int _material_index(Parser *p, const Material *material, uint32_t *out) {
+    World *world = &p->scene->world;
+    // Keep the table at most half full so that probes stay short
+    if (2 * (world->material_count + 1) > p->material_table_capacity) {
+        size_t capacity = p->material_table_capacity ? 2 * p->material_table_capacity : 64;
+        MaterialSlot *table = malloc(capacity * sizeof(MaterialSlot));
+        if (table == NULL) {
+            return _error(p, "out of memory");
+        }
+        for (size_t i = 0; i < capacity; i++) {
+            table[i].index = MATERIAL_UNSET;
+        }
+        for (size_t i = 0; i < p->material_table_capacity; i++) {
+            const MaterialSlot *s = &p->material_table[i];
+            if (s->index != MATERIAL_UNSET) {
+                size_t mask = capacity - 1;
+                size_t j = s->hash & mask;
+                while (table[j].index != MATERIAL_UNSET) {
+                    j = (j + 1) & mask;
+                }
+                table[j] = *s;
+            }
+        }
+        free(p->material_table);
+        p->material_table = table;
+        p->material_table_capacity = capacity;
+    }
+
+    Material key;
+    _material_bytes(material, &key);
+    uint64_t hash = _hash((const char *)&key, sizeof(key));
+    MaterialSlot *slot = _material_slot(p, p->material_table, p->material_table_capacity, &key, hash);
+    if (slot->index == MATERIAL_UNSET) {
+        if (_reserve((void **)&world->materials, &p->material_capacity, world->material_count + 1, sizeof(Material))) {
+            return _error(p, "out of memory");
+        }
+        world->materials[world->material_count] = *material;
+        *slot = (MaterialSlot) { hash, (uint32_t)world->material_count++ };
+    }
+    *out = slot->index;
+    return 0;
+}
+
+/// @brief Writes the index in the world's materials of the defined material, adding it on first use.
+static int _define_material_index(Parser *p, Define *d, uint32_t *out) {
+    if (d->material_index == MATERIAL_UNSET && _material_index(p, &d->material, &d->material_index)) {
+        return 1;
+    }
+    *out = d->material_index;
+    return 0;
+}
+
+// Transforms. Each operation is applied after those before it, and its inverse is known exactly, so the
+// inverse is built up alongside the transform instead of inverting the result.
+
+static void _compose(Mat4D *m, Mat4D *inv, Mat4D op, Mat4D op_inv) {
+    *m = mat4d_mul_mat4d(op, *m);
+    *inv = mat4d_mul_mat4d(*inv, op_inv);
+}
+
+static void _translate(Mat4D *m, Mat4D *inv, double t[3]) {
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            m->m[i][j] += t[i] * m->m[3][j];
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        inv->m[i][3] -= inv->m[i][0] * t[0] + inv->m[i][1] * t[1] + inv->m[i][2] * t[2];
+    }
+}
+
+static void _scale(Mat4D *m, Mat4D *inv, double s[3]) {
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            m->m[i][j] *= s[i];
+            inv->m[j][i] /= s[i];
+        }
+    }
+}
+
+static int _transform_entry(Parser *p, Block *block, Text entry) {
+    if (entry.len > 0 && entry.s[0] != '[') {
+        const Define *d = _define_find(p, entry, DEFINE_TRANSFORM);
+        if (d == NULL) {
+            return 1;
+        }
+        _compose(block->m, block->inv, d->m, d->inv);
+        return 0;
+    }
+
+    Text op;
+    double v[SCENE_MAX_VALUES];
+    int count = _read_list(p, entry, &op, v);
+    if (count < 0) {
+        return 1;
+    }
+    int expected;
+    if (_is(op, "translate") || _is(op, "scale")) {
+        expected = 3;
+    } else if (_is(op, "rotate-x") || _is(op, "rotate-y") || _is(op, "rotate-z")) {
+        expected = 1;
+    } else if (_is(op, "shear")) {
+        expected = 6;
+    } else {
+        return _error(p, "unknown transform '%.*s'", (int)op.len, op.s);
+    }
+    if (count != expected) {
+        return _error(p, "'%.*s' takes %d numbers", (int)op.len, op.s, expected);
+    }
+
+    if (_is(op, "translate")) {
+        _translate(block->m, block->inv, v);
+    } else if (_is(op, "scale")) {
+        if (v[0] == 0.0 || v[1] == 0.0 || v[2] == 0.0) {
+            return _error(p, "cannot scale by zero");
+        }
+        _scale(block->m, block->inv, v);
+    } else if (_is(op, "shear")) {
+        Mat4D shear = shearing(v[0], v[1], v[2], v[3], v[4], v[5]);
+        if (mat4d_determinant(shear) == 0.0) {
+            return _error(p, "shear is not invertible");
+        }
+        _compose(block->m, block->inv, shear, mat4d_inverse(shear));
+    } else {
+        // Rotations are orthogonal, so their inverse is their transpose
+        Mat4D rotation = op.s[7] == 'x' ? rotation_x(v[0]) : op.s[7] == 'y' ? rotation_y(v[0]) : rotation_z(v[0]);
+        _compose(block->m, block->inv, rotation, mat4d_transpose(rotation));
+    }
+    return 0;
+}
+
+// Blocks
+
+static int _push(Parser *p, BlockKind kind, int indent) {
+    if (p->depth == SCENE_MAX_DEPTH) {
+        return _error(p, "blocks are nested too deeply");
+    }
+    p->blocks[p->depth++] = (Block) { kind, indent, NULL, NULL, NULL, 0 };
+    return 0;
+}
+
+static Block *_top(Parser *p) {
+    return &p->blocks[p->depth - 1];
+}
+
+static int _push_material(Parser *p, BlockKind kind, int indent, Material *material) {
+    if (_push(p, kind, indent)) {
+        return 1;
+    }
+    _top(p)->material = material;
+    return 0;
+}
+
+static int _push_transform(Parser *p, int indent, Mat4D *m, Mat4D *inv) {
+    if (_push(p, BLOCK_TRANSFORM, indent)) {
+        return 1;
+    }
+    _top(p)->m = m;
+    _top(p)->inv = inv;
+    return 0;
+}
+
+static int _expect_value(Parser *p, const Line *line) {
+    if (line->value.len == 0) {
+        return _error(p, "'%.*s' needs a value", (int)line->key.len, line->key.s);
+    }
+    return 0;
+}
+
+static int _expect_block(Parser *p, const Line *line) {
+    if (line->value.len != 0) {
+        return _error(p, "'%.*s' starts a block, so its contents go on the following lines", (int)line->key.len, line->key.s);
+    }
+    return 0;
+}
+
+static int _unknown_key(Parser *p, const Line *line) {
+    return _error(p, "unexpected key '%.*s'", (int)line->key.len, line->key.s);
+}
+
+static int _material_key(Parser *p, Block *block, const Line *line) {
+    Material *material = block->material;
+    Text v = line->value;
+    if (_is(line->key, "pattern")) {
+        if (_expect_block(p, line)) {
+            return 1;
+        }
+        material->pattern = (Pattern) { PATTERN_PLAIN, p->identity, p->identity, material->pattern.a, material->pattern.b };
+        return _push_material(p, BLOCK_PATTERN, line->indent, material);
+    }
+    if (_expect_value(p, line)) {
+        return 1;
+    }
+    if (_is(line->key, "color")) {
+        Color c;
+        if (_read_color(p, v, &c)) {
+            return 1;
+        }
+        material->pattern = (Pattern) { PATTERN_PLAIN, p->identity, p->identity, c, c };
+        return 0;
+    }
+    double *field = _is(line->key, "ambient") ? &material->ambient
+        : _is(line->key, "diffuse") ? &material->diffuse
+        : _is(line->key, "specular") ? &material->specular
+        : _is(line->key, "shininess") ? &material->shininess
+        : _is(line->key, "reflective") ? &material->reflective
+        : _is(line->key, "transparency") ? &material->transparency
+        : _is(line->key, "refractive-index") ? &material->refractive_index
+        : NULL;
+    if (field == NULL) {
+        return _unknown_key(p, line);
+    }
+    return _read_number(p, v, field);
+}
+
+static int _pattern_key(Parser *p, Block *block, const Line *line) {
+    Pattern *pattern = &block->material->pattern;
+    if (_is(line->key, "colors")) {
+        if (_expect_block(p, line)) {
+            return 1;
+        }
+        return _push_material(p, BLOCK_COLORS, line->indent, block->material);
+    }
+    if (_is(line->key, "transform")) {
+        if (_expect_block(p, line)) {
+            return 1;
+        }
+        return _push_transform(p, line->indent, &pattern->transform, &pattern->inv_transform);
+    }
+    if (!_is(line->key, "type")) {
+        return _unknown_key(p, line);
+    }
+
+    Text v = line->value;
+    if (_is(v, "plain")) {
+        pattern->type = PATTERN_PLAIN;
+    } else if (_is(v, "stripes") || _is(v, "stripe")) {
+        pattern->type = PATTERN_STRIPE;
+    } else if (_is(v, "gradient")) {
+        pattern->type = PATTERN_GRADIENT;
+    } else if (_is(v, "rings") || _is(v, "ring")) {
+        pattern->type = PATTERN_RING;
+    } else if (_is(v, "checkers") || _is(v, "checker")) {
+        pattern->type = PATTERN_CHECKER;
+    } else {
+        return _error(p, "unknown pattern '%.*s'", (int)v.len, v.s);
+    }
+    return 0;
+}
+
+static int _color_entry(Parser *p, Block *block, Text entry) {
+    if (block->count == 2) {
+        return _error(p, "patterns take two colors");
+    }
+    Pattern *pattern = &block->material->pattern;
+    return _read_color(p, entry, block->count++ == 0 ? &pattern->a : &pattern->b);
+}
+
+static int _keyframe_key(Parser *p, const Line *line) {
+    Keyframe *key = &p->keys[p->key_count - 1];
+    if (_expect_value(p, line)) {
+        return 1;
+    }
+    if (_is(line->key, "time")) {
+        return _read_number(p, line->value, &key->time);
+    } else if (_is(line->key, "translate")) {
+        return _read_vector(p, line->value, &key->translation);
+    } else if (_is(line->key, "rotate")) {
+        return _read_vector(p, line->value, &key->rotation);
+    } else if (_is(line->key, "scale")) {
+        return _read_vector(p, line->value, &key->scale);
+    }
+    return _unknown_key(p, line);
+}
+
+// Items
+
+static void _item_start(Parser *p) {
+    Item *item = p->item;
+    item->kind = ITEM_NONE;
+    item->line = p->line;
+    item->shape = NULL;
+    item->prototype = 0;
+    item->instance = NULL;
+    item->first_key = p->key_count;
+    item->file[0] = '\0';
+    item->smooth = 0;
+    item->width = 0;
+    item->height = 0;
+    item->field_of_view = M_PI / 3.0;
+    item->from = d4_point(0.0, 0.0, -5.0);
+    item->to = d4_point(0.0, 0.0, 0.0);
+    item->up = d4_vector(0.0, 1.0, 0.0);
+    item->at = d4_point(0.0, 0.0, 0.0);
+    item->intensity = color_rgb(1.0, 1.0, 1.0);
+    item->falloff = 0.0;
+    item->area = 0;
+    item->uvec = d4_vector(1.0, 0.0, 0.0);
+    item->vvec = d4_vector(0.0, 0.0, 1.0);
+    item->usteps = 4;
+    item->vsteps = 4;
+    item->fps = DEFAULT_FPS;
+    item->accelerator = ACCELERATOR_AUTO;
+    item->own_material = 0;
+    p->palette_count = 0;
+}
+
+/// @brief Starts building a shape of the type named `type`, as a prototype if `prototype` is set.
+static int _shape_start(Parser *p, Text type, int prototype) {
+    static const struct { const char *word; int type; } SHAPES[] = {
+        { "sphere", SHAPE_SPHERE }, { "plane", SHAPE_PLANE }, { "cube", SHAPE_CUBE },
+        { "cylinder", SHAPE_CYLINDER }, { "cone", SHAPE_CONE }, { "mesh", SHAPE_MESH }, { "group", SHAPE_GROUP },
+        { "sphere-cloud", SHAPE_SPHERE_CLOUD }, { "csg", SHAPE_CSG },
+    };
+    size_t i = 0;
+    while (i < sizeof(SHAPES) / sizeof(SHAPES[0]) && !_is(type, SHAPES[i].word)) {
+        i++;
+    }
+    if (i == sizeof(SHAPES) / sizeof(SHAPES[0])) {
+        return _error(p, "cannot add '%.*s'", (int)type.len, type.s);
+    }
+
+    Item *item = p->item;
+    item->kind = ITEM_SHAPE;
+    item->prototype = prototype;
+    if (item != p->items) {
+        item->shape = &item->child;
+    } else {
+        World *world = &p->scene->world;
+        Shape **shapes = prototype ? &world->prototypes : &world->objects;
+        size_t *count = prototype ? &world->prototype_count : &world->object_count;
+        if (_reserve((void **)shapes, prototype ? &p->prototype_capacity : &p->object_capacity, *count + 1, sizeof(Shape))) {
+            return _error(p, "out of memory");
+        }
+        item->shape = &(*shapes)[(*count)++];
+    }
+    const char *name = prototype ? item->define.name : SHAPES[i].word;
+    if (SHAPES[i].type == SHAPE_GROUP || SHAPES[i].type == SHAPE_CSG) {
+        *item->shape = SHAPES[i].type == SHAPE_CSG ? csg_new(CSG_UNION, p->identity, name) : group_new(p->identity, name);
+        return item->shape->group == NULL ? _error(p, "out of memory") : 0;
+    }
+    *item->shape = shape_from_parts(SHAPES[i].type, p->identity, p->identity, MATERIAL_UNSET, name, -INFINITY, INFINITY, 0);
+    return 0;
+}
+
+static int _item_kind(Parser *p, const Line *line) {
+    Item *item = p->item;
+    Text v = line->value;
+    if (item != p->items) {
+        // A group's child
+        return _is(line->key, "add") ? _shape_start(p, v, 0) : _error(p, "groups hold only shapes");
+    }
+    if (_is(line->key, "define")) {
+        item->kind = ITEM_DEFINE;
+        item->define = (Define) { 0 };
+        item->define.material_index = MATERIAL_UNSET;
+        return _read_name(p, v, item->define.name);
+    }
+    if (!_is(line->key, "add")) {
+        return _error(p, "items start with 'add' or 'define'");
+    }
+
+    if (_is(v, "camera")) {
+        item->kind = ITEM_CAMERA;
+    } else if (_is(v, "light")) {
+        item->kind = ITEM_LIGHT;
+    } else if (_is(v, "animation")) {
+        item->kind = ITEM_ANIMATION;
+    } else if (_is(v, "accelerator")) {
+        item->kind = ITEM_ACCELERATOR;
+    } else if (_is(v, "instance")) {
+        World *world = &p->scene->world;
+        if (_reserve((void **)&world->instances, &p->instance_capacity, world->instance_count + 1, sizeof(Instance))) {
+            return _error(p, "out of memory");
+        }
+        item->kind = ITEM_INSTANCE;
+        item->instance = &world->instances[world->instance_count++];
+        *item->instance = (Instance) { UINT32_MAX, INSTANCE_PROTOTYPE_MATERIAL, p->identity, p->identity, 0 };
+    } else {
+        return _shape_start(p, v, 0);
+    }
+    return 0;
+}
+
+static int _shape_key(Parser *p, const Line *line) {
+    Shape *shape = p->item->shape;
+    Text v = line->value;
+    if (shape_is_group(shape)) {
+        // Groups have only a name, a transform, keyframes and children, which have the rest, and CSG shapes
+        // an operation too
+        if (_is(line->key, "children")) {
+            return _expect_block(p, line) || _push(p, BLOCK_CHILDREN, line->indent);
+        }
+        if (_is(line->key, "operation") && shape->type == SHAPE_CSG) {
+            if (_expect_value(p, line)) {
+                return 1;
+            } else if (_is(v, "union")) {
+                shape->group->operation = CSG_UNION;
+            } else if (_is(v, "intersection")) {
+                shape->group->operation = CSG_INTERSECTION;
+            } else if (_is(v, "difference")) {
+                shape->group->operation = CSG_DIFFERENCE;
+            } else {
+                return _error(p, "unknown operation '%.*s'", (int)v.len, v.s);
+            }
+            return 0;
+        }
+        if (!_is(line->key, "name") && !_is(line->key, "transform") && !_is(line->key, "keyframes")) {
+            return _unknown_key(p, line);
+        }
+    }
+    if (_is(line->key, "material")) {
+        if (v.len == 0) {
+            p->item->material = p->default_material;
+            p->item->own_material = 1;
+            return _push_material(p, BLOCK_MATERIAL, line->indent, &p->item->material);
+        }
+        Define *d = _define_find(p, v, DEFINE_MATERIAL);
+        p->item->own_material = 0;
+        return d == NULL || _define_material_index(p, d, &shape->material);
+    }
+    if (_is(line->key, "transform")) {
+        return _expect_block(p, line) || _push_transform(p, line->indent, &shape->transform, &shape->inv_transform);
+    }
+    if (_is(line->key, "palette") && shape->type == SHAPE_SPHERE_CLOUD) {
+        return _expect_block(p, line) || _push(p, BLOCK_PALETTE, line->indent);
+    }
+    if (_is(line->key, "keyframes")) {
+        if (p->item->prototype) {
+            return _error(p, "prototypes cannot have keyframes, but their instances' transforms can be changed");
+        }
+        if (p->item != p->items) {
+            return _error(p, "children of groups cannot have keyframes, but the groups can");
+        }
+        return _expect_block(p, line) || _push(p, BLOCK_KEYFRAMES, line->indent);
+    }
+    if (_expect_value(p, line)) {
+        return 1;
+    }
+    if (_is(line->key, "name")) {
+        return _read_name(p, v, shape->name);
+    } else if (_is(line->key, "min")) {
+        return _read_number(p, v, &shape->ymin);
+    } else if (_is(line->key, "max")) {
+        return _read_number(p, v, &shape->ymax);
+    } else if (_is(line->key, "closed")) {
+        return _read_bool(p, v, &shape->closed);
+    } else if (_is(line->key, "file") && (shape->type == SHAPE_MESH || shape->type == SHAPE_SPHERE_CLOUD)) {
+        return _read_file(p, v, p->item->file);
+    } else if (_is(line->key, "smooth") && shape->type == SHAPE_MESH) {
+        return _read_bool(p, v, &p->item->smooth);
+    }
+    return _unknown_key(p, line);
+}
+
+static int _instance_key(Parser *p, const Line *line) {
+    Instance *instance = p->item->instance;
+    Text v = line->value;
+    if (_is(line->key, "material")) {
+        if (v.len == 0) {
+            // A material of the instance's own
+            p->item->material = p->default_material;
+            p->item->own_material = 1;
+            return _push_material(p, BLOCK_MATERIAL, line->indent, &p->item->material);
+        }
+        Define *d = _define_find(p, v, DEFINE_MATERIAL);
+        p->item->own_material = 0;
+        return d == NULL || _define_material_index(p, d, &instance->material);
+    }
+    if (_is(line->key, "transform")) {
+        return _expect_block(p, line) || _push_transform(p, line->indent, &instance->transform, &instance->inv_transform);
+    }
+    if (_is(line->key, "of")) {
+        const Define *d = _expect_value(p, line) ? NULL : _define_find(p, v, DEFINE_SHAPE);
+        if (d == NULL) {
+            return 1;
+        }
+        instance->prototype = d->prototype;
+        return 0;
+    }
+    return _unknown_key(p, line);
+}
+
+static int _item_key(Parser *p, const Line *line) {
+    Item *item = p->item;
+    if (item->kind == ITEM_NONE) {
+        return _item_kind(p, line);
+    }
+
+    Text v = line->value;
+    switch (item->kind) {
+        case ITEM_SHAPE:
+            return _shape_key(p, line);
+        case ITEM_INSTANCE:
+            return _instance_key(p, line);
+        case ITEM_DEFINE:
+            if (_is(line->key, "value")) {
+                return _expect_block(p, line) || _push(p, BLOCK_VALUE, line->indent);
+            } else if (_is(line->key, "shape")) {
+                if (item->define.kind != DEFINE_UNSET) {
+                    return _error(p, "'%s' already has a value", item->define.name);
+                }
+                // The rest of the item describes the prototype, like a shape of its own
+                return _expect_value(p, line) || _shape_start(p, v, 1);
+            } else if (_is(line->key, "extend")) {
+                Define *define = &item->define;
+                const Define *base = _define_find(p, v, DEFINE_UNSET);
+                if (base == NULL) {
+                    return 1;
+                }
+                if (base->kind == DEFINE_SHAPE) {
+                    return _error(p, "shapes cannot be extended, but instances of them can have their own material");
+                }
+                define->kind = base->kind;
+                define->material = base->material;
+                define->material_index = base->material_index;
+                define->m = base->m;
+                define->inv = base->inv;
+                return 0;
+            }
+            break;
+        case ITEM_CAMERA:
+            if (_expect_value(p, line)) {
+                return 1;
+            } else if (_is(line->key, "width")) {
+                return _read_int(p, v, &item->width);
+            } else if (_is(line->key, "height")) {
+                return _read_int(p, v, &item->height);
+            } else if (_is(line->key, "field-of-view")) {
+                return _read_number(p, v, &item->field_of_view);
+            } else if (_is(line->key, "from")) {
+                return _read_point(p, v, &item->from);
+            } else if (_is(line->key, "to")) {
+                return _read_point(p, v, &item->to);
+            } else if (_is(line->key, "up")) {
+                return _read_vector(p, v, &item->up);
+            }
+            break;
+        case ITEM_LIGHT:
+            if (_expect_value(p, line)) {
+                return 1;
+            } else if (_is(line->key, "at")) {
+                return _read_point(p, v, &item->at);
+            } else if (_is(line->key, "intensity")) {
+                return _read_color(p, v, &item->intensity);
+            } else if (_is(line->key, "falloff")) {
+                return _read_number(p, v, &item->falloff);
+            } else if (_is(line->key, "corner")) {
+                item->area = 1;
+                return _read_point(p, v, &item->at);
+            } else if (_is(line->key, "uvec")) {
+                return _read_vector(p, v, &item->uvec);
+            } else if (_is(line->key, "vvec")) {
+                return _read_vector(p, v, &item->vvec);
+            } else if (_is(line->key, "usteps")) {
+                return _read_int(p, v, &item->usteps);
+            } else if (_is(line->key, "vsteps")) {
+                return _read_int(p, v, &item->vsteps);
+            }
+            break;
+        case ITEM_ANIMATION:
+            if (_is(line->key, "fps")) {
+                return _expect_value(p, line) || _read_number(p, v, &item->fps);
+            }
+            break;
+        case ITEM_ACCELERATOR:
+            if (_is(line->key, "type")) {
+                if (_expect_value(p, line)) {
+                    return 1;
+                } else if (_is(v, "auto")) {
+                    item->accelerator = ACCELERATOR_AUTO;
+                } else if (_is(v, "bvh")) {
+                    item->accelerator = ACCELERATOR_BVH;
+                } else if (_is(v, "grid")) {
+                    item->accelerator = ACCELERATOR_GRID;
+                } else {
+                    return _error(p, "unknown accelerator '%.*s'", (int)v.len, v.s);
+                }
+                return 0;
+            }
+            break;
+        default:
+            break;
+    }
+    return _unknown_key(p, line);
+}
+
+/// @brief Adds a track for the shape just read if it has keyframes.
+static int _add_track(Parser *p) {
+    Item *item = p->item;
+    size_t key_count = p->key_count - item->first_key;
+    if (key_count == 0) {
+        return 0;
+    }
+    for (size_t i = item->first_key + 1; i < p->key_count; i++) {
+        if (p->keys[i].time <= p->keys[i - 1].time) {
+            return _error(p, "keyframes of '%s' are not in order of time", item->shape->name);
+        }
+    }
+    Animation *animation = &p->scene->animation;
+    size_t track_capacity = p->track_capacity;
+    if (_reserve((void **)&animation->tracks, &p->track_capacity, animation->track_count + 1, sizeof(Track))
+        || _reserve((void **)&p->track_keys, &track_capacity, animation->track_count + 1, sizeof(size_t))) {
+        return _error(p, "out of memory");
+    }
+    // Keys are pointed at once they are all read, since the array may yet move
+    size_t object = (size_t)(item->shape - p->scene->world.objects);
+    animation->tracks[animation->track_count] = (Track) { object, item->shape->transform, NULL, key_count };
+    p->track_keys[animation->track_count] = item->first_key;
+    animation->track_count++;
+    return 0;
+}
+
+/// @brief Points the mesh shape just read at its triangles, reading them unless another shape already has.
+static int _add_mesh(Parser *p) {
+    Item *item = p->item;
+    Scene *scene = p->scene;
+    if (item->file[0] == '\0') {
+        return _error(p, "meshes need a file");
+    }
+    for (size_t i = 0; i < scene->mesh_count; i++) {
+        if (scene->meshes[i].smooth == item->smooth && strcmp(scene->meshes[i].path, item->file) == 0) {
+            item->shape->mesh = scene->meshes[i].mesh;
+            return 0;
+        }
+    }
+
+    if (_reserve((void **)&scene->meshes, &p->mesh_capacity, scene->mesh_count + 1, sizeof(SceneMesh))) {
+        return _error(p, "out of memory");
+    }
+    Mesh *mesh = mesh_load_obj(item->file, item->smooth);
+    if (mesh == NULL) {
+        return _error(p, "failed to read mesh '%s'", item->file);
+    }
+    SceneMesh *m = &scene->meshes[scene->mesh_count++];
+    m->mesh = mesh;
+    memcpy(m->path, item->file, sizeof(m->path));
+    m->smooth = item->smooth;
+    item->shape->mesh = mesh;
+    return 0;
+}
+
+static int _palette_entry(Parser *p, Text entry) {
+    Define *d = _define_find(p, entry, DEFINE_MATERIAL);
+    if (d == NULL) {
+        return 1;
+    }
+    if (_reserve((void **)&p->palette, &p->palette_capacity, p->palette_count + 1, sizeof(uint32_t))) {
+        return _error(p, "out of memory");
+    }
+    return _define_material_index(p, d, &p->palette[p->palette_count++]);
+}
+
+static int _add_cloud(Parser *p) {
+    Item *item = p->item;
+    Scene *scene = p->scene;
+    if (item->file[0] == '\0') {
+        return _error(p, "sphere clouds need a file");
+    }
+    if (_reserve((void **)&scene->clouds, &p->cloud_capacity, scene->cloud_count + 1, sizeof(SphereCloud *))) {
+        return _error(p, "out of memory");
+    }
+    SphereCloud *cloud = sphere_cloud_load(item->file);
+    if (cloud == NULL) {
+        return _error(p, "failed to read particles '%s'", item->file);
+    }
+    scene->clouds[scene->cloud_count++] = cloud;
+    item->shape->cloud = cloud;
+    if (p->palette_count > 0 && sphere_cloud_set_palette(cloud, p->palette, p->palette_count)) {
+        return _error(p, "out of memory");
+    }
+    return 0;
+}
+
+/// @brief Moves the child just read into its group.
+static int _add_child(Parser *p) {
+    Item *item = p->item;
+    Shape *parent = (item - 1)->shape;
+    if (parent->type == SHAPE_CSG && parent->group->child_count == 2) {
+        return _error(p, "csg shapes combine exactly two shapes");
+    }
+    if (parent->type == SHAPE_CSG && !csg_can_combine(item->shape)) {
+        return _error(p, "csg shapes cannot combine meshes or sphere clouds");
+    }
+    if (group_add(parent, *item->shape)) {
+        return _error(p, "out of memory");
+    }
+    item->shape = NULL;  // Now the group's
+    return 0;
+}
+
+/// @brief Adds the item just read to the scene, or to its group.
+static int _item_end(Parser *p) {
+    Item *item = p->item;
+    Scene *scene = p->scene;
+    int line = p->line;
+    p->line = item->line;  // Errors refer to the start of the item
+    int err = 0;
+    switch (item->kind) {
+        case ITEM_NONE:
+            err = _error(p, "empty item");
+            break;
+        case ITEM_CAMERA:
+            if (item->width == 0 || item->height == 0) {
+                err = _error(p, "cameras need a width and a height");
+                break;
+            }
+            scene->camera = camera_new(item->width, item->height, item->field_of_view, view_transform(item->from, item->to, item->up));
+            p->has_camera = 1;
+            break;
+        case ITEM_LIGHT: {
+            World *world = &scene->world;
+            if (_reserve((void **)&world->lights, &p->light_capacity, world->light_count + 1, sizeof(PointLight))) {
+                err = _error(p, "out of memory");
+                break;
+            }
+            if (item->area && (item->usteps < 1 || item->vsteps < 1)) {
+                err = _error(p, "area lights need at least one step along each edge");
+                break;
+            }
+            PointLight light = item->area
+                ? area_light_new(item->at, item->uvec, item->usteps, item->vvec, item->vsteps, item->intensity)
+                : point_light_new(item->at, item->intensity);
+            light.falloff = item->falloff;
+            world->lights[world->light_count++] = light;
+            break;
+        }
+        case ITEM_SHAPE:
+            shape_classify(item->shape);  // Its transform was built in place
+            if (item->own_material) {
+                err = _material_index(p, &item->material, &item->shape->material);
+            } else if (item->shape->material == MATERIAL_UNSET) {
+                err = _material_index(p, &p->default_material, &item->shape->material);
+            }
+            err = err || (item->shape->type == SHAPE_MESH && _add_mesh(p))
+                || (item->shape->type == SHAPE_SPHERE_CLOUD && _add_cloud(p));
+            if (!err && item->shape->type == SHAPE_CSG && item->shape->group->child_count != 2) {
+                err = _error(p, "csg shapes combine exactly two shapes");
+            }
+            if (!err && shape_is_group(item->shape)) {
+                // Its transform may have come after its children
+                group_compose(item->shape);
+            }
+            if (!err && item != p->items) {
+                err = _add_child(p);
+            } else if (!err && item->prototype) {
+                item->define.kind = DEFINE_SHAPE;
+                item->define.prototype = (uint32_t)(item->shape - scene->world.prototypes);
+                err = _define_add(p, &item->define);
+            } else if (!err) {
+                err = _add_track(p);
+            }
+            break;
+        case ITEM_INSTANCE:
+            if (item->instance->prototype == UINT32_MAX) {
+                err = _error(p, "instances need the shape they place, given by 'of'");
+            } else if (item->own_material) {
+                err = _material_index(p, &item->material, &item->instance->material);
+            }
+            break;
+        case ITEM_ANIMATION:
+            scene->animation.fps = item->fps;
+            break;
+        case ITEM_ACCELERATOR:
+            scene->world.accelerator = item->accelerator;
+            break;
+        case ITEM_DEFINE:
+            if (item->define.kind == DEFINE_UNSET) {
+                err = _error(p, "'%s' has no value", item->define.name);
+                break;
+            }
+            err = _define_add(p, &item->define);
+            break;
+    }
+    p->line = line;
+    if (item != p->items) {
+        p->item--;
+    }
+    return err;
+}
+
+/// @brief Closes blocks until the one holding `line` is on top.
+static int _close_blocks(Parser *p, const Line *line) {
+    while (p->depth > 1) {
+        Block *top = _top(p);
+        // Entries of a list may line up with the key that opened it
+        int is_list = top->kind == BLOCK_TRANSFORM || top->kind == BLOCK_COLORS || top->kind == BLOCK_KEYFRAMES || top->kind == BLOCK_CHILDREN
+            || top->kind == BLOCK_PALETTE;
+        if (top->indent < line->dash || (line->list_item && is_list && top->indent == line->dash)) {
+            break;
+        }
+        p->depth--;
+        if (top->kind == BLOCK_ITEM && _item_end(p)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int _handle_line(Parser *p, const Line *line) {
+    if (_close_blocks(p, line)) {
+        return 1;
+    }
+
+    Block *block = _top(p);
+    if (block->kind == BLOCK_VALUE) {
+        // A define's value is a transform if it is a list, and a material otherwise
+        Define *define = &p->item->define;
+        DefineKind kind = line->list_item ? DEFINE_TRANSFORM : DEFINE_MATERIAL;
+        if (define->kind == DEFINE_UNSET) {
+            define->material = p->default_material;
+            define->m = p->identity;
+            define->inv = p->identity;
+        } else if (define->kind != kind) {
+            return _error(p, "'%s' extends a %s", define->name, DEFINE_KIND_NAMES[define->kind]);
+        }
+        define->kind = kind;
+        *block = kind == DEFINE_TRANSFORM
+            ? (Block) { BLOCK_TRANSFORM, block->indent, NULL, &define->m, &define->inv, 0 }
+            : (Block) { BLOCK_MATERIAL, block->indent, &define->material, NULL, NULL, 0 };
+    }
+
+    int lists = block->kind == BLOCK_ROOT || block->kind == BLOCK_TRANSFORM || block->kind == BLOCK_COLORS || block->kind == BLOCK_KEYFRAMES
+        || block->kind == BLOCK_CHILDREN || block->kind == BLOCK_PALETTE;
+    if (line->list_item != lists) {
+        return _error(p, line->list_item ? "unexpected list entry" : "expected a list entry starting with '- '");
+    }
+    int bare = block->kind == BLOCK_TRANSFORM || block->kind == BLOCK_COLORS || block->kind == BLOCK_PALETTE;
+    if ((line->key.len == 0) != bare) {
+        return _error(p, bare ? "expected a list entry without a key" : "expected 'key: value'");
+    }
+
+    switch (block->kind) {
+        case BLOCK_ROOT:
+            if (_push(p, BLOCK_ITEM, line->dash)) {
+                return 1;
+            }
+            _item_start(p);
+            return _item_key(p, line);
+        case BLOCK_ITEM:
+            return _item_key(p, line);
+        case BLOCK_CHILDREN:
+            if (p->item == &p->items[SCENE_MAX_NESTING]) {
+                return _error(p, "groups are nested too deeply");
+            }
+            if (_push(p, BLOCK_ITEM, line->dash)) {
+                return 1;
+            }
+            p->item++;
+            _item_start(p);
+            return _item_key(p, line);
+        case BLOCK_MATERIAL:
+            return _material_key(p, block, line);
+        case BLOCK_PATTERN:
+            return _pattern_key(p, block, line);
+        case BLOCK_COLORS:
+            return _color_entry(p, block, line->value);
+        case BLOCK_TRANSFORM:
+            return _transform_entry(p, block, line->value);
+        case BLOCK_PALETTE:
+            return _palette_entry(p, line->value);
+        case BLOCK_KEYFRAMES:
+            if (_reserve((void **)&p->keys, &p->key_capacity, p->key_count + 1, sizeof(Keyframe))) {
+                return _error(p, "out of memory");
+            }
+            p->keys[p->key_count++] = keyframe_new(0.0, d4_vector(0.0, 0.0, 0.0), d4_vector(0.0, 0.0, 0.0), d4_vector(1.0, 1.0, 1.0));
+            return _push(p, BLOCK_KEYFRAME, line->dash) || _keyframe_key(p, line);
+        case BLOCK_KEYFRAME:
+            return _keyframe_key(p, line);
+        default:
+            return _error(p, "unexpected line");
+    }
+}
+
+/// @brief Splits the line [begin, end) into its indentation, key and value, and handles it.
+static int _parse_line(void *user, const char *begin, const char *end) {
+    Parser *p = user;
+    p->line++;
+    // Drop comments and trailing whitespace
+    const char *hash = memchr(begin, '#', (size_t)(end - begin));
+    if (hash != NULL) {
+        end = hash;
+    }
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+        end--;
+    }
+    const char *s = begin;
+    while (s < end && *s == ' ') {
+        s++;
+    }
+    if (s == end) {
+        return 0;
+    }
+    if (*s == '\t') {
+        return _error(p, "indent with spaces, not tabs");
+    }
+
+    Line line = { 0 };
+    line.dash = (int)(s - begin);
+    if (*s == '-' && (s + 1 == end || s[1] == ' ')) {
+        line.list_item = 1;
+        for (s++; s < end && *s == ' '; s++) {
+        }
+        if (s == end) {
+            return _error(p, "empty list entry");
+        }
+    }
+    line.indent = (int)(s - begin);
+
+    size_t rest = (size_t)(end - s);
+    const char *colon = *s == '[' ? NULL : memchr(s, ':', rest);
+    if (colon != NULL) {
+        line.key = _trim(s, colon);
+        line.value = _trim(colon + 1, end);
+        if (line.key.len == 0) {
+            return _error(p, "missing key before ':'");
+        }
+    } else {
+        line.value = _trim(s, end);
+    }
+    return _handle_line(p, &line);
+}
+
+static void _parser_free(Parser *p) {
+    // Children of groups that were still being read when an error stopped the parser
+    for (int i = 1; i <= SCENE_MAX_NESTING; i++) {
+        Item *item = &p->items[i];
+        if (item->shape == &item->child && shape_is_group(&item->child)) {
+            group_free(&item->child);
+        }
+    }
+    free(p->keys);
+    free(p->track_keys);
+    free(p->defines);
+    free(p->material_table);
+    free(p->palette);
+}
+
+int scene_load(const char *path, Scene *out) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open scene file %s\n", path);
+        return 1;
+    }
+    *out = (Scene) { world_new(), camera_default(), { NULL, 0, DEFAULT_FPS }, NULL, NULL, 0, NULL, 0, NULL };
+    Parser p = { 0 };
+    p.path = path;
+    p.scene = out;
+    p.default_material = material_default();
+    p.identity = mat4d_identity();
+    p.blocks[0] = (Block) { BLOCK_ROOT, -1, NULL, NULL, NULL, 0 };
+    p.depth = 1;
+    p.item = p.items;
+
+    int err = text_for_each_line(fp, _parse_line, &p);
+    if (err < 0 && ferror(fp)) {
+        err = _error(&p, "failed to read file");
+    } else if (err < 0) {
+        p.line++;
+        err = _error(&p, "line is too long");
+    }
+    fclose(fp);
+
+    // Close the last item
+    if (!err) {
+        Line end = { 0 };
+        end.dash = -1;
+        err = _close_blocks(&p, &end);
+    }
+    if (!err && !p.has_camera) {
+        fprintf(stderr, "%s: the scene has no camera\n", path);
+        err = 1;
+    }
+    if (!err) {
+        for (size_t i = 0; i < out->animation.track_count; i++) {
+            out->animation.tracks[i].keys = p.keys + p.track_keys[i];
+        }
+        out->keyframes = p.keys;
+        p.keys = NULL;
+    }
+
+    _parser_free(&p);
+    if (err) {
+        scene_free(out);
+    }
+    return err;
+}
+
+void scene_free(Scene *scene) {
+    world_free_bvh(&scene->world);
+    for (size_t i = 0; i < scene->cloud_count; i++) {
+        sphere_cloud_destroy(scene->clouds[i]);
+    }
+    free(scene->clouds);
+    if (scene->mapping != NULL) {
+        // The meshes' arrays are in the mapping too
+        for (size_t i = 0; i < scene->mesh_count; i++) {
+            free(scene->meshes[i].mesh);
+        }
+        free(scene->meshes);
+        scene_cache_unmap(scene->mapping);
+    } else {
+        for (size_t i = 0; i < scene->mesh_count; i++) {
+            mesh_destroy(scene->meshes[i].mesh);
+        }
+        for (size_t i = 0; i < scene->world.object_count; i++) {
+            group_free(&scene->world.objects[i]);
+        }
+        for (size_t i = 0; i < scene->world.prototype_count; i++) {
+            group_free(&scene->world.prototypes[i]);
+        }
+        free(scene->meshes);
+        free(scene->world.objects);
+        free(scene->world.prototypes);
+        free(scene->world.materials);
+        free(scene->world.instances);
+        free(scene->world.lights);
+        free(scene->animation.tracks);
+        free(scene->keyframes);
+    }
+    *scene = (Scene) { world_new(), camera_default(), { NULL, 0, DEFAULT_FPS }, NULL, NULL, 0, NULL, 0, NULL };
+}
@@ -0,0 +1,779 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <group.h>
+#include <mapped_file.h>
+#include <scene.h>
+
+/* Compiled scene files: a header followed by one section per array, each aligned so that it can be used
+in place once mapped. Nothing in the arrays is a pointer except Track.keys, which is stored as an index
+into the keyframes section, Shape.mesh, which is stored as an index into the meshes section, and
+Shape.group, which is rebuilt from the group records. All are fixed up after mapping. Shapes and instances
+refer to materials, and instances to prototypes, by index already. Each mesh's vertices, triangles and BVH are aligned arrays of
+their own in the mesh data, which the mesh's record gives the offsets of. The children of every group are
+stored together, each group's after its parent's, and a group's record gives where its children start. */
+
+static const char SCENE_FILE_MAGIC[8] = "BEAKSCN";
+// Bump whenever the header or the sections change
+static const uint32_t SCENE_FILE_VERSION = 9;
+// Written in the file's byte order, so that a file from a machine with another byte order reads differently
+static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+// Sections start at multiples of this many bytes, which suits any of the arrays and a cache line
+#define SECTION_ALIGNMENT 64
+
+typedef enum {
+    SECTION_OBJECTS,
+    SECTION_LIGHTS,
+    SECTION_TRACKS,
+    SECTION_TRACK_KEYS,      // Index of each track's first keyframe
+    SECTION_KEYFRAMES,
+    SECTION_PROTOTYPES,
+    SECTION_MATERIALS,
+    SECTION_INSTANCES,
+    SECTION_BVH_BOUNDS,
+    SECTION_BVH_REVISIONS,
+    SECTION_BVH_UNBOUNDED,
+    SECTION_BVH_NODES,
+    SECTION_BVH_INDICES,
+    SECTION_MESHES,          // A MeshRecord for each mesh
+    SECTION_MESH_DATA,       // The arrays of every mesh
+    SECTION_MESH_SHAPES,     // A MeshShape for each shape that is a mesh
+    SECTION_GROUPS,          // A GroupRecord for each group
+    SECTION_CHILDREN,        // The children of every group
+    SECTION_CHILD_LOCALS,    // Their transforms relative to their groups
+    SECTION_CHILD_LOCAL_INVS,
+    SECTION_CHILD_BOUNDS,
+    SECTION_COUNT,
+} Section;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} SectionEntry;
+
+typedef struct {
+    char path[SCENE_MAX_PATH];   // Of the OBJ file the mesh was read from
+    uint32_t smooth;
+    uint64_t source_size;        // Of that file, as for the scene file
+    int64_t source_mtime;
+    uint64_t vertex_count;
+    uint64_t triangle_count;
+    uint64_t node_count;
+    uint64_t primitive_count;
+    double built_cost;
+    Aabb bounds;
+    // File offsets of the mesh's arrays. Normals are at 0 if the mesh has none.
+    uint64_t positions;
+    uint64_t normals;
+    uint64_t indices;
+    uint64_t nodes;
+    uint64_t bvh_indices;
+} MeshRecord;
+
+typedef struct {
+    uint64_t object;         // Index of an object, or past the objects, of a prototype, or past those, of a child of a group
+    uint64_t mesh;
+} MeshShape;
+
+// Parent of groups that are not children of another
+#define GROUP_NO_PARENT UINT64_MAX
+
+typedef struct {
+    uint64_t shape;          // The group's shape, numbered as in MeshShape
+    uint64_t first_child;    // Index of the group's first child in the children sections
+    uint64_t child_count;
+    uint64_t parent;         // Index of the group's parent's record, or GROUP_NO_PARENT
+    uint64_t index;          // Among the parent's children
+    Aabb bounds;
+    uint64_t revision;
+    uint64_t operation;      // CSG_*
+} GroupRecord;
+
+/// The groups of a scene, flattened for writing.
+typedef struct {
+    GroupRecord *records;
+    const Group **groups;    // The group of each record
+    size_t group_count;
+    Shape *children;
+    Mat4D *locals;
+    Mat4D *local_invs;
+    Aabb *child_bounds;
+    size_t child_count;
+} GroupTable;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t layout[10];     // Sizes of the structs stored in sections. See _layout.
+    uint64_t source_size;    // Of the scene file this was compiled from, or 0 if unknown
+    int64_t source_mtime;
+    Camera camera;
+    double fps;
+    uint64_t accelerator;    // The world's
+    uint64_t object_count;
+    uint64_t prototype_count;
+    uint64_t material_count;
+    uint64_t instance_count;
+    uint64_t light_count;
+    uint64_t track_count;
+    uint64_t key_count;
+    uint64_t has_bvh;
+    uint64_t bvh_node_count;
+    uint64_t bvh_primitive_count;
+    uint64_t bvh_unbounded_count;
+    double bvh_built_cost;
+    uint64_t mesh_count;
+    uint64_t mesh_shape_count;
+    uint64_t group_count;
+    uint64_t child_count;
+    SectionEntry sections[SECTION_COUNT];
+} SceneFileHeader;
+
+struct SceneMapping {
+    void *data;
+    size_t size;
+    Group *groups;           // Around their arrays in the mapping
+    Shape *children;         // Of every group
+    size_t child_count;
+    MappedFile file;         // Whose data and size the fields above repeat
+};
+
+static void _layout(uint32_t out[10]) {
+    uint32_t sizes[10] = {
+        sizeof(Shape), sizeof(PointLight), sizeof(Track), sizeof(Keyframe),
+        sizeof(Aabb), sizeof(BvhNode), sizeof(Camera), sizeof(SceneFileHeader),
+        sizeof(Material), sizeof(Instance),
+    };
+    memcpy(out, sizes, sizeof(sizes));
+}
+
+/// @brief Reads the size and modification time of the file at `path`. Returns 0 on success.
+static int _source_stamp(const char *path, uint64_t *out_size, int64_t *out_mtime) {
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(path, &st) != 0) {
+        return 1;
+    }
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return 1;
+    }
+#endif
+    *out_size = (uint64_t)st.st_size;
+    *out_mtime = (int64_t)st.st_mtime;
+    return 0;
+}
+
+// Writing
+
+/// @brief Appends `size` bytes to `fp` at the next aligned offset, and records where in `entry`.
+static int _write_section(FILE *fp, uint64_t *offset, SectionEntry *entry, const void *data, size_t size) {
+    static const char PADDING[SECTION_ALIGNMENT] = { 0 };
+    size_t pad = (size_t)((SECTION_ALIGNMENT - *offset % SECTION_ALIGNMENT) % SECTION_ALIGNMENT);
+    if (fwrite(PADDING, 1, pad, fp) != pad || (size > 0 && fwrite(data, 1, size, fp) != size)) {
+        return 1;
+    }
+    *entry = (SectionEntry) { *offset + pad, size };
+    *offset += pad + size;
+    return 0;
+}
+
+/// @brief Returns the `i`th shape, numbered as in MeshShape.
+static Shape *_numbered_shape(const World *world, Shape *children, uint64_t i) {
+    if (i < world->object_count) {
+        return &world->objects[i];
+    }
+    i -= world->object_count;
+    return i < world->prototype_count ? &world->prototypes[i] : &children[i - world->prototype_count];
+}
+
+static void _count_groups(const Shape *shape, size_t *group_count, size_t *child_count) {
+    if (!shape_is_group(shape)) {
+        return;
+    }
+    const Group *group = shape->group;
+    (*group_count)++;
+    *child_count += group->child_count;
+    for (size_t i = 0; i < group->child_count; i++) {
+        _count_groups(&group->children[i], group_count, child_count);
+    }
+}
+
+static void _free_group_table(GroupTable *table) {
+    free(table->records);
+    free(table->groups);
+    free(table->children);
+    free(table->locals);
+    free(table->local_invs);
+    free(table->child_bounds);
+}
+
+/// @brief Lists every group of the world's objects and prototypes, breadth first so that each group's
+/// parent comes before it, and gathers their children in the same order. Returns 0 on success.
+static int _flatten_groups(const World *world, GroupTable *table) {
+    size_t shape_count = world->object_count + world->prototype_count;
+    size_t group_count = 0;
+    size_t child_count = 0;
+    for (size_t i = 0; i < shape_count; i++) {
+        _count_groups(_numbered_shape(world, NULL, i), &group_count, &child_count);
+    }
+    *table = (GroupTable) { 0 };
+    table->records = malloc(group_count > 0 ? group_count * sizeof(GroupRecord) : 1);
+    table->groups = malloc(group_count > 0 ? group_count * sizeof(Group *) : 1);
+    table->children = malloc(child_count > 0 ? child_count * sizeof(Shape) : 1);
+    table->locals = malloc(child_count > 0 ? child_count * sizeof(Mat4D) : 1);
+    table->local_invs = malloc(child_count > 0 ? child_count * sizeof(Mat4D) : 1);
+    table->child_bounds = malloc(child_count > 0 ? child_count * sizeof(Aabb) : 1);
+    if (table->records == NULL || table->groups == NULL || table->children == NULL || table->locals == NULL
+        || table->local_invs == NULL || table->child_bounds == NULL) {
+        _free_group_table(table);
+        return 1;
+    }
+
+    // The records double as the queue of groups whose children are yet to be gathered
+    for (size_t i = 0; i < shape_count; i++) {
+        const Shape *shape = _numbered_shape(world, NULL, i);
+        if (shape_is_group(shape)) {
+            table->records[table->group_count] = (GroupRecord) { i, 0, 0, GROUP_NO_PARENT, 0, aabb_empty(), 0, 0 };
+            table->groups[table->group_count++] = shape->group;
+        }
+    }
+    for (size_t i = 0; i < table->group_count; i++) {
+        const Group *group = table->groups[i];
+        GroupRecord *r = &table->records[i];
+        size_t first = table->child_count;
+        r->first_child = first;
+        r->child_count = group->child_count;
+        r->bounds = group->bounds;
+        r->revision = group->revision;
+        r->operation = (uint64_t)group->operation;
+        memcpy(&table->children[first], group->children, group->child_count * sizeof(Shape));
+        memcpy(&table->locals[first], group->locals, group->child_count * sizeof(Mat4D));
+        memcpy(&table->local_invs[first], group->local_invs, group->child_count * sizeof(Mat4D));
+        memcpy(&table->child_bounds[first], group->child_bounds, group->child_count * sizeof(Aabb));
+        table->child_count += group->child_count;
+        for (size_t j = 0; j < group->child_count; j++) {
+            Shape *child = &table->children[first + j];
+            if (shape_is_group(child)) {
+                table->records[table->group_count] = (GroupRecord) { shape_count + first + j, 0, 0, i, j, aabb_empty(), 0, 0 };
+                table->groups[table->group_count++] = child->group;
+            }
+            child->group = NULL;
+        }
+    }
+    return 0;
+}
+
+/// @brief Writes the arrays of every mesh as one section, recording where each went in `records`, then
+/// the records and the meshes the shapes refer to. If the scene has a source, so do the meshes, which are
+/// stamped like it.
+static int _write_meshes(FILE *fp, uint64_t *offset, SceneFileHeader *header, const Scene *scene, const char *source_path, const GroupTable *groups, MeshRecord *records, MeshShape *mesh_shapes) {
+    SectionEntry *sections = header->sections;
+    uint64_t data_start = *offset;
+    int first = 1;
+    for (size_t i = 0; i < scene->mesh_count; i++) {
+        const Mesh *mesh = scene->meshes[i].mesh;
+        MeshRecord *r = &records[i];
+        *r = (MeshRecord) {
+            { 0 }, (uint32_t)scene->meshes[i].smooth, 0, 0,
+            mesh->vertex_count, mesh->triangle_count, mesh->bvh.node_count, mesh->bvh.primitive_count,
+            mesh->bvh.built_cost, mesh->bounds, 0, 0, 0, 0, 0,
+        };
+        memcpy(r->path, scene->meshes[i].path, sizeof(r->path));
+        if (source_path != NULL && _source_stamp(r->path, &r->source_size, &r->source_mtime)) {
+            fprintf(stderr, "Failed to read %s\n", r->path);
+            return 1;
+        }
+        SectionEntry entry;
+        if (_write_section(fp, offset, &entry, mesh->positions, 3 * mesh->vertex_count * sizeof(float))) {
+            return 1;
+        }
+        r->positions = entry.offset;
+        if (first) {
+            // The section starts at the first array, past any padding
+            data_start = entry.offset;
+            first = 0;
+        }
+        if (mesh->normals != NULL) {
+            if (_write_section(fp, offset, &entry, mesh->normals, 3 * mesh->vertex_count * sizeof(float))) {
+                return 1;
+            }
+            r->normals = entry.offset;
+        }
+        if (_write_section(fp, offset, &entry, mesh->indices, 3 * mesh->triangle_count * sizeof(uint32_t))) {
+            return 1;
+        }
+        r->indices = entry.offset;
+        if (_write_section(fp, offset, &entry, mesh->bvh.nodes, mesh->bvh.node_count * sizeof(BvhNode))) {
+            return 1;
+        }
+        r->nodes = entry.offset;
+        if (_write_section(fp, offset, &entry, mesh->bvh.indices, mesh->bvh.primitive_count * sizeof(uint32_t))) {
+            return 1;
+        }
+        r->bvh_indices = entry.offset;
+    }
+    sections[SECTION_MESH_DATA] = (SectionEntry) { data_start, *offset - data_start };
+
+    uint64_t mesh_shape_count = 0;
+    const World *world = &scene->world;
+    for (size_t i = 0; i < world->object_count + world->prototype_count + groups->child_count; i++) {
+        const Shape *shape = _numbered_shape(world, groups->children, i);
+        if (shape->type != SHAPE_MESH) {
+            continue;
+        }
+        size_t mesh = 0;
+        while (mesh < scene->mesh_count && scene->meshes[mesh].mesh != shape->mesh) {
+            mesh++;
+        }
+        if (mesh == scene->mesh_count) {
+            fprintf(stderr, "Mesh of %s is not one of the scene's meshes\n", shape->name);
+            return 1;
+        }
+        mesh_shapes[mesh_shape_count++] = (MeshShape) { i, mesh };
+    }
+    header->mesh_count = scene->mesh_count;
+    header->mesh_shape_count = mesh_shape_count;
+    return _write_section(fp, offset, &sections[SECTION_MESHES], records, scene->mesh_count * sizeof(MeshRecord))
+        || _write_section(fp, offset, &sections[SECTION_MESH_SHAPES], mesh_shapes, mesh_shape_count * sizeof(MeshShape));
+}
+
+int scene_cache_write(const Scene *scene, const char *path, const char *source_path) {
+    const World *world = &scene->world;
+    const Animation *animation = &scene->animation;
+    if (scene->cloud_count > 0) {
+        // Their particles are already mapped from dumps of their own
+        fprintf(stderr, "Scenes with sphere clouds cannot be compiled\n");
+        return 1;
+    }
+    SceneFileHeader header = { 0 };
+    memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+    header.version = SCENE_FILE_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    _layout(header.layout);
+    if (source_path != NULL && _source_stamp(source_path, &header.source_size, &header.source_mtime)) {
+        fprintf(stderr, "Failed to read %s\n", source_path);
+        return 1;
+    }
+    header.camera = scene->camera;
+    header.fps = animation->fps;
+    header.accelerator = (uint64_t)world->accelerator;
+    header.object_count = world->object_count;
+    header.prototype_count = world->prototype_count;
+    header.material_count = world->material_count;
+    header.instance_count = world->instance_count;
+    header.light_count = world->light_count;
+    header.track_count = animation->track_count;
+
+    // Tracks may point into any keyframe array, so their keys are gathered into one section
+    size_t key_count = 0;
+    for (size_t i = 0; i < animation->track_count; i++) {
+        key_count += animation->tracks[i].key_count;
+    }
+    header.key_count = key_count;
+    size_t track_bytes = animation->track_count * sizeof(Track);
+    Track *tracks = malloc(track_bytes > 0 ? track_bytes : 1);
+    uint64_t *track_keys = malloc(animation->track_count > 0 ? animation->track_count * sizeof(uint64_t) : 1);
+    Keyframe *keys = malloc(key_count > 0 ? key_count * sizeof(Keyframe) : 1);
+    GroupTable groups;
+    if (_flatten_groups(world, &groups)) {
+        free(tracks);
+        free(track_keys);
+        free(keys);
+        return 1;
+    }
+    header.group_count = groups.group_count;
+    header.child_count = groups.child_count;
+    size_t mesh_shape_count = 0;
+    for (size_t i = 0; i < world->object_count + world->prototype_count + groups.child_count; i++) {
+        mesh_shape_count += _numbered_shape(world, groups.children, i)->type == SHAPE_MESH;
+    }
+    MeshRecord *mesh_records = malloc(scene->mesh_count > 0 ? scene->mesh_count * sizeof(MeshRecord) : 1);
+    MeshShape *mesh_shapes = malloc(mesh_shape_count > 0 ? mesh_shape_count * sizeof(MeshShape) : 1);
+    if (tracks == NULL || track_keys == NULL || keys == NULL || mesh_records == NULL || mesh_shapes == NULL) {
+        free(tracks);
+        free(track_keys);
+        free(keys);
+        free(mesh_records);
+        free(mesh_shapes);
+        _free_group_table(&groups);
+        return 1;
+    }
+    size_t next_key = 0;
+    for (size_t i = 0; i < animation->track_count; i++) {
+        const Track *track = &animation->tracks[i];
+        tracks[i] = *track;
+        tracks[i].keys = NULL;
+        track_keys[i] = next_key;
+        memcpy(&keys[next_key], track->keys, track->key_count * sizeof(Keyframe));
+        next_key += track->key_count;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        free(tracks);
+        free(track_keys);
+        free(keys);
+        free(mesh_records);
+        free(mesh_shapes);
+        _free_group_table(&groups);
+        fprintf(stderr, "Failed to write compiled scene %s\n", path);
+        return 1;
+    }
+
+    // The header goes in last, so that a file cut short by a failed write is never mistaken for a valid one
+    SceneFileHeader placeholder = { 0 };
+    int err = fwrite(&placeholder, sizeof(placeholder), 1, fp) != 1;
+    uint64_t offset = sizeof(placeholder);
+    SectionEntry *sections = header.sections;
+    err = err
+        || _write_section(fp, &offset, &sections[SECTION_OBJECTS], world->objects, world->object_count * sizeof(Shape))
+        || _write_section(fp, &offset, &sections[SECTION_LIGHTS], world->lights, world->light_count * sizeof(PointLight))
+        || _write_section(fp, &offset, &sections[SECTION_TRACKS], tracks, track_bytes)
+        || _write_section(fp, &offset, &sections[SECTION_TRACK_KEYS], track_keys, animation->track_count * sizeof(uint64_t))
+        || _write_section(fp, &offset, &sections[SECTION_KEYFRAMES], keys, key_count * sizeof(Keyframe))
+        || _write_section(fp, &offset, &sections[SECTION_PROTOTYPES], world->prototypes, world->prototype_count * sizeof(Shape))
+        || _write_section(fp, &offset, &sections[SECTION_MATERIALS], world->materials, world->material_count * sizeof(Material))
+        || _write_section(fp, &offset, &sections[SECTION_INSTANCES], world->instances, world->instance_count * sizeof(Instance))
+        || _write_section(fp, &offset, &sections[SECTION_GROUPS], groups.records, groups.group_count * sizeof(GroupRecord))
+        || _write_section(fp, &offset, &sections[SECTION_CHILDREN], groups.children, groups.child_count * sizeof(Shape))
+        || _write_section(fp, &offset, &sections[SECTION_CHILD_LOCALS], groups.locals, groups.child_count * sizeof(Mat4D))
+        || _write_section(fp, &offset, &sections[SECTION_CHILD_LOCAL_INVS], groups.local_invs, groups.child_count * sizeof(Mat4D))
+        || _write_section(fp, &offset, &sections[SECTION_CHILD_BOUNDS], groups.child_bounds, groups.child_count * sizeof(Aabb))
+        || _write_meshes(fp, &offset, &header, scene, source_path, &groups, mesh_records, mesh_shapes);
+
+    // The BVH is only worth keeping if it is up to date with the objects
+    const WorldBvh *bvh = world->bvh;
+    int bvh_current = bvh != NULL && bvh->object_count == world->object_count && bvh->instance_count == world->instance_count;
+    for (size_t i = 0; bvh_current && i < world->object_count; i++) {
+        bvh_current = bvh->revisions[i] == shape_revision(&world->objects[i]);
+    }
+    for (size_t i = 0; bvh_current && i < world->instance_count; i++) {
+        bvh_current = bvh->revisions[world->object_count + i] == world->instances[i].revision;
+    }
+    size_t bvh_count = world->object_count + world->instance_count;
+    if (!err && bvh_current) {
+        header.has_bvh = 1;
+        header.bvh_node_count = bvh->tree.node_count;
+        header.bvh_primitive_count = bvh->tree.primitive_count;
+        header.bvh_unbounded_count = bvh->unbounded_count;
+        header.bvh_built_cost = bvh->tree.built_cost;
+        err = _write_section(fp, &offset, &sections[SECTION_BVH_BOUNDS], bvh->bounds, bvh_count * sizeof(Aabb))
+            || _write_section(fp, &offset, &sections[SECTION_BVH_REVISIONS], bvh->revisions, bvh_count * sizeof(uint32_t))
+            || _write_section(fp, &offset, &sections[SECTION_BVH_UNBOUNDED], bvh->unbounded, bvh->unbounded_count * sizeof(uint32_t))
+            || _write_section(fp, &offset, &sections[SECTION_BVH_NODES], bvh->tree.nodes, bvh->tree.node_count * sizeof(BvhNode))
+            || _write_section(fp, &offset, &sections[SECTION_BVH_INDICES], bvh->tree.indices, bvh->tree.primitive_count * sizeof(uint32_t));
+    }
+    err = err || fseek(fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, fp) != 1;
+    err = fclose(fp) != 0 || err;
+
+    free(tracks);
+    free(track_keys);
+    free(keys);
+    free(mesh_records);
+    free(mesh_shapes);
+    _free_group_table(&groups);
+    if (err) {
+        fprintf(stderr, "Failed to write compiled scene %s\n", path);
+        remove(path);
+    }
+    return err;
+}
+
+// Loading
+
+/// @brief Maps the whole file at `path` copy-on-write, so that the scene can be modified in memory, e.g.
+/// by animations, without touching the file. Returns NULL on failure.
+static SceneMapping *_map(const char *path) {
+    SceneMapping *m = calloc(1, sizeof(SceneMapping));
+    if (m == NULL) {
+        return NULL;
+    }
+    if (mapped_file_open(path, &m->file)) {
+        free(m);
+        return NULL;
+    }
+    m->data = m->file.data;
+    m->size = m->file.size;
+    return m;
+}
+
+void scene_cache_unmap(SceneMapping *mapping) {
+    if (mapping == NULL) {
+        return;
+    }
+    mapped_file_close(&mapping->file);
+    free(mapping->groups);
+    free(mapping);
+}
+
+/// @brief Returns the start of a section if it lies within the file and holds `count` elements of `size`
+/// bytes, or NULL.
+static void *_section(SceneMapping *m, const SceneFileHeader *header, Section section, uint64_t count, size_t size) {
+    SectionEntry entry = header->sections[section];
+    if (entry.size != count * size || entry.offset % SECTION_ALIGNMENT != 0
+        || entry.offset > m->size || entry.size > m->size - entry.offset) {
+        return NULL;
+    }
+    return (char *)m->data + entry.offset;
+}
+
+/// @brief Returns the array of `count` elements of `size` bytes at `offset` in the mesh data, or NULL if
+/// it is not wholly inside it.
+static void *_mesh_array(SceneMapping *m, const SceneFileHeader *header, uint64_t offset, uint64_t count, size_t size) {
+    SectionEntry data = header->sections[SECTION_MESH_DATA];
+    uint64_t data_end = data.offset + data.size;
+    if (offset % SECTION_ALIGNMENT != 0 || offset < data.offset || offset > data_end || count > (data_end - offset) / size) {
+        return NULL;
+    }
+    return (char *)m->data + offset;
+}
+
+/// @brief Builds the scene's meshes around their arrays in the mapping, and points the shapes at them.
+/// If `source_path` is set, the meshes' files must be unchanged too. Returns 0 on success.
+static int _load_meshes(SceneMapping *m, const SceneFileHeader *header, const char *source_path, Scene *scene) {
+    MeshRecord *records = _section(m, header, SECTION_MESHES, header->mesh_count, sizeof(MeshRecord));
+    MeshShape *mesh_shapes = _section(m, header, SECTION_MESH_SHAPES, header->mesh_shape_count, sizeof(MeshShape));
+    SectionEntry data = header->sections[SECTION_MESH_DATA];
+    if (records == NULL || mesh_shapes == NULL || data.offset > m->size || data.size > m->size - data.offset) {
+        return 1;
+    }
+    scene->meshes = calloc(header->mesh_count > 0 ? (size_t)header->mesh_count : 1, sizeof(SceneMesh));
+    if (scene->meshes == NULL) {
+        return 1;
+    }
+    for (uint64_t i = 0; i < header->mesh_count; i++) {
+        const MeshRecord *r = &records[i];
+        if (memchr(r->path, '\0', sizeof(r->path)) == NULL) {
+            return 1;
+        }
+        if (source_path != NULL) {
+            uint64_t size;
+            int64_t mtime;
+            if (_source_stamp(r->path, &size, &mtime) || size != r->source_size || mtime != r->source_mtime) {
+                return 1;
+            }
+        }
+        Mesh *mesh = calloc(1, sizeof(Mesh));
+        if (mesh == NULL) {
+            return 1;
+        }
+        SceneMesh *scene_mesh = &scene->meshes[scene->mesh_count++];
+        scene_mesh->mesh = mesh;
+        memcpy(scene_mesh->path, r->path, sizeof(scene_mesh->path));
+        scene_mesh->smooth = (int)r->smooth;
+        *mesh = (Mesh) {
+            (size_t)r->vertex_count,
+            (size_t)r->triangle_count,
+            _mesh_array(m, header, r->positions, 3 * r->vertex_count, sizeof(float)),
+            r->normals != 0 ? _mesh_array(m, header, r->normals, 3 * r->vertex_count, sizeof(float)) : NULL,
+            _mesh_array(m, header, r->indices, 3 * r->triangle_count, sizeof(uint32_t)),
+            {
+                _mesh_array(m, header, r->nodes, r->node_count, sizeof(BvhNode)),
+                (size_t)r->node_count,
+                _mesh_array(m, header, r->bvh_indices, r->primitive_count, sizeof(uint32_t)),
+                (size_t)r->primitive_count,
+                r->built_cost,
+            },
+            r->bounds,
+        };
+        if (mesh->positions == NULL || (r->normals != 0 && mesh->normals == NULL) || mesh->indices == NULL
+            || mesh->bvh.nodes == NULL || mesh->bvh.indices == NULL) {
+            return 1;
+        }
+    }
+    for (uint64_t i = 0; i < header->mesh_shape_count; i++) {
+        const MeshShape *s = &mesh_shapes[i];
+        if (s->object >= header->object_count + header->prototype_count + m->child_count || s->mesh >= header->mesh_count) {
+            return 1;
+        }
+        _numbered_shape(&scene->world, m->children, s->object)->mesh = scene->meshes[s->mesh].mesh;
+    }
+    return 0;
+}
+
+/// @brief Builds the scene's groups around their children in the mapping, and points the group shapes at
+/// them. Returns 0 on success.
+static int _load_groups(SceneMapping *m, const SceneFileHeader *header, Scene *scene) {
+    uint64_t child_count = header->child_count;
+    GroupRecord *records = _section(m, header, SECTION_GROUPS, header->group_count, sizeof(GroupRecord));
+    Shape *children = _section(m, header, SECTION_CHILDREN, child_count, sizeof(Shape));
+    Mat4D *locals = _section(m, header, SECTION_CHILD_LOCALS, child_count, sizeof(Mat4D));
+    Mat4D *local_invs = _section(m, header, SECTION_CHILD_LOCAL_INVS, child_count, sizeof(Mat4D));
+    Aabb *child_bounds = _section(m, header, SECTION_CHILD_BOUNDS, child_count, sizeof(Aabb));
+    if (records == NULL || children == NULL || locals == NULL || local_invs == NULL || child_bounds == NULL) {
+        return 1;
+    }
+    m->children = children;
+    m->child_count = (size_t)child_count;
+    m->groups = calloc(header->group_count > 0 ? (size_t)header->group_count : 1, sizeof(Group));
+    if (m->groups == NULL) {
+        return 1;
+    }
+
+    // Group pointers in the file are stale, so every group shape must be given one by a record
+    World *world = &scene->world;
+    uint64_t shape_count = header->object_count + header->prototype_count + child_count;
+    for (uint64_t i = 0; i < shape_count; i++) {
+        Shape *shape = _numbered_shape(world, children, i);
+        if (shape->material >= world->material_count) {
+            return 1;
+        }
+        shape->group = NULL;
+    }
+    for (uint64_t i = 0; i < header->group_count; i++) {
+        const GroupRecord *r = &records[i];
+        if (r->shape >= shape_count || r->first_child > child_count || r->child_count > child_count - r->first_child) {
+            return 1;
+        }
+        Group *parent = NULL;
+        if (r->parent != GROUP_NO_PARENT) {
+            // Parents come first, and hold the group where the record says
+            if (r->parent >= i || r->index >= records[r->parent].child_count
+                || r->shape != header->object_count + header->prototype_count + records[r->parent].first_child + r->index) {
+                return 1;
+            }
+            parent = &m->groups[r->parent];
+        }
+        Shape *shape = _numbered_shape(world, children, r->shape);
+        if (!shape_is_group(shape) || shape->group != NULL || r->operation > CSG_DIFFERENCE
+            || (shape->type == SHAPE_CSG) != (r->operation != CSG_NONE) || (shape->type == SHAPE_CSG && r->child_count != 2)) {
+            return 1;
+        }
+        size_t first = (size_t)r->first_child;
+        m->groups[i] = (Group) {
+            (size_t)r->child_count, &children[first], &locals[first], &local_invs[first], &child_bounds[first],
+            r->bounds, parent, (size_t)r->index, (size_t)r->child_count, (uint32_t)r->revision, (int)r->operation,
+        };
+        shape->group = &m->groups[i];
+    }
+    for (uint64_t i = 0; i < shape_count; i++) {
+        const Shape *shape = _numbered_shape(world, children, i);
+        if (shape_is_group(shape) && shape->group == NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int _header_valid(const SceneFileHeader *header, size_t file_size, const char *source_path) {
+    uint32_t layout[10];
+    _layout(layout);
+    if (file_size < sizeof(SceneFileHeader)
+        || memcmp(header->magic, SCENE_FILE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != SCENE_FILE_VERSION
+        || header->byte_order != BYTE_ORDER_MARK
+        || memcmp(header->layout, layout, sizeof(layout)) != 0) {
+        return 0;
+    }
+    if (source_path != NULL) {
+        uint64_t size;
+        int64_t mtime;
+        if (_source_stamp(source_path, &size, &mtime) || size != header->source_size || mtime != header->source_mtime) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int scene_cache_load(const char *path, const char *source_path, Scene *out) {
+    SceneMapping *m = _map(path);
+    if (m == NULL) {
+        return 1;
+    }
+    const SceneFileHeader *header = m->data;
+    if (!_header_valid(header, m->size, source_path)) {
+        scene_cache_unmap(m);
+        return 1;
+    }
+
+    Shape *objects = _section(m, header, SECTION_OBJECTS, header->object_count, sizeof(Shape));
+    PointLight *lights = _section(m, header, SECTION_LIGHTS, header->light_count, sizeof(PointLight));
+    Track *tracks = _section(m, header, SECTION_TRACKS, header->track_count, sizeof(Track));
+    uint64_t *track_keys = _section(m, header, SECTION_TRACK_KEYS, header->track_count, sizeof(uint64_t));
+    Keyframe *keys = _section(m, header, SECTION_KEYFRAMES, header->key_count, sizeof(Keyframe));
+    Shape *prototypes = _section(m, header, SECTION_PROTOTYPES, header->prototype_count, sizeof(Shape));
+    Material *materials = _section(m, header, SECTION_MATERIALS, header->material_count, sizeof(Material));
+    Instance *instances = _section(m, header, SECTION_INSTANCES, header->instance_count, sizeof(Instance));
+    if (objects == NULL || lights == NULL || tracks == NULL || track_keys == NULL || keys == NULL
+        || prototypes == NULL || materials == NULL || instances == NULL) {
+        scene_cache_unmap(m);
+        return 1;
+    }
+    for (uint64_t i = 0; i < header->instance_count; i++) {
+        if (instances[i].prototype >= header->prototype_count
+            || (instances[i].material != INSTANCE_PROTOTYPE_MATERIAL && instances[i].material >= header->material_count)) {
+            scene_cache_unmap(m);
+            return 1;
+        }
+    }
+    for (uint64_t i = 0; i < header->track_count; i++) {
+        if (track_keys[i] > header->key_count || tracks[i].key_count > header->key_count - track_keys[i]
+            || tracks[i].object >= header->object_count) {
+            scene_cache_unmap(m);
+            return 1;
+        }
+        tracks[i].keys = keys + track_keys[i];
+    }
+
+    World world = world_new();
+    world.objects = objects;
+    world.object_count = (size_t)header->object_count;
+    world.lights = lights;
+    world.light_count = (size_t)header->light_count;
+    world.prototypes = prototypes;
+    world.prototype_count = (size_t)header->prototype_count;
+    world.materials = materials;
+    world.material_count = (size_t)header->material_count;
+    world.instances = instances;
+    world.instance_count = (size_t)header->instance_count;
+    world.accelerator = header->accelerator <= ACCELERATOR_GRID ? (int)header->accelerator : ACCELERATOR_AUTO;
+    if (header->has_bvh) {
+        WorldBvh *bvh = calloc(1, sizeof(WorldBvh));
+        if (bvh == NULL) {
+            scene_cache_unmap(m);
+            return 1;
+        }
+        uint64_t bvh_count = header->object_count + header->instance_count;
+        bvh->object_count = world.object_count;
+        bvh->instance_count = world.instance_count;
+        bvh->accelerator = world.accelerator;
+        bvh->bounds = _section(m, header, SECTION_BVH_BOUNDS, bvh_count, sizeof(Aabb));
+        bvh->revisions = _section(m, header, SECTION_BVH_REVISIONS, bvh_count, sizeof(uint32_t));
+        bvh->unbounded = _section(m, header, SECTION_BVH_UNBOUNDED, header->bvh_unbounded_count, sizeof(uint32_t));
+        bvh->unbounded_count = (size_t)header->bvh_unbounded_count;
+        bvh->tree.nodes = _section(m, header, SECTION_BVH_NODES, header->bvh_node_count, sizeof(BvhNode));
+        bvh->tree.node_count = (size_t)header->bvh_node_count;
+        bvh->tree.indices = _section(m, header, SECTION_BVH_INDICES, header->bvh_primitive_count, sizeof(uint32_t));
+        bvh->tree.primitive_count = (size_t)header->bvh_primitive_count;
+        bvh->tree.built_cost = header->bvh_built_cost;
+        bvh->borrowed = 1;
+        world.bvh = bvh;
+        if (bvh->bounds == NULL || bvh->revisions == NULL || bvh->unbounded == NULL
+            || (bvh->tree.node_count > 0 && (bvh->tree.nodes == NULL || bvh->tree.indices == NULL))) {
+            world_free_bvh(&world);
+            scene_cache_unmap(m);
+            return 1;
+        }
+        // The grid and wide tree are built again rather than stored, as they take a fraction of the time
+        // the binary tree's build does. Without them, rays take the binary tree. So is the light tree.
+        world_bvh_finish(bvh);
+        if (light_tree_build(&bvh->lights, world.lights, world.light_count)) {
+            world_free_bvh(&world);
+            scene_cache_unmap(m);
+            return 1;
+        }
+    }
+
+    *out = (Scene) { world, header->camera, { tracks, (size_t)header->track_count, header->fps }, keys, NULL, 0, NULL, 0, m };
+    if (_load_groups(m, header, out) || _load_meshes(m, header, source_path, out)) {
+        scene_free(out);
+        return 1;
+    }
+    return 0;
+}
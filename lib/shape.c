@@ -5,41 +5,179 @@
 #include <stdlib.h>
 #include <matrix.h>
 #include <shape.h>
+#include <group.h>
 #include <config.h>
 
-Shape _shape_new(int type, Mat4D transform, Material material, const char *name, double ymin, double ymax, int closed) {
-    Mat4D inv = mat4d_inverse(transform);
-    Shape s = { type, transform, inv, material, { 0 }, ymin, ymax, closed };
+// Largest part of a transform, relative to its scale, that may be ignored when classifying it. Transforms
+// built from rotations by multiples of a quarter turn have entries like cos(pi / 2) that are not quite 0.
+static const double FAST_TOLERANCE = 1e-12;
+
+Shape shape_from_parts(int type, Mat4D transform, Mat4D inv_transform, uint32_t material, const char *name, double ymin, double ymax, int closed) {
+    Shape s = { type, SHAPE_FAST_NONE, material, { 0 }, transform, inv_transform, { 0 }, ymin, ymax, closed, NULL, NULL, NULL, 0 };
     strncpy_s(s.name, SHAPE_NAME_LEN, name, SHAPE_NAME_LEN - 1);
     s.name[SHAPE_NAME_LEN - 1] = '\0';  // Ensure null-termination
+    shape_classify(&s);
     return s;
 }
 
-Shape sphere_new(Mat4D transform, Material material, char *name) {
+Shape _shape_new(int type, Mat4D transform, uint32_t material, const char *name, double ymin, double ymax, int closed) {
+    return shape_from_parts(type, transform, mat4d_inverse(transform), material, name, ymin, ymax, closed);
+}
+
+Shape sphere_new(Mat4D transform, uint32_t material, char *name) {
     return _shape_new(SHAPE_SPHERE, transform, material, name, -INFINITY, INFINITY, 0);
 }
 
 Shape sphere_default() {
-    return sphere_new(mat4d_identity(), material_default(), "default_sphere");
+    return sphere_new(mat4d_identity(), 0, "default_sphere");
 }
 
-Shape plane_new(Mat4D transform, Material material, char *name) {
+Shape plane_new(Mat4D transform, uint32_t material, char *name) {
     return _shape_new(SHAPE_PLANE, transform, material, name, -INFINITY, INFINITY, 0);
 }
 
-Shape cube_new(Mat4D transform, Material material, char *name)
+Shape cube_new(Mat4D transform, uint32_t material, char *name)
 {
     return _shape_new(SHAPE_CUBE, transform, material, name, -INFINITY, INFINITY, 0);
 }
 
-Shape cylinder_new(Mat4D transform, Material material, char *name, double ymin, double ymax, int closed)
+Shape cylinder_new(Mat4D transform, uint32_t material, char *name, double ymin, double ymax, int closed)
 {
     return _shape_new(SHAPE_CYLINDER, transform, material, name, ymin, ymax, closed);
 }
 
-Shape cone_new(Mat4D transform, Material material, char *name, double ymin, double ymax, int closed)
+Shape cone_new(Mat4D transform, uint32_t material, char *name, double ymin, double ymax, int closed)
 {
-    return _shape_new(SHAPE_CYLINDER, transform, material, name, ymin, ymax, closed);
+    return _shape_new(SHAPE_CONE, transform, material, name, ymin, ymax, closed);
+}
+
+Shape mesh_new(Mat4D transform, uint32_t material, char *name, Mesh *mesh)
+{
+    Shape s = _shape_new(SHAPE_MESH, transform, material, name, -INFINITY, INFINITY, 0);
+    s.mesh = mesh;
+    return s;
+}
+
+Shape sphere_cloud_new(Mat4D transform, uint32_t material, char *name, SphereCloud *cloud)
+{
+    Shape s = _shape_new(SHAPE_SPHERE_CLOUD, transform, material, name, -INFINITY, INFINITY, 0);
+    s.cloud = cloud;
+    return s;
+}
+
+void shape_set_transform(Shape *shape, Mat4D transform) {
+    shape->transform = transform;
+    shape->inv_transform = mat4d_inverse(transform);
+    shape_classify(shape);
+    if (shape_is_group(shape)) {
+        group_compose(shape);
+    }
+    shape->revision++;
+}
+
+/// @brief Returns 1 if the transform's linear part turns and scales evenly, writing the scale.
+static int _is_similarity(const Mat4D *m, double *out_scale) {
+    double dots[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            dots[i][j] = m->m[0][i] * m->m[0][j] + m->m[1][i] * m->m[1][j] + m->m[2][i] * m->m[2][j];
+        }
+    }
+    double s2 = dots[0][0];
+    double tolerance = FAST_TOLERANCE * s2;
+    *out_scale = sqrt(s2);
+    return s2 > 0.0 && fabs(dots[1][1] - s2) <= tolerance && fabs(dots[2][2] - s2) <= tolerance
+        && fabs(dots[0][1]) <= tolerance && fabs(dots[0][2]) <= tolerance && fabs(dots[1][2]) <= tolerance;
+}
+
+/// @brief Returns 1 if the transform's linear part only scales along the axes.
+static int _is_axis_scale(const Mat4D *m) {
+    double scale = fmax(fabs(m->m[0][0]), fmax(fabs(m->m[1][1]), fabs(m->m[2][2])));
+    double tolerance = FAST_TOLERANCE * scale;
+    for (int i = 0; i < 3; i++) {
+        if (m->m[i][i] == 0.0) {
+            return 0;
+        }
+        for (int j = 0; j < 3; j++) {
+            if (i != j && fabs(m->m[i][j]) > tolerance) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+void shape_classify(Shape *shape) {
+    const Mat4D *m = &shape->transform;
+    double *f = shape->fast_shape;
+    double scale;
+    shape->fast = SHAPE_FAST_NONE;
+    memset(shape->fast_shape, 0, sizeof(shape->fast_shape));
+    if (m->m[3][0] != 0.0 || m->m[3][1] != 0.0 || m->m[3][2] != 0.0 || m->m[3][3] != 1.0) {
+        return;
+    }
+    if (shape->type == SHAPE_SPHERE && _is_similarity(m, &scale)) {
+        shape->fast = SHAPE_FAST_SPHERE;
+        f[0] = m->m[0][3];
+        f[1] = m->m[1][3];
+        f[2] = m->m[2][3];
+        f[3] = scale;
+    } else if (shape->type == SHAPE_CUBE && _is_axis_scale(m)) {
+        shape->fast = SHAPE_FAST_BOX;
+        for (int a = 0; a < 3; a++) {
+            f[a] = m->m[a][3] - fabs(m->m[a][a]);
+            f[a + 3] = m->m[a][3] + fabs(m->m[a][a]);
+        }
+    } else if (shape->type == SHAPE_PLANE) {
+        // A point's height above the plane in object space is the second row of the inverse times it
+        shape->fast = SHAPE_FAST_PLANE;
+        for (int i = 0; i < 4; i++) {
+            f[i] = shape->inv_transform.m[1][i];
+        }
+    }
+}
+
+void shape_set_material(Shape *shape, uint32_t material) {
+    shape->material = material;
+    shape->revision++;
+}
+
+Aabb shape_bounds(const Shape *shape) {
+    Aabb local;
+    switch (shape->type) {
+        case SHAPE_SPHERE:
+        case SHAPE_CUBE:
+            local = (Aabb) { { -1.0, -1.0, -1.0 }, { 1.0, 1.0, 1.0 } };
+            break;
+        case SHAPE_CYLINDER:
+            local = (Aabb) { { -1.0, shape->ymin, -1.0 }, { 1.0, shape->ymax, 1.0 } };
+            break;
+        case SHAPE_CONE: {
+            double r = fmax(fabs(shape->ymin), fabs(shape->ymax));
+            local = (Aabb) { { -r, shape->ymin, -r }, { r, shape->ymax, r } };
+            break;
+        }
+        case SHAPE_MESH:
+            local = shape->mesh->bounds;
+            break;
+        case SHAPE_SPHERE_CLOUD:
+            local = shape->cloud->bounds;
+            break;
+        case SHAPE_GROUP:
+        case SHAPE_CSG:
+            // Already in the space around the group, as its children's transforms include the group's
+            return shape->group->bounds;
+        default:
+            return aabb_infinite();
+    }
+    if (!aabb_is_finite(&local)) {
+        return aabb_infinite();
+    }
+    return aabb_transform(&local, shape->transform);
+}
+
+uint32_t shape_revision(const Shape *shape) {
+    return shape_is_group(shape) ? shape->revision + shape->group->revision : shape->revision;
 }
 
 Vec4D _sphere_normal(Vec4D object_point) {
@@ -54,12 +192,12 @@ Vec4D _cube_normal(Vec4D object_point) {
     double maxc = fmax(fabs(object_point.x), fabs(object_point.y));
     maxc = fmax(maxc, fabs(object_point.z));
 
-    if (maxc == object_point.x) {
-        return d4_vector(1.0, 0.0, 0.0);
-    } else if (maxc == object_point.y) {
-        return d4_vector(0.0, 1.0, 0.0);
+    if (maxc == fabs(object_point.x)) {
+        return d4_vector(object_point.x, 0.0, 0.0);
+    } else if (maxc == fabs(object_point.y)) {
+        return d4_vector(0.0, object_point.y, 0.0);
     }
-    return d4_vector(0.0, 0.0, 1.0);
+    return d4_vector(0.0, 0.0, object_point.z);
 }
 
 Vec4D _cylinder_normal(Vec4D object_point, Shape *cylinder) {
@@ -75,12 +213,50 @@ Vec4D _cylinder_normal(Vec4D object_point, Shape *cylinder) {
     return d4_vector(x, 0.0, z);
 }
 
-Vec4D _cone_normal(Vec4D object_point) {
-    return d4_vector(object_point.x, 0.0, object_point.z);
+Vec4D _cone_normal(Vec4D object_point, Shape *cone) {
+    double x = object_point.x;
+    double y = object_point.y;
+    double z = object_point.z;
+    double dist = pow(x, 2.0) + pow(z, 2.0);
+    if (dist < pow(cone->ymax, 2.0) && y >= cone->ymax - EPSILON) {
+        return d4_vector(0.0, 1.0, 0.0);
+    } else if (dist < pow(cone->ymin, 2.0) && y <= cone->ymin + EPSILON) {
+        return d4_vector(0.0, -1.0, 0.0);
+    }
+    // The side slopes at 45 degrees, away from the axis above the apex and towards it below
+    double ny = sqrt(dist);
+    return d4_vector(x, y > 0.0 ? -ny : ny, z);
 }
 
 Vec4D shape_normal(Shape *shape, Vec4D world_point)
 {
+    return shape_normal_at(shape, world_point, 0, 0.0, 0.0);
+}
+
+/// @brief Returns the world-space normal of a shape with a fast path, without its transform.
+static Vec4D _fast_normal(const Shape *shape, Vec4D p) {
+    const double *f = shape->fast_shape;
+    switch (shape->fast) {
+        case SHAPE_FAST_SPHERE:
+            return d4_norm(d4_vector(p.x - f[0], p.y - f[1], p.z - f[2]));
+        case SHAPE_FAST_BOX: {
+            // The point on the unit cube the box was scaled from
+            Vec4D q = d4_point(
+                (2.0 * p.x - f[0] - f[3]) / (f[3] - f[0]),
+                (2.0 * p.y - f[1] - f[4]) / (f[4] - f[1]),
+                (2.0 * p.z - f[2] - f[5]) / (f[5] - f[2]));
+            return d4_norm(_cube_normal(q));
+        }
+        default:
+            return d4_norm(d4_vector(f[0], f[1], f[2]));
+    }
+}
+
+Vec4D shape_normal_at(Shape *shape, Vec4D world_point, uint32_t primitive, double u, double v)
+{
+    if (shape->fast != SHAPE_FAST_NONE) {
+        return _fast_normal(shape, world_point);
+    }
     Mat4D inv_transpose = mat4d_transpose(shape->inv_transform);
 
     // Convert the point to object space
@@ -101,7 +277,13 @@ Vec4D shape_normal(Shape *shape, Vec4D world_point)
             object_normal = _cylinder_normal(object_point, shape);
             break;
         case SHAPE_CONE:
-            object_normal = _cone_normal(object_point);
+            object_normal = _cone_normal(object_point, shape);
+            break;
+        case SHAPE_MESH:
+            object_normal = mesh_normal(shape->mesh, primitive, u, v);
+            break;
+        case SHAPE_SPHERE_CLOUD:
+            object_normal = sphere_cloud_normal(shape->cloud, primitive, object_point);
             break;
         default:
             printf("Unrecognised shape type %i", shape->type);
@@ -114,9 +296,13 @@ Vec4D shape_normal(Shape *shape, Vec4D world_point)
     return d4_norm(world_normal);
 }
 
-Color shape_color_at(Shape shape, Vec4D world_point)
+Color shape_color_at(const Shape *shape, const Material *material, Vec4D world_point)
 {
-    Vec4D object_point = mat4d_mul_vec4d(shape.inv_transform, world_point);
-    Vec4D pattern_point = mat4d_mul_vec4d(shape.material.pattern.inv_transform, object_point);
-    return pattern_color_at(shape.material.pattern, pattern_point);
+    if (material->pattern.type == PATTERN_PLAIN) {
+        // The same everywhere, so the point need not be carried into the pattern's space
+        return material->pattern.a;
+    }
+    Vec4D object_point = mat4d_mul_vec4d(shape->inv_transform, world_point);
+    Vec4D pattern_point = mat4d_mul_vec4d(material->pattern.inv_transform, object_point);
+    return pattern_color_at(material->pattern, pattern_point);
 }
@@ -0,0 +1,292 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+#include <sphere_cloud.h>
+
+static const char DUMP_MAGIC[8] = "BEAKPTC";
+static const uint32_t DUMP_VERSION = 1;
+// Arrays start at multiples of this many bytes, which suits floats and a cache line
+#define DUMP_ALIGNMENT 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t has_materials;
+    uint64_t count;
+} DumpHeader;
+
+// Deeper than any tree bvh_build makes, since each level pushes at most one node
+#define CLOUD_STACK_SIZE 64
+// Particles a ray remembers testing as it walks the grid, by their indices' low bits. A power of two.
+#define CLOUD_MAILBOX_SIZE 32
+
+/// @brief Returns the offset in a dump of its `k`th array: x, y, z, radius, then materials.
+static uint64_t _array_offset(uint64_t count, int k) {
+    uint64_t stride = (count * sizeof(float) + DUMP_ALIGNMENT - 1) / DUMP_ALIGNMENT * DUMP_ALIGNMENT;
+    return DUMP_ALIGNMENT + k * stride;
+}
+
+/// @brief Computes the cloud's bounds and builds its grid, or its BVH if the grid does not suit the
+/// particles. Returns 0 on success.
+static int _build_index(SphereCloud *cloud) {
+    size_t n = cloud->count;
+    Aabb *bounds = malloc((n > 0 ? n : 1) * sizeof(Aabb));
+    uint32_t *ids = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+    if (bounds == NULL || ids == NULL) {
+        free(bounds);
+        free(ids);
+        return 1;
+    }
+    cloud->bounds = aabb_empty();
+    for (size_t i = 0; i < n; i++) {
+        double c[3] = { cloud->x[i], cloud->y[i], cloud->z[i] };
+        double r = cloud->radius[i];
+        bounds[i] = (Aabb) { { c[0] - r, c[1] - r, c[2] - r }, { c[0] + r, c[1] + r, c[2] + r } };
+        aabb_extend(&cloud->bounds, &bounds[i]);
+        ids[i] = (uint32_t)i;
+    }
+    int err = grid_build(&cloud->grid, bounds, ids, n, CFG_GRID_DENSITY);
+    if (err || !grid_suits(&cloud->grid, bounds, ids, n)) {
+        grid_free(&cloud->grid);
+        err = bvh_build(&cloud->bvh, bounds, ids, n);
+    }
+    free(bounds);
+    free(ids);
+    return err;
+}
+
+SphereCloud *sphere_cloud_create(void *memory, const float *x, const float *y, const float *z, const float *radius, const uint32_t *materials, size_t count) {
+    SphereCloud *cloud = calloc(1, sizeof(SphereCloud));
+    if (cloud == NULL || count > UINT32_MAX) {
+        free(cloud);
+        free(memory);
+        return NULL;
+    }
+    cloud->count = count;
+    cloud->x = x;
+    cloud->y = y;
+    cloud->z = z;
+    cloud->radius = radius;
+    cloud->materials = materials;
+    cloud->memory = memory;
+    if (_build_index(cloud)) {
+        sphere_cloud_destroy(cloud);
+        return NULL;
+    }
+    return cloud;
+}
+
+SphereCloud *sphere_cloud_load(const char *path) {
+    SphereCloud *cloud = calloc(1, sizeof(SphereCloud));
+    if (cloud == NULL) {
+        return NULL;
+    }
+    if (mapped_file_open(path, &cloud->file)) {
+        fprintf(stderr, "Failed to map %s\n", path);
+        free(cloud);
+        return NULL;
+    }
+
+    const MappedFile *file = &cloud->file;
+    const DumpHeader *header = file->data;
+    if (file->size < sizeof(DumpHeader) || memcmp(header->magic, DUMP_MAGIC, sizeof(DUMP_MAGIC)) != 0
+        || header->version != DUMP_VERSION || header->count > UINT32_MAX
+        || _array_offset(header->count, header->has_materials ? 4 : 3) + header->count * sizeof(float) > file->size) {
+        fprintf(stderr, "%s is not a particle dump\n", path);
+        sphere_cloud_destroy(cloud);
+        return NULL;
+    }
+    const char *data = file->data;
+    cloud->count = (size_t)header->count;
+    cloud->x = (const float *)(data + _array_offset(header->count, 0));
+    cloud->y = (const float *)(data + _array_offset(header->count, 1));
+    cloud->z = (const float *)(data + _array_offset(header->count, 2));
+    cloud->radius = (const float *)(data + _array_offset(header->count, 3));
+    cloud->materials = header->has_materials ? (const uint32_t *)(data + _array_offset(header->count, 4)) : NULL;
+    if (_build_index(cloud)) {
+        sphere_cloud_destroy(cloud);
+        return NULL;
+    }
+    return cloud;
+}
+
+int sphere_cloud_write(const SphereCloud *cloud, const char *path) {
+    static const char PADDING[DUMP_ALIGNMENT] = { 0 };
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s for writing\n", path);
+        return 1;
+    }
+    DumpHeader header = { { 0 }, DUMP_VERSION, cloud->materials != NULL, cloud->count };
+    memcpy(header.magic, DUMP_MAGIC, sizeof(DUMP_MAGIC));
+    const void *arrays[5] = { cloud->x, cloud->y, cloud->z, cloud->radius, cloud->materials };
+    int err = fwrite(&header, sizeof(header), 1, fp) != 1;
+    uint64_t offset = sizeof(header);
+    for (int k = 0; k < (cloud->materials != NULL ? 5 : 4) && !err; k++) {
+        uint64_t start = _array_offset(cloud->count, k);
+        size_t size = cloud->count * sizeof(float);
+        err = fwrite(PADDING, 1, (size_t)(start - offset), fp) != start - offset
+            || (size > 0 && fwrite(arrays[k], size, 1, fp) != 1);
+        offset = start + size;
+    }
+    err = fclose(fp) != 0 || err;
+    if (err) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        remove(path);
+    }
+    return err;
+}
+
+int sphere_cloud_set_palette(SphereCloud *cloud, const uint32_t *materials, size_t count) {
+    uint32_t *palette = malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+    if (palette == NULL) {
+        return 1;
+    }
+    memcpy(palette, materials, count * sizeof(uint32_t));
+    free(cloud->palette);
+    cloud->palette = palette;
+    cloud->palette_size = count;
+    return 0;
+}
+
+void sphere_cloud_destroy(SphereCloud *cloud) {
+    if (cloud == NULL) {
+        return;
+    }
+    grid_free(&cloud->grid);
+    bvh_free(&cloud->bvh);
+    free(cloud->palette);
+    free(cloud->memory);
+    mapped_file_close(&cloud->file);
+    free(cloud);
+}
+
+// Intersection
+
+typedef struct {
+    double origin[3];
+    double direction[3];
+    double a;                 // Squared length of the direction
+} CloudRay;
+
+/// @brief Returns the distance to the particle if the ray hits it between 0 and `tmax`, or INFINITY. Rays
+/// from inside a particle hit it on the way out.
+static double _hit_particle(const SphereCloud *cloud, uint32_t i, const CloudRay *r, double tmax) {
+    double oc[3] = { r->origin[0] - cloud->x[i], r->origin[1] - cloud->y[i], r->origin[2] - cloud->z[i] };
+    double radius = cloud->radius[i];
+    double b = oc[0] * r->direction[0] + oc[1] * r->direction[1] + oc[2] * r->direction[2];
+    double c = oc[0] * oc[0] + oc[1] * oc[1] + oc[2] * oc[2] - radius * radius;
+    double discriminant = b * b - r->a * c;
+    if (discriminant < 0.0) {
+        return INFINITY;
+    }
+    double root = sqrt(discriminant);
+    double t = (-b - root) / r->a;
+    if (t < 0.0) {
+        t = (-b + root) / r->a;
+    }
+    return t >= 0.0 && t < tmax ? t : INFINITY;
+}
+
+/// @brief Finds the nearest particle by walking the grid's cells until one holds a hit within it.
+static double _intersect_grid(const SphereCloud *cloud, const CloudRay *r, Vec4D origin, Vec4D direction, double tmax, uint32_t *out_particle) {
+    const Grid *grid = &cloud->grid;
+    double best = tmax;
+    GridWalk walk;
+    if (!grid_walk_start(grid, origin, direction, tmax, &walk)) {
+        return INFINITY;
+    }
+    uint32_t mailbox[CLOUD_MAILBOX_SIZE];
+    memset(mailbox, 0xff, sizeof(mailbox));  // No particle's index is UINT32_MAX
+    do {
+        for (uint32_t i = grid->cell_start[walk.index]; i < grid->cell_start[walk.index + 1]; i++) {
+            uint32_t particle = grid->items[i];
+            uint32_t *slot = &mailbox[particle & (CLOUD_MAILBOX_SIZE - 1)];
+            if (*slot == particle) {
+                continue;
+            }
+            *slot = particle;
+            double t = _hit_particle(cloud, particle, r, best);
+            if (t < best) {
+                best = t;
+                *out_particle = particle;
+            }
+        }
+    } while (best > walk.t_cell_exit && grid_walk_next(&walk));
+    return best < tmax ? best : INFINITY;
+}
+
+/// @brief Finds the nearest particle through the BVH, visiting the nearer child of each node first.
+static double _intersect_bvh(const SphereCloud *cloud, const CloudRay *r, Vec4D origin, Vec4D direction, double tmax, uint32_t *out_particle) {
+    const Bvh *bvh = &cloud->bvh;
+    if (bvh->node_count == 0) {
+        return INFINITY;
+    }
+    AabbRay box_ray = aabb_ray_new(origin, direction);
+    double best = tmax;
+    const BvhNode *nodes = bvh->nodes;
+    uint32_t stack[CLOUD_STACK_SIZE];
+    int top = 0;
+    if (aabb_ray_entry(&nodes[0].bounds, &box_ray, best) < INFINITY) {
+        stack[top++] = 0;
+    }
+    while (top > 0) {
+        const BvhNode *node = &nodes[stack[--top]];
+        if (node->count > 0) {
+            for (uint32_t i = node->first; i < node->first + node->count; i++) {
+                double t = _hit_particle(cloud, bvh->indices[i], r, best);
+                if (t < best) {
+                    best = t;
+                    *out_particle = bvh->indices[i];
+                }
+            }
+            continue;
+        }
+
+        uint32_t near = node->first;
+        uint32_t far = node->first + 1;
+        double t_near = aabb_ray_entry(&nodes[near].bounds, &box_ray, best);
+        double t_far = aabb_ray_entry(&nodes[far].bounds, &box_ray, best);
+        if (t_far < t_near) {
+            uint32_t tmp = near;
+            near = far;
+            far = tmp;
+            double tmp_t = t_near;
+            t_near = t_far;
+            t_far = tmp_t;
+        }
+        if (t_far < INFINITY) {
+            stack[top++] = far;
+        }
+        if (t_near < INFINITY) {
+            stack[top++] = near;
+        }
+    }
+    return best < tmax ? best : INFINITY;
+}
+
+double sphere_cloud_intersect(const SphereCloud *cloud, Vec4D origin, Vec4D direction, double tmax, uint32_t *out_particle) {
+    CloudRay r = {
+        { origin.x, origin.y, origin.z },
+        { direction.x, direction.y, direction.z },
+        direction.x * direction.x + direction.y * direction.y + direction.z * direction.z,
+    };
+    if (cloud->grid.cell_count > 0) {
+        return _intersect_grid(cloud, &r, origin, direction, tmax, out_particle);
+    }
+    return _intersect_bvh(cloud, &r, origin, direction, tmax, out_particle);
+}
+
+Vec4D sphere_cloud_normal(const SphereCloud *cloud, uint32_t particle, Vec4D object_point) {
+    return d4_vector(object_point.x - cloud->x[particle], object_point.y - cloud->y[particle], object_point.z - cloud->z[particle]);
+}
+
+uint32_t sphere_cloud_material(const SphereCloud *cloud, uint32_t particle, uint32_t fallback) {
+    if (cloud->materials == NULL || cloud->materials[particle] >= cloud->palette_size) {
+        return fallback;
+    }
+    return cloud->palette[cloud->materials[particle]];
+}
@@ -0,0 +1,119 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <text.h>
+
+int text_for_each_line(FILE *fp, LineHandler handle, void *user) {
+    char *buffer = malloc(TEXT_CHUNK_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    int err = 0;
+    size_t filled = 0;
+    while (!err) {
+        size_t read = fread(buffer + filled, 1, TEXT_CHUNK_SIZE - filled, fp);
+        filled += read;
+        if (ferror(fp)) {
+            err = -1;
+            break;
+        }
+
+        // Handle every complete line, and carry the last one over if it continues into the next chunk
+        const char *line = buffer;
+        const char *end = buffer + filled;
+        const char *newline;
+        while (!err && (newline = memchr(line, '\n', (size_t)(end - line))) != NULL) {
+            err = handle(user, line, newline);
+            line = newline + 1;
+        }
+        if (err) {
+            break;
+        }
+        size_t rest = (size_t)(end - line);
+        if (read == 0) {
+            if (rest > 0) {
+                err = handle(user, line, end);
+            }
+            break;
+        }
+        if (rest == TEXT_CHUNK_SIZE) {
+            err = -1;
+            break;
+        }
+        memmove(buffer, line, rest);
+        filled = rest;
+    }
+    free(buffer);
+    return err;
+}
+
+// Powers of ten that doubles hold exactly, so that most numbers are parsed with a single rounding
+static const double POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+const char *text_parse_double(const char *s, const char *end, double *out) {
+    int negative = 0;
+    if (s < end && (*s == '-' || *s == '+')) {
+        negative = *s == '-';
+        s++;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    int any = 0;
+    for (; s < end && *s >= '0' && *s <= '9'; s++, any = 1) {
+        if (digits < 19) {
+            mantissa = 10 * mantissa + (uint64_t)(*s - '0');
+            digits += mantissa > 0;
+        } else {
+            exponent++;
+        }
+    }
+    if (s < end && *s == '.') {
+        for (s++; s < end && *s >= '0' && *s <= '9'; s++, any = 1) {
+            if (digits < 19) {
+                mantissa = 10 * mantissa + (uint64_t)(*s - '0');
+                digits += mantissa > 0;
+                exponent--;
+            }
+        }
+    }
+    if (!any) {
+        return NULL;
+    }
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        s++;
+        int exp_negative = 0;
+        if (s < end && (*s == '-' || *s == '+')) {
+            exp_negative = *s == '-';
+            s++;
+        }
+        if (s == end || *s < '0' || *s > '9') {
+            return NULL;
+        }
+        int e = 0;
+        for (; s < end && *s >= '0' && *s <= '9'; s++) {
+            if (e < 10000) {
+                e = 10 * e + (*s - '0');
+            }
+        }
+        exponent += exp_negative ? -e : e;
+    }
+
+    double value = (double)mantissa;
+    if (exponent >= 0 && exponent <= 22) {
+        value *= POW10[exponent];
+    } else if (exponent < 0 && exponent >= -22) {
+        value /= POW10[-exponent];
+    } else {
+        value *= pow(10.0, exponent);
+    }
+    *out = negative ? -value : value;
+    return s;
+}
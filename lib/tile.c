@@ -0,0 +1,81 @@
+#include <tile.h>
+
+static int _min(int a, int b) {
+    return a < b ? a : b;
+}
+
+int tile_queue_init(TileQueue *queue, int image_width, int image_height, int tile_size) {
+    if (mtx_init(&queue->lock, mtx_plain) != thrd_success) {
+        return 1;
+    }
+    queue->image_width = image_width;
+    queue->image_height = image_height;
+    queue->tile_size = tile_size;
+    queue->tiles_x = (image_width + tile_size - 1) / tile_size;
+    queue->tiles_y = (image_height + tile_size - 1) / tile_size;
+    queue->next = 0;
+    queue->end = queue->tiles_x * queue->tiles_y;
+    return 0;
+}
+
+void tile_queue_destroy(TileQueue *queue) {
+    mtx_destroy(&queue->lock);
+}
+
+/// @brief Returns the rectangle covered by `cols` tiles and `rows` rows of tiles starting at tile `index`,
+/// clipped to the image.
+static Tile _tile_rect(TileQueue *queue, int index, int cols, int rows) {
+    int x = (index % queue->tiles_x) * queue->tile_size;
+    int y = (index / queue->tiles_x) * queue->tile_size;
+    return (Tile) {
+        x,
+        y,
+        _min(cols * queue->tile_size, queue->image_width - x),
+        _min(rows * queue->tile_size, queue->image_height - y)
+    };
+}
+
+int tile_queue_claim(TileQueue *queue, int max_tiles, Tile *out) {
+    mtx_lock(&queue->lock);
+    int available = queue->end - queue->next;
+    if (available <= 0 || max_tiles <= 0) {
+        mtx_unlock(&queue->lock);
+        return 0;
+    }
+
+    int claimed;
+    int col = queue->next % queue->tiles_x;
+    int rows = _min(max_tiles, available) / queue->tiles_x;
+    if (col == 0 && rows > 0) {
+        // Whole rows of tiles form a single rectangle
+        claimed = rows * queue->tiles_x;
+        *out = _tile_rect(queue, queue->next, queue->tiles_x, rows);
+    } else {
+        // Otherwise stay within the current row of tiles so that the claim remains rectangular
+        claimed = _min(_min(max_tiles, available), queue->tiles_x - col);
+        *out = _tile_rect(queue, queue->next, claimed, 1);
+    }
+    queue->next += claimed;
+
+    mtx_unlock(&queue->lock);
+    return claimed;
+}
+
+int tile_queue_claim_last(TileQueue *queue, Tile *out) {
+    mtx_lock(&queue->lock);
+    if (queue->end <= queue->next) {
+        mtx_unlock(&queue->lock);
+        return 0;
+    }
+    queue->end -= 1;
+    *out = _tile_rect(queue, queue->end, 1, 1);
+    mtx_unlock(&queue->lock);
+    return 1;
+}
+
+int tile_queue_remaining(TileQueue *queue) {
+    mtx_lock(&queue->lock);
+    int remaining = queue->end - queue->next;
+    mtx_unlock(&queue->lock);
+    return remaining;
+}
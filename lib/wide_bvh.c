@@ -0,0 +1,276 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <wide_bvh.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WIDE_BVH_SSE 1
+#include <emmintrin.h>
+#endif
+
+// Largest step count, and the most steps a node's box may span, which leaves one spare to round outwards into
+#define QUANT_MAX 255
+#define QUANT_SPAN 254
+
+// Relative error allowed for when computing entry and exit distances in single precision, a few times
+// the rounding of the handful of operations involved
+static const double SLACK = 1.0 / (1 << 20);
+
+/// @brief Returns 2^e, for the exponents a node stores, without a call to ldexp.
+static double _pow2(int e) {
+    uint64_t bits = (uint64_t)(e + 1023) << 52;
+    double x;
+    memcpy(&x, &bits, sizeof(double));
+    return x;
+}
+
+// Stands in for the infinite reciprocal of a zero direction component
+#define PARALLEL_INV_DIRECTION 1e30f
+
+typedef struct {
+    const Bvh *bvh;
+    WideBvhNode *nodes;
+    size_t node_count;
+} Collapse;
+
+/// @brief Fills in the node's origin, exponents and children's quantized bounds.
+static void _quantize(WideBvhNode *node, const Aabb *children, int count) {
+    Aabb box = aabb_empty();
+    for (int i = 0; i < count; i++) {
+        aabb_extend(&box, &children[i]);
+    }
+    for (int a = 0; a < 3; a++) {
+        float origin = (float)box.min[a];
+        if (origin > box.min[a]) {
+            origin = nextafterf(origin, -INFINITY);
+        }
+        // The smallest power of two that spans the box in QUANT_SPAN steps
+        int e = 0;
+        double step = (box.max[a] - origin) / QUANT_SPAN;
+        if (step > 0.0) {
+            frexp(step, &e);
+        }
+        e = e < -126 ? -126 : e > 127 ? 127 : e;  // Normal floats
+        step = _pow2(e);
+        node->origin[a] = origin;
+        node->exponent[a] = (int8_t)e;
+
+        for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+            if (i >= count) {
+                node->bounds[0][a][i] = QUANT_MAX;
+                node->bounds[1][a][i] = 0;
+                continue;
+            }
+            double lo = floor((children[i].min[a] - origin) / step);
+            double hi = ceil((children[i].max[a] - origin) / step);
+            lo = lo < 0.0 ? 0.0 : lo;
+            hi = hi > QUANT_MAX ? QUANT_MAX : hi;
+            // Division rounds too, so check that the decoded box holds the child
+            while (lo > 0.0 && origin + lo * step > children[i].min[a]) {
+                lo--;
+            }
+            while (hi < QUANT_MAX && origin + hi * step < children[i].max[a]) {
+                hi++;
+            }
+            node->bounds[0][a][i] = (uint8_t)lo;
+            node->bounds[1][a][i] = (uint8_t)hi;
+        }
+    }
+}
+
+/// @brief Fills in wide node `index` with the descendants of binary node `binary`: its children, then
+/// repeatedly the children of whichever interior one has the largest surface area, until there are
+/// WIDE_BVH_WIDTH. Then does the same for the interior ones left.
+static int _collapse(Collapse *c, uint32_t binary, uint32_t index) {
+    const BvhNode *nodes = c->bvh->nodes;
+    uint32_t picked[WIDE_BVH_WIDTH];
+    int count = 0;
+    if (nodes[binary].count > 0) {
+        picked[count++] = binary;  // A root that is a leaf
+    } else {
+        picked[count++] = nodes[binary].first;
+        picked[count++] = nodes[binary].first + 1;
+    }
+    while (count < WIDE_BVH_WIDTH) {
+        int largest = -1;
+        double largest_area = -1.0;
+        for (int i = 0; i < count; i++) {
+            double area = aabb_surface_area(&nodes[picked[i]].bounds);
+            if (nodes[picked[i]].count == 0 && area > largest_area) {
+                largest = i;
+                largest_area = area;
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+        uint32_t first = nodes[picked[largest]].first;
+        picked[largest] = first;
+        picked[count++] = first + 1;
+    }
+
+    WideBvhNode *node = &c->nodes[index];
+    Aabb bounds[WIDE_BVH_WIDTH];
+    memset(node, 0, sizeof(WideBvhNode));
+    node->child_count = (uint8_t)count;
+    for (int i = 0; i < count; i++) {
+        const BvhNode *child = &nodes[picked[i]];
+        bounds[i] = child->bounds;
+        if (child->count > UINT16_MAX) {
+            return 1;
+        }
+        node->count[i] = (uint16_t)child->count;
+        node->child[i] = child->count > 0 ? child->first : (uint32_t)c->node_count++;
+    }
+    _quantize(node, bounds, count);
+
+    for (int i = 0; i < count; i++) {
+        if (node->count[i] == 0 && _collapse(c, picked[i], node->child[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int wide_bvh_build(WideBvh *out, const Bvh *bvh) {
+    wide_bvh_free(out);
+    if (bvh->node_count == 0) {
+        return 0;
+    }
+
+    // Every wide node but a leaf root's replaces at least one interior binary node, of which there are
+    // fewer than half of all nodes
+    size_t capacity = bvh->node_count / 2 + 1;
+    out->memory = malloc(capacity * sizeof(WideBvhNode) + 63);
+    if (out->memory == NULL) {
+        return 1;
+    }
+    Collapse c = { bvh, (WideBvhNode *)(((uintptr_t)out->memory + 63) & ~(uintptr_t)63), 1 };
+    if (_collapse(&c, 0, 0)) {
+        wide_bvh_free(out);
+        return 1;
+    }
+    out->nodes = c.nodes;
+    out->node_count = c.node_count;
+    out->indices = bvh->indices;
+    return 0;
+}
+
+WideBvhRay wide_bvh_ray_new(Vec4D origin, Vec4D direction) {
+    WideBvhRay r = { { (float)origin.x, (float)origin.y, (float)origin.z, 0.0f }, { 0.0f }, { 0.0f }, { 0, 0, 0 } };
+    double d[3] = { direction.x, direction.y, direction.z };
+    for (int i = 0; i < 3; i++) {
+        // Kept finite for axes the ray is parallel to, so that a child's slab still culls it unless the
+        // ray is within the slack of its sides, where infinities would make NaN of the distances
+        r.inv_direction[i] = 1.0f / (float)d[i];
+        if (isinf(r.inv_direction[i])) {
+            r.inv_direction[i] = copysignf(PARALLEL_INV_DIRECTION, r.inv_direction[i]);
+        }
+        r.error[i] = fabsf(r.origin[i] * r.inv_direction[i]);
+        // Also set for -0.0, whose reciprocal is -INFINITY
+        r.sign[i] = r.inv_direction[i] < 0.0f;
+    }
+    return r;
+}
+
+/* Along each axis, a child's bound q steps from the node's origin is crossed at t = q * k + c, where k is
+the step over the direction and c the distance to the origin. The slack, subtracted from the near side's c
+and added to the far side's, covers the rounding of each term, which may be large and opposite when the
+node is far from the ray or the ray's origin far from zero. Should the terms still overflow, comparisons
+against the NaN they make are false, so the max and min below take their second operand, and that axis
+culls nothing. */
+
+#ifdef WIDE_BVH_SSE
+
+/// @brief Returns the four bytes at `q` as floats.
+static __m128 _load_steps(const uint8_t *q) {
+    uint32_t bits;
+    memcpy(&bits, q, sizeof(uint32_t));
+    __m128i zero = _mm_setzero_si128();
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)bits), zero), zero));
+}
+
+#define WIDE_BVH_SLAB(axis)                                                                                  \
+    {                                                                                                         \
+        __m128 k_axis = _mm_shuffle_ps(k, k, _MM_SHUFFLE(axis, axis, axis, axis));                            \
+        __m128 c_near_axis = _mm_shuffle_ps(c_near, c_near, _MM_SHUFFLE(axis, axis, axis, axis));             \
+        __m128 c_far_axis = _mm_shuffle_ps(c_far, c_far, _MM_SHUFFLE(axis, axis, axis, axis));                \
+        __m128 t_near = _mm_add_ps(_mm_mul_ps(_load_steps(node->bounds[ray->sign[axis]][axis]), k_axis), c_near_axis);     \
+        __m128 t_far = _mm_add_ps(_mm_mul_ps(_load_steps(node->bounds[1 - ray->sign[axis]][axis]), k_axis), c_far_axis);   \
+        t_min = _mm_max_ps(t_near, t_min);                                                                    \
+        t_max = _mm_min_ps(t_far, t_max);                                                                     \
+    }
+
+int wide_bvh_node_hits(const WideBvhNode *node, const WideBvhRay *ray, double tmax, float out_t[WIDE_BVH_WIDTH]) {
+    // The origin and exponents of the three axes, each in a lane, the fourth of which holds whatever
+    // follows them in the node and is masked off
+    __m128 xyz = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+    __m128 origin = _mm_and_ps(_mm_loadu_ps(node->origin), xyz);
+    uint32_t exponent_bits;
+    memcpy(&exponent_bits, node->exponent, sizeof(uint32_t));
+    __m128i e = _mm_cvtsi32_si128((int)exponent_bits);
+    e = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_unpacklo_epi8(e, e), _mm_unpacklo_epi8(e, e)), 24);
+    __m128 step = _mm_and_ps(_mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(e, _mm_set1_epi32(127)), 23)), xyz);
+
+    __m128 inv = _mm_loadu_ps(ray->inv_direction);
+    __m128 sign_bit = _mm_set1_ps(-0.0f);
+    __m128 k = _mm_mul_ps(step, inv);
+    __m128 c = _mm_mul_ps(_mm_sub_ps(origin, _mm_loadu_ps(ray->origin)), inv);
+    __m128 error = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(sign_bit, c), _mm_loadu_ps(ray->error)),
+        _mm_mul_ps(_mm_andnot_ps(sign_bit, k), _mm_set1_ps((float)QUANT_MAX)));
+    __m128 slack = _mm_mul_ps(error, _mm_set1_ps((float)SLACK));
+    __m128 c_near = _mm_sub_ps(c, slack);
+    __m128 c_far = _mm_add_ps(c, slack);
+
+    float t_limit = (float)tmax;
+    if (t_limit < tmax) {
+        t_limit = nextafterf(t_limit, INFINITY);
+    }
+    __m128 t_min = _mm_setzero_ps();
+    __m128 t_max = _mm_set1_ps(t_limit);
+    WIDE_BVH_SLAB(0)
+    WIDE_BVH_SLAB(1)
+    WIDE_BVH_SLAB(2)
+    _mm_storeu_ps(out_t, t_min);
+    return _mm_movemask_ps(_mm_cmple_ps(t_min, t_max)) & ((1 << node->child_count) - 1);
+}
+
+#else
+
+int wide_bvh_node_hits(const WideBvhNode *node, const WideBvhRay *ray, double tmax, float out_t[WIDE_BVH_WIDTH]) {
+    float k[3], c_near[3], c_far[3];
+    for (int a = 0; a < 3; a++) {
+        k[a] = (float)_pow2(node->exponent[a]) * ray->inv_direction[a];
+        float c = (node->origin[a] - ray->origin[a]) * ray->inv_direction[a];
+        float slack = (float)SLACK * (fabsf(c) + ray->error[a] + fabsf(k[a]) * QUANT_MAX);
+        c_near[a] = c - slack;
+        c_far[a] = c + slack;
+    }
+    float t_limit = (float)tmax;
+    if (t_limit < tmax) {
+        t_limit = nextafterf(t_limit, INFINITY);
+    }
+
+    int mask = 0;
+    for (int i = 0; i < node->child_count; i++) {
+        float t_min = 0.0f;
+        float t_max = t_limit;
+        for (int a = 0; a < 3; a++) {
+            float t_near = node->bounds[ray->sign[a]][a][i] * k[a] + c_near[a];
+            float t_far = node->bounds[1 - ray->sign[a]][a][i] * k[a] + c_far[a];
+            t_min = t_near > t_min ? t_near : t_min;
+            t_max = t_far < t_max ? t_far : t_max;
+        }
+        out_t[i] = t_min;
+        mask |= (t_min <= t_max) << i;
+    }
+    return mask;
+}
+
+#endif
+
+void wide_bvh_free(WideBvh *bvh) {
+    free(bvh->memory);
+    *bvh = (WideBvh) { 0 };
+}
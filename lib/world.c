@@ -1,13 +1,16 @@
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <config.h>
+#include <group.h>
 #include <world.h>
 #include <ray.h>
 
 /// Returns an empty world with no light and no objects
 World world_new()
 {
-    return (World) { 0, NULL, 0, NULL };
+    return (World) { 0, NULL, 0, NULL, NULL, 0, NULL, 0, NULL, 0, NULL, ACCELERATOR_AUTO };
 }
 
 /// Returns a placeholder world for testing.
@@ -15,18 +18,20 @@ World world_new()
 World world_default()
 {
     PointLight *lights = malloc(sizeof(PointLight));
-    lights[0] = (PointLight) { d4_point(-10., 10., -10.), color_rgb(1., 1., 1.) };
+    lights[0] = point_light_new(d4_point(-10., 10., -10.), color_rgb(1., 1., 1.));
 
-    Shape *objects = malloc(2 * sizeof(Shape));
-    Material material = material_default();
-    material.pattern = pattern_plain_new(color_rgb(0.8, 1.0, 0.6), mat4d_identity());
-    material.diffuse = 0.7;
-    material.specular = 0.2;
-    objects[0] = sphere_new(mat4d_identity(), material, "sphere_outer");
+    Material *materials = malloc(2 * sizeof(Material));
+    materials[0] = material_default();
+    materials[0].pattern = pattern_plain_new(color_rgb(0.8, 1.0, 0.6), mat4d_identity());
+    materials[0].diffuse = 0.7;
+    materials[0].specular = 0.2;
+    materials[1] = material_default();
 
-    objects[1] = sphere_new(scaling(0.5, 0.5, 0.5), material_default(), "sphere_inner");
+    Shape *objects = malloc(2 * sizeof(Shape));
+    objects[0] = sphere_new(mat4d_identity(), 0, "sphere_outer");
+    objects[1] = sphere_new(scaling(0.5, 0.5, 0.5), 1, "sphere_inner");
 
-    return (World) { 1, lights, 2, objects};
+    return (World) { 1, lights, 2, objects, NULL, 0, NULL, 2, materials, 0, NULL, ACCELERATOR_AUTO };
 }
 
 int is_point_shadowed(Vec4D point, PointLight light, World world)
@@ -39,3 +44,184 @@ int is_point_shadowed(Vec4D point, PointLight light, World world)
     Intersection h = ray_intersect_world(r, world);
     return h.t < distance;
 }
+
+// Rebuild the hierarchy once refits have made it this many times as expensive to traverse as when it was built
+static const double BVH_REBUILD_COST_RATIO = 1.5;
+
+/// @brief Writes the bounds and revision of the `i`th object, or of an instance if `i` is past the objects.
+static void _entry_bounds(const World *world, size_t i, Aabb *out, uint32_t *out_revision) {
+    if (i < world->object_count) {
+        *out = shape_bounds(&world->objects[i]);
+        *out_revision = shape_revision(&world->objects[i]);
+        return;
+    }
+    const Instance *instance = &world->instances[i - world->object_count];
+    const Shape *prototype = &world->prototypes[instance->prototype];
+    if (shape_is_group(prototype)) {
+        // The box around the group's box, which is in the instance's space
+        Aabb local = shape_bounds(prototype);
+        *out = aabb_is_finite(&local) ? aabb_transform(&local, instance->transform) : aabb_infinite();
+    } else {
+        // Other shapes' boxes are tighter with the transforms composed first
+        Shape placed = *prototype;
+        placed.transform = mat4d_mul_mat4d(instance->transform, prototype->transform);
+        *out = shape_bounds(&placed);
+    }
+    *out_revision = instance->revision;
+}
+
+static uint32_t _entry_revision(const World *world, size_t i) {
+    return i < world->object_count ? shape_revision(&world->objects[i]) : world->instances[i - world->object_count].revision;
+}
+
+void world_bvh_finish(WorldBvh *bvh) {
+    wide_bvh_free(&bvh->wide);
+    grid_free(&bvh->grid);
+    if (bvh->accelerator != ACCELERATOR_BVH) {
+        // Over the same objects as the tree, whose indices list them
+        const uint32_t *ids = bvh->tree.indices;
+        size_t count = bvh->tree.primitive_count;
+        if (!grid_build(&bvh->grid, bvh->bounds, ids, count, CFG_GRID_DENSITY)
+            && (bvh->accelerator == ACCELERATOR_GRID || grid_suits(&bvh->grid, bvh->bounds, ids, count))) {
+            return;
+        }
+        grid_free(&bvh->grid);
+    }
+    if (CFG_WIDE_BVH) {
+        wide_bvh_build(&bvh->wide, &bvh->tree);
+    }
+}
+
+/// @brief Builds the tree from the bounds already stored in `bvh`.
+static int _build_tree(WorldBvh *bvh) {
+    wide_bvh_free(&bvh->wide);  // Its leaves index the tree about to be replaced
+    size_t count = bvh->object_count + bvh->instance_count;
+    uint32_t *bounded = malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+    if (bounded == NULL) {
+        return 1;
+    }
+    size_t bounded_count = 0;
+    bvh->unbounded_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (aabb_is_finite(&bvh->bounds[i])) {
+            bounded[bounded_count++] = (uint32_t)i;
+        } else {
+            bvh->unbounded[bvh->unbounded_count++] = (uint32_t)i;
+        }
+    }
+    int err = bvh_build(&bvh->tree, bvh->bounds, bounded, bounded_count);
+    free(bounded);
+    if (!err) {
+        world_bvh_finish(bvh);
+    }
+    return err;
+}
+
+/// @brief Replaces the arrays of a borrowed hierarchy with copies of its own, so that it can be rebuilt.
+static int _own_arrays(WorldBvh *bvh) {
+    size_t count = bvh->object_count + bvh->instance_count;
+    size_t n = count > 0 ? count : 1;
+    Aabb *bounds = malloc(n * sizeof(Aabb));
+    uint32_t *revisions = malloc(n * sizeof(uint32_t));
+    uint32_t *unbounded = malloc(n * sizeof(uint32_t));
+    if (bounds == NULL || revisions == NULL || unbounded == NULL) {
+        free(bounds);
+        free(revisions);
+        free(unbounded);
+        return 1;
+    }
+    memcpy(bounds, bvh->bounds, count * sizeof(Aabb));
+    memcpy(revisions, bvh->revisions, count * sizeof(uint32_t));
+    bvh->bounds = bounds;
+    bvh->revisions = revisions;
+    bvh->unbounded = unbounded;
+    bvh->tree = (Bvh) { 0 };  // Rebuilt next, without freeing the mapped nodes
+    bvh->borrowed = 0;
+    return 0;
+}
+
+int world_build_bvh(World *world) {
+    world_free_bvh(world);
+    size_t count = world->object_count + world->instance_count;
+    size_t n = count > 0 ? count : 1;
+    WorldBvh *bvh = calloc(1, sizeof(WorldBvh));
+    if (bvh == NULL) {
+        return 1;
+    }
+    bvh->object_count = world->object_count;
+    bvh->instance_count = world->instance_count;
+    bvh->accelerator = world->accelerator;
+    bvh->bounds = malloc(n * sizeof(Aabb));
+    bvh->revisions = malloc(n * sizeof(uint32_t));
+    bvh->unbounded = malloc(n * sizeof(uint32_t));
+    world->bvh = bvh;
+    if (bvh->bounds == NULL || bvh->revisions == NULL || bvh->unbounded == NULL) {
+        world_free_bvh(world);
+        return 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        _entry_bounds(world, i, &bvh->bounds[i], &bvh->revisions[i]);
+    }
+    if (_build_tree(bvh) || light_tree_build(&bvh->lights, world->lights, world->light_count)) {
+        world_free_bvh(world);
+        return 1;
+    }
+    return 0;
+}
+
+int world_update_bvh(World *world) {
+    WorldBvh *bvh = world->bvh;
+    if (bvh == NULL || bvh->object_count != world->object_count || bvh->instance_count != world->instance_count
+        || bvh->accelerator != world->accelerator) {
+        return world_build_bvh(world) ? -1 : 1;
+    }
+    if (light_tree_update(&bvh->lights, world->lights, world->light_count) < 0) {
+        return -1;
+    }
+
+    int changed = 0;
+    int membership_changed = 0;
+    for (size_t i = 0; i < world->object_count + world->instance_count; i++) {
+        if (_entry_revision(world, i) == bvh->revisions[i]) {
+            continue;
+        }
+        int was_bounded = aabb_is_finite(&bvh->bounds[i]);
+        _entry_bounds(world, i, &bvh->bounds[i], &bvh->revisions[i]);
+        membership_changed |= was_bounded != aabb_is_finite(&bvh->bounds[i]);
+        changed = 1;
+    }
+    if (!changed) {
+        return 0;
+    }
+
+    if (!membership_changed) {
+        bvh_refit(&bvh->tree, bvh->bounds);
+        if (bvh_cost(&bvh->tree) <= BVH_REBUILD_COST_RATIO * bvh->tree.built_cost) {
+            world_bvh_finish(bvh);
+            return 0;
+        }
+    }
+    if (bvh->borrowed && _own_arrays(bvh)) {
+        return -1;
+    }
+    return _build_tree(bvh) ? -1 : 1;
+}
+
+void world_free_bvh(World *world) {
+    WorldBvh *bvh = world->bvh;
+    if (bvh == NULL) {
+        return;
+    }
+    wide_bvh_free(&bvh->wide);
+    grid_free(&bvh->grid);
+    light_tree_free(&bvh->lights);
+    if (!bvh->borrowed) {
+        bvh_free(&bvh->tree);
+        free(bvh->bounds);
+        free(bvh->revisions);
+        free(bvh->unbounded);
+    }
+    free(bvh);
+    world->bvh = NULL;
+}
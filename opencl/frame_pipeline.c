@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <timer.h>
+
+#include "opencl_renderer.h"
+
+/* Renders frame sequences with uploads, kernels and readbacks on separate in-order queues, so that the
+device can run one frame's kernel while the next frame's scene is written and the previous frame's image
+is read. Each frame in flight has its own scene buffers, output image and host staging memory. */
+
+#define MAX_SLOTS 2
+
+typedef struct {
+    int frame;                 // The frame using the slot, or -1 if it is free
+    MarshalledScene staging;   // Source of the frame's uploads, so it must outlive them
+    SceneBuffers buffers;      // Only what changed since the slot's last frame is uploaded
+    uint8_t *result;           // Destination of the frame's readback
+    cl_event uploaded;
+    cl_event kernel;
+    cl_event readback;
+} FrameSlot;
+
+typedef struct {
+    OpenCLRenderer *r;
+    cl_command_queue upload_queue;
+    cl_command_queue readback_queue;
+    FrameSlot slots[MAX_SLOTS];
+    int slot_count;
+    Canvas canvas;
+} Pipeline;
+
+static void _release_events(FrameSlot *slot) {
+    if (slot->uploaded) clReleaseEvent(slot->uploaded);
+    if (slot->kernel) clReleaseEvent(slot->kernel);
+    if (slot->readback) clReleaseEvent(slot->readback);
+    slot->uploaded = NULL;
+    slot->kernel = NULL;
+    slot->readback = NULL;
+}
+
+/// @brief Marshalls the scene for `frame` into a free slot and enqueues its upload, kernel and readback.
+static int _enqueue_frame(Pipeline *p, FrameSlot *slot, int frame, FrameSource source, void *user) {
+    OpenCLRenderer *r = p->r;
+    World world;
+    Camera camera;
+    if (source(frame, user, &world, &camera)) {
+        fprintf(stderr, "Failed to get scene for frame %d\n", frame);
+        return 1;
+    }
+    if (world.object_count != r->shape_count || world.material_count != r->material_count || world.light_count != r->light_count
+        || camera.hsize != r->width || camera.vsize != r->height) {
+        fprintf(stderr, "Frame %d does not match the scene the renderer was created with\n", frame);
+        return 1;
+    }
+
+    cl_int err = upload_scene(r, p->upload_queue, world, camera, &slot->staging, &slot->buffers, CL_FALSE, &slot->uploaded);
+    err |= set_scene_args(r, &slot->buffers);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Error uploading frame %d. Error code %d\n", frame, err);
+        return 1;
+    }
+
+    Tile whole_image = { 0, 0, r->width, r->height };
+    err = enqueue_tile_kernel(r, whole_image, 1, &slot->uploaded, &slot->kernel);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Error queueing kernel for frame %d. Error code %d\n", frame, err);
+        return 1;
+    }
+    profile_record(r->profile, PROFILE_KERNEL, slot->kernel);
+
+    err = clEnqueueReadImage(
+        p->readback_queue,
+        slot->buffers.output_image,
+        CL_FALSE,
+        (size_t[]){ 0, 0, 0 },
+        (size_t[]){ r->width, r->height, 1 },
+        0,
+        0,
+        slot->result,
+        1,
+        &slot->kernel,
+        &slot->readback
+    );
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Error queueing readback for frame %d. Error code %d\n", frame, err);
+        return 1;
+    }
+    profile_record(r->profile, PROFILE_READBACK, slot->readback);
+
+    // Submit now rather than when the host next blocks, so the device can start on the frame
+    clFlush(p->upload_queue);
+    clFlush(r->command_queue);
+    clFlush(p->readback_queue);
+    slot->frame = frame;
+    return 0;
+}
+
+/// @brief Waits for the slot's frame to be read back, hands it to the sink and frees the slot.
+static int _finish_frame(Pipeline *p, FrameSlot *slot, FrameSink sink, void *user) {
+    OpenCLRenderer *r = p->r;
+    double start = timer_seconds();
+    cl_int err = clWaitForEvents(1, &slot->readback);
+    profile_host(r->profile, PROFILE_READBACK, timer_seconds() - start);
+    int frame = slot->frame;
+    slot->frame = -1;
+    _release_events(slot);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Error reading back frame %d. Error code %d\n", frame, err);
+        return 1;
+    }
+
+    start = timer_seconds();
+    Tile whole_image = { 0, 0, r->width, r->height };
+    write_result_to_canvas(slot->result, whole_image, p->canvas);
+    profile_host(r->profile, PROFILE_CANVAS_WRITE, timer_seconds() - start);
+    return sink(frame, p->canvas, user);
+}
+
+static int _pipeline_init(Pipeline *p, OpenCLRenderer *r) {
+    *p = (Pipeline) { 0 };
+    p->r = r;
+    p->slot_count = r->double_buffer ? 2 : 1;
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        p->slots[i].frame = -1;
+    }
+
+    cl_command_queue_properties properties = r->profile ? CL_QUEUE_PROFILING_ENABLE : 0;
+    cl_int err;
+    p->upload_queue = clCreateCommandQueue(r->context, r->device, properties, &err);
+    if (p->upload_queue == NULL) {
+        fprintf(stderr, "Failed to create upload queue. Error code %d\n", err);
+        return 1;
+    }
+    p->readback_queue = clCreateCommandQueue(r->context, r->device, properties, &err);
+    if (p->readback_queue == NULL) {
+        fprintf(stderr, "Failed to create readback queue. Error code %d\n", err);
+        return 1;
+    }
+
+    for (int i = 0; i < p->slot_count; i++) {
+        FrameSlot *slot = &p->slots[i];
+        if (marshalled_scene_init(&slot->staging, r->shape_count, r->material_count, r->light_count)) {
+            return 1;
+        }
+        slot->result = calloc(4 * (size_t)r->width * r->height, sizeof(uint8_t));
+        if (slot->result == NULL) {
+            return 1;
+        }
+        err = scene_buffers_create(r, r->shape_count, r->material_count, r->light_count, &slot->buffers);
+        if (err != CL_SUCCESS) {
+            fprintf(stderr, "Failed to create buffers for frame pipeline. Error code %d\n", err);
+            return 1;
+        }
+    }
+
+    p->canvas = canvas_create(r->width, r->height);
+    return 0;
+}
+
+static void _pipeline_destroy(Pipeline *p) {
+    // Commands still in flight after an error may use the slots' memory
+    if (p->upload_queue) clFinish(p->upload_queue);
+    clFinish(p->r->command_queue);
+    if (p->readback_queue) clFinish(p->readback_queue);
+
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        FrameSlot *slot = &p->slots[i];
+        _release_events(slot);
+        scene_buffers_release(&slot->buffers);
+        marshalled_scene_free(&slot->staging);
+        free(slot->result);
+    }
+    if (p->canvas.pixels) canvas_destroy(p->canvas);
+    if (p->readback_queue) clReleaseCommandQueue(p->readback_queue);
+    if (p->upload_queue) clReleaseCommandQueue(p->upload_queue);
+
+    // opencl_render_tile expects the kernel to render the renderer's own scene
+    set_scene_args(p->r, &p->r->scene);
+}
+
+int opencl_render_frames(OpenCLRenderer *r, int frame_count, FrameSource source, FrameSink sink, void *user) {
+    Pipeline p;
+    int err = _pipeline_init(&p, r);
+
+    for (int frame = 0; frame < frame_count && !err; frame++) {
+        FrameSlot *slot = &p.slots[frame % p.slot_count];
+
+        // Without double buffering the previous frame still occupies the only slot
+        if (slot->frame >= 0) {
+            err = _finish_frame(&p, slot, sink, user);
+            if (err) {
+                break;
+            }
+        }
+        err = _enqueue_frame(&p, slot, frame, source, user);
+
+        // The previous frame is read back and written while this one renders
+        FrameSlot *previous = &p.slots[(frame + p.slot_count - 1) % p.slot_count];
+        if (!err && p.slot_count > 1 && previous->frame >= 0) {
+            err = _finish_frame(&p, previous, sink, user);
+        }
+    }
+
+    // Drain the last frame
+    for (int i = 0; i < p.slot_count && !err; i++) {
+        FrameSlot *slot = &p.slots[(frame_count + i) % p.slot_count];
+        if (slot->frame >= 0) {
+            err = _finish_frame(&p, slot, sink, user);
+        }
+    }
+
+    _pipeline_destroy(&p);
+    return err ? 1 : 0;
+}
@@ -0,0 +1,792 @@
+#include <renderer.h>
+#include <config.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <timer.h>
+#include <CL/cl.h>
+
+#include "opencl_renderer.h"
+#include "program_cache.h"
+#include "scene_cl.h"
+
+const cl_uint MAX_PLATFORMS = 8;
+const cl_uint MAX_PLATFORM_NAME_LEN = 32;
+const cl_uint MAX_DEVICES = 8;
+
+
+// Converts host-side scene data into the layouts in scene_cl.h
+int marshall_affine(Mat4D *in, cl_float4 out[3]) {
+    for (int iRow = 0; iRow < 3; iRow++) {
+        for (int jCol = 0; jCol < 4; jCol++) {
+            out[iRow].s[jCol] = (float)in->m[iRow][jCol];
+        }
+    }
+    return 0;
+}
+
+int marshall_vec4(Vec4D *in, cl_float4 *out) {
+    out->s[0] = (float)in->x;
+    out->s[1] = (float)in->y;
+    out->s[2] = (float)in->z;
+    out->s[3] = (float)in->w;
+    return 0;
+}
+
+int marshall_color(Color *in, cl_float4 *out) {
+    out->s[0] = (float)in->r;
+    out->s[1] = (float)in->g;
+    out->s[2] = (float)in->b;
+    out->s[3] = 1.0f;
+    return 0;
+}
+
+int marshall_camera(Camera camera, CameraCL *out) {
+    // Everything the kernel needs to generate a ray for any point within a pixel, so that it does not
+    // have to recompute the image plane or transform the eye for every sample.
+    Mat4D inv = camera.inv_transform;
+    Vec4D origin = mat4d_mul_vec4d(inv, d4_point(0., 0., 0.));
+    Vec4D corner = d4_sub(mat4d_mul_vec4d(inv, d4_point(camera.half_width, camera.half_height, -1.)), origin);
+    Vec4D pixel_dx = mat4d_mul_vec4d(inv, d4_vector(-camera.pixel_size, 0., 0.));
+    Vec4D pixel_dy = mat4d_mul_vec4d(inv, d4_vector(0., -camera.pixel_size, 0.));
+    marshall_vec4(&origin, &out->origin);
+    marshall_vec4(&corner, &out->corner);
+    marshall_vec4(&pixel_dx, &out->pixel_dx);
+    marshall_vec4(&pixel_dy, &out->pixel_dy);
+    out->hsize = camera.hsize;
+    out->vsize = camera.vsize;
+    out->pad[0] = 0;
+    out->pad[1] = 0;
+    return 0;
+}
+
+int marshall_material(Material material, MaterialCL *out) {
+    // Assuming uniform colors for now
+    marshall_color(&material.pattern.a, &out->color);
+    out->ambient = (float)material.ambient;
+    out->diffuse = (float)material.diffuse;
+    out->specular = (float)material.specular;
+    out->shininess = (float)material.shininess;
+    out->reflective = (float)material.reflective;
+    out->transparency = (float)material.transparency;
+    out->refractive_index = (float)material.refractive_index;
+    out->pad = 0.0f;
+    return 0;
+}
+
+_Static_assert(SHAPE_CL_SPHERE == SHAPE_SPHERE && SHAPE_CL_PLANE == SHAPE_PLANE, "Shape type mismatch");
+
+/// @brief Marshalls `count` shapes starting at `first`, each into the entry of `out` with the same index. Shapes
+/// refer to their materials by their index in the world's palette, which is uploaded on its own.
+int marshall_shapes(World world, size_t first, size_t count, ShapeCL *out)  {
+    for (size_t i = first; i < first + count; i++) {
+        Shape *shape = &world.objects[i];
+        ShapeCL *shape_cl = &out[i];
+
+        marshall_affine(&shape->inv_transform, shape_cl->inv_transform);
+        shape_cl->ymin = (float)shape->ymin;
+        shape_cl->ymax = (float)shape->ymax;
+        shape_cl->material = (cl_int)shape->material;
+        shape_cl->type = (cl_ushort)shape->type;
+        shape_cl->closed = (cl_ushort)shape->closed;
+    }
+    return 0;
+}
+
+/// @brief Marshalls the world's palette into `out`, which holds the palette as it was last marshalled. Returns
+/// the end of the range of materials that changed, or of every material if `all` is set, and writes its start
+/// to `*first`, which equals the end if none did.
+size_t marshall_materials(World world, MaterialCL *out, int all, size_t *first) {
+    size_t end = 0;
+    *first = world.material_count;
+    for (size_t i = 0; i < world.material_count; i++) {
+        MaterialCL material;
+        marshall_material(world.materials[i], &material);
+        if (all || memcmp(&material, &out[i], sizeof(MaterialCL)) != 0) {
+            out[i] = material;
+            *first = i < *first ? i : *first;
+            end = i + 1;
+        }
+    }
+    if (end == 0) {
+        *first = 0;
+    }
+    return end;
+}
+
+int marshall_lights(World world, size_t first, size_t count, PointLightCL *out) {
+    for (size_t i = first; i < first + count; i++) {
+        PointLight *light = &world.lights[i];
+        PointLightCL *light_cl = &out[i];
+        Vec4D center = light_center(light);
+        marshall_vec4(&center, &light_cl->position);
+        marshall_color(&light->intensity, &light_cl->intensity);
+        light_cl->intensity.s[3] = (float)light->falloff;
+    }
+    return 0;
+}
+
+cl_context create_context() {
+    // Select an OpenCL platform to run on. For now, just use the default.
+    cl_platform_id first_platform_id;
+    cl_uint num_platforms;
+    cl_int err = clGetPlatformIDs(1, &first_platform_id, &num_platforms);
+    if (err != CL_SUCCESS || num_platforms <= 0) {
+        printf_s("Failed to find any OpenCL platforms.\n");
+        return NULL;
+    }
+
+    // Create an OpenCL context on the platform.
+    // Attempt to create a GPU-based context. If that fails, try to create a CPU-based context.
+    cl_context_properties contextProperties[] = {
+        CL_CONTEXT_PLATFORM,
+        (cl_context_properties)first_platform_id,
+        0
+    };
+
+    cl_context context = clCreateContextFromType(
+        contextProperties,
+        CL_DEVICE_TYPE_GPU,
+        NULL,
+        NULL,
+        &err
+    );
+
+    if (err != CL_SUCCESS) {
+        printf("Could not create GPU context. Trying CPU...\n");
+        context = clCreateContextFromType(
+            contextProperties,
+            CL_DEVICE_TYPE_CPU,
+            NULL,
+            NULL,
+            &err
+        );
+        if (err != CL_SUCCESS) {
+            fprintf(stderr, "Failed to create an OpenCL GPU or CPU context.\n");
+            return NULL;
+        }
+    }
+
+    return context;
+}
+
+/// @brief Selects a device and creates a command queue on it with the given properties.
+cl_command_queue create_command_queue(cl_context context, cl_device_id *device, cl_command_queue_properties properties) {
+    size_t device_buffer_size;
+    cl_int err = clGetContextInfo(context, CL_CONTEXT_DEVICES, 0, NULL, &device_buffer_size);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Failed call to clGetContextInfo(...,GL_CONTEXT_DEVICES,...)\n");
+        return NULL;
+    }
+    if (device_buffer_size <= 0) {
+        fprintf(stderr, "No devices available.\n");
+        return NULL;
+    }
+
+    // Allocate memory for the devices buffer
+    cl_device_id *devices = calloc(device_buffer_size, sizeof(cl_device_id));
+    err = clGetContextInfo(context, CL_CONTEXT_DEVICES, device_buffer_size, devices, NULL);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Failed to get device IDs.\n");
+        return NULL;
+    }
+
+    // Use the first device with image support
+    for (int i = 0; i < device_buffer_size; i++) {
+        cl_bool supports_images;
+        err = clGetDeviceInfo(devices[i], CL_DEVICE_IMAGE_SUPPORT, sizeof(cl_bool), &supports_images, NULL);
+        if (supports_images) {
+            *device = devices[i];
+            break;
+        }
+    }
+    if (device == NULL) {
+        fprintf(stderr, "No devices support images.\n");
+        return NULL;
+    }
+
+    // If we want this to run on a cluster or something, modify to use all available GPUs.
+    cl_command_queue command_queue = clCreateCommandQueue(context, *device, properties, &err);
+    if (command_queue == NULL) {
+        fprintf(stderr, "Failed to create commandQueue for device 0. Error code %d.\n", err);
+        return NULL;
+    }
+
+    free(devices);
+    return command_queue;
+}
+
+/// @brief Writes the build options for raytrace.cl to `out`. These always fix the kernel's limits.
+/// If `specialize` is set they also fix the scene's light count and the shape types it contains, so the
+/// compiler can unroll the lighting loop and drop intersection code for absent shape types.
+void kernel_build_options(World world, int specialize, char *out, size_t len) {
+    int written = snprintf(
+        out,
+        len,
+        "-D MAX_REFLECTIONS=%d -D NUM_SAMPLES=%d -D STOP_AT_ATTENUATION=%ff",
+        CFG_RECURSION_DEPTH,
+        CFG_NUM_SAMPLES,
+        CFG_STOP_AT_ATTENUATION
+    );
+    if (!specialize || written < 0 || (size_t)written >= len) {
+        return;
+    }
+
+    int has_sphere = 0;
+    int has_plane = 0;
+    for (size_t i = 0; i < world.object_count; i++) {
+        has_sphere |= world.objects[i].type == SHAPE_SPHERE;
+        has_plane |= world.objects[i].type == SHAPE_PLANE;
+    }
+    snprintf(
+        out + written,
+        len - written,
+        " -D NUM_LIGHTS=%zu -D HAS_SHAPE_SPHERE=%d -D HAS_SHAPE_PLANE=%d",
+        world.light_count,
+        has_sphere,
+        has_plane
+    );
+}
+
+int opencl_supports_world(World world) {
+    if (world.instance_count > 0 || world.light_count > (size_t)CFG_LIGHT_SAMPLES) {
+        return 0;
+    }
+    for (size_t i = 0; i < world.object_count; i++) {
+        if (world.objects[i].type != SHAPE_SPHERE && world.objects[i].type != SHAPE_PLANE) {
+            return 0;
+        }
+    }
+    for (size_t i = 0; i < world.light_count; i++) {
+        if (world.lights[i].type != LIGHT_POINT) {
+            return 0;
+        }
+    }
+    for (size_t i = 0; i < world.material_count; i++) {
+        if (world.materials[i].pattern.type != PATTERN_PLAIN || world.materials[i].transparency > 0.0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/// @brief Returns an OpenCL context, command queue, program and kernel. If `profile` is not NULL the queue
+/// records profiling information and the setup stages are timed.
+int init_opencl(
+    const char *build_options,
+    Profile *profile,
+    cl_context *out_context,
+    cl_device_id *out_device,
+    cl_command_queue *out_command_queue,
+    cl_program *out_program,
+    cl_kernel *out_kernel,
+    char out_cache_key[PROGRAM_CACHE_KEY_LEN]
+) {
+    // Create an OpenCL context on first available platform
+    double start = timer_seconds();
+    cl_context context = create_context();
+    if (context == NULL) {
+        fprintf(stderr, "Failed to create OpenCL context.\n");
+        return 1;
+    }
+
+    // Create a command queue on the first available device
+    cl_device_id device;
+    cl_command_queue_properties properties = profile ? CL_QUEUE_PROFILING_ENABLE : 0;
+    cl_command_queue command_queue = create_command_queue(context, &device, properties);
+    if (command_queue == NULL) {
+        clReleaseContext(context);
+        return 1;
+    }
+    profile_host(profile, PROFILE_CONTEXT_SETUP, timer_seconds() - start);
+
+    // Create OpenCL program from source files, or from the cached binary of an earlier build.
+    // The shared scene layouts are prepended to the kernel rather than #included so that they are part of
+    // the cache key, and so that driver-side caches cannot serve a kernel built against an older header.
+    const char *sources[] = { "opencl/scene_cl.h", "opencl/raytrace.cl" };
+    int cached;
+    start = timer_seconds();
+    cl_program program = program_cache_build(context, device, sources, 2, build_options, out_cache_key, &cached);
+    if (CFG_VERBOSE && program != NULL) {
+        printf("%s kernel variant %s (%s)\n", cached ? "Loaded cached" : "Built", out_cache_key, build_options);
+    }
+    if (program == NULL) {
+        clReleaseCommandQueue(command_queue);
+        clReleaseContext(context);
+        return 1;
+    }
+
+    // Create OpenCL kernel
+    cl_int kernel_err;
+    cl_kernel kernel = clCreateKernel(program, "raytrace_kernel", &kernel_err);
+    if (kernel == NULL) {
+        fprintf(stderr, "Failed to create kernel. Error code %d\n", kernel_err);
+        clReleaseProgram(program);
+        clReleaseCommandQueue(command_queue);
+        clReleaseContext(context);
+        return 1;
+    }
+    profile_host(profile, PROFILE_PROGRAM_BUILD, timer_seconds() - start);
+
+    *out_context = context;
+    *out_device = device;
+    *out_command_queue = command_queue;
+    *out_program = program;
+    *out_kernel = kernel;
+    return 0;
+}
+
+// Fraction of the device's local memory that may be used to stage the scene. Using all of it would
+// limit how many work-groups can be resident at once.
+static const double LOCAL_MEMORY_FRACTION = 0.5;
+
+/// @brief Decides how many lights, and then how many shapes, each work-group copies into local memory.
+/// Lights come first because every hit reads all of them; shapes fill whatever budget remains.
+void plan_local_staging(cl_device_id device, World world, cl_int *out_staged_shapes, cl_int *out_staged_lights) {
+    cl_ulong local_memory_size = 0;
+    clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &local_memory_size, NULL);
+    size_t budget = (size_t)(LOCAL_MEMORY_FRACTION * (double)local_memory_size);
+
+    size_t staged_lights = budget / sizeof(PointLightCL);
+    if (staged_lights > world.light_count) {
+        staged_lights = world.light_count;
+    }
+    budget -= staged_lights * sizeof(PointLightCL);
+
+    size_t staged_shapes = budget / sizeof(ShapeCL);
+    if (staged_shapes > world.object_count) {
+        staged_shapes = world.object_count;
+    }
+
+    *out_staged_shapes = (cl_int)staged_shapes;
+    *out_staged_lights = (cl_int)staged_lights;
+}
+
+int marshalled_scene_init(MarshalledScene *scene, size_t shape_count, size_t material_count, size_t light_count) {
+    scene->shapes = calloc(shape_count, sizeof(ShapeCL));
+    scene->materials = calloc(material_count, sizeof(MaterialCL));
+    scene->lights = calloc(light_count, sizeof(PointLightCL));
+    scene->shape_count = shape_count;
+    scene->material_count = material_count;
+    scene->light_count = light_count;
+    if ((shape_count > 0 && scene->shapes == NULL) || (material_count > 0 && scene->materials == NULL)
+        || (light_count > 0 && scene->lights == NULL)) {
+        marshalled_scene_free(scene);
+        return 1;
+    }
+    return 0;
+}
+
+void marshalled_scene_free(MarshalledScene *scene) {
+    free(scene->shapes);
+    free(scene->materials);
+    free(scene->lights);
+    scene->shapes = NULL;
+    scene->materials = NULL;
+    scene->lights = NULL;
+}
+
+cl_int scene_buffers_create(OpenCLRenderer *r, size_t shape_count, size_t material_count, size_t light_count, SceneBuffers *out) {
+    // Empty buffers are not allowed, so allocate at least one element
+    size_t shapes = shape_count > 0 ? shape_count : 1;
+    size_t materials = material_count > 0 ? material_count : 1;
+    size_t lights = light_count > 0 ? light_count : 1;
+    cl_int err[5];
+    out->camera = clCreateBuffer(r->context, CL_MEM_READ_ONLY, sizeof(CameraCL), NULL, &err[0]);
+    out->shapes = clCreateBuffer(r->context, CL_MEM_READ_ONLY, shapes * sizeof(ShapeCL), NULL, &err[1]);
+    out->materials = clCreateBuffer(r->context, CL_MEM_READ_ONLY, materials * sizeof(MaterialCL), NULL, &err[2]);
+    out->lights = clCreateBuffer(r->context, CL_MEM_READ_ONLY, lights * sizeof(PointLightCL), NULL, &err[3]);
+    out->shape_revisions = calloc(shapes, sizeof(uint32_t));
+    out->light_revisions = calloc(lights, sizeof(uint32_t));
+    out->filled = 0;
+    if (out->shape_revisions == NULL || out->light_revisions == NULL) {
+        err[3] = CL_OUT_OF_HOST_MEMORY;
+    }
+
+    // Tiles are written at their absolute position and read back one region at a time
+    cl_image_format image_format;
+    image_format.image_channel_order = CL_RGBA;
+    image_format.image_channel_data_type = CL_UNORM_INT8;
+    out->output_image = clCreateImage2D(
+        r->context,
+        CL_MEM_WRITE_ONLY,
+        &image_format,
+        r->width,
+        r->height,
+        0,
+        NULL,
+        &err[4]
+    );
+
+    for (int i = 0; i < 5; i++) {
+        if (err[i] != CL_SUCCESS) {
+            scene_buffers_release(out);
+            return err[i];
+        }
+    }
+    return CL_SUCCESS;
+}
+
+void scene_buffers_release(SceneBuffers *buffers) {
+    if (buffers->output_image) clReleaseMemObject(buffers->output_image);
+    if (buffers->lights) clReleaseMemObject(buffers->lights);
+    if (buffers->materials) clReleaseMemObject(buffers->materials);
+    if (buffers->shapes) clReleaseMemObject(buffers->shapes);
+    if (buffers->camera) clReleaseMemObject(buffers->camera);
+    free(buffers->shape_revisions);
+    free(buffers->light_revisions);
+    *buffers = (SceneBuffers) { 0 };
+}
+
+// Writing a few unchanged items is cheaper than issuing another command, so changed items closer together
+// than this are uploaded in one write
+static const size_t UPLOAD_MERGE_GAP = 8;
+
+/// @brief Finds the next run of items at or after `*first` whose revision differs from the uploaded one, or
+/// every item if `all` is set. Items are `stride` bytes apart with their revision `offset` bytes in. Moves
+/// `*first` to the start of the run and returns its end, which equals `*first` if nothing changed.
+static size_t _next_changed_run(
+    const uint32_t *uploaded,
+    const void *items,
+    size_t stride,
+    size_t offset,
+    size_t count,
+    int all,
+    size_t *first
+) {
+    #define REVISION(i) (*(const uint32_t *)((const char *)items + (i) * stride + offset))
+    size_t i = *first;
+    while (i < count && !all && uploaded[i] == REVISION(i)) {
+        i++;
+    }
+    *first = i;
+
+    size_t end = i;
+    size_t unchanged = 0;
+    for (; i < count && unchanged < UPLOAD_MERGE_GAP; i++) {
+        if (all || uploaded[i] != REVISION(i)) {
+            end = i + 1;
+            unchanged = 0;
+        } else {
+            unchanged++;
+        }
+    }
+    #undef REVISION
+    return end;
+}
+
+/// @brief Enqueues a write of items [first, end) of `data` to the same range of `buffer` and records it in the profile.
+static cl_int _write_range(
+    OpenCLRenderer *r,
+    cl_command_queue queue,
+    cl_mem buffer,
+    const void *data,
+    size_t item_size,
+    size_t first,
+    size_t end,
+    cl_bool blocking
+) {
+    return clEnqueueWriteBuffer(
+        queue,
+        buffer,
+        blocking,
+        first * item_size,
+        (end - first) * item_size,
+        (const char *)data + first * item_size,
+        0,
+        NULL,
+        profile_event(r->profile, PROFILE_UPLOAD)
+    );
+}
+
+cl_int upload_scene(
+    OpenCLRenderer *r,
+    cl_command_queue queue,
+    World world,
+    Camera camera,
+    MarshalledScene *staging,
+    SceneBuffers *buffers,
+    cl_bool blocking,
+    cl_event *out_done
+) {
+    int all = !buffers->filled || !r->incremental;
+    size_t shapes_written = 0;
+    size_t materials_written = 0;
+    size_t lights_written = 0;
+
+    // The camera is a single small struct, so it is always rewritten
+    double start = timer_seconds();
+    marshall_camera(camera, &staging->camera);
+    profile_host(r->profile, PROFILE_MARSHALLING, timer_seconds() - start);
+    cl_int err = _write_range(r, queue, buffers->camera, &staging->camera, sizeof(CameraCL), 0, 1, blocking);
+
+    size_t end;
+    for (size_t first = 0; (end = _next_changed_run(buffers->shape_revisions, world.objects, sizeof(Shape),
+            offsetof(Shape, revision), world.object_count, all, &first)) > first; first = end) {
+        start = timer_seconds();
+        marshall_shapes(world, first, end - first, staging->shapes);
+        profile_host(r->profile, PROFILE_MARSHALLING, timer_seconds() - start);
+        err |= _write_range(r, queue, buffers->shapes, staging->shapes, sizeof(ShapeCL), first, end, blocking);
+        for (size_t i = first; i < end; i++) {
+            buffers->shape_revisions[i] = world.objects[i].revision;
+        }
+        shapes_written += end - first;
+    }
+
+    // Editing a material changes no shape's revision, so the palette is compared with the copy last written
+    // instead. Palettes are small, so one write covers every change.
+    start = timer_seconds();
+    size_t first_material;
+    size_t end_material = marshall_materials(world, staging->materials, all, &first_material);
+    profile_host(r->profile, PROFILE_MARSHALLING, timer_seconds() - start);
+    if (end_material > first_material) {
+        err |= _write_range(r, queue, buffers->materials, staging->materials, sizeof(MaterialCL), first_material, end_material, blocking);
+        materials_written = end_material - first_material;
+    }
+
+    for (size_t first = 0; (end = _next_changed_run(buffers->light_revisions, world.lights, sizeof(PointLight),
+            offsetof(PointLight, revision), world.light_count, all, &first)) > first; first = end) {
+        start = timer_seconds();
+        marshall_lights(world, first, end - first, staging->lights);
+        profile_host(r->profile, PROFILE_MARSHALLING, timer_seconds() - start);
+        err |= _write_range(r, queue, buffers->lights, staging->lights, sizeof(PointLightCL), first, end, blocking);
+        for (size_t i = first; i < end; i++) {
+            buffers->light_revisions[i] = world.lights[i].revision;
+        }
+        lights_written += end - first;
+    }
+
+    if (out_done != NULL) {
+        // Queues are in order, so the marker completes once every write above has
+        err |= clEnqueueMarker(queue, out_done);
+    }
+
+    // After a failed write the device copy is unknown, so the next upload rewrites everything
+    buffers->filled = err == CL_SUCCESS;
+    if (CFG_VERBOSE) {
+        printf("Uploaded %zu of %zu shapes, %zu of %zu materials and %zu of %zu lights\n",
+            shapes_written, world.object_count, materials_written, world.material_count, lights_written, world.light_count);
+    }
+    return err;
+}
+
+cl_int set_scene_args(OpenCLRenderer *r, const SceneBuffers *buffers) {
+    cl_int num_shapes = (cl_int)r->shape_count;
+    cl_int num_lights = (cl_int)r->light_count;
+    cl_int err = clSetKernelArg(r->kernel, 0, sizeof(cl_mem), &buffers->camera);
+    err |= clSetKernelArg(r->kernel, 1, sizeof(cl_int), &num_shapes);
+    err |= clSetKernelArg(r->kernel, 2, sizeof(cl_mem), &buffers->shapes);
+    err |= clSetKernelArg(r->kernel, 3, sizeof(cl_mem), &buffers->materials);
+    err |= clSetKernelArg(r->kernel, 4, sizeof(cl_int), &num_lights);
+    err |= clSetKernelArg(r->kernel, 5, sizeof(cl_mem), &buffers->lights);
+    err |= clSetKernelArg(r->kernel, 6, sizeof(cl_mem), &buffers->output_image);
+    return err;
+}
+
+OpenCLOptions opencl_options_default() {
+    return (OpenCLOptions) { CFG_OPENCL_SPECIALIZE, CFG_OPENCL_STAGE_LOCAL, CFG_OPENCL_TUNE_WORK_GROUP, CFG_OPENCL_PROFILE, CFG_OPENCL_DOUBLE_BUFFER, CFG_OPENCL_INCREMENTAL_UPLOADS };
+}
+
+OpenCLRenderer *opencl_renderer_new(World world, Camera camera, OpenCLOptions options) {
+    OpenCLRenderer *r = calloc(1, sizeof(OpenCLRenderer));
+    if (r == NULL) {
+        return NULL;
+    }
+    if (options.profile) {
+        r->profile = profile_new();
+    }
+    char build_options[256];
+    kernel_build_options(world, options.specialize, build_options, sizeof(build_options));
+    if (init_opencl(build_options, r->profile, &r->context, &r->device, &r->command_queue, &r->program, &r->kernel, r->cache_key)) {
+        profile_free(r->profile);
+        free(r);
+        return NULL;
+    }
+    r->width = camera.hsize;
+    r->height = camera.vsize;
+    r->shape_count = world.object_count;
+    r->material_count = world.material_count;
+    r->light_count = world.light_count;
+    r->double_buffer = options.double_buffer;
+
+    r->incremental = options.incremental_uploads;
+
+    if (marshalled_scene_init(&r->staging, world.object_count, world.material_count, world.light_count)) {
+        opencl_renderer_free(r);
+        return NULL;
+    }
+    cl_int err = scene_buffers_create(r, world.object_count, world.material_count, world.light_count, &r->scene);
+    if (err == CL_SUCCESS) {
+        err = upload_scene(r, r->command_queue, world, camera, &r->staging, &r->scene, CL_TRUE, NULL);
+    }
+    if (err == CL_SUCCESS) {
+        err = set_scene_args(r, &r->scene);
+    }
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Error uploading scene. Error code %d\n", err);
+        opencl_renderer_free(r);
+        return NULL;
+    }
+
+    // Local memory for the part of the scene each work-group stages. Zero-sized local arguments are not
+    // allowed, so reserve at least one element even when nothing is staged.
+    int arg_counter = ARG_OFFSET_Y + 1;
+    cl_int staged_shapes = 0;
+    cl_int staged_lights = 0;
+    if (options.stage_local) {
+        plan_local_staging(r->device, world, &staged_shapes, &staged_lights);
+    }
+    size_t shape_cache_size = (staged_shapes > 0 ? staged_shapes : 1) * sizeof(ShapeCL);
+    size_t light_cache_size = (staged_lights > 0 ? staged_lights : 1) * sizeof(PointLightCL);
+    err = clSetKernelArg(r->kernel, arg_counter++, sizeof(cl_int), &staged_shapes);
+    err |= clSetKernelArg(r->kernel, arg_counter++, shape_cache_size, NULL);
+    err |= clSetKernelArg(r->kernel, arg_counter++, sizeof(cl_int), &staged_lights);
+    err |= clSetKernelArg(r->kernel, arg_counter++, light_cache_size, NULL);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Error setting local staging args. Error code %d\n", err);
+        opencl_renderer_free(r);
+        return NULL;
+    }
+    if (CFG_VERBOSE) {
+        printf("Staging %d of %zu shapes and %d of %zu lights in local memory\n",
+            staged_shapes, world.object_count, staged_lights, world.light_count);
+    }
+
+    r->result = calloc(4 * (size_t)r->width * r->height, sizeof(uint8_t));
+    if (r->result == NULL) {
+        opencl_renderer_free(r);
+        return NULL;
+    }
+
+    if (options.tune_work_group) {
+        double start = timer_seconds();
+        tune_work_group_size(r);
+        profile_host(r->profile, PROFILE_WORK_GROUP_TUNING, timer_seconds() - start);
+    }
+    return r;
+}
+
+cl_int enqueue_tile_kernel(OpenCLRenderer *r, Tile tile, cl_uint wait_count, const cl_event *wait_list, cl_event *event) {
+    cl_int offset_x = tile.x;
+    cl_int offset_y = tile.y;
+    cl_int err = clSetKernelArg(r->kernel, ARG_OFFSET_X, sizeof(cl_int), &offset_x);
+    err |= clSetKernelArg(r->kernel, ARG_OFFSET_Y, sizeof(cl_int), &offset_y);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Error setting tile offset args. Error code %d\n", err);
+        return err;
+    }
+
+    size_t global_work_size[NUM_DIMENSIONS] = { tile.width, tile.height };
+    size_t *local_work_size = NULL;
+    if (r->local_work_size[0] > 0) {
+        // OpenCL 1.x requires the global size to be a multiple of the work-group size. The kernel
+        // ignores work-items that fall outside the image.
+        local_work_size = r->local_work_size;
+        for (int i = 0; i < NUM_DIMENSIONS; i++) {
+            size_t remainder = global_work_size[i] % local_work_size[i];
+            if (remainder > 0) {
+                global_work_size[i] += local_work_size[i] - remainder;
+            }
+        }
+    }
+
+    return clEnqueueNDRangeKernel(
+        r->command_queue,
+        r->kernel,
+        (cl_uint)NUM_DIMENSIONS,
+        NULL,
+        global_work_size,
+        local_work_size,
+        wait_count,
+        wait_list,
+        event
+    );
+}
+
+void write_result_to_canvas(const uint8_t *result, Tile tile, Canvas canvas) {
+    for (int y = 0; y < tile.height; y++) {
+        for (int x = 0; x < tile.width; x++) {
+            int idx = tile.width * y + x;
+            int offset = 4 * idx;
+            uint8_t red = result[offset];
+            uint8_t green = result[offset + 1];
+            uint8_t blue = result[offset + 2];
+            Color c = color_rgb(red / 255.0, green / 255.0, blue / 255.0);
+            canvas_pixel_set(canvas, tile.x + x, tile.y + y, c);
+        }
+    }
+}
+
+int opencl_render_tile(OpenCLRenderer *r, Tile tile, Canvas canvas) {
+    // ----------------------------------------
+    // Execute kernel
+    // ----------------------------------------
+
+    // Queue the kernel up for execution across the tile
+    cl_int err = enqueue_tile_kernel(r, tile, 0, NULL, profile_event(r->profile, PROFILE_KERNEL));
+
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Error queueing kernel for execution. Error code %d\n", err);
+        return 1;
+    }
+
+    // Read the tile back to the host. We need 4 bytes per pixel.
+    double start = timer_seconds();
+    err = clEnqueueReadImage(
+        r->command_queue,
+        r->scene.output_image,
+        CL_TRUE,
+        (size_t[]){ tile.x, tile.y, 0 },
+        (size_t[]){ tile.width, tile.height, 1 },
+        0,
+        0,
+        r->result,
+        0,
+        NULL,
+        profile_event(r->profile, PROFILE_READBACK)
+    );
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Error reading result buffer.\n");
+        return 1;
+    }
+    profile_host(r->profile, PROFILE_READBACK, timer_seconds() - start);
+
+    // The blocking read has completed every command enqueued so far, so collect their timestamps now
+    // rather than letting events accumulate across tiles
+    profile_resolve(r->profile);
+
+    // Output the result buffer
+    start = timer_seconds();
+    write_result_to_canvas(r->result, tile, canvas);
+    profile_host(r->profile, PROFILE_CANVAS_WRITE, timer_seconds() - start);
+    return 0;
+}
+
+/// @brief Prints the renderer's profile and writes it to CFG_OPENCL_PROFILE_PATH.
+void report_profile(OpenCLRenderer *r) {
+    char device_name[128] = "unknown device";
+    clGetDeviceInfo(r->device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    device_name[sizeof(device_name) - 1] = '\0';
+
+    profile_print(r->profile, stdout, device_name, r->cache_key);
+    program_cache_ensure_dir();
+    if (profile_write_json(r->profile, CFG_OPENCL_PROFILE_PATH, device_name, r->cache_key) == 0) {
+        printf("Wrote profile to %s\n", CFG_OPENCL_PROFILE_PATH);
+    }
+}
+
+void opencl_renderer_free(OpenCLRenderer *r) {
+    if (r->profile) {
+        report_profile(r);
+        profile_free(r->profile);
+    }
+    scene_buffers_release(&r->scene);
+    marshalled_scene_free(&r->staging);
+    clReleaseKernel(r->kernel);
+    clReleaseProgram(r->program);
+    clReleaseCommandQueue(r->command_queue);
+    clReleaseContext(r->context);
+    free(r->result);
+    free(r);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <CL/cl.h>
+
+#include <renderer.h>
+#include "profiler.h"
+#include "program_cache.h"
+#include "scene_cl.h"
+
+/* Internals of the OpenCL backend, shared between its source files. */
+
+#define NUM_DIMENSIONS 2
+
+// Indices of the tile offset arguments of raytrace_kernel. The other arguments are set once per scene.
+#define ARG_OFFSET_X 7
+#define ARG_OFFSET_Y 8
+
+// Host-side copy of a scene in the device layouts, ready to be written to SceneBuffers
+typedef struct {
+    CameraCL camera;
+    ShapeCL *shapes;
+    MaterialCL *materials;  // The world's palette, which shapes refer to by index
+    PointLightCL *lights;
+    size_t shape_count;
+    size_t material_count;
+    size_t light_count;
+} MarshalledScene;
+
+// Device buffers for one scene and the image it is rendered into
+typedef struct {
+    cl_mem camera;
+    cl_mem shapes;
+    cl_mem materials;
+    cl_mem lights;
+    cl_mem output_image;
+    uint32_t *shape_revisions;  // Revision of each shape and light as last written to the buffers
+    uint32_t *light_revisions;
+    int filled;                 // Whether the buffers hold a whole scene, so that only changes need writing
+} SceneBuffers;
+
+struct OpenCLRenderer {
+    cl_context context;
+    cl_device_id device;
+    cl_command_queue command_queue;
+    cl_program program;
+    cl_kernel kernel;
+    char cache_key[PROGRAM_CACHE_KEY_LEN];  // Identifies the kernel variant in the program cache
+    size_t local_work_size[NUM_DIMENSIONS]; // All zero to let the driver choose
+    SceneBuffers scene;                     // The scene opencl_render_tile renders
+    MarshalledScene staging;                // Host copy of `scene`, updated along with it
+    size_t shape_count;                     // Every scene rendered must have as many shapes, materials and lights as
+    size_t material_count;                  // the first, because local staging and specialized variants are planned
+    size_t light_count;                     // around them and the buffers are sized for them
+    int width;
+    int height;
+    int double_buffer;
+    int incremental;                        // Whether upload_scene skips unchanged shapes and lights
+    uint8_t *result;  // Readback staging area, 4 bytes per pixel
+    Profile *profile; // NULL unless profiling is enabled
+};
+
+/// Allocates host arrays for a scene of the given size. Returns 0 on success.
+int marshalled_scene_init(MarshalledScene *scene, size_t shape_count, size_t material_count, size_t light_count);
+void marshalled_scene_free(MarshalledScene *scene);
+
+/// Creates unfilled buffers for a scene of the given size and an output image the size of the renderer's.
+cl_int scene_buffers_create(OpenCLRenderer *r, size_t shape_count, size_t material_count, size_t light_count, SceneBuffers *out);
+void scene_buffers_release(SceneBuffers *buffers);
+
+/// Brings `buffers` up to date with `world` and `camera` by enqueueing writes on `queue`. Only the shapes and
+/// lights whose revisions changed since the buffers were last written are marshalled into `staging` and
+/// written, in runs of nearby items, along with the materials whose contents changed. `staging` must be used with the same buffers every time and must not
+/// change until the writes complete. If `out_done` is not NULL it receives an event that completes with them.
+cl_int upload_scene(
+    OpenCLRenderer *r,
+    cl_command_queue queue,
+    World world,
+    Camera camera,
+    MarshalledScene *staging,
+    SceneBuffers *buffers,
+    cl_bool blocking,
+    cl_event *out_done
+);
+
+/// Points raytrace_kernel's scene and output arguments at `buffers`. Arguments are captured when a
+/// kernel is enqueued, so different launches can render different buffers.
+cl_int set_scene_args(OpenCLRenderer *r, const SceneBuffers *buffers);
+
+/// Enqueues raytrace_kernel over the given region of the image with the renderer's work-group size,
+/// once the commands in `wait_list` have completed.
+cl_int enqueue_tile_kernel(OpenCLRenderer *r, Tile tile, cl_uint wait_count, const cl_event *wait_list, cl_event *event);
+
+/// Converts a region read back from the output image, 4 bytes per pixel, into colors on `canvas`.
+void write_result_to_canvas(const uint8_t *result, Tile tile, Canvas canvas);
+
+/// Sets the renderer's work-group size to the fastest candidate for its kernel variant and device.
+/// The result is stored alongside the variant's cached binary and reused by later renders.
+/// Returns 0 on success, or 1 if no candidate could be run, leaving the choice to the driver.
+int tune_work_group_size(OpenCLRenderer *r);
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+
+#include "profiler.h"
+
+static const char *STAGE_NAMES[PROFILE_NUM_STAGES] = {
+    "context_setup",
+    "program_build",
+    "marshalling",
+    "upload",
+    "work_group_tuning",
+    "kernel",
+    "readback",
+    "canvas_write",
+};
+
+typedef struct {
+    ProfileStage stage;
+    cl_event event;
+} PendingEvent;
+
+typedef struct {
+    int host_calls;
+    double host_seconds;
+    int commands;
+    double device_seconds;  // Sum of END - START over the stage's commands
+    double queued_seconds;  // Sum of START - QUEUED: how long commands waited before running
+} StageTimes;
+
+struct Profile {
+    StageTimes stages[PROFILE_NUM_STAGES];
+    PendingEvent *pending;
+    size_t pending_count;
+    size_t pending_capacity;
+};
+
+Profile *profile_new() {
+    return calloc(1, sizeof(Profile));
+}
+
+void profile_free(Profile *profile) {
+    if (profile == NULL) {
+        return;
+    }
+    profile_resolve(profile);
+    free(profile->pending);
+    free(profile);
+}
+
+void profile_host(Profile *profile, ProfileStage stage, double seconds) {
+    if (profile == NULL) {
+        return;
+    }
+    profile->stages[stage].host_calls++;
+    profile->stages[stage].host_seconds += seconds;
+}
+
+cl_event *profile_event(Profile *profile, ProfileStage stage) {
+    if (profile == NULL) {
+        return NULL;
+    }
+    if (profile->pending_count == profile->pending_capacity) {
+        size_t capacity = profile->pending_capacity ? 2 * profile->pending_capacity : 16;
+        PendingEvent *pending = realloc(profile->pending, capacity * sizeof(PendingEvent));
+        if (pending == NULL) {
+            return NULL;
+        }
+        profile->pending = pending;
+        profile->pending_capacity = capacity;
+    }
+    PendingEvent *slot = &profile->pending[profile->pending_count++];
+    slot->stage = stage;
+    slot->event = NULL;
+    return &slot->event;
+}
+
+void profile_record(Profile *profile, ProfileStage stage, cl_event event) {
+    cl_event *slot = profile_event(profile, stage);
+    if (slot != NULL) {
+        clRetainEvent(event);
+        *slot = event;
+    }
+}
+
+void profile_resolve(Profile *profile) {
+    if (profile == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < profile->pending_count; i++) {
+        cl_event event = profile->pending[i].event;
+        if (event == NULL) {
+            // The enqueue failed, so no command ran
+            continue;
+        }
+        cl_ulong queued = 0, start = 0, end = 0;
+        cl_int err = clWaitForEvents(1, &event);
+        err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL);
+        err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+        err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+        if (err == CL_SUCCESS) {
+            StageTimes *times = &profile->stages[profile->pending[i].stage];
+            times->commands++;
+            times->device_seconds += (double)(end - start) * 1e-9;
+            times->queued_seconds += (double)(start - queued) * 1e-9;
+        }
+        clReleaseEvent(event);
+    }
+    profile->pending_count = 0;
+}
+
+void profile_print(Profile *profile, FILE *out, const char *device_name, const char *variant) {
+    profile_resolve(profile);
+    fprintf(out, "OpenCL profile for %s, kernel variant %s\n", device_name, variant);
+    fprintf(out, "  %-18s %6s %11s %9s %11s %11s\n", "stage", "calls", "host ms", "commands", "device ms", "queued ms");
+
+    StageTimes total = { 0 };
+    for (int i = 0; i < PROFILE_NUM_STAGES; i++) {
+        StageTimes t = profile->stages[i];
+        if (t.host_calls == 0 && t.commands == 0) {
+            continue;
+        }
+        fprintf(out, "  %-18s %6d %11.3f %9d %11.3f %11.3f\n",
+            STAGE_NAMES[i], t.host_calls, 1e3 * t.host_seconds, t.commands, 1e3 * t.device_seconds, 1e3 * t.queued_seconds);
+        total.host_seconds += t.host_seconds;
+        total.device_seconds += t.device_seconds;
+    }
+    fprintf(out, "  %-18s %6s %11.3f %9s %11.3f\n", "total", "", 1e3 * total.host_seconds, "", 1e3 * total.device_seconds);
+}
+
+/// @brief Writes `s` as a JSON string literal. Device names are the only untrusted strings we write.
+static void _write_json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', fp);
+        }
+        if ((unsigned char)*s >= 0x20) {
+            fputc(*s, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+int profile_write_json(Profile *profile, const char *path, const char *device_name, const char *variant) {
+    profile_resolve(profile);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to write profile to %s\n", path);
+        return 1;
+    }
+
+    fprintf(fp, "{\n  \"device\": ");
+    _write_json_string(fp, device_name);
+    fprintf(fp, ",\n  \"kernel_variant\": ");
+    _write_json_string(fp, variant);
+    fprintf(fp, ",\n  \"stages\": [\n");
+    for (int i = 0; i < PROFILE_NUM_STAGES; i++) {
+        StageTimes t = profile->stages[i];
+        fprintf(fp,
+            "    { \"name\": \"%s\", \"calls\": %d, \"host_ms\": %.6f, \"commands\": %d, \"device_ms\": %.6f, \"queued_ms\": %.6f }%s\n",
+            STAGE_NAMES[i], t.host_calls, 1e3 * t.host_seconds, t.commands, 1e3 * t.device_seconds, 1e3 * t.queued_seconds,
+            i + 1 < PROFILE_NUM_STAGES ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+    return 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <CL/cl.h>
+
+/* Opt-in timing of the OpenCL backend. Host-side stages are timed with the wall clock; every command
+enqueued while profiling also gets an event whose device timestamps are collected once it completes. */
+
+typedef enum {
+    PROFILE_CONTEXT_SETUP,   // Platform, context and command queue creation
+    PROFILE_PROGRAM_BUILD,   // Building or loading the kernel variant
+    PROFILE_MARSHALLING,     // Converting the scene to device layouts on the host
+    PROFILE_UPLOAD,          // Buffer writes
+    PROFILE_WORK_GROUP_TUNING,
+    PROFILE_KERNEL,          // raytrace_kernel launches
+    PROFILE_READBACK,        // Image reads
+    PROFILE_CANVAS_WRITE,    // Copying read-back pixels into the canvas
+    PROFILE_NUM_STAGES
+} ProfileStage;
+
+typedef struct Profile Profile;
+
+Profile *profile_new();
+void profile_free(Profile *profile);
+
+/// Adds `seconds` of host time to a stage. Does nothing if `profile` is NULL, so callers need not
+/// check whether profiling is enabled.
+void profile_host(Profile *profile, ProfileStage stage, double seconds);
+
+/// Returns a slot for the event of the next command enqueued for `stage`, to be passed as the event
+/// argument of the enqueue call. Returns NULL if `profile` is NULL, in which case no event is created.
+cl_event *profile_event(Profile *profile, ProfileStage stage);
+
+/// Records an event that the caller also keeps. The profile takes its own reference to it.
+void profile_record(Profile *profile, ProfileStage stage, cl_event event);
+
+/// Collects the device timestamps of all recorded events, waiting for any still running, and releases them.
+void profile_resolve(Profile *profile);
+
+/// Prints a table of calls, host time, device time and queueing delay per stage.
+void profile_print(Profile *profile, FILE *out, const char *device_name, const char *variant);
+
+/// Writes the same breakdown as JSON. Returns 0 on success.
+int profile_write_json(Profile *profile, const char *path, const char *device_name, const char *variant);
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define MKDIR(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define MKDIR(path) mkdir(path, 0755)
+#endif
+
+#include "program_cache.h"
+
+static const unsigned long long FNV_OFFSET_BASIS = 14695981039346656037ULL;
+static const unsigned long long FNV_PRIME = 1099511628211ULL;
+
+/// @brief 64-bit FNV-1a hash of `len` bytes, continuing from `hash`.
+static unsigned long long _fnv1a(const void *data, size_t len, unsigned long long hash) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/// @brief Reads a whole file into a null-terminated buffer. Returns NULL on failure.
+static char *_read_file(const char *filename, size_t *out_size) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    char *buffer = malloc(size + 1);
+
+    size_t bytes_read = fread(buffer, 1, size, fp);
+    buffer[size] = '\0';
+    fclose(fp);
+    if (bytes_read != (size_t)size) {
+        fprintf(stderr, "Short read: expected %ld bytes, got %zu\n", size, bytes_read);
+        free(buffer);
+        return NULL;
+    }
+    *out_size = (size_t)size;
+    return buffer;
+}
+
+static void _free_sources(char **sources, size_t *sizes, int count) {
+    for (int i = 0; i < count; i++) {
+        free(sources[i]);
+    }
+    free(sources);
+    free(sizes);
+}
+
+static unsigned long long _hash_device_string(cl_device_id device, cl_device_info param, unsigned long long hash) {
+    char value[256] = { 0 };
+    clGetDeviceInfo(device, param, sizeof(value) - 1, value, NULL);
+    return _fnv1a(value, strlen(value), hash);
+}
+
+/// @brief Prints the build log for a program that failed to build.
+static void _print_build_log(cl_program program, cl_device_id device) {
+    char build_log[16384];
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(build_log), build_log, NULL);
+    fprintf(stderr, "Error in kernel: \n");
+    fprintf(stderr, "%s\n", build_log);
+}
+
+void program_cache_ensure_dir() {
+    MKDIR("build");
+    MKDIR(PROGRAM_CACHE_DIR);
+}
+
+void program_cache_path(const char *key, const char *extension, char *out, size_t len) {
+    snprintf(out, len, "%s/%s.%s", PROGRAM_CACHE_DIR, key, extension);
+}
+
+static cl_program _load_binary(cl_context context, cl_device_id device, const char *path, const char *options) {
+    size_t size;
+    unsigned char *binary = (unsigned char *)_read_file(path, &size);
+    if (binary == NULL) {
+        return NULL;
+    }
+
+    cl_int binary_status, err;
+    cl_program program = clCreateProgramWithBinary(
+        context,
+        1,
+        &device,
+        &size,
+        (const unsigned char **)&binary,
+        &binary_status,
+        &err
+    );
+    free(binary);
+    if (program == NULL || err != CL_SUCCESS || binary_status != CL_SUCCESS) {
+        // Stale or corrupt entry, e.g. after a driver update. It will be rebuilt and overwritten.
+        if (program) clReleaseProgram(program);
+        return NULL;
+    }
+    if (clBuildProgram(program, 1, &device, options, NULL, NULL) != CL_SUCCESS) {
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+static void _save_binary(cl_program program, cl_device_id device, const char *path) {
+    // The program may have been created for several devices in the context. Find our device's binary.
+    cl_uint num_devices;
+    clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &num_devices, NULL);
+    cl_device_id *devices = calloc(num_devices, sizeof(cl_device_id));
+    size_t *sizes = calloc(num_devices, sizeof(size_t));
+    unsigned char **binaries = calloc(num_devices, sizeof(unsigned char *));
+    clGetProgramInfo(program, CL_PROGRAM_DEVICES, num_devices * sizeof(cl_device_id), devices, NULL);
+    clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, num_devices * sizeof(size_t), sizes, NULL);
+    for (cl_uint i = 0; i < num_devices; i++) {
+        binaries[i] = sizes[i] > 0 ? malloc(sizes[i]) : NULL;
+    }
+
+    cl_int err = clGetProgramInfo(program, CL_PROGRAM_BINARIES, num_devices * sizeof(unsigned char *), binaries, NULL);
+    for (cl_uint i = 0; i < num_devices && err == CL_SUCCESS; i++) {
+        if (devices[i] != device || binaries[i] == NULL) {
+            continue;
+        }
+        program_cache_ensure_dir();
+        FILE *fp = fopen(path, "wb");
+        if (fp) {
+            fwrite(binaries[i], 1, sizes[i], fp);
+            fclose(fp);
+        }
+    }
+
+    for (cl_uint i = 0; i < num_devices; i++) {
+        free(binaries[i]);
+    }
+    free(binaries);
+    free(sizes);
+    free(devices);
+}
+
+cl_program program_cache_build(
+    cl_context context,
+    cl_device_id device,
+    const char **filenames,
+    int file_count,
+    const char *options,
+    char out_key[PROGRAM_CACHE_KEY_LEN],
+    int *out_cached
+) {
+    char **sources = calloc(file_count, sizeof(char *));
+    size_t *sizes = calloc(file_count, sizeof(size_t));
+    for (int i = 0; i < file_count; i++) {
+        sources[i] = _read_file(filenames[i], &sizes[i]);
+        if (sources[i] == NULL) {
+            fprintf(stderr, "Failed to open file %s", filenames[i]);
+            _free_sources(sources, sizes, file_count);
+            return NULL;
+        }
+    }
+
+    // A binary is only valid for the exact sources, options, device and driver it was built with
+    unsigned long long hash = FNV_OFFSET_BASIS;
+    for (int i = 0; i < file_count; i++) {
+        hash = _fnv1a(sources[i], sizes[i], hash);
+    }
+    hash = _fnv1a(options, strlen(options), hash);
+    hash = _hash_device_string(device, CL_DEVICE_NAME, hash);
+    hash = _hash_device_string(device, CL_DEVICE_VERSION, hash);
+    hash = _hash_device_string(device, CL_DRIVER_VERSION, hash);
+    snprintf(out_key, PROGRAM_CACHE_KEY_LEN, "%016llx", hash);
+
+    char path[256];
+    program_cache_path(out_key, "bin", path, sizeof(path));
+
+    cl_program program = _load_binary(context, device, path, options);
+    if (program != NULL) {
+        *out_cached = 1;
+        _free_sources(sources, sizes, file_count);
+        return program;
+    }
+
+    *out_cached = 0;
+    program = clCreateProgramWithSource(context, (cl_uint)file_count, (const char **)sources, sizes, NULL);
+    _free_sources(sources, sizes, file_count);
+    if (program == NULL) {
+        fprintf(stderr, "Failed to create CL program from source.\n");
+        return NULL;
+    }
+
+    cl_int err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+    if (err != CL_SUCCESS) {
+        _print_build_log(program, device);
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    _save_binary(program, device, path);
+    return program;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <CL/cl.h>
+
+/* Builds OpenCL programs and keeps their binaries on disk, keyed by a hash of the kernel source,
+the build options and the device, so each specialized variant is only compiled once per machine. */
+
+#define PROGRAM_CACHE_DIR "build/kernel_cache"
+#define PROGRAM_CACHE_KEY_LEN 17  // 16 hex digits and a terminator
+
+/// Builds the program made of the concatenated `filenames` for `device` with the given options, loading it from the cache if
+/// a binary for the same configuration exists and saving the binary otherwise. Writes the cache key to
+/// `out_key` and whether the binary came from the cache to `out_cached`. Returns NULL on failure.
+cl_program program_cache_build(
+    cl_context context,
+    cl_device_id device,
+    const char **filenames,
+    int file_count,
+    const char *options,
+    char out_key[PROGRAM_CACHE_KEY_LEN],
+    int *out_cached
+);
+
+/// Writes the path of the cache entry with the given key and extension to `out`. Other per-variant data,
+/// such as tuning results, is stored next to the binary under the same key.
+void program_cache_path(const char *key, const char *extension, char *out, size_t len);
+
+/// Creates the cache directory if it does not exist.
+void program_cache_ensure_dir();
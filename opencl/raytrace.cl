@@ -1,44 +1,37 @@
-__constant int SHAPE_TYPE_SPHERE = 0;
-__constant int SHAPE_TYPE_PLANE = 1;
 __constant float SKIN_DEPTH = 0.0001f;
-__constant float STOP_AT_ATTENUATION = 0.001f;
-__constant int MAX_REFLECTIONS = 5;
-__constant int NUM_SAMPLES = 30;
 
-typedef struct {
-    float4 inv_transform[4];
-    float field_of_view;
-    int hsize;
-    int vsize;
-    int pad;  // To ensure aligned to 16 bytes
-} Camera;
-
-typedef struct {
-    float4 color;
-    float ambient;
-    float diffuse;
-    float specular;
-    float shininess;
-    float reflective;
-    float transparency;
-    float refractive_index;
-    float pad;
-} Material;
-
-typedef struct {
-    int type;
-    float ymin;   // Only relevant for cylinders and cones
-    float ymax;   // ditto
-    bool closed;  // ditto
-    float4 inv_transform[4];
-    float4 inv_transpose[4];
-    Material material;
-} Shape;
-
-typedef struct {
-    float4 position;   // Where is the light located?
-    float4 intensity;  // What color is the light?
-} PointLight;
+// Limits and scene properties are passed in as build options by the host (see kernel_build_options)
+// so that the compiler can unroll loops and drop dead branches. These defaults apply otherwise.
+#ifndef STOP_AT_ATTENUATION
+#define STOP_AT_ATTENUATION 0.001f
+#endif
+#ifndef MAX_REFLECTIONS
+#define MAX_REFLECTIONS 5
+#endif
+#ifndef NUM_SAMPLES
+#define NUM_SAMPLES 30
+#endif
+
+// Shape types present in the scene. A generic build supports all of them.
+#ifndef HAS_SHAPE_SPHERE
+#define HAS_SHAPE_SPHERE 1
+#endif
+#ifndef HAS_SHAPE_PLANE
+#define HAS_SHAPE_PLANE 1
+#endif
+
+// Number of lights, if known when the program is built. Otherwise taken from the kernel argument.
+#ifdef NUM_LIGHTS
+#define LIGHT_COUNT NUM_LIGHTS
+#else
+#define LIGHT_COUNT num_lights
+#endif
+
+// Scene layouts shared with the host. scene_cl.h is prepended to this file when the program is built.
+typedef CameraCL Camera;
+typedef MaterialCL Material;
+typedef ShapeCL Shape;
+typedef PointLightCL PointLight;
 
 typedef struct {
     float4 origin;
@@ -65,15 +58,22 @@ float random_float(uint2 *random_state) {
     return (float)r / (float)UINT_MAX;
 }
 
-float4 mat_mul_vec(__global float4 mat[4], float4 vec) {
+/* Multiplies a vector by an affine matrix stored as its first three rows. The implicit last row is
+(0, 0, 0, 1), so w passes through unchanged. */
+float4 mat_mul_vec(const float4 mat[3], float4 vec) {
     return (float4)(
         dot(mat[0], vec),
         dot(mat[1], vec),
         dot(mat[2], vec),
-        dot(mat[3], vec)
+        vec.w
     );
 }
 
+/* Multiplies a vector by the transpose of the 3x3 linear part of an affine matrix stored as rows. */
+float4 transpose_mul_vec(const float4 mat[3], float4 vec) {
+    return (float4)(vec.x * mat[0].xyz + vec.y * mat[1].xyz + vec.z * mat[2].xyz, 0.0f);
+}
+
 bool ray_intersect_sphere(Ray ray, float *t) {
     // Vector from sphere's center to ray origin
     float4 sphere_to_ray = ray.origin - (float4)(0.0f, 0.0f, 0.0f, 1.0f);
@@ -113,29 +113,48 @@ bool ray_intersect_plane(Ray ray, float *t) {
     return false;
 }
 
-Ray transform_ray(Ray r, __global float4 transform[4]) {
+Ray transform_ray(Ray r, const float4 transform[3]) {
     return (Ray) {
         mat_mul_vec(transform, r.origin),
         mat_mul_vec(transform, r.direction)
     };
 }
 
-bool ray_intersect_shapes(Ray ray, int num_shapes, __global Shape *shapes, float *t, int *hit_index) {
+/* Shapes are passed by value so that the same code serves copies from local and global memory. */
+bool ray_intersect_shape(Ray ray, Shape shape, float *t) {
+    // Transform the ray into the shape's object space to simplify calculations
+    Ray ray_local = transform_ray(ray, shape.inv_transform);
+    return (
+        (HAS_SHAPE_SPHERE && shape.type == SHAPE_CL_SPHERE && ray_intersect_sphere(ray_local, t)) ||
+        (HAS_SHAPE_PLANE && shape.type == SHAPE_CL_PLANE && ray_intersect_plane(ray_local, t))
+    );
+}
+
+bool ray_intersect_shapes(
+    Ray ray,
+    int num_shapes,
+    int staged_shapes,
+    __local Shape *shape_cache,
+    __global Shape *shapes,
+    float *t,
+    int *hit_index
+) {
     // Puts the smallest non-negative t-value at which the ray intersects an object in the world and returns true.
     // Or returns false if the ray flies off to infinity.
     float tmin = INFINITY;
     *hit_index = -1;
-    for (int i = 0; i < num_shapes; i++) {
-        __global Shape *shape = &shapes[i];
 
-        // Transform the ray into the shape's object space to simplify calculations
-        Ray ray_local = transform_ray(ray, shape->inv_transform);
+    // The first shapes were staged in local memory by the work-group. Any that did not fit are read from global memory.
+    for (int i = 0; i < staged_shapes; i++) {
         float _t;
-        bool hit = (
-            (shape->type == SHAPE_TYPE_SPHERE && ray_intersect_sphere(ray_local, &_t)) ||
-            (shape->type == SHAPE_TYPE_PLANE && ray_intersect_plane(ray_local, &_t))
-        );
-        if (hit && _t < tmin) {
+        if (ray_intersect_shape(ray, shape_cache[i], &_t) && _t < tmin) {
+            *hit_index = i;
+            tmin = _t;
+        }
+    }
+    for (int i = staged_shapes; i < num_shapes; i++) {
+        float _t;
+        if (ray_intersect_shape(ray, shapes[i], &_t) && _t < tmin) {
             *hit_index = i;
             tmin = _t;
         }
@@ -144,17 +163,16 @@ bool ray_intersect_shapes(Ray ray, int num_shapes, __global Shape *shapes, float
     return *hit_index != -1;
 }
 
-float4 normal_at(__global Shape *shape, float4 world_point) {
+float4 normal_at(Shape shape, float4 world_point) {
     // First transform the hit point into the shape's object space to simplify the calculation
-    float4 intersection_local = mat_mul_vec(shape->inv_transform, world_point);
-    float4 local_normal = shape->type == SHAPE_TYPE_SPHERE
+    float4 intersection_local = mat_mul_vec(shape.inv_transform, world_point);
+    float4 local_normal = HAS_SHAPE_SPHERE && (!HAS_SHAPE_PLANE || shape.type == SHAPE_CL_SPHERE)
         ? (float4)(intersection_local.xyz, 0.0f)
         : (float4)(0.0f, 1.0f, 0.0f, 0.0f);
 
     // Convert the normal back to world space. Here we have to multiply by the inverse *transpose*.
     // (I worked out why this is once but can't remember so just trust me bro)
-    float4 world_normal = mat_mul_vec(shape->inv_transpose, local_normal);
-    world_normal.w = 0.0f;
+    float4 world_normal = transpose_mul_vec(shape.inv_transform, local_normal);
     return normalize(world_normal);
 }
 
@@ -167,33 +185,55 @@ __kernel void raytrace_kernel(
     __global Camera *camera,
     int num_shapes,
     __global Shape *shapes,
+    __global Material *materials,
     int num_lights,
     __global PointLight *lights,
-    __write_only image2d_t result_img
+    __write_only image2d_t result_img,
+    int offset_x,  // Position of the tile being rendered within the image
+    int offset_y,
+    int staged_shapes,  // How many of the first shapes and lights to copy into local memory
+    __local Shape *shape_cache,
+    int staged_lights,
+    __local PointLight *light_cache
 ) {
+    // Copy the staged part of the scene into local memory once for the whole work-group, so that each ray's
+    // bounces and shadow rays read it from there rather than from global memory.
+    // Every work-item must take part, so work-items outside the image only return afterwards.
+    if (staged_shapes > 0) {
+        event_t copy = async_work_group_copy(
+            (__local float4 *)shape_cache,
+            (__global const float4 *)shapes,
+            staged_shapes * sizeof(Shape) / sizeof(float4),
+            0
+        );
+        wait_group_events(1, &copy);
+    }
+    if (staged_lights > 0) {
+        event_t copy = async_work_group_copy(
+            (__local float4 *)light_cache,
+            (__global const float4 *)lights,
+            staged_lights * sizeof(PointLight) / sizeof(float4),
+            0
+        );
+        wait_group_events(1, &copy);
+    }
+
     // Get pixel coordinates
-    int2 pixel = (int2)(get_global_id(0), get_global_id(1));
+    int2 pixel = (int2)(get_global_id(0) + offset_x, get_global_id(1) + offset_y);
+    if (pixel.x >= camera->hsize || pixel.y >= camera->vsize) {
+        return;
+    }
     float2 pixelf = convert_float2(pixel);
-
-    // Compute camera properties (common to every pixel)
-    float half_view = tan(0.5f * camera->field_of_view);
-    float aspect = (float)camera->hsize / (float)camera->vsize;
-    float2 camera_half_size = aspect >= 1.0f
-        ? (float2)(half_view, half_view / aspect)
-        : (float2)(half_view * aspect, half_view); 
-    float camera_pixel_size = camera_half_size.x * 2.0f / (float)camera->hsize;
+    Camera cam = *camera;
 
     uint2 random_state = (uint2)((uint)pixel.x, (uint)pixel.y);
     float3 accumulated_color = (float3)(0.0f);
     for (int iSample = 0; iSample < NUM_SAMPLES; iSample++) {
         // Compute ray at this pixel
         float2 pixel_fraction = (float2)(random_float(&random_state), random_float(&random_state));
-        float2 offset = (pixelf + pixel_fraction) * camera_pixel_size;   // Offset from edge of camera to pixel's center
-        float4 pixel_center_view = (float4)(camera_half_size - offset, -1.0f, 1.0f); // Untransformed coordinates of pixel center in view space
-        float4 pixel_center_world = mat_mul_vec(camera->inv_transform, pixel_center_view);
-        float4 ray_origin_world = mat_mul_vec(camera->inv_transform, (float4)(0.0f, 0.0f, 0.0f, 1.0f));
-        float4 direction = normalize(pixel_center_world - ray_origin_world);
-        Ray ray = { ray_origin_world, direction };
+        float2 position = pixelf + pixel_fraction;  // Point within the image, in pixels
+        float4 direction = normalize(cam.corner + position.x * cam.pixel_dx + position.y * cam.pixel_dy);
+        Ray ray = { cam.origin, direction };
 
         // We are going to bounce this ray around the scene up to a maximum number of times, picking up color from
         // objects it hits along the way. It may be stopped early by a non-reflective object.
@@ -201,11 +241,12 @@ __kernel void raytrace_kernel(
         for (int depth = 0; depth <= MAX_REFLECTIONS; depth++) {
             float t;
             int hit_index;
-            if (!ray_intersect_shapes(ray, num_shapes, shapes, &t, &hit_index)) {
+            if (!ray_intersect_shapes(ray, num_shapes, staged_shapes, shape_cache, shapes, &t, &hit_index)) {
                 // Ray flies off to infinity, adding no color
                 break;
             }
-            __global Shape *hit_shape = &shapes[hit_index];
+            Shape hit_shape = hit_index < staged_shapes ? shape_cache[hit_index] : shapes[hit_index];
+            __global Material *hit_material = &materials[hit_shape.material];
 
             // Find the point t units along the ray - this is where the intersection occured.
             // Then compute normal vector at the hit point
@@ -220,25 +261,32 @@ __kernel void raytrace_kernel(
             // Start with the ambient color of the material and add contributions from each light source in the world.
             // We use the Phong reflection model to get reasonably good looking shading and specular highlights.
             float3 combined_color = (float3)(0.0f);
-            for (int i = 0; i < num_lights; i++) {
-                PointLight light = lights[i];
+            for (int i = 0; i < LIGHT_COUNT; i++) {
+                PointLight light = i < staged_lights ? light_cache[i] : lights[i];
+                float4 lightv = light.position - over_point;
+                float light_distance = length(lightv);
+                lightv = normalize(lightv);
+
+                // Beyond its falloff distance, in intensity.w, a light dims with the square of the distance.
+                float3 intensity = light.intensity.xyz;
+                if (light.intensity.w > 0.0f && light_distance > light.intensity.w) {
+                    float ratio = light.intensity.w / light_distance;
+                    intensity *= ratio * ratio;
+                }
 
                 // We use the elementwise product to combine the light color and the material color.
-                float3 effective_color = light.intensity.xyz * hit_shape->material.color.xyz;
+                float3 effective_color = intensity * hit_material->color.xyz;
 
                 // Add ambient contribution. This doesn't depend at all on the position of the light.
-                combined_color += effective_color * hit_shape->material.ambient;
+                combined_color += effective_color * hit_material->ambient;
 
                 // Check if the point is in shadow with respect to this light by casting a ray towards it and seeing if
                 // it intersects with something on its way.
-                float4 lightv = light.position - over_point;
-                float light_distance = length(lightv);
-                lightv = normalize(lightv);
 
                 Ray r = (Ray) { over_point, lightv };
                 float t;
                 int hit_index;
-                if (ray_intersect_shapes(r, num_shapes, shapes, &t, &hit_index) && t < light_distance) {
+                if (ray_intersect_shapes(r, num_shapes, staged_shapes, shape_cache, shapes, &t, &hit_index) && t < light_distance) {
                     continue;
                 }
 
@@ -247,7 +295,7 @@ __kernel void raytrace_kernel(
                 if (light_dot_normal < 0.0f) {
                     continue;
                 }
-                combined_color += effective_color * hit_shape->material.diffuse * light_dot_normal;
+                combined_color += effective_color * hit_material->diffuse * light_dot_normal;
 
                 // Add specular contribution.
                 float4 eyev = -ray.direction;
@@ -256,13 +304,13 @@ __kernel void raytrace_kernel(
                 if (reflect_dot_eye <= 0.0f) {
                     continue;
                 }
-                float factor = pow(reflect_dot_eye, hit_shape->material.shininess);
-                combined_color += light.intensity.xyz * hit_shape->material.specular * factor;
+                float factor = pow(reflect_dot_eye, hit_material->shininess);
+                combined_color += intensity * hit_material->specular * factor;
             }
 
             accumulated_color += attenuation * combined_color;
 
-            attenuation *= hit_shape->material.reflective;
+            attenuation *= hit_material->reflective;
             if (attenuation <= STOP_AT_ATTENUATION) {
                 break;
             }
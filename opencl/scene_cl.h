@@ -0,0 +1,95 @@
+#ifndef SCENE_CL_H
+#define SCENE_CL_H
+
+/* Scene data laid out for the OpenCL device.
+This header is compiled by both the host (opencl_backend.c) and the device: the host prepends it to
+raytrace.cl when building the program. It therefore uses an include guard rather than #pragma once,
+and only the subset of C that OpenCL C also accepts.
+
+Transforms are affine, so their last row is always (0, 0, 0, 1) and only the first three rows are
+stored. Normals are transformed with the same rows (see normal_at), so no inverse transpose is needed.
+Every struct is a multiple of 16 bytes and each shape fits in a single 64-byte cache line. */
+
+#ifdef __OPENCL_VERSION__
+
+#define SCENE_FLOAT4 float4
+#define SCENE_FLOAT float
+#define SCENE_INT int
+#define SCENE_USHORT ushort
+
+// OpenCL C 1.x has no static assertions, so make a failing condition declare a negative-sized array
+#define SCENE_STATIC_ASSERT(cond, name) typedef char scene_static_assert_##name[(cond) ? 1 : -1]
+
+#else
+
+#include <stddef.h>
+#include <CL/cl.h>
+
+#define SCENE_FLOAT4 cl_float4
+#define SCENE_FLOAT cl_float
+#define SCENE_INT cl_int
+#define SCENE_USHORT cl_ushort
+
+#define SCENE_STATIC_ASSERT(cond, name) _Static_assert(cond, #name)
+
+#endif
+
+#define SHAPE_CL_SPHERE 0
+#define SHAPE_CL_PLANE 1
+
+/* Per-frame camera constants, precomputed on the host. The ray through pixel (x, y) has direction
+corner + x * pixel_dx + y * pixel_dy, where x and y may be fractional. */
+typedef struct {
+    SCENE_FLOAT4 origin;    // Eye position in world space
+    SCENE_FLOAT4 corner;    // From the eye to the outer corner of pixel (0, 0) on the image plane
+    SCENE_FLOAT4 pixel_dx;  // Step across the image plane between horizontally adjacent pixels
+    SCENE_FLOAT4 pixel_dy;  // Step between vertically adjacent pixels
+    SCENE_INT hsize;
+    SCENE_INT vsize;
+    SCENE_INT pad[2];
+} CameraCL;
+
+typedef struct {
+    SCENE_FLOAT4 color;
+    SCENE_FLOAT ambient;
+    SCENE_FLOAT diffuse;
+    SCENE_FLOAT specular;
+    SCENE_FLOAT shininess;
+    SCENE_FLOAT reflective;
+    SCENE_FLOAT transparency;
+    SCENE_FLOAT refractive_index;
+    SCENE_FLOAT pad;
+} MaterialCL;
+
+typedef struct {
+    SCENE_FLOAT4 inv_transform[3];  // World to object space
+    SCENE_FLOAT ymin;               // Only relevant for cylinders and cones
+    SCENE_FLOAT ymax;               // ditto
+    SCENE_INT material;             // Index into the materials buffer
+    SCENE_USHORT type;
+    SCENE_USHORT closed;            // Only relevant for cylinders and cones
+} ShapeCL;
+
+typedef struct {
+    SCENE_FLOAT4 position;   // Where is the light located? Area lights are shaded as a point at their center.
+    SCENE_FLOAT4 intensity;  // What color is the light? w is its falloff distance, or 0 if it has none.
+} PointLightCL;
+
+SCENE_STATIC_ASSERT(sizeof(CameraCL) == 80, camera_size);
+SCENE_STATIC_ASSERT(sizeof(MaterialCL) == 48, material_size);
+SCENE_STATIC_ASSERT(sizeof(ShapeCL) == 64, shape_size);
+SCENE_STATIC_ASSERT(sizeof(PointLightCL) == 32, point_light_size);
+
+#ifndef __OPENCL_VERSION__
+SCENE_STATIC_ASSERT(offsetof(CameraCL, pixel_dy) == 48, camera_pixel_dy_offset);
+SCENE_STATIC_ASSERT(offsetof(CameraCL, vsize) == 68, camera_vsize_offset);
+SCENE_STATIC_ASSERT(offsetof(MaterialCL, ambient) == 16, material_ambient_offset);
+SCENE_STATIC_ASSERT(offsetof(MaterialCL, refractive_index) == 40, material_refractive_index_offset);
+SCENE_STATIC_ASSERT(offsetof(ShapeCL, ymin) == 48, shape_ymin_offset);
+SCENE_STATIC_ASSERT(offsetof(ShapeCL, material) == 56, shape_material_offset);
+SCENE_STATIC_ASSERT(offsetof(ShapeCL, type) == 60, shape_type_offset);
+SCENE_STATIC_ASSERT(offsetof(ShapeCL, closed) == 62, shape_closed_offset);
+SCENE_STATIC_ASSERT(offsetof(PointLightCL, intensity) == 16, point_light_intensity_offset);
+#endif
+
+#endif
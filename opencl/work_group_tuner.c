@@ -0,0 +1,101 @@
+#include <math.h>
+#include <stdio.h>
+
+#include <config.h>
+#include <timer.h>
+
+#include "opencl_renderer.h"
+
+/* Picks the work-group size for raytrace_kernel by timing candidates on the device.
+Work-group shape matters for ray tracing: rays from a compact block of pixels tend to hit the same
+shapes and take the same branches, so the best shape depends on the device and the kernel variant. */
+
+static const size_t CANDIDATES[][NUM_DIMENSIONS] = {
+    { 8, 8 }, { 16, 4 }, { 32, 2 }, { 64, 1 }, { 4, 16 },
+    { 16, 8 }, { 32, 4 }, { 8, 16 }, { 16, 16 }, { 32, 8 },
+};
+static const int NUM_CANDIDATES = sizeof(CANDIDATES) / sizeof(CANDIDATES[0]);
+
+// Each candidate renders a region of this many pixels square from the middle of the image this many times
+static const int TUNE_REGION_SIZE = 256;
+static const int TUNE_FRAMES = 3;
+
+static int _load(const char *path, size_t out[NUM_DIMENSIONS]) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+    int found = fscanf(fp, "%zu %zu", &out[0], &out[1]) == 2 && out[0] > 0 && out[1] > 0;
+    fclose(fp);
+    return found;
+}
+
+static void _save(const char *path, const size_t size[NUM_DIMENSIONS]) {
+    program_cache_ensure_dir();
+    FILE *fp = fopen(path, "w");
+    if (fp) {
+        fprintf(fp, "%zu %zu\n", size[0], size[1]);
+        fclose(fp);
+    }
+}
+
+/// @brief Returns the average seconds per frame to render `region` with the renderer's current work-group
+/// size, or INFINITY if the device rejects it.
+static double _time_region(OpenCLRenderer *r, Tile region) {
+    // Warm up once so that the first launch's overheads are not counted
+    if (enqueue_tile_kernel(r, region, 0, NULL, NULL) != CL_SUCCESS || clFinish(r->command_queue) != CL_SUCCESS) {
+        return INFINITY;
+    }
+
+    double start = timer_seconds();
+    for (int i = 0; i < TUNE_FRAMES; i++) {
+        if (enqueue_tile_kernel(r, region, 0, NULL, NULL) != CL_SUCCESS) {
+            clFinish(r->command_queue);
+            return INFINITY;
+        }
+    }
+    clFinish(r->command_queue);
+    return (timer_seconds() - start) / TUNE_FRAMES;
+}
+
+int tune_work_group_size(OpenCLRenderer *r) {
+    char path[256];
+    program_cache_path(r->cache_key, "wg", path, sizeof(path));
+    if (_load(path, r->local_work_size)) {
+        return 0;
+    }
+
+    size_t kernel_max = 0;
+    clGetKernelWorkGroupInfo(r->kernel, r->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernel_max, NULL);
+
+    int width = r->width < TUNE_REGION_SIZE ? r->width : TUNE_REGION_SIZE;
+    int height = r->height < TUNE_REGION_SIZE ? r->height : TUNE_REGION_SIZE;
+    Tile region = { (r->width - width) / 2, (r->height - height) / 2, width, height };
+
+    double best_seconds = INFINITY;
+    size_t best[NUM_DIMENSIONS] = { 0, 0 };
+    for (int i = 0; i < NUM_CANDIDATES; i++) {
+        if (CANDIDATES[i][0] * CANDIDATES[i][1] > kernel_max) {
+            continue;
+        }
+        r->local_work_size[0] = CANDIDATES[i][0];
+        r->local_work_size[1] = CANDIDATES[i][1];
+        double seconds = _time_region(r, region);
+        if (CFG_VERBOSE) {
+            printf("Work-group size %zux%zu: %.3f ms\n", CANDIDATES[i][0], CANDIDATES[i][1], 1000.0 * seconds);
+        }
+        if (seconds < best_seconds) {
+            best_seconds = seconds;
+            best[0] = CANDIDATES[i][0];
+            best[1] = CANDIDATES[i][1];
+        }
+    }
+
+    r->local_work_size[0] = best[0];
+    r->local_work_size[1] = best[1];
+    if (best[0] == 0) {
+        return 1;
+    }
+    _save(path, best);
+    return 0;
+}
@@ -11,6 +11,7 @@
 
 #include <CL/cl.h>
 
+#include <animation.h>
 #include <config.h>
 #include <color.h>
 #include <canvas.h>
@@ -18,6 +19,8 @@
 #include <ray.h>
 #include <lighting.h>
 #include <renderer.h>
+#include <scene.h>
+#include <timer.h>
 
 // Config
 void log_line(char *msg) {
@@ -31,109 +34,167 @@ void log_line(char *msg) {
     );
 }
 
-int main() {
-    log_line("Starting scene configuration");
+/// Logs how many rays of each kind were traced per pixel, if any were counted.
+void log_ray_stats(const RayStats *stats) {
+    if (stats->pixels == 0) {
+        return;
+    }
+    double pixels = (double)stats->pixels;
+    char msg[256];
+    snprintf(msg, sizeof(msg), "Rays per pixel: %.2f camera, %.2f reflected, %.2f refracted, %.2f shadow, at most %llu; %.2f culled",
+        stats->camera / pixels, stats->reflected / pixels, stats->refracted / pixels, stats->shadow / pixels,
+        (unsigned long long)stats->most, stats->culled / pixels);
+    log_line(msg);
+}
 
-    Mat4D transform;
-    Material material;
-
-    material = material_default();
-    transform = mat4d_identity();
-    material.pattern = pattern_checker_new(color_rgb(0.8, 0.8, 0.9), color_rgb(0.2, 0.2, 0.3), mat4d_identity());
-    material.reflective = 0.1;
-    Shape floor = plane_new(transform, material, "floor");
-
-    transform = mat4d_mul_mat4d(translation(0, 0, 5.), rotation_x(-M_PI / 2.));
-    material = material_default();
-    material.pattern = pattern_plain_new(color_rgb(0.4, 0.1, 0.1), mat4d_identity());
-    material.diffuse = 0.6;
-    Shape back_wall = plane_new(transform, material, "back_wall");
-
-    transform = mat4d_mul_mat4d(rotation_y(-M_PI / 2.), rotation_x(-M_PI / 2.));
-    transform = mat4d_mul_mat4d(translation(-4., 0., 0.), transform);
-    material = material_default();
-    material.pattern = pattern_plain_new(color_rgb(0.1, 0.4, 0.1), mat4d_identity());
-    material.diffuse = 0.6;
-    Shape left_wall = plane_new(transform, material, "left_wall");
-
-    transform = mat4d_mul_mat4d(rotation_y(M_PI / 2.), rotation_x(-M_PI / 2.));
-    transform = mat4d_mul_mat4d(translation(4., 0., 0.), transform);
-    material = material_default();
-    material.pattern = pattern_plain_new(color_rgb(0.1, 0.1, 0.4), mat4d_identity());
-    material.diffuse = 0.6;
-    Shape right_wall = plane_new(transform, material, "right_wall");
-
-    transform = mat4d_mul_mat4d(translation(0.0, 2.0, 0.0), scaling(2.0, 2.0, 2.0));
-    material = material_default();
-    material.pattern = pattern_gradient_new(color_rgb(0.6, 0.2, 0.1), color_rgb(0.0, 0.2, 0.8), mat4d_identity());
-    material.pattern.transform = mat4d_mul_mat4d(scaling(0.2, 0.2, 0.2), rotation_z(1.2));
-    material.diffuse = 0.7;
-    material.specular = 0.6;
-    material.shininess = 500;
-    material.reflective = 0.1;
-    Shape middle = sphere_new(transform, material, "middle");
-
-    transform = mat4d_mul_mat4d(translation(1.5, 0.5, -2.9), scaling(0.5, 0.5, 0.5));
-    material = material_default();
-    material.pattern = pattern_plain_new(color_rgb(0.9, 0.5, 0.1), mat4d_identity());
-    material.diffuse = 0.7;
-    material.specular = 0.6;
-    material.shininess = 500;
-    material.reflective = 0.1;
-    Shape right = sphere_new(transform, material, "right");
-
-    transform = mat4d_mul_mat4d(translation(-2.0, 0.6, -4.0), scaling(0.6, 0.6, 0.6));
-    material = material_default();
-    material.pattern = pattern_plain_new(color_rgb(1.0, 0.8, 0.1), mat4d_identity());
-    material.diffuse = 0.7;
-    material.specular = 0.3;
-    material.reflective = 0.1;
-    Shape left = sphere_new(transform, material, "left");
-
-    Vec4D light_position = d4_point(3.0, 5.0, -5.0);
-    Color light_color = (Color) {1.0, 1.0, 1.0};
-    PointLight light = (PointLight) { light_position, light_color };
-
-    World world = world_new();
-    world.object_count = 7;
-    world.objects = malloc(world.object_count * sizeof(Shape));
-    world.objects[0] = right;
-    world.objects[1] = middle;
-    world.objects[2] = left;
-    world.objects[3] = floor;
-    world.objects[4] = left_wall;
-    world.objects[5] = right_wall;
-    world.objects[6] = back_wall;
-    world.light_count = 1;
-    world.lights = malloc(world.light_count * sizeof(PointLight));
-    world.lights[0] = light;
-
-    Mat4D view = view_transform(
-        d4_point(-1.0, 3.0, -10.0),
-        d4_point(0., 0., 0.),
-        d4_vector(0., 1., 0.)
-    );
-    Camera camera = camera_new(1200, 1000, M_PI / 3., view);
-    Canvas canvas = canvas_create(camera.hsize, camera.vsize);
+typedef struct {
+    size_t moved;          // Objects the frame's animation moved
+    int rebuilt;           // Whether the BVH was rebuilt for the frame rather than refit
+    double setup_ms;
+    double supplied;       // When the frame's scene was handed to the renderer
+} FrameLog;
+
+typedef struct {
+    World *world;
+    Camera camera;
+    const Animation *animation;
+    int first;             // Animation frame rendered as frame 0
+    int prepared;          // Frame the world was last moved to, or -1
+    FrameLog *logs;        // One per frame
+    RayStats stats;        // Of the frame being rendered, on the CPU
+} AnimationRun;
+
+/// @brief Supplies frame `frame` of the run, moving the world to it if it is not there already.
+static int _animation_source(int frame, void *user, World *out_world, Camera *out_camera) {
+    AnimationRun *run = user;
+    FrameLog *log = &run->logs[frame];
+    if (frame != run->prepared) {
+        // Only moved objects are re-inverted, and the BVH is refit around them unless it needs rebuilding
+        double setup_start = timer_seconds();
+        log->moved = animation_apply(run->animation, run->world, (run->first + frame) / run->animation->fps);
+        log->rebuilt = world_update_bvh(run->world);
+        log->setup_ms = 1000.0 * (timer_seconds() - setup_start);
+        if (log->rebuilt < 0) {
+            fprintf(stderr, "Failed to update BVH\n");
+            return 1;
+        }
+        run->prepared = frame;
+    }
+    log->supplied = timer_seconds();
+    *out_world = *run->world;
+    *out_camera = run->camera;
+    return 0;
+}
+
+/// @brief Writes frame `frame` of the run to out_<frame>.ppm and logs it.
+static int _animation_sink(int frame, Canvas canvas, void *user) {
+    AnimationRun *run = user;
+    const FrameLog *log = &run->logs[frame];
+    char path[64];
+    snprintf(path, sizeof(path), "out_%04d.ppm", run->first + frame);
+    canvas_save_ppm(canvas, path);
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Frame %d: %zu objects moved, BVH %s, setup %.2f ms, render %.0f ms",
+        run->first + frame, log->moved, log->rebuilt ? "rebuilt" : "refit", log->setup_ms,
+        1000.0 * (timer_seconds() - log->supplied));
+    log_line(msg);
+    log_ray_stats(&run->stats);
+    run->stats = (RayStats) { 0 };
+    return 0;
+}
 
-    log_line("Completed scene configuration");
+/// Renders frames `first` to `last` of `animation`, writing each to out_<frame>.ppm. The OpenCL renderer keeps
+/// its device and scene between frames, uploading only what moved, and works on the next frame's scene while
+/// a frame renders.
+int render_animation(World *world, Camera camera, const Animation *animation, int first, int last) {
+    int frame_count = last - first + 1;
+    AnimationRun run = { world, camera, animation, first, -1, calloc((size_t)frame_count, sizeof(FrameLog)), { 0 } };
+    if (run.logs == NULL) {
+        return 1;
+    }
+    int err = render_frames(frame_count, _animation_source, _animation_sink, &run, &run.stats);
+    free(run.logs);
+    return err;
+}
+
+int main(int argc, char **argv) {
+    // With --frames FIRST LAST, render that range of the scene's animation instead of a still image
+    const char *scene_path = NULL;
+    int first_frame = 0;
+    int last_frame = -1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 2 < argc) {
+            first_frame = atoi(argv[i + 1]);
+            last_frame = atoi(argv[i + 2]);
+            i += 2;
+        } else if (scene_path == NULL && argv[i][0] != '-') {
+            scene_path = argv[i];
+        } else {
+            scene_path = NULL;
+            break;
+        }
+    }
+    if (scene_path == NULL) {
+        fprintf(stderr, "Usage: %s SCENE [--frames FIRST LAST]\n", argv[0]);
+        return 1;
+    }
+
+    log_line("Starting scene configuration");
+
+    // SCENE may be a compiled scene itself. Otherwise, use its compiled scene if it is up to date, and
+    // write one if not.
+    Scene scene;
+    char cache_path[1024];
+    snprintf(cache_path, sizeof(cache_path), "%s%s", scene_path, CFG_SCENE_CACHE_SUFFIX);
+    double load_start = timer_seconds();
+    int compiled = scene_cache_load(scene_path, NULL, &scene) == 0
+        || (CFG_SCENE_CACHE && scene_cache_load(cache_path, scene_path, &scene) == 0);
+    if (!compiled && scene_load(scene_path, &scene)) {
+        return 1;
+    }
+    double load_ms = 1000.0 * (timer_seconds() - load_start);
+    if (scene.world.bvh == NULL && world_build_bvh(&scene.world)) {
+        fprintf(stderr, "Failed to build BVH\n");
+        scene_free(&scene);
+        return 1;
+    }
+    if (!compiled && CFG_SCENE_CACHE) {
+        // Not fatal, since the scene can still be loaded from its source next time
+        scene_cache_write(&scene, cache_path, scene_path);
+    }
+    World world = scene.world;
+    Camera camera = scene.camera;
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Completed scene configuration: %zu objects, %zu instances and %zu lights %s in %.2f ms",
+        world.object_count, world.instance_count, world.light_count, compiled ? "mapped" : "parsed", load_ms);
+    log_line(msg);
+
+    if (last_frame >= first_frame) {
+        int err = render_animation(&scene.world, camera, &scene.animation, first_frame, last_frame);
+        scene_free(&scene);
+        return err;
+    }
 
     if (CFG_SINGLE_PIXEL_DEBUG) {
         printf("Debugging single pixel at (%d, %d)\n", CFG_SINGLE_PIXEL_X, CFG_SINGLE_PIXEL_Y);
         Ray ray = ray_at_pixel(camera, CFG_SINGLE_PIXEL_X, CFG_SINGLE_PIXEL_Y);
         Color c = ray_color(ray, world, CFG_RECURSION_DEPTH);
         printf("Output color: (%f, %f, %f)\n", c.r, c.g, c.b);
+        scene_free(&scene);
         return 0;
     }
 
     // Render
+    Canvas canvas = canvas_create(camera.hsize, camera.vsize);
     log_line("Starting render");
-    render_image(world, camera, canvas);
+    RayStats stats = { 0 };
+    render_image(world, camera, canvas, &stats);
     log_line("Completed render");
+    log_ray_stats(&stats);
     canvas_save_ppm(canvas, "out.ppm");
 
     // Free stuff to keep address sanitizer happy
-    free(world.lights);
-    free(world.objects);
+    scene_free(&scene);
     canvas_destroy(canvas);
-}
\ No newline at end of file
+}
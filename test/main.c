@@ -1,9 +1,16 @@
+#include <stdlib.h>
+#include <string.h>
+
 #include <config.h>
 #include <assertions.h>
 #include <vector.h>
 #include <ray.h>
 #include <lighting.h>
+#include <scene.h>
 #include <shape.h>
+#include <mesh.h>
+#include <group.h>
+#include <tile.h>
 
 const double TOL = 0.0000000001;
 
@@ -11,11 +18,16 @@ const double TOL = 0.0000000001;
 // Helper functions
 // -------------------
 
-Shape glass_sphere(){
+Material glass_material() {
     Material glassy = material_default();
     glassy.transparency = 1;
     glassy.refractive_index = 1.5;
-    return sphere_new(mat4d_identity(), glassy, "glass_sphere");
+    return glassy;
+}
+
+/// A unit sphere of the world's `material`th material, which glass_material may describe.
+Shape glass_sphere(uint32_t material) {
+    return sphere_new(mat4d_identity(), material, "glass_sphere");
 }
 
 // -------------------
@@ -86,11 +98,46 @@ void test_ray_position() {
 }
 
 void test_sphere_normal__translated() {
-    Shape sphere = sphere_new(translation(0.0, 1.0, 0.0), material_default(), "debug");
+    Shape sphere = sphere_new(translation(0.0, 1.0, 0.0), 0, "debug");
     Vec4D n = shape_normal(&sphere, d4_point(0.0, 1.70711, -0.70711));
     assert_eq_vec4d(n, d4_vector(0.0, 0.70711, -0.70711), 0.00001);
 }
 
+void test_shape_set_transform__updates_inverse_and_revision() {
+    Shape sphere = sphere_default();
+    assert_eq_int(sphere.revision, 0);
+    shape_set_transform(&sphere, translation(0.0, 1.0, 0.0));
+    assert_eq_int(sphere.revision, 1);
+    assert_eq_mat4d(sphere.inv_transform, translation(0.0, -1.0, 0.0), TOL);
+}
+
+void test_shape_bounds__slab_test() {
+    Shape cylinder = cylinder_new(translation(0.0, 0.0, 5.0), 0, "cylinder", -1.0, 2.0, 1);
+    Aabb box = shape_bounds(&cylinder);
+    assert_eq_double(box.min[2], 4.0, TOL);
+    assert_eq_double(box.max[1], 2.0, TOL);
+    Shape plane = plane_new(mat4d_identity(), 0, "plane");
+    Aabb infinite = shape_bounds(&plane);
+    assert_eq_int(aabb_is_finite(&infinite), 0);
+
+    // Rays along the z axis enter the box at its near face whichever way they point, and miss it beside it
+    AabbRay forward = aabb_ray_new(d4_point(0.0, 0.0, 0.0), d4_vector(0.0, 0.0, 1.0));
+    AabbRay backward = aabb_ray_new(d4_point(0.0, 0.0, 10.0), d4_vector(0.0, 0.0, -1.0));
+    AabbRay beside = aabb_ray_new(d4_point(0.0, 3.0, 0.0), d4_vector(0.0, 0.0, 1.0));
+    assert_eq_double(aabb_ray_entry(&box, &forward, INFINITY), 4.0, TOL);
+    assert_eq_double(aabb_ray_entry(&box, &backward, INFINITY), 4.0, TOL);
+    assert_eq_double(aabb_ray_entry(&box, &forward, 3.0), INFINITY, 0);
+    assert_eq_double(aabb_ray_entry(&box, &beside, INFINITY), INFINITY, 0);
+}
+
+void test_cone_normal() {
+    Shape cone = cone_new(mat4d_identity(), 0, "cone", -INFINITY, INFINITY, 0);
+    Ray r = { d4_point(0.0, 0.0, -5.0), d4_vector(0.0, 0.0, 1.0) };
+    assert_eq_double(ray_intersect_shape(r, &cone), 5.0, TOL);
+    Vec4D n = shape_normal(&cone, d4_point(1.0, 1.0, 1.0));
+    assert_eq_vec4d(n, d4_norm(d4_vector(1.0, -sqrt(2.0), 1.0)), TOL);
+}
+
 /// --------------------------
 /// The Phong Reflection Model
 /// --------------------------
@@ -107,10 +154,10 @@ void test_lighting__eye_between_light_and_surface() {
     Vec4D position = d4_point(0., 0., 0.);
     Vec4D eyev = d4_vector(0., 0., -1.);
     Vec4D normalv = d4_vector(0., 0., -1.);
-    PointLight light = (PointLight){ d4_point(0., 0., -10.), (Color) { 1., 1., 1. }};
-    Shape obj = sphere_new(mat4d_identity(), m, "debug");
+    PointLight light = point_light_new(d4_point(0., 0., -10.), (Color) { 1., 1., 1. });
+    Shape obj = sphere_new(mat4d_identity(), 0, "debug");
 
-    Color result = lighting_compute(obj, light, position, eyev, normalv, 0);
+    Color result = lighting_compute(&m, shape_color_at(&obj, &m, position), light, position, eyev, normalv, 0);
     assert_eq_double(result.r, 1.9, TOL);
     assert_eq_double(result.g, 1.9, TOL);
     assert_eq_double(result.b, 1.9, TOL);
@@ -121,10 +168,10 @@ void test_lighting__eye_between_light_and_surface__eye_offset_45() {
     Vec4D position = d4_point(0., 0., 0.);
     Vec4D eyev = d4_vector(0., sqrt(2) / 2.0, -sqrt(2) / 2.0);
     Vec4D normalv = d4_vector(0., 0., -1.);
-    PointLight light = (PointLight){ d4_point(0., 0., -10.), (Color) { 1., 1., 1. }};
-    Shape obj = sphere_new(mat4d_identity(), m, "debug");
+    PointLight light = point_light_new(d4_point(0., 0., -10.), (Color) { 1., 1., 1. });
+    Shape obj = sphere_new(mat4d_identity(), 0, "debug");
 
-    Color result = lighting_compute(obj, light, position, eyev, normalv, 0);
+    Color result = lighting_compute(&m, shape_color_at(&obj, &m, position), light, position, eyev, normalv, 0);
     assert_eq_double(result.r, 1.0, TOL);
     assert_eq_double(result.g, 1.0, TOL);
     assert_eq_double(result.b, 1.0, TOL);
@@ -135,15 +182,57 @@ void test_lighting__eye_in_path_of_reflection_vector() {
     Vec4D position = d4_point(0., 0., 0.);
     Vec4D eyev = d4_vector(0., -sqrt(2) / 2.0, -sqrt(2) / 2.0);
     Vec4D normalv = d4_vector(0., 0., -1.);
-    PointLight light = (PointLight){ d4_point(0., 10., -10.), (Color) { 1., 1., 1. }};
-    Shape obj = sphere_new(mat4d_identity(), m, "debug");
+    PointLight light = point_light_new(d4_point(0., 10., -10.), (Color) { 1., 1., 1. });
+    Shape obj = sphere_new(mat4d_identity(), 0, "debug");
 
-    Color result = lighting_compute(obj, light, position, eyev, normalv, 0);
+    Color result = lighting_compute(&m, shape_color_at(&obj, &m, position), light, position, eyev, normalv, 0);
     assert_eq_double(result.r, 1.6364, 0.00001);
     assert_eq_double(result.g, 1.6364, 0.00001);
     assert_eq_double(result.b, 1.6364, 0.00001);
 }
 
+void test_light_tree_sample__weights_match_every_light() {
+    // A square of lights above a point facing up, the nearer ones brighter and the outer ones falling off
+    enum { SIDE = 16, COUNT = SIDE * SIDE + 1 };
+    PointLight lights[COUNT];
+    for (int i = 0; i < SIDE * SIDE; i++) {
+        double x = i % SIDE - 7.5, z = i / SIDE - 7.5;
+        lights[i] = point_light_new(d4_point(x, 3.0, z), color_rgb(0.1, 0.05 * (i % 3), 0.0));
+        lights[i].falloff = i % 2 ? 4.0 : 0.0;
+    }
+    // A dim light far beyond its falloff distance, which adds too little to be picked
+    lights[COUNT - 1] = point_light_new(d4_point(1000.0, 3.0, 0.0), color_rgb(0.1, 0.1, 0.1));
+    lights[COUNT - 1].falloff = 1.0;
+    LightTree tree = { 0 };
+    assert_eq_int(light_tree_build(&tree, lights, COUNT), 0);
+
+    Material m = material_default();
+    Vec4D point = d4_point(0.5, 0.0, 0.0);
+    Vec4D eyev = d4_vector(0.0, 1.0, 0.0);
+    Vec4D normalv = d4_vector(0.0, 1.0, 0.0);
+    Color color = color_rgb(1.0, 1.0, 1.0);
+    LightReceiver receiver = light_receiver_new(&m, color, point, normalv);
+    double exact = 0.0;
+    for (int i = 0; i < COUNT - 1; i++) {
+        exact += lighting_compute(&m, color, lights[i], point, eyev, normalv, 0).r;
+    }
+
+    // Spread evenly over u, the weighted picks add up to every light's contribution
+    const int samples = 100000;
+    double estimate = 0.0;
+    int far_picked = 0;
+    for (int s = 0; s < samples; s++) {
+        uint32_t i;
+        double probability;
+        assert_eq_int(light_tree_sample(&tree, lights, &receiver, CFG_LIGHT_CUTOFF, (s + 0.5) / samples, &i, &probability), 1);
+        estimate += lighting_compute(&m, color, lights[i], point, eyev, normalv, 0).r / probability / samples;
+        far_picked |= i == COUNT - 1;
+    }
+    assert_eq_double(estimate, exact, 1e-3 * exact);
+    assert_eq_int(far_picked, 0);
+    light_tree_free(&tree);
+}
+
 // ------------------------
 // Making a Scene
 // ------------------------
@@ -151,7 +240,7 @@ void test_lighting__eye_in_path_of_reflection_vector() {
 void test_computations(){
     Ray r = (Ray) {d4_point(0.,0.,-5.), d4_vector(0., 0., 1.)};
     Shape sphere = sphere_default();
-    Intersection i = (Intersection) {4, &sphere};
+    Intersection i = (Intersection) { 4, &sphere, 0, 0.0, 0.0, NULL, 0 };
     IntersectionData data = ray_prepare_computations(r, i);
     assert_eq_double(data.t, i.t, TOL);
     assert_eq_vec4d(data.point, d4_point(0., 0., -1.), TOL);
@@ -175,11 +264,560 @@ void test_ray_color__ray_hits() {
 
 void test_ray_color__intersection_behind_ray() {
     World w = world_default();
-    w.objects[0].material.ambient = 1.0;
-    w.objects[1].material.ambient = 1.0;
+    w.materials[w.objects[0].material].ambient = 1.0;
+    w.materials[w.objects[1].material].ambient = 1.0;
     Ray r = (Ray) { d4_point(0., 0., 0.75), d4_vector(0., 0., -1.) };
     Color c = ray_color(r, w, CFG_RECURSION_DEPTH);
-    assert_eq_color(c, w.objects[1].material.pattern.a, TOL);
+    assert_eq_color(c, w.materials[w.objects[1].material].pattern.a, TOL);
+}
+
+void test_ray_color__area_light_soft_shadow() {
+    // A ball hanging between a square light and the floor
+    Shape objects[] = {
+        plane_new(mat4d_identity(), 0, "floor"),
+        sphere_new(translation(0.0, 2.0, 0.0), 0, "ball"),
+    };
+    Material material = material_default();
+    PointLight light = area_light_new(d4_point(-1.0, 5.0, -1.0), d4_vector(2.0, 0.0, 0.0), 4, d4_vector(0.0, 0.0, 2.0), 4, color_rgb(1.0, 1.0, 1.0));
+    World w = world_new();
+    w.objects = objects;
+    w.object_count = 2;
+    w.materials = &material;
+    w.material_count = 1;
+    w.lights = &light;
+    w.light_count = 1;
+
+    Vec4D down = d4_vector(0.0, -1.0, 0.0);
+    Color umbra = ray_color((Ray) { d4_point(0.0, 0.5, 0.0), down }, w, 0);
+    Color penumbra = ray_color((Ray) { d4_point(1.5, 0.5, 0.0), down }, w, 0);
+    w.object_count = 1;
+    Color unshadowed = ray_color((Ray) { d4_point(1.5, 0.5, 0.0), down }, w, 0);
+    assert_eq_color(umbra, color_rgb(material.ambient, material.ambient, material.ambient), TOL);
+    assert_eq_int(penumbra.r > umbra.r + TOL && penumbra.r < unshadowed.r - TOL, 1);
+}
+
+void test_ray_color__transparent_reflective_floor() {
+    // A floor that lets light through, over a ball below it
+    World w = world_default();
+    Material floor = material_default();
+    floor.reflective = 0.5;
+    floor.transparency = 0.5;
+    floor.refractive_index = 1.5;
+    Material ball = material_default();
+    ball.pattern = pattern_plain_new(color_rgb(1.0, 0.0, 0.0), mat4d_identity());
+    ball.ambient = 0.5;
+    Shape objects[] = {
+        w.objects[0],
+        w.objects[1],
+        plane_new(translation(0.0, -1.0, 0.0), 2, "floor"),
+        sphere_new(translation(0.0, -3.5, -0.5), 3, "ball"),
+    };
+    Material materials[] = { w.materials[0], w.materials[1], floor, ball };
+    free(w.objects);
+    free(w.materials);
+    w.objects = objects;
+    w.object_count = 4;
+    w.materials = materials;
+    w.material_count = 4;
+
+    Ray r = (Ray) { d4_point(0.0, 0.0, -3.0), d4_vector(0.0, -sqrt(2.0) / 2.0, sqrt(2.0) / 2.0) };
+    materials[2].reflective = 0.0;
+    assert_eq_color(ray_color(r, w, CFG_RECURSION_DEPTH), color_rgb(0.93642, 0.68642, 0.68642), 0.00001);
+
+    // With room for one more ray, only the refracted one is cast, since at 45 degrees Schlick's
+    // approximation gives almost all of the light to it
+    materials[2].reflective = 0.5;
+    RayStats stats = { 0 };
+    RayBudget budget = { 1, 0.0, &stats };
+    ray_trace(r, w, CFG_RECURSION_DEPTH, &budget);
+    assert_eq_int((int)stats.refracted, 1);
+    assert_eq_int((int)stats.reflected, 0);
+    assert_eq_int((int)stats.culled, 1);
+}
+
+void test_ray_intersect_world__bvh_matches_every_object() {
+    World w = world_default();
+    w.objects[1] = sphere_new(translation(3.0, 0.0, 0.0), 0, "sphere_offset");
+    world_build_bvh(&w);
+    Ray rays[] = {
+        { d4_point(0., 0., -5.), d4_vector(0., 0., 1.) },
+        { d4_point(3., 0., -5.), d4_vector(0., 0., 1.) },
+        { d4_point(-5., 0., 0.), d4_vector(1., 0., 0.) },
+        { d4_point(0., 5., -5.), d4_vector(0., 0., 1.) },
+    };
+    for (int i = 0; i < 4; i++) {
+        Intersection with_bvh = ray_intersect_world(rays[i], w);
+        WorldBvh *bvh = w.bvh;
+        w.bvh = NULL;
+        Intersection without_bvh = ray_intersect_world(rays[i], w);
+        w.bvh = bvh;
+        assert_eq_ptr(with_bvh.object_ptr, without_bvh.object_ptr);
+        assert_eq_double(with_bvh.t, without_bvh.t, TOL);
+    }
+    world_free_bvh(&w);
+}
+
+void test_bvh_build_with__threads_and_linear_keep_every_box() {
+    // More boxes than one thread builds alone, so the threaded build hands out subtrees
+    const size_t count = 40000;
+    Aabb *bounds = malloc(count * sizeof(Aabb));
+    uint32_t *ids = malloc(count * sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) {
+        double x = (double)(i % 200), y = (double)(i / 200 % 20), z = (double)(i * 7 % 13);
+        bounds[i] = (Aabb) { { x, y, z }, { x + 0.5, y + 0.5, z + 0.5 } };
+        ids[i] = (uint32_t)i;
+    }
+    BvhBuildOptions options = bvh_build_options_default();
+    Bvh single = { 0 }, threaded = { 0 }, linear = { 0 };
+    options.thread_count = 1;
+    assert_eq_int(bvh_build_with(&single, bounds, ids, count, options), 0);
+    options.thread_count = 4;
+    assert_eq_int(bvh_build_with(&threaded, bounds, ids, count, options), 0);
+    options.linear = 1;
+    assert_eq_int(bvh_build_with(&linear, bounds, ids, count, options), 0);
+
+    // Threads only change who builds each subtree, not the tree
+    assert_eq_size_t(threaded.node_count, single.node_count);
+    assert_eq_int(memcmp(threaded.nodes, single.nodes, single.node_count * sizeof(BvhNode)), 0);
+    assert_eq_int(memcmp(threaded.indices, single.indices, count * sizeof(uint32_t)), 0);
+
+    // Every box is in exactly one leaf of the linear tree
+    char *seen = calloc(count, 1);
+    size_t leaf_total = 0;
+    for (size_t i = 0; i < linear.node_count; i++) {
+        for (uint32_t j = 0; j < linear.nodes[i].count; j++) {
+            seen[linear.indices[linear.nodes[i].first + j]]++;
+            leaf_total++;
+        }
+    }
+    assert_eq_size_t(leaf_total, count);
+    assert_eq_int(memchr(seen, 0, count) == NULL, 1);
+
+    free(seen);
+    bvh_free(&single);
+    bvh_free(&threaded);
+    bvh_free(&linear);
+    free(bounds);
+    free(ids);
+}
+
+void test_ray_intersect_world__wide_bvh_matches_binary() {
+    World w = world_new();
+    Shape spheres[32];
+    for (int i = 0; i < 32; i++) {
+        spheres[i] = sphere_new(translation(3.0 * (i % 8), 0.0, 3.0 * (i / 8)), 0, "sphere");
+    }
+    w.objects = spheres;
+    w.object_count = 32;
+    world_build_bvh(&w);
+    WorldBvh *bvh = w.bvh;
+    assert_eq_int(bvh->wide.node_count > 0 && bvh->wide.node_count < bvh->tree.node_count, 1);
+
+    Ray rays[] = {
+        { d4_point(6., 0., -5.), d4_vector(0., 0., 1.) },
+        { d4_point(-5., 0., 9.), d4_vector(1., 0., 0.) },
+        { d4_point(-5., 0.99, 3.), d4_vector(1., 0., 0.) },
+        { d4_point(-5., 5., -5.), d4_vector(1., -0.4, 0.9) },
+        { d4_point(-5., 1.5, 0.), d4_vector(1., 0., 0.) },
+    };
+    for (int i = 0; i < 5; i++) {
+        Intersection wide = ray_intersect_world(rays[i], w);
+        WideBvh wide_tree = bvh->wide;
+        bvh->wide = (WideBvh) { 0 };
+        Intersection binary = ray_intersect_world(rays[i], w);
+        bvh->wide = wide_tree;
+        assert_eq_ptr(wide.object_ptr, binary.object_ptr);
+        assert_eq_double(wide.t, binary.t, TOL);
+    }
+
+    // A ray parallel to an axis is still culled along it
+    WideBvhRay above = wide_bvh_ray_new(d4_point(-5., 1.5, 0.), d4_vector(1., 0., 0.));
+    float t[WIDE_BVH_WIDTH];
+    assert_eq_int(wide_bvh_node_hits(&bvh->wide.nodes[0], &above, INFINITY, t), 0);
+    world_free_bvh(&w);
+}
+
+void test_ray_intersect_world__grid_matches_bvh() {
+    World w = world_new();
+    Shape shapes[65];
+    shapes[0] = plane_new(translation(0.0, -1.0, 0.0), 0, "floor");
+    for (int i = 0; i < 64; i++) {
+        // The large spheres span several cells, so rays meet them again after testing them
+        double r = i % 5 == 0 ? 1.4 : 0.4;
+        shapes[1 + i] = sphere_new(mat4d_mul_mat4d(translation(i % 4, i / 4 % 4, i / 16), scaling(r, r, r)), 0, "sphere");
+    }
+    w.objects = shapes;
+    w.object_count = 65;
+    w.accelerator = ACCELERATOR_GRID;
+    world_build_bvh(&w);
+    WorldBvh *bvh = w.bvh;
+    assert_eq_int(bvh->grid.cell_count > 1 && bvh->wide.node_count == 0, 1);
+    assert_eq_size_t(bvh->unbounded_count, 1);
+
+    Ray rays[] = {
+        { d4_point(1.5, 1.5, -5.), d4_vector(0., 0., 1.) },
+        { d4_point(-5., 0.2, 2.), d4_vector(1., 0., 0.) },
+        { d4_point(8., 8., 8.), d4_vector(-1., -1.1, -0.9) },
+        { d4_point(1.5, 1.5, 1.5), d4_vector(0.3, -1., 0.2) },
+        { d4_point(-5., 10., 0.), d4_vector(1., 0., 0.) },
+        { d4_point(-5., 5., -5.), d4_vector(0.4, -1., 0.7) },
+    };
+    for (int i = 0; i < 6; i++) {
+        Intersection with_grid = ray_intersect_world(rays[i], w);
+        Grid grid = bvh->grid;
+        bvh->grid = (Grid) { 0 };
+        Intersection with_tree = ray_intersect_world(rays[i], w);
+        bvh->grid = grid;
+        assert_eq_ptr(with_grid.object_ptr, with_tree.object_ptr);
+        assert_eq_double(with_grid.t, with_tree.t, TOL);
+    }
+
+    // Too few objects for a grid to be worth it
+    w.accelerator = ACCELERATOR_AUTO;
+    assert_eq_int(world_update_bvh(&w), 1);
+    assert_eq_int(w.bvh->grid.cell_count == 0 && w.bvh->wide.node_count > 0, 1);
+    world_free_bvh(&w);
+}
+
+void test_ray_intersect_world__instance_of_prototype() {
+    // The prototype's material, then the first instance's
+    Material materials[] = { material_default(), material_default() };
+    materials[1].pattern = pattern_plain_new(color_rgb(1.0, 0.0, 0.0), mat4d_identity());
+    Shape prototype = sphere_new(scaling(2.0, 2.0, 2.0), 0, "prototype");
+    Instance instances[] = {
+        instance_new(0, translation(10.0, 0.0, 0.0), 1),
+        instance_new(0, translation(-10.0, 0.0, 0.0), INSTANCE_PROTOTYPE_MATERIAL),
+    };
+    World w = world_new();
+    w.prototypes = &prototype;
+    w.prototype_count = 1;
+    w.materials = materials;
+    w.material_count = 2;
+    w.instances = instances;
+    w.instance_count = 2;
+    world_build_bvh(&w);
+
+    Ray r = { d4_point(10.0, 0.0, -10.0), d4_vector(0.0, 0.0, 1.0) };
+    Intersection x = ray_intersect_world(r, w);
+    assert_eq_double(x.t, 8.0, TOL);
+    assert_eq_ptr(x.object_ptr, &prototype);
+    assert_eq_ptr(x.instance, &instances[0]);
+    IntersectionData d = ray_prepare_computations(r, x);
+    assert_eq_int(d.material, 1);
+    assert_eq_double(d.normalv.z, -1.0, TOL);
+
+    x = ray_intersect_world((Ray) { d4_point(-10.0, 0.0, -10.0), d4_vector(0.0, 0.0, 1.0) }, w);
+    assert_eq_ptr(x.instance, &instances[1]);
+    assert_eq_int(ray_prepare_computations(r, x).material, 0);
+    world_free_bvh(&w);
+}
+
+void test_ray_hit_shape__nested_group() {
+    // A quarter turn around y, then a scale, then an offset, as in the Ray Tracer Challenge
+    Shape outer = group_new(rotation_y(1.5707963267948966), "outer");
+    Shape inner = group_new(scaling(1.0, 2.0, 3.0), "inner");
+    group_add(&inner, sphere_new(translation(5.0, 0.0, 0.0), 0, "sphere"));
+    group_add(&outer, inner);
+    Shape *sphere = &outer.group->children[0].group->children[0];
+    Vec4D n = shape_normal(sphere, d4_point(1.7321, 1.1547, -5.5774));
+    assert_eq_double(n.x, 0.2857, 0.0001);
+    assert_eq_double(n.y, 0.4286, 0.0001);
+    assert_eq_double(n.z, -0.8571, 0.0001);
+
+    Intersection x = ray_hit_shape((Ray) { d4_point(0.0, 0.0, -20.0), d4_vector(0.0, 0.0, 1.0) }, &outer);
+    assert_eq_ptr(x.object_ptr, sphere);
+    assert_eq_double(x.t, 14.0, TOL);
+    x = ray_hit_shape((Ray) { d4_point(0.0, 5.0, -20.0), d4_vector(0.0, 0.0, 1.0) }, &outer);
+    assert_eq_double(x.t, INFINITY, 0);
+
+    // Moving the inner group moves the sphere, and the outer group's bounds with it
+    uint32_t revision = shape_revision(&outer);
+    group_set_child_transform(&outer, 0, translation(0.0, 10.0, 0.0));
+    assert_eq_double(outer.group->bounds.min[1], 9.0, TOL);
+    assert_eq_int(shape_revision(&outer) != revision, 1);
+    x = ray_hit_shape((Ray) { d4_point(0.0, 10.0, -20.0), d4_vector(0.0, 0.0, 1.0) }, &outer);
+    assert_eq_double(x.t, 14.0, TOL);
+    group_free(&outer);
+}
+
+void test_ray_hit_shape__csg_operations() {
+    // Two spheres overlapping between x = -0.5 and 0.5, seen along x
+    Ray from_left = { d4_point(-5.0, 0.0, 0.0), d4_vector(1.0, 0.0, 0.0) };
+    Ray from_inside_left = { d4_point(-1.0, 0.0, 0.0), d4_vector(1.0, 0.0, 0.0) };
+    int operations[3] = { CSG_UNION, CSG_INTERSECTION, CSG_DIFFERENCE };
+    double expected[3][2] = { { 3.5, 2.5 }, { 4.5, 0.5 }, { 3.5, 0.5 } };
+    for (int i = 0; i < 3; i++) {
+        Shape csg = csg_new(operations[i], mat4d_identity(), "csg");
+        group_add(&csg, sphere_new(translation(-0.5, 0.0, 0.0), 0, "left"));
+        group_add(&csg, sphere_new(translation(0.5, 0.0, 0.0), 0, "right"));
+        assert_eq_double(ray_hit_shape(from_left, &csg).t, expected[i][0], TOL);
+        assert_eq_double(ray_hit_shape(from_inside_left, &csg).t, expected[i][1], TOL);
+        group_free(&csg);
+    }
+}
+
+void test_intersection_list__spills_and_sorts() {
+    IntersectionList xs;
+    intersection_list_init(&xs);
+    for (int i = 0; i < 4 * INTERSECTION_LIST_LOCAL; i++) {
+        intersection_list_add(&xs, (Intersection) { 10.0 - i, NULL, 0, 0.0, 0.0, NULL, 0 });
+    }
+    intersection_list_sort(&xs, 0, xs.count);
+    assert_eq_size_t(xs.count, 4 * INTERSECTION_LIST_LOCAL);
+    assert_eq_int(xs.items != xs.local, 1);
+    for (size_t i = 1; i < xs.count; i++) {
+        assert_eq_int(xs.items[i - 1].t <= xs.items[i].t, 1);
+    }
+    assert_eq_double(hit(&xs)->t, 0.0, 0);
+    intersection_list_free(&xs);
+}
+
+void test_ray_hit_shape__fast_paths_match_transform() {
+    Shape shapes[] = {
+        sphere_new(mat4d_mul_mat4d(mat4d_mul_mat4d(translation(1.0, 2.0, 3.0), rotation_y(0.7)), scaling(2.0, 2.0, 2.0)), 0, "sphere"),
+        cube_new(mat4d_mul_mat4d(translation(-1.0, 0.5, 2.0), scaling(1.0, -2.0, 3.0)), 0, "box"),
+        cube_new(mat4d_mul_mat4d(rotation_y(1.5707963267948966), scaling(1.0, 2.0, 3.0)), 0, "turned box"),
+        plane_new(mat4d_mul_mat4d(translation(0.0, -1.0, 0.0), rotation_x(0.3)), 0, "plane"),
+    };
+    int expected[] = { SHAPE_FAST_SPHERE, SHAPE_FAST_BOX, SHAPE_FAST_NONE, SHAPE_FAST_PLANE };
+    Shape sheared = sphere_new(shearing(1.0, 0.0, 0.0, 0.0, 0.0, 0.0), 0, "sheared");
+    assert_eq_int(sheared.fast, SHAPE_FAST_NONE);
+
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        assert_eq_int(shapes[s].fast, expected[s]);
+        Shape slow = shapes[s];
+        slow.fast = SHAPE_FAST_NONE;
+        for (int i = 0; i < 64; i++) {
+            // Rays from around the shape towards points near it, some from inside
+            double a = 0.4 * i;
+            Ray r = { d4_point(6.0 * cos(a), 4.0 * sin(1.3 * a), 6.0 * sin(a)), d4_vector(0.0, 0.0, 0.0) };
+            r.direction = d4_norm(d4_sub(d4_point(0.5 * sin(3.0 * a), 1.0, 2.0 * cos(a)), r.origin));
+            if (i % 8 == 0) {
+                r.origin = mat4d_mul_vec4d(shapes[s].transform, d4_point(0.1, 0.2, 0.3));
+            }
+            double t = ray_intersect_shape(r, &shapes[s]);
+            assert_eq_double(t, ray_intersect_shape(r, &slow), 1e-9);
+            if (t < INFINITY) {
+                Vec4D point = ray_position(r, t);
+                Vec4D n = shape_normal(&shapes[s], point);
+                Vec4D expected_n = shape_normal(&slow, point);
+                assert_eq_double(n.x, expected_n.x, 1e-6);
+                assert_eq_double(n.y, expected_n.y, 1e-6);
+                assert_eq_double(n.z, expected_n.z, 1e-6);
+            }
+        }
+    }
+}
+
+/// --------------
+/// Scene files
+/// --------------
+
+void test_scene_load__demo() {
+    Scene scene;
+    if (!assert_eq_int(scene_load("scenes/demo.yml", &scene), 0)) {
+        return;
+    }
+    assert_eq_size_t(scene.world.object_count, 7);
+    assert_eq_size_t(scene.world.light_count, 1);
+    assert_eq_size_t(scene.animation.track_count, 2);
+
+    Shape middle = scene.world.objects[1];
+    assert_eq_mat4d(middle.transform, mat4d_mul_mat4d(translation(0.0, 2.0, 0.0), scaling(2.0, 2.0, 2.0)), TOL);
+    assert_eq_mat4d(middle.inv_transform, mat4d_inverse(middle.transform), TOL);
+    assert_eq_int(scene.world.materials[middle.material].pattern.type, PATTERN_GRADIENT);
+    Shape wall = scene.world.objects[4];
+    assert_eq_mat4d(wall.inv_transform, mat4d_inverse(wall.transform), TOL);
+    scene_free(&scene);
+}
+
+void test_scene_load__shares_equal_materials() {
+    const char *path = "test_materials.yml";
+    FILE *fp = fopen(path, "w");
+    fputs(
+        "- add: camera\n  width: 10\n  height: 10\n  field-of-view: 1\n  from: [0, 0, -5]\n  to: [0, 0, 0]\n  up: [0, 1, 0]\n"
+        "- define: red\n  value:\n    color: [1, 0, 0]\n"
+        "- add: sphere\n  material: red\n"
+        "- add: sphere\n  material: red\n"
+        "- add: sphere\n  material:\n    color: [1, 0, 0]\n"
+        "- add: sphere\n  material:\n    color: [0, 1, 0]\n"
+        "- add: plane\n",
+        fp);
+    fclose(fp);
+    Scene scene;
+    int err = scene_load(path, &scene);
+    remove(path);
+    if (!assert_eq_int(err, 0)) {
+        return;
+    }
+
+    // Spelled out or defined, red is stored once. The plane takes the default.
+    const Shape *objects = scene.world.objects;
+    assert_eq_size_t(scene.world.material_count, 3);
+    assert_eq_int(objects[1].material, objects[0].material);
+    assert_eq_int(objects[2].material, objects[0].material);
+    assert_eq_int(objects[3].material != objects[0].material, 1);
+    assert_eq_double(scene.world.materials[objects[4].material].diffuse, material_default().diffuse, TOL);
+    scene_free(&scene);
+}
+
+void test_scene_cache__round_trip() {
+    Scene parsed;
+    Scene mapped;
+    if (!assert_eq_int(scene_load("scenes/demo.yml", &parsed), 0)) {
+        return;
+    }
+    world_build_bvh(&parsed.world);
+    assert_eq_int(scene_cache_write(&parsed, "test_scene.compiled", "scenes/demo.yml"), 0);
+    if (!assert_eq_int(scene_cache_load("test_scene.compiled", "scenes/demo.yml", &mapped), 0)) {
+        scene_free(&parsed);
+        remove("test_scene.compiled");
+        return;
+    }
+
+    assert_eq_size_t(mapped.world.object_count, parsed.world.object_count);
+    assert_eq_int(memcmp(mapped.world.objects, parsed.world.objects, parsed.world.object_count * sizeof(Shape)), 0);
+    assert_eq_size_t(mapped.world.bvh->tree.node_count, parsed.world.bvh->tree.node_count);
+    assert_eq_size_t(mapped.animation.tracks[1].key_count, parsed.animation.tracks[1].key_count);
+    assert_eq_double(mapped.animation.tracks[1].keys[1].time, parsed.animation.tracks[1].keys[1].time, TOL);
+
+    scene_free(&mapped);
+    scene_free(&parsed);
+    remove("test_scene.compiled");
+}
+
+void test_mesh_intersect__shared_edge_is_watertight() {
+    // A unit quad in the z = 0 plane, split along its diagonal
+    float quad[] = { -1.0f, -1.0f, 0.0f, 1.0f, -1.0f, 0.0f, 1.0f, 1.0f, 0.0f, -1.0f, 1.0f, 0.0f };
+    uint32_t triangles[] = { 0, 1, 2, 0, 2, 3 };
+    float *positions = malloc(sizeof(quad));
+    uint32_t *indices = malloc(sizeof(triangles));
+    memcpy(positions, quad, sizeof(quad));
+    memcpy(indices, triangles, sizeof(triangles));
+    Mesh *mesh = mesh_create(positions, NULL, 4, indices, 2);
+
+    for (int i = -4; i <= 4; i++) {
+        // Rays exactly through the diagonal, where a non-watertight test can miss both triangles
+        double d = 0.2 * i;
+        uint32_t triangle;
+        double u, v;
+        double t = mesh_intersect(mesh, d4_point(d, d, -5.0), d4_vector(0.0, 0.0, 1.0), INFINITY, &triangle, &u, &v);
+        assert_eq_double(t, 5.0, TOL);
+        Vec4D n = d4_norm(mesh_normal(mesh, triangle, u, v));
+        assert_eq_double(n.z, 1.0, TOL);
+    }
+    uint32_t triangle;
+    double u, v;
+    assert_eq_int(isinf(mesh_intersect(mesh, d4_point(1.5, 0.0, -5.0), d4_vector(0.0, 0.0, 1.0), INFINITY, &triangle, &u, &v)), 1);
+    mesh_destroy(mesh);
+}
+
+void test_mesh_load_obj__polygons_and_relative_indices() {
+    FILE *fp = fopen("test_mesh.obj", "w");
+    fputs("# A pyramid\nv 0 1 0\nv -1 0 -1\nv 1 0 -1\nv 1 0 1\nv -1 0 1\nvn 0 -1 0\n"
+          "f -4//1 -3//1 -2//1 -1//1\nf 1 2/7 3\nf 1/1/1 3 4\nf 1 4 5\nf 1 5 2\n", fp);
+    fclose(fp);
+    Mesh *mesh = mesh_load_obj("test_mesh.obj", 1);
+    remove("test_mesh.obj");
+
+    assert_eq_size_t(mesh->triangle_count, 6);
+    assert_eq_double(mesh->bounds.max[1], 1.0, TOL);
+    assert_eq_double(mesh->bounds.min[0], -1.0, TOL);
+    uint32_t triangle;
+    double u, v;
+    double t = mesh_intersect(mesh, d4_point(0.0, -5.0, 0.0), d4_vector(0.0, 1.0, 0.0), INFINITY, &triangle, &u, &v);
+    assert_eq_double(t, 5.0, TOL);
+    assert_eq_double(d4_norm(mesh_normal(mesh, triangle, u, v)).y, -1.0, TOL);
+    mesh_destroy(mesh);
+}
+
+void test_sphere_cloud__dump_round_trip() {
+    // Two particles on the z axis and one beside them, all but the first in the palette's second material
+    size_t n = 3;
+    float *memory = malloc(5 * n * sizeof(float));
+    float *x = memory, *y = memory + n, *z = memory + 2 * n, *radius = memory + 3 * n;
+    uint32_t *materials = (uint32_t *)(memory + 4 * n);
+    float centers[3][3] = { { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 5.0f }, { 3.0f, 0.0f, 0.0f } };
+    for (size_t i = 0; i < n; i++) {
+        x[i] = centers[i][0];
+        y[i] = centers[i][1];
+        z[i] = centers[i][2];
+        radius[i] = 1.0f;
+        materials[i] = i == 0 ? 7 : 1;
+    }
+    SphereCloud *created = sphere_cloud_create(memory, x, y, z, radius, materials, n);
+    assert_eq_int(sphere_cloud_write(created, "test_particles.bin"), 0);
+    sphere_cloud_destroy(created);
+    SphereCloud *cloud = sphere_cloud_load("test_particles.bin");
+    assert_eq_size_t(cloud->count, n);
+    assert_eq_double(cloud->bounds.max[2], 6.0, TOL);
+
+    // Indices into the world's materials, of which the shape's is the 9th
+    uint32_t palette[2] = { 4, 5 };
+    sphere_cloud_set_palette(cloud, palette, 2);
+    Shape shape = sphere_cloud_new(translation(0.0, 2.0, 0.0), 9, "cloud", cloud);
+    Intersection hit = ray_hit_shape((Ray) { d4_point(0.0, 2.0, -5.0), d4_vector(0.0, 0.0, 1.0) }, &shape);
+    assert_eq_double(hit.t, 4.0, TOL);
+    assert_eq_int(hit.material, 9);  // Outside the palette, so the shape's
+    hit = ray_hit_shape((Ray) { d4_point(0.0, 2.0, 10.0), d4_vector(0.0, 0.0, -1.0) }, &shape);
+    assert_eq_double(hit.t, 4.0, TOL);
+    assert_eq_int(hit.material, 5);
+    Vec4D normal = shape_normal_at(&shape, d4_point(3.0, 3.0, 0.0), 2, 0.0, 0.0);
+    assert_eq_double(normal.y, 1.0, TOL);
+
+    // Each particle is hit where a sphere shape in its place is
+    for (size_t i = 0; i < n; i++) {
+        Shape sphere = sphere_new(translation(centers[i][0], centers[i][1] + 2.0, centers[i][2]), 0, "sphere");
+        Ray r = { d4_point(centers[i][0] + 0.3, 10.0, centers[i][2] - 0.4), d4_vector(0.0, -1.0, 0.0) };
+        assert_eq_double(ray_hit_shape(r, &shape).t, ray_hit_shape(r, &sphere).t, TOL);
+    }
+    sphere_cloud_destroy(cloud);
+    remove("test_particles.bin");
+}
+
+void test_tile_queue__front_and_back_claims_cover_image_once() {
+    // 5 by 3 tiles of 16 pixels, the last column and row clipped to 6 and 5 pixels
+    enum { WIDTH = 70, HEIGHT = 37 };
+    static int covered[HEIGHT][WIDTH];
+    TileQueue queue;
+    tile_queue_init(&queue, WIDTH, HEIGHT, 16);
+    assert_eq_int(queue.tiles_x * queue.tiles_y, 15);
+
+    // A device taking batches from the front and a CPU thread single tiles from the back, in turn
+    int batches[] = { 7, 3, 2, 2, 2, 2 };
+    int tiles = 0;
+    for (int i = 0; tile_queue_remaining(&queue) > 0; i++) {
+        Tile tile;
+        int claimed = i % 2 == 0 ? tile_queue_claim(&queue, batches[i / 2], &tile) : tile_queue_claim_last(&queue, &tile);
+        if (i == 0) {
+            // Whole rows are taken together, as wide as the image
+            assert_eq_int(claimed, 5);
+            assert_eq_int(tile.width, WIDTH);
+        } else if (i == 1) {
+            assert_eq_int(tile.x, 64);
+            assert_eq_int(tile.y, 32);
+            assert_eq_int(tile.width, 6);
+            assert_eq_int(tile.height, 5);
+        }
+        for (int y = tile.y; y < tile.y + tile.height; y++) {
+            for (int x = tile.x; x < tile.x + tile.width; x++) {
+                covered[y][x]++;
+            }
+        }
+        tiles += claimed;
+    }
+    Tile none;
+    assert_eq_int(tile_queue_claim(&queue, 4, &none), 0);
+    assert_eq_int(tile_queue_claim_last(&queue, &none), 0);
+    assert_eq_int(tiles, 15);
+    int once = 0;
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            once += covered[y][x] == 1;
+        }
+    }
+    assert_eq_int(once, WIDTH * HEIGHT);
+    tile_queue_destroy(&queue);
 }
 
 int main() {
@@ -190,6 +828,9 @@ int main() {
     test_ray_position();
 
     test_sphere_normal__translated();
+    test_shape_set_transform__updates_inverse_and_revision();
+    test_shape_bounds__slab_test();
+    test_cone_normal();
 
     test_hit__all_intersections_positive_t();
 
@@ -197,10 +838,33 @@ int main() {
     test_lighting__eye_between_light_and_surface();
     test_lighting__eye_between_light_and_surface__eye_offset_45();
     test_lighting__eye_in_path_of_reflection_vector();
+    test_light_tree_sample__weights_match_every_light();
 
     test_ray_color__ray_misses();
     test_ray_color__ray_hits();
     test_ray_color__intersection_behind_ray();
+    test_ray_color__area_light_soft_shadow();
+    test_ray_color__transparent_reflective_floor();
+
+    test_ray_intersect_world__bvh_matches_every_object();
+    test_bvh_build_with__threads_and_linear_keep_every_box();
+    test_ray_intersect_world__wide_bvh_matches_binary();
+    test_ray_intersect_world__grid_matches_bvh();
+    test_ray_intersect_world__instance_of_prototype();
+    test_ray_hit_shape__nested_group();
+    test_ray_hit_shape__fast_paths_match_transform();
+    test_ray_hit_shape__csg_operations();
+    test_intersection_list__spills_and_sorts();
+
+    test_scene_load__demo();
+    test_scene_load__shares_equal_materials();
+    test_scene_cache__round_trip();
+
+    test_mesh_intersect__shared_edge_is_watertight();
+    test_mesh_load_obj__polygons_and_relative_indices();
+    test_sphere_cloud__dump_round_trip();
+
+    test_tile_queue__front_and_back_claims_cover_image_once();
 
     printf("Testing complete\n");
 }
\ No newline at end of file